@@ -0,0 +1,674 @@
+/*******************************************************************************
+	convolver.c -- Uniformly partitioned FFT convolution
+
+	$author$
+
+	@license: MIT Licence
+
+	The impulse response is cut into partitions of +block+ samples, each one
+	transformed once by a real FFT of 2 * block points.  Every block of input
+	is transformed the same way, together with the block before it, into a
+	ring of as many spectra as there are partitions (the frequency-domain
+	delay line); the sum of their products with the partitions, transformed
+	back, gives the output of the block in its second half (overlap-save).
+	A block thus costs two FFTs of 2 * block points and one complex product
+	of block + 1 bins per partition, whatever the length of the response.
+*******************************************************************************/
+#include <ruby.h>
+#include <ruby/thread.h>
+#include "ruby/wave/globals.h"
+#include "ruby/wave/pcm.h"
+#include "internal/parallel.h"
+#include "internal/algorithm/fft.h"
+
+/* Calls of at least this many samples times partitions run without the GVL */
+#define CONV_NOGVL_MIN  65536
+
+#define CONV_BLOCK_DEF  1024
+#define CONV_BLOCK_MAX  65536
+
+struct conv_channel {
+	double *h;  // parts * bins complex, the partitions divided by 2 * block
+	double *fdl;  // parts * bins complex, the spectra of the input blocks
+	double *x;  // 2 * block samples, the previous block of input and the current one
+	double *acc;  // bins complex
+	double *y;  // 2 * block samples
+	double *work;
+};
+
+struct Convolver {
+	long fs;
+	long block;
+	long bins;  // block + 1
+	long parts;
+	long length;  // samples of the longest impulse response
+	long fill;  // samples of the current block of input
+	long head;  // slot of the delay line for the current block
+	int channels;
+	int multi;  // the impulse responses were given as an Array
+	int threads;
+	int busy;
+	const fft_rplan_t *plan;
+	struct conv_channel *ch;
+	double *buf;  // one allocation for the buffers of all the channels
+	size_t count;  // doubles of buf
+};
+
+static void
+convolver_free(void *p)
+{
+	struct Convolver *ptr = p;
+	if (ptr->buf != NULL)
+		fft_free(ptr->buf);
+	if (ptr->ch != NULL)
+		xfree(ptr->ch);
+	if (ptr->plan != NULL)
+		fft_rplan_release(ptr->plan);
+	xfree(ptr);
+}
+
+static size_t
+convolver_memsize(const void *p)
+{
+	const struct Convolver *ptr = p;
+	return sizeof(struct Convolver) + ptr->channels * sizeof(struct conv_channel) + ptr->count * sizeof(double);
+}
+
+static const rb_data_type_t convolver_data_type = {
+    "convolver",
+    {
+	0,
+	convolver_free,
+	convolver_memsize,
+    },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static struct Convolver *
+get_convolver(VALUE self)
+{
+	struct Convolver *ptr = rb_check_typeddata(self, &convolver_data_type);
+
+	if (ptr->buf == NULL)
+		rb_raise(rb_eRuntimeError, "uninitialized Convolver");
+	return ptr;
+}
+
+static VALUE
+convolver_s_allocate(VALUE klass)
+{
+	struct Convolver *ptr;
+	return TypedData_Make_Struct(klass, struct Convolver, &convolver_data_type, ptr);
+}
+
+/* +n+ samples of +s+ from +pos+ to +x+, 0.0 when +s+ is NULL */
+static void
+conv_load(const void *s, enum rb_pcm_dtype dtype, long pos, double *x, long n)
+{
+	if (s == NULL)
+		for (long i = 0; i < n; i++)  x[i] = 0.0;
+	else if (dtype == RB_PCM_F32)
+		for (long i = 0; i < n; i++)  x[i] = ((const float *)s)[pos + i];
+	else
+		for (long i = 0; i < n; i++)  x[i] = ((const double *)s)[pos + i];
+}
+
+/* +n+ samples of +y+ to +s+ from +pos+ */
+static void
+conv_store(void *s, enum rb_pcm_dtype dtype, long pos, const double *y, long n)
+{
+	if (dtype == RB_PCM_F32)
+		for (long i = 0; i < n; i++)  ((float *)s)[pos + i] = (float)y[i];
+	else
+		for (long i = 0; i < n; i++)  ((double *)s)[pos + i] = y[i];
+}
+
+/* Output of the block of input in the second half of ch->x, to the second half of ch->y */
+static void
+conv_block(const struct Convolver *cv, struct conv_channel *ch, long head)
+{
+	const long bins = cv->bins;
+	double *acc = ch->acc;
+
+	fft_r2c(cv->plan, ch->x, ch->fdl + 2 * head * bins, ch->work);
+	for (long k = 0; k < 2 * bins; k++)
+		acc[k] = 0.0;
+	for (long p = 0; p < cv->parts; p++)
+	{
+		const double *h = ch->h + 2 * p * bins;
+		const double *x = ch->fdl + 2 * ((head - p + cv->parts) % cv->parts) * bins;
+
+		for (long k = 0; k < bins; k++)
+		{
+			acc[2 * k] += x[2 * k] * h[2 * k] - x[2 * k + 1] * h[2 * k + 1];
+			acc[2 * k + 1] += x[2 * k] * h[2 * k + 1] + x[2 * k + 1] * h[2 * k];
+		}
+	}
+	fft_c2r(cv->plan, acc, ch->y, ch->work);
+}
+
+struct conv_job {
+	const struct Convolver *cv;
+	struct conv_channel *ch;
+	const void *in;  // n samples of input, NULL for 0.0
+	enum rb_pcm_dtype in_dtype;
+	void *out;  // the output, from pos, limit samples at most
+	enum rb_pcm_dtype out_dtype;
+	long n, pos, limit;
+};
+
+static void
+conv_job_run(struct conv_job *j)
+{
+	const struct Convolver *cv = j->cv;
+	struct conv_channel *ch = j->ch;
+	const long block = cv->block;
+	long fill = cv->fill, head = cv->head, i = 0, o = 0;
+
+	while (i < j->n)
+	{
+		const long k = block - fill < j->n - i ? block - fill : j->n - i;
+
+		conv_load(j->in, j->in_dtype, i, ch->x + block + fill, k);
+		fill += k;
+		i += k;
+		if (fill < block)
+			break;
+		conv_block(cv, ch, head);
+		if (o < j->limit)
+		{
+			conv_store(j->out, j->out_dtype, j->pos + o, ch->y + block, j->limit - o < block ? j->limit - o : block);
+			o += block;
+		}
+		MEMCPY(ch->x, ch->x + block, double, block);
+		head = (head + 1) % cv->parts;
+		fill = 0;
+	}
+}
+
+struct conv_worker {
+	struct conv_job *jobs;
+	int first, last;
+};
+
+static void *
+conv_worker_run(void *arg)
+{
+	struct conv_worker *w = arg;
+
+	for (int c = w->first; c < w->last; c++)
+		conv_job_run(&w->jobs[c]);
+	return NULL;
+}
+
+struct conv_set {
+	struct conv_worker *w;
+	int n;
+};
+
+static void *
+conv_nogvl(void *arg)
+{
+	struct conv_set *set = arg;
+	wave_parallel_run(conv_worker_run, set->w, sizeof(struct conv_worker), set->n);
+	return NULL;
+}
+
+struct conv_call {
+	struct Convolver *cv;
+	VALUE in;  // a Wave::PCM, an Array of cv->channels of them, or nil for 0.0
+	const VALUE *out;  // cv->channels Wave::PCM
+	long n, pos, limit;
+};
+
+static VALUE
+conv_call0(VALUE arg)
+{
+	struct conv_call *call = (struct conv_call *)arg;
+	struct Convolver *cv = call->cv;
+	struct conv_set set;
+	struct conv_job *jobs;
+	VALUE tmp = 0;
+	long chunk;
+
+	jobs = ALLOCV_N(struct conv_job, tmp, cv->channels);
+	for (int c = 0; c < cv->channels; c++)
+	{
+		VALUE in = RB_TYPE_P(call->in, T_ARRAY) ? RARRAY_AREF(call->in, c) : call->in;
+
+		jobs[c].cv = cv;
+		jobs[c].ch = &cv->ch[c];
+		jobs[c].in = NULL;
+		jobs[c].in_dtype = RB_PCM_F64;
+		if (!NIL_P(in))
+		{
+			jobs[c].in_dtype = rb_pcm_dtype(in);
+			jobs[c].in = jobs[c].in_dtype == RB_PCM_F32 ?
+				(const void *)rb_waveform_data_ptr_f32(in) : (const void *)rb_waveform_data_ptr(in);
+		}
+		jobs[c].out_dtype = rb_pcm_dtype(call->out[c]);
+		jobs[c].out = jobs[c].out_dtype == RB_PCM_F32 ?
+			(void *)rb_waveform_data_ptr_f32(call->out[c]) : (void *)rb_waveform_data_ptr(call->out[c]);
+		jobs[c].n = call->n;
+		jobs[c].pos = call->pos;
+		jobs[c].limit = call->limit;
+	}
+
+	set.n = cv->channels < cv->threads ? cv->channels : cv->threads;
+	set.w = ALLOCA_N(struct conv_worker, set.n);
+	chunk = (cv->channels + set.n - 1) / set.n;
+	for (int i = 0; i < set.n; i++)
+	{
+		set.w[i].jobs = jobs;
+		set.w[i].first = i * chunk < cv->channels ? (int)(i * chunk) : cv->channels;
+		set.w[i].last = (i + 1) * chunk < cv->channels ? (int)((i + 1) * chunk) : cv->channels;
+	}
+	if (set.n > 1 || call->n * cv->parts * cv->channels >= CONV_NOGVL_MIN)
+		rb_thread_call_without_gvl(conv_nogvl, &set, NULL, NULL);
+	else
+		conv_worker_run(set.w);
+
+	cv->head = (cv->head + (cv->fill + call->n) / cv->block) % cv->parts;
+	cv->fill = (cv->fill + call->n) % cv->block;
+	ALLOCV_END(tmp);
+	return Qnil;
+}
+
+static VALUE
+conv_call_ensure(VALUE arg)
+{
+	struct conv_call *call = (struct conv_call *)arg;
+
+	if (RB_TYPE_P(call->in, T_ARRAY))
+	{
+		for (long c = 0; c < RARRAY_LEN(call->in); c++)
+			rb_pcm_unlocktmp(RARRAY_AREF(call->in, c));
+	}
+	else if (!NIL_P(call->in))
+		rb_pcm_unlocktmp(call->in);
+	call->cv->busy = 0;
+	return Qnil;
+}
+
+/*
+ * Feeds +n+ samples of +in+ to every channel, and stores the outputs of the
+ * blocks it completes to +out+ from +pos+, +limit+ samples at most.  +in+ is
+ * checked, and held as a copy if it is an Array.
+ */
+static void
+conv_call(struct Convolver *cv, VALUE in, const VALUE *out, long n, long pos, long limit)
+{
+	struct conv_call call;
+
+	if (cv->busy)
+		rb_raise(rb_eRuntimeError, "Convolver in use by another thread");
+	if (RB_TYPE_P(in, T_ARRAY))
+	{
+		in = rb_ary_dup(in);
+		for (long c = 0; c < RARRAY_LEN(in); c++)
+			rb_pcm_locktmp(RARRAY_AREF(in, c));
+	}
+	else if (!NIL_P(in))
+		rb_pcm_locktmp(in);
+	cv->busy = 1;
+
+	call.cv = cv;
+	call.in = in;
+	call.out = out;
+	call.n = n;
+	call.pos = pos;
+	call.limit = limit;
+	rb_ensure(conv_call0, (VALUE)&call, conv_call_ensure, (VALUE)&call);
+	RB_GC_GUARD(in);
+}
+
+/* Forgets the input, for a new signal */
+static void
+conv_clear(struct Convolver *cv)
+{
+	for (int c = 0; c < cv->channels; c++)
+	{
+		MEMZERO(cv->ch[c].fdl, double, 2 * cv->parts * cv->bins);
+		MEMZERO(cv->ch[c].x, double, 2 * cv->block);
+	}
+	cv->fill = 0;
+	cv->head = 0;
+}
+
+/*
+ * The length of the input +in+ for +cv+: a Wave::PCM, or an Array of
+ * cv->channels Wave::PCM of the same length, all at the sampling frequency
+ * of the impulse responses.
+ */
+static long
+conv_input_len(const struct Convolver *cv, VALUE in)
+{
+	long n;
+
+	if (!RB_TYPE_P(in, T_ARRAY))
+	{
+		if (rb_pcm_fs(in) != cv->fs)
+			rb_raise(rb_eArgError, "sampling frequency mismatch");
+		return rb_pcm_len(in);
+	}
+	if (RARRAY_LEN(in) != cv->channels)
+		rb_raise(rb_eArgError, "%ld channels of input for %d impulse responses", RARRAY_LEN(in), cv->channels);
+	n = rb_pcm_len(RARRAY_AREF(in, 0));
+	for (long c = 0; c < RARRAY_LEN(in); c++)
+	{
+		if (rb_pcm_fs(RARRAY_AREF(in, c)) != cv->fs)
+			rb_raise(rb_eArgError, "sampling frequency mismatch");
+		if (rb_pcm_len(RARRAY_AREF(in, c)) != n)
+			rb_raise(rb_eArgError, "length mismatch (%ld for %ld)", rb_pcm_len(RARRAY_AREF(in, c)), n);
+	}
+	return n;
+}
+
+/* The dtype of the output of +in+ */
+static enum rb_pcm_dtype
+conv_input_dtype(VALUE in)
+{
+	return rb_pcm_dtype(RB_TYPE_P(in, T_ARRAY) ? RARRAY_AREF(in, 0) : in);
+}
+
+/* Wave::PCM or Array of them, as the impulse responses were given */
+static VALUE
+conv_result(const struct Convolver *cv, const VALUE *out)
+{
+	return cv->multi ? rb_ary_new_from_values(cv->channels, out) : out[0];
+}
+
+/*
+ *  class Wave::Convolver
+ *
+ *  Convolution with long impulse responses, such as room responses of several seconds
+ *  or long linear-phase FIR filters, by uniformly partitioned overlap-save in the
+ *  frequency domain.
+ *
+ *  The impulse response is cut into partitions of +block+ samples, whose spectra are
+ *  computed once. Each block of input is transformed once and kept in a delay line of
+ *  as many spectra as partitions; its output is the inverse transform of the sum of
+ *  their products with the partitions. The output of a block is ready as soon as the
+ *  block is complete, so the latency is at most <code>block - 1</code> samples, and a
+ *  sample costs two FFTs of <code>2 * block</code> points and a complex product per
+ *  partition, per block.
+ *
+ *  Several impulse responses, as for the channels of a multichannel reverb, are
+ *  convolved in parallel on +threads+ native threads.
+ *
+ *    conv = Wave::Convolver.new(ir, block: 512)
+ *    reader.each_block(512){|pcm| io.write(conv.process(pcm).to_binary)}
+ *    io.write(conv.flush.to_binary)
+ */
+
+static long
+conv_block_arg(VALUE block, long def)
+{
+	const long n = block == Qundef || NIL_P(block) ? def : NUM2LONG(block);
+
+	if (n < 1 || n > CONV_BLOCK_MAX)
+		rb_raise(rb_eArgError, "block must be in 1..%d", CONV_BLOCK_MAX);
+	return n;
+}
+
+static void
+conv_init(struct Convolver *cv, VALUE ir, long block, int threads)
+{
+	VALUE irs = rb_check_array_type(ir), tmp = 0;
+	const VALUE *pcm;
+	size_t stride, bytes;
+	double *x;
+
+	cv->multi = !NIL_P(irs);
+	if (!cv->multi)
+		irs = rb_ary_new_from_values(1, &ir);
+	if (RARRAY_LEN(irs) < 1 || RARRAY_LEN(irs) > UINT16_MAX)
+		rb_raise(rb_eArgError, "impulse responses must be 1..%d Wave::PCM", UINT16_MAX);
+	pcm = RARRAY_CONST_PTR(irs);
+	cv->channels = (int)RARRAY_LEN(irs);
+	cv->length = 0;
+	cv->fs = rb_pcm_fs(pcm[0]);
+	for (int c = 0; c < cv->channels; c++)
+	{
+		if (rb_pcm_fs(pcm[c]) != cv->fs)
+			rb_raise(rb_eArgError, "sampling frequency mismatch");
+		if (rb_pcm_len(pcm[c]) > cv->length)
+			cv->length = rb_pcm_len(pcm[c]);
+	}
+	if (cv->length == 0)
+		rb_raise(rb_eArgError, "empty impulse response");
+
+	cv->block = block;
+	cv->bins = block + 1;
+	cv->parts = (cv->length + block - 1) / block;
+	cv->threads = threads;
+	cv->plan = fft_rplan(2 * block);
+	if (cv->plan == NULL)
+		rb_memerror();
+
+	stride = (4 * cv->parts * cv->bins + 6 * block + 2 + fft_rwork_size(cv->plan) + 7) & ~(size_t)7;
+	cv->ch = ZALLOC_N(struct conv_channel, cv->channels);
+	cv->buf = fft_malloc(stride * cv->channels * sizeof(double));
+	if (cv->buf == NULL)
+		rb_memerror();
+	cv->count = stride * cv->channels;
+	MEMZERO(cv->buf, double, cv->count);
+
+	bytes = 2 * block * sizeof(double);
+	x = ALLOCV(tmp, bytes);
+	for (int c = 0; c < cv->channels; c++)
+	{
+		struct conv_channel *ch = &cv->ch[c];
+		const long len = rb_pcm_len(pcm[c]);
+
+		ch->h = cv->buf + c * stride;
+		ch->fdl = ch->h + 2 * cv->parts * cv->bins;
+		ch->x = ch->fdl + 2 * cv->parts * cv->bins;
+		ch->y = ch->x + 2 * block;
+		ch->acc = ch->y + 2 * block;
+		ch->work = ch->acc + 2 * cv->bins;
+		for (long p = 0; p < cv->parts; p++)
+		{
+			const long n = len - p * block < block ? len - p * block : block;
+			double *h = ch->h + 2 * p * cv->bins;
+
+			if (n > 0)
+				conv_load(rb_pcm_dtype(pcm[c]) == RB_PCM_F32 ?
+					(const void *)rb_waveform_data_ptr_f32(pcm[c]) : (const void *)rb_waveform_data_ptr(pcm[c]),
+					rb_pcm_dtype(pcm[c]), p * block, x, n);
+			for (long i = n > 0 ? n : 0; i < 2 * block; i++)
+				x[i] = 0.0;
+			fft_r2c(cv->plan, x, h, ch->work);
+			for (long k = 0; k < 2 * cv->bins; k++)
+				h[k] /= 2 * block;
+		}
+	}
+	ALLOCV_END(tmp);
+	RB_GC_GUARD(irs);
+}
+
+/*
+ *  call-seq:
+ *    Wave::Convolver.new(ir, block: 1024, threads: 1) -> Wave::Convolver
+ *
+ *  Convolver with the impulse response +ir+, a Wave::PCM, or with each of the Array of
+ *  Wave::PCM +ir+, one per channel of output. +block+ samples are processed at a
+ *  time: smaller blocks lower the latency, larger ones the cost per sample of long
+ *  impulse responses. The channels are split between +threads+ native threads.
+ *  Raises ArgumentError unless the impulse responses share one sampling frequency.
+ */
+static VALUE
+convolver_initialize(int argc, VALUE *argv, VALUE self)
+{
+	static ID kw[2];
+	struct Convolver *ptr = rb_check_typeddata(self, &convolver_data_type);
+	VALUE ir, opts, v[2];
+
+	rb_scan_args(argc, argv, "1:", &ir, &opts);
+	if (!kw[0])
+	{
+		kw[0] = rb_intern_const("block");
+		kw[1] = rb_intern_const("threads");
+	}
+	rb_get_kwargs(opts, kw, 0, 2, v);
+	if (ptr->plan != NULL)
+		rb_raise(rb_eRuntimeError, "already initialized Convolver");
+	conv_init(ptr, ir, conv_block_arg(v[0], CONV_BLOCK_DEF), wave_threads_arg(v[1]));
+	return self;
+}
+
+/*
+ *  call-seq:
+ *    convolver.process(pcm) -> Wave::PCM or Array
+ *    convolver.process([pcm, ...]) -> Wave::PCM or Array
+ *
+ *  Feeds the samples of +pcm+ to every impulse response, or those of each Wave::PCM of
+ *  the Array to the impulse response of its channel, and returns the output of the
+ *  blocks they complete: a Wave::PCM, or an Array of one per channel when the
+ *  impulse responses were given as an Array, of the dtype of the input. The
+ *  samples of a block not yet complete are kept for the next call; when the
+ *  input comes in blocks of +block+ samples, each call returns as many.
+ *  The input must be at the sampling frequency of the impulse responses.
+ */
+static VALUE
+convolver_process(VALUE self, VALUE in)
+{
+	struct Convolver *ptr = get_convolver(self);
+	const long n = conv_input_len(ptr, in);
+	const long count = (ptr->fill + n) / ptr->block * ptr->block;
+	VALUE tmp = 0, res;
+	VALUE *out = ALLOCV_N(VALUE, tmp, ptr->channels);
+
+	for (int c = 0; c < ptr->channels; c++)
+		out[c] = rb_pcm_new2(count, ptr->fs, conv_input_dtype(in));
+	conv_call(ptr, in, out, n, 0, count);
+	res = conv_result(ptr, out);
+	ALLOCV_END(tmp);
+	return res;
+}
+
+/*
+ *  call-seq:
+ *    convolver.flush -> Wave::PCM or Array
+ *
+ *  Returns the rest of the output, as if the input went on with 0.0: the samples
+ *  of the block not yet complete and the tail of the impulse response,
+ *  <code>ir.length - 1</code> samples after the last one, for the longest of
+ *  them. The convolver then
+ *  starts over for a new signal.
+ */
+static VALUE
+convolver_flush(VALUE self)
+{
+	struct Convolver *ptr = get_convolver(self);
+	const long count = ptr->fill + ptr->length - 1;
+	const long n = (count + ptr->block - 1) / ptr->block * ptr->block - ptr->fill;
+	VALUE tmp = 0, res;
+	VALUE *out = ALLOCV_N(VALUE, tmp, ptr->channels);
+
+	for (int c = 0; c < ptr->channels; c++)
+		out[c] = rb_pcm_new(count, ptr->fs);
+	conv_call(ptr, Qnil, out, n, 0, count);
+	conv_clear(ptr);
+	res = conv_result(ptr, out);
+	ALLOCV_END(tmp);
+	return res;
+}
+
+/*
+ *  call-seq:
+ *    convolver.block -> Integer
+ *
+ *  Returns the number of samples processed at a time.
+ */
+static VALUE
+convolver_block(VALUE self)
+{
+	return LONG2NUM(get_convolver(self)->block);
+}
+
+/*
+ *  call-seq:
+ *    convolver.channels -> Integer
+ *
+ *  Returns the number of impulse responses.
+ */
+static VALUE
+convolver_channels(VALUE self)
+{
+	return INT2NUM(get_convolver(self)->channels);
+}
+
+/*
+ *  call-seq:
+ *    Wave::Convolver.convolve(pcm, ir, block: nil, threads: 1) -> Wave::PCM or Array
+ *
+ *  Full convolution of +pcm+ with +ir+, given as to Wave::Convolver.new and
+ *  Wave::Convolver#process: <code>pcm.length + ir.length - 1</code> samples per channel,
+ *  for the longest impulse response.
+ *  By default, +block+ is the power of two not below the length of the impulse
+ *  responses, up to 65536.
+ *
+ *    wet = Wave::Convolver.convolve(dry, [ir_left, ir_right], threads: 2)
+ */
+static VALUE
+convolver_s_convolve(int argc, VALUE *argv, VALUE klass)
+{
+	static ID kw[2];
+	VALUE in, ir, opts, v[2], obj, res, tmp = 0;
+	struct Convolver *ptr;
+	long n, count, done, def = 1;
+	VALUE *out;
+
+	rb_scan_args(argc, argv, "2:", &in, &ir, &opts);
+	if (!kw[0])
+	{
+		kw[0] = rb_intern_const("block");
+		kw[1] = rb_intern_const("threads");
+	}
+	rb_get_kwargs(opts, kw, 0, 2, v);
+	obj = convolver_s_allocate(klass);
+	ptr = DATA_PTR(obj);
+	if (v[0] == Qundef || NIL_P(v[0]))
+	{
+		VALUE irs = rb_check_array_type(ir);
+		long len = 0;
+
+		for (long c = 0; c < (NIL_P(irs) ? 1 : RARRAY_LEN(irs)); c++)
+		{
+			const long l = rb_pcm_len(NIL_P(irs) ? ir : RARRAY_AREF(irs, c));
+			if (l > len)
+				len = l;
+		}
+		while (def < len && def < CONV_BLOCK_MAX)
+			def *= 2;
+	}
+	conv_init(ptr, ir, conv_block_arg(v[0], def), wave_threads_arg(v[1]));
+
+	n = conv_input_len(ptr, in);
+	count = n + ptr->length - 1;
+	out = ALLOCV_N(VALUE, tmp, ptr->channels);
+	for (int c = 0; c < ptr->channels; c++)
+		out[c] = rb_pcm_new2(count, ptr->fs, conv_input_dtype(in));
+	done = n / ptr->block * ptr->block;
+	conv_call(ptr, in, out, n, 0, done);
+	conv_call(ptr, Qnil, out, (count + ptr->block - 1) / ptr->block * ptr->block - n, done, count - done);
+	res = conv_result(ptr, out);
+	ALLOCV_END(tmp);
+	RB_GC_GUARD(obj);
+	return res;
+}
+
+
+void
+InitVM_Convolver(void)
+{
+	rb_define_alloc_func(rb_cWaveConvolver, convolver_s_allocate);
+	rb_define_singleton_method(rb_cWaveConvolver, "convolve", convolver_s_convolve, -1);
+
+	rb_define_method(rb_cWaveConvolver, "initialize", convolver_initialize, -1);
+	rb_define_method(rb_cWaveConvolver, "process", convolver_process, 1);
+	rb_define_method(rb_cWaveConvolver, "flush", convolver_flush, 0);
+	rb_define_method(rb_cWaveConvolver, "block", convolver_block, 0);
+	rb_define_method(rb_cWaveConvolver, "channels", convolver_channels, 0);
+}
@@ -2,6 +2,15 @@
 require 'mkmf'
 
 have_func('cyl_bessel_i0', 'math.h')
+have_func('pread', 'unistd.h') if have_header('unistd.h')
+have_func('rb_io_descriptor', 'ruby/io.h')
+have_func('rb_io_wait', 'ruby/io.h')
+have_func('rb_io_buffer_get_bytes_for_reading', 'ruby/io/buffer.h')
+have_func('pthread_create', 'pthread.h') if have_header('pthread.h')
+if have_header('sys/mman.h')
+  have_func('mmap', 'sys/mman.h')
+  have_func('madvise', 'sys/mman.h')
+end
 
 $INCFLAGS << ' -Iinclude'
 
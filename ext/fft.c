@@ -0,0 +1,1478 @@
+/*******************************************************************************
+	fft.c -- Wave::FFT
+
+	$author$
+*******************************************************************************/
+#include <ruby.h>
+#include <ruby/thread.h>
+#include <stdint.h>
+#include <math.h>
+#include "ruby/wave/globals.h"
+#include "ruby/wave/pcm.h"
+#include "ruby/wave/frames.h"
+#include "ruby/wave/spectrogram.h"
+#include "internal/window_function.h"
+#include "internal/parallel.h"
+#include "internal/algorithm/fft.h"
+
+/* Transforms of at least this many points run without the GVL */
+#define FFT_NOGVL_MIN  4096
+
+/* +p+ rounded up to FFT_ALIGN */
+static inline double *
+fft_align(void *p)
+{
+	return (double *)((char *)p + (FFT_ALIGN - (uintptr_t)p % FFT_ALIGN) % FFT_ALIGN);
+}
+
+/*
+ * +count+ doubles aligned to FFT_ALIGN, on a buffer held by +v+ until
+ * ALLOCV_END(v), or the GC if an exception is raised before.
+ */
+#define FFT_SCRATCH(v, count)  fft_align(ALLOCV((v), (count) * sizeof(double) + FFT_ALIGN))
+
+/*
+ * A reference to a plan, held by a hidden object until fft_plan_put(), or
+ * the GC if an exception is raised before.  Plans are got and released
+ * under the GVL only, the cache of fft_kernel.c not being thread safe.
+ */
+struct fft_hold {
+	const fft_plan_t *plan;
+	const fft_rplan_t *rplan;
+};
+
+static void
+fft_hold_release(struct fft_hold *h)
+{
+	if (h->plan != NULL)
+		fft_plan_release(h->plan);
+	if (h->rplan != NULL)
+		fft_rplan_release(h->rplan);
+	h->plan = NULL;
+	h->rplan = NULL;
+}
+
+static void
+fft_hold_free(void *p)
+{
+	fft_hold_release(p);
+	xfree(p);
+}
+
+static const rb_data_type_t fft_hold_data_type = {
+    "fft_hold",
+    {
+	0,
+	fft_hold_free,
+	0,
+    },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static const fft_plan_t *
+fft_plan_get(long n, VALUE *hold)
+{
+	struct fft_hold *h;
+
+	*hold = TypedData_Make_Struct(0, struct fft_hold, &fft_hold_data_type, h);
+	h->plan = fft_plan(n);
+	if (h->plan == NULL)
+		rb_memerror();
+	return h->plan;
+}
+
+static const fft_rplan_t *
+fft_rplan_get(long n, VALUE *hold)
+{
+	struct fft_hold *h;
+
+	*hold = TypedData_Make_Struct(0, struct fft_hold, &fft_hold_data_type, h);
+	h->rplan = fft_rplan(n);
+	if (h->rplan == NULL)
+		rb_memerror();
+	return h->rplan;
+}
+
+/* Releases the plan of +hold+ now, if any */
+static void
+fft_plan_put(VALUE hold)
+{
+	if (hold)
+		fft_hold_release(rb_check_typeddata(hold, &fft_hold_data_type));
+}
+
+/* The samples of +pcm+ to x[0], x[stride], ... */
+static void
+fft_load(VALUE pcm, double *x, long n, long stride)
+{
+	if (rb_pcm_dtype(pcm) == RB_PCM_F32)
+	{
+		const float *s = rb_waveform_data_ptr_f32(pcm);
+		for (long i = 0; i < n; i++)
+			x[i * stride] = s[i];
+	}
+	else
+	{
+		const double *s = rb_waveform_data_ptr(pcm);
+		for (long i = 0; i < n; i++)
+			x[i * stride] = s[i];
+	}
+}
+
+/* x[0], x[stride], ... times +scale+ to the samples of +pcm+ */
+static void
+fft_store(VALUE pcm, const double *x, long n, long stride, double scale)
+{
+	if (rb_pcm_dtype(pcm) == RB_PCM_F32)
+	{
+		float *s = rb_waveform_data_ptr_f32(pcm);
+		for (long i = 0; i < n; i++)
+			s[i] = (float)(x[i * stride] * scale);
+	}
+	else
+	{
+		double *s = rb_waveform_data_ptr(pcm);
+		for (long i = 0; i < n; i++)
+			s[i] = x[i * stride] * scale;
+	}
+}
+
+/* The +out:+ option, nil if not given */
+static VALUE
+fft_out_opt(VALUE opts)
+{
+	static ID kw;
+	VALUE v = Qundef;
+
+	if (NIL_P(opts))
+		return Qnil;
+	if (!kw)
+		kw = rb_intern_const("out");
+	rb_get_kwargs(opts, &kw, 0, 1, &v);
+	return v == Qundef ? Qnil : v;
+}
+
+/*
+ * +count+ Wave::PCM of +len+ samples for the results: new ones of +dtype+
+ * when +out+ is nil, otherwise the ones of +out+ (a Wave::PCM when +count+
+ * is 1, else an Array of them), resized and of their own dtype.
+ */
+static void
+fft_out_pcm(VALUE out, VALUE *pcm, int count, long len, long fs, enum rb_pcm_dtype dtype)
+{
+	if (NIL_P(out))
+	{
+		for (int c = 0; c < count; c++)
+			pcm[c] = rb_pcm_new2(len, fs, dtype);
+		return;
+	}
+	if (count == 1)
+		pcm[0] = out;
+	else
+	{
+		VALUE ary = rb_check_array_type(out);
+		if (NIL_P(ary) || RARRAY_LEN(ary) != count)
+			rb_raise(rb_eArgError, "out must be an Array of %d Wave::PCM", count);
+		for (int c = 0; c < count; c++)
+		{
+			pcm[c] = RARRAY_AREF(ary, c);
+			for (int d = 0; d < c; d++)
+			{
+				if (pcm[d] == pcm[c])
+					rb_raise(rb_eArgError, "out must be distinct Wave::PCM");
+			}
+		}
+	}
+	for (int c = 0; c < count; c++)
+	{
+		rb_pcm_modify(pcm[c]);
+		rb_pcm_resize(pcm[c], len);
+		rb_pcm_set_fs(pcm[c], fs);
+	}
+}
+
+enum fft_job_kind {
+	FFT_JOB_C2C,
+	FFT_JOB_R2C,
+	FFT_JOB_C2R
+};
+
+struct fft_job {
+	enum fft_job_kind kind;
+	const void *plan;
+	double *in, *out, *work;
+	int sign;
+};
+
+static void *
+fft_job_run(void *arg)
+{
+	struct fft_job *job = arg;
+
+	switch (job->kind) {
+	case FFT_JOB_C2C:
+		fft_c2c(job->plan, job->in, job->sign, job->work);
+		break;
+	case FFT_JOB_R2C:
+		fft_r2c(job->plan, job->in, job->out, job->work);
+		break;
+	case FFT_JOB_C2R:
+		fft_c2r(job->plan, job->in, job->out, job->work);
+		break;
+	}
+	return NULL;
+}
+
+/* The buffers of +job+ are private to the call, so no PCM is locked meanwhile */
+static void
+fft_job_exec(struct fft_job *job, long n)
+{
+	if (n >= FFT_NOGVL_MIN)
+		rb_thread_call_without_gvl(fft_job_run, job, NULL, NULL);
+	else
+		fft_job_run(job);
+}
+
+/*
+ *  module Wave::FFT
+ *
+ *  Discrete Fourier transforms of Wave::PCM.
+ *  A complex signal or spectrum is a pair of Wave::PCM, its real and imaginary parts.
+ *  The forward transforms compute X[k] = sum(x[j] * exp(-2 pi i jk / n)), unnormalized;
+ *  the inverse ones divide by n, so that a round trip gives back the samples.
+ *
+ *  Any size is accepted. Sizes of the form 2^a * 3^b * 5^c are the fastest; the others
+ *  are computed by Bluestein's algorithm over such a size, some 3 to 6 times slower.
+ *  The sines and cosines of a size are computed once and kept for the later calls.
+ *
+ *  New results are of the dtype of the input; with <code>out:</code>, they are written
+ *  to the given Wave::PCM instead, resized as needed, with no new allocation once
+ *  they are large enough. The transforms run in a scratch area aligned for SIMD
+ *  loads, and the samples are converted into and out of it; the storage of the
+ *  Wave::PCM, given or new, is ordinary and need not be aligned.
+ *
+ *    pcm = Wave::PCM.new(1024, 48000){|n| Math.sin(2 * Math::PI * 1000 * n / 48000)}
+ *    re, im = Wave::FFT.rfft(pcm)
+ *    Wave::FFT.irfft(re, im) # => pcm, within rounding
+ */
+
+static VALUE
+fft_complex(int argc, VALUE *argv, int sign)
+{
+	VALUE re, im, opts, res[2], tmp = 0, hold = 0;
+	const fft_plan_t *plan = NULL;
+	struct fft_job job;
+	double *x;
+	long n;
+
+	rb_scan_args(argc, argv, "11:", &re, &im, &opts);
+	n = rb_pcm_len(re);
+	if (!NIL_P(im) && rb_pcm_len(im) != n)
+		rb_raise(rb_eArgError, "length mismatch (%ld for %ld)", rb_pcm_len(im), n);
+	if (n > 0)
+		plan = fft_plan_get(n, &hold);
+
+	x = FFT_SCRATCH(tmp, 2 * n + (plan ? fft_work_size(plan) : 0));
+	fft_load(re, x, n, 2);
+	if (NIL_P(im))
+		for (long i = 0; i < n; i++)  x[2 * i + 1] = 0.0;
+	else
+		fft_load(im, x + 1, n, 2);
+	fft_out_pcm(fft_out_opt(opts), res, 2, n, rb_pcm_fs(re), rb_pcm_dtype(re));
+
+	if (n > 0)
+	{
+		job.kind = FFT_JOB_C2C;
+		job.plan = plan;
+		job.in = x;
+		job.out = x;
+		job.work = x + 2 * n;
+		job.sign = sign;
+		fft_job_exec(&job, n);
+	}
+	fft_store(res[0], x, n, 2, sign > 0 ? 1.0 / n : 1.0);
+	fft_store(res[1], x + 1, n, 2, sign > 0 ? 1.0 / n : 1.0);
+
+	fft_plan_put(hold);
+	ALLOCV_END(tmp);
+	return rb_assoc_new(res[0], res[1]);
+}
+
+/*
+ *  call-seq:
+ *    Wave::FFT.fft(re, im = nil, out: nil) -> [re, im]
+ *
+ *  Forward transform of the complex signal of real part +re+ and imaginary part +im+
+ *  (zero when nil), both Wave::PCM of the same length. Returns the spectrum as a
+ *  pair of Wave::PCM of that length, or the pair given as <code>out: [re, im]</code>.
+ */
+static VALUE
+rb_fft_s_fft(int argc, VALUE *argv, VALUE unused_obj)
+{
+	return fft_complex(argc, argv, -1);
+}
+
+/*
+ *  call-seq:
+ *    Wave::FFT.ifft(re, im = nil, out: nil) -> [re, im]
+ *
+ *  Inverse of Wave::FFT.fft, divided by the length.
+ */
+static VALUE
+rb_fft_s_ifft(int argc, VALUE *argv, VALUE unused_obj)
+{
+	return fft_complex(argc, argv, 1);
+}
+
+/*
+ *  call-seq:
+ *    Wave::FFT.rfft(pcm, out: nil) -> [re, im]
+ *
+ *  Forward transform of the real signal +pcm+ of length n: the n / 2 + 1 bins from 0
+ *  to the Nyquist frequency, as a pair of Wave::PCM or the pair given as
+ *  <code>out: [re, im]</code>. The other bins are the conjugates of these.
+ *  An even n runs as a complex transform of n / 2 points.
+ */
+static VALUE
+rb_fft_s_rfft(int argc, VALUE *argv, VALUE unused_obj)
+{
+	VALUE pcm, opts, res[2], tmp = 0, hold = 0;
+	const fft_rplan_t *plan = NULL;
+	struct fft_job job;
+	double *x, *y;
+	long n, bins;
+
+	rb_scan_args(argc, argv, "1:", &pcm, &opts);
+	n = rb_pcm_len(pcm);
+	bins = n > 0 ? n / 2 + 1 : 0;
+	if (n > 0)
+		plan = fft_rplan_get(n, &hold);
+
+	x = FFT_SCRATCH(tmp, n + 2 * bins + (plan ? fft_rwork_size(plan) : 0));
+	y = x + n;
+	fft_load(pcm, x, n, 1);
+	fft_out_pcm(fft_out_opt(opts), res, 2, bins, rb_pcm_fs(pcm), rb_pcm_dtype(pcm));
+
+	if (n > 0)
+	{
+		job.kind = FFT_JOB_R2C;
+		job.plan = plan;
+		job.in = x;
+		job.out = y;
+		job.work = y + 2 * bins;
+		job.sign = -1;
+		fft_job_exec(&job, n);
+	}
+	fft_store(res[0], y, bins, 2, 1.0);
+	fft_store(res[1], y + 1, bins, 2, 1.0);
+
+	fft_plan_put(hold);
+	ALLOCV_END(tmp);
+	return rb_assoc_new(res[0], res[1]);
+}
+
+/*
+ *  call-seq:
+ *    Wave::FFT.irfft(re, im, n = 2 * (re.length - 1), out: nil) -> Wave::PCM
+ *
+ *  Inverse of Wave::FFT.rfft: the real signal of length +n+ whose n / 2 + 1 first bins
+ *  are given by +re+ and +im+, divided by +n+. Pass +n+ to get an odd length back.
+ *  The imaginary parts of the bins 0 and, for an even +n+, n / 2 are ignored.
+ *  The signal is written to the Wave::PCM given as <code>out:</code>, if any.
+ */
+static VALUE
+rb_fft_s_irfft(int argc, VALUE *argv, VALUE unused_obj)
+{
+	VALUE re, im, vn, opts, res, tmp = 0, hold = 0;
+	const fft_rplan_t *plan;
+	struct fft_job job;
+	double *x, *y;
+	long n, bins;
+
+	rb_scan_args(argc, argv, "21:", &re, &im, &vn, &opts);
+	bins = rb_pcm_len(re);
+	if (rb_pcm_len(im) != bins)
+		rb_raise(rb_eArgError, "length mismatch (%ld for %ld)", rb_pcm_len(im), bins);
+	if (bins == 0)
+		rb_raise(rb_eArgError, "empty spectrum");
+	n = NIL_P(vn) ? 2 * (bins - 1) : NUM2LONG(vn);
+	if (n < 1 || n / 2 + 1 != bins)
+		rb_raise(rb_eArgError, "%ld bins for a signal of length %ld", bins, n);
+	plan = fft_rplan_get(n, &hold);
+
+	x = FFT_SCRATCH(tmp, 2 * bins + n + fft_rwork_size(plan));
+	y = x + 2 * bins;
+	fft_load(re, x, bins, 2);
+	fft_load(im, x + 1, bins, 2);
+	fft_out_pcm(fft_out_opt(opts), &res, 1, n, rb_pcm_fs(re), rb_pcm_dtype(re));
+
+	job.kind = FFT_JOB_C2R;
+	job.plan = plan;
+	job.in = x;
+	job.out = y;
+	job.work = y + n;
+	job.sign = 1;
+	fft_job_exec(&job, n);
+	fft_store(res, y, n, 1, 1.0 / n);
+
+	fft_plan_put(hold);
+	ALLOCV_END(tmp);
+	return res;
+}
+
+
+/*******************************************************************************
+	Short-time Fourier transform
+*******************************************************************************/
+
+struct stft_worker {
+	const void *s;  // the signal
+	enum rb_pcm_dtype dtype;
+	long len;
+	const double *w;  // the window
+	long size, hop, offset, bins;
+	const fft_rplan_t *plan;
+	double *data;  // frames * bins complex, or NULL
+	double *mag;  // frames * bins magnitudes, or NULL
+	long first, last;  // frames of this worker
+	double *x, *y, *work;  // its scratch
+};
+
+struct stft_set {
+	struct stft_worker *w;
+	int n;
+};
+
+/* Window times the samples of a frame, zero past the ends of the signal */
+static void
+stft_load(const struct stft_worker *a, long start, double *x)
+{
+	const long j0 = start < 0 ? -start : 0;
+	const long j1 = a->len - start < a->size ? a->len - start : a->size;
+	long j = 0;
+
+	for (; j < j0 && j < a->size; j++)
+		x[j] = 0.0;
+	if (a->dtype == RB_PCM_F32)
+	{
+		const float *s = a->s;
+		for (; j < j1; j++)
+			x[j] = s[start + j] * a->w[j];
+	}
+	else
+	{
+		const double *s = a->s;
+		for (; j < j1; j++)
+			x[j] = s[start + j] * a->w[j];
+	}
+	for (; j < a->size; j++)
+		x[j] = 0.0;
+}
+
+static void *
+stft_worker_run(void *arg)
+{
+	struct stft_worker *a = arg;
+
+	for (long t = a->first; t < a->last; t++)
+	{
+		double *y = a->data ? a->data + 2 * t * a->bins : a->y;
+
+		stft_load(a, t * a->hop + a->offset, a->x);
+		fft_r2c(a->plan, a->x, y, a->work);
+		if (a->mag)
+		{
+			double *m = a->mag + t * a->bins;
+			for (long k = 0; k < a->bins; k++)
+				m[k] = sqrt(y[2 * k] * y[2 * k] + y[2 * k + 1] * y[2 * k + 1]);
+		}
+	}
+	return NULL;
+}
+
+static void *
+stft_nogvl(void *arg)
+{
+	struct stft_set *set = arg;
+	wave_parallel_run(stft_worker_run, set->w, sizeof(struct stft_worker), set->n);
+	return NULL;
+}
+
+struct stft_args {
+	VALUE pcm;
+	struct stft_worker proto;
+	long frames;
+	int threads;
+};
+
+static VALUE
+stft0(VALUE arg)
+{
+	struct stft_args *args = (struct stft_args *)arg;
+	const struct stft_worker *proto = &args->proto;
+	const size_t stride = (proto->size + 2 * proto->bins + fft_rwork_size(proto->plan) + 7) & ~(size_t)7;
+	struct stft_set set;
+	VALUE tmp = 0;
+	double *scratch;
+	long chunk;
+
+	set.n = args->frames < args->threads ? (int)args->frames : args->threads;
+	if (set.n == 0)
+		return Qnil;
+	set.w = ALLOCA_N(struct stft_worker, set.n);
+	scratch = FFT_SCRATCH(tmp, stride * set.n);
+	chunk = (args->frames + set.n - 1) / set.n;
+	for (int i = 0; i < set.n; i++)
+	{
+		set.w[i] = *proto;
+		set.w[i].s = rb_pcm_dtype(args->pcm) == RB_PCM_F32 ?
+			(const void *)rb_waveform_data_ptr_f32(args->pcm) : (const void *)rb_waveform_data_ptr(args->pcm);
+		set.w[i].first = i * chunk < args->frames ? i * chunk : args->frames;
+		set.w[i].last = (i + 1) * chunk < args->frames ? (i + 1) * chunk : args->frames;
+		set.w[i].x = scratch + i * stride;
+		set.w[i].y = set.w[i].x + proto->size;
+		set.w[i].work = set.w[i].y + 2 * proto->bins;
+	}
+	if (set.n > 1 || args->frames * proto->size >= FFT_NOGVL_MIN)
+		rb_thread_call_without_gvl(stft_nogvl, &set, NULL, NULL);
+	else
+		stft_worker_run(set.w);
+
+	ALLOCV_END(tmp);
+	return Qnil;
+}
+
+static VALUE
+fft_pcm_unlock(VALUE pcm)
+{
+	rb_pcm_unlocktmp(pcm);
+	return Qnil;
+}
+
+/*
+ *  call-seq:
+ *    Wave::FFT.stft(pcm, size:, hop: size / 4, window: :hann, center: true, magnitude: false, threads: 1) -> Wave::Spectrogram
+ *    Wave::FFT.stft(pcm, size:, hop: size / 4, window: :hann, center: true, magnitude: true, threads: 1) -> Wave::Frames
+ *
+ *  Short-time Fourier transform of +pcm+: the real FFT of +size+ points of frames of
+ *  +size+ samples, +hop+ samples apart, each multiplied by the window.
+ *
+ *  +window+ is the name of a Wave::WindowFunction, e.g. <code>:hann</code> or
+ *  <code>:blackman_harris</code>, or a pair such as <code>[:kaiser, 8.0]</code> for one
+ *  with a parameter, or the +size+ samples of the window as an Array or a Wave::PCM.
+ *  It is computed once, as are the sines and cosines of the transform; the frames
+ *  go to the FFT straight from the samples of +pcm+, windowed on the way, and their
+ *  bins to one allocation.
+ *
+ *  With <code>center: true</code>, frame +t+ is centered on the sample <code>t * hop</code>,
+ *  and there are <code>pcm.length / hop + 1</code> frames; with <code>center: false</code>,
+ *  frame +t+ starts on that sample, the last one covering the end of +pcm+. Samples
+ *  before and after +pcm+ are taken to be 0.0.
+ *
+ *  Returns a Wave::Spectrogram of the complex bins; with <code>magnitude: true</code>,
+ *  their magnitudes only, as Wave::Spectrogram#magnitude would, without the complex bins,
+ *  as a Wave::Frames with a channel per bin: +size+ is then at most 131069.
+ *  The frames are split between +threads+ native threads, started for the call and
+ *  joined before it returns; there is no resident pool, so a few threads pay off on
+ *  long signals only.
+ *
+ *    pcm = Wave::RIFF.read_linear_pcm("session.wav")[0]
+ *    spec = Wave::FFT.stft(pcm, size: 2048, hop: 512, window: :hann, threads: 4)
+ *    spec.frames # => pcm.length / 512 + 1
+ *    re, im = spec[10]
+ */
+static VALUE
+rb_fft_s_stft(int argc, VALUE *argv, VALUE unused_obj)
+{
+	static ID kw[6];
+	VALUE pcm, opts, v[6], res, window, tmp = 0, hold = 0;
+	struct stft_args args;
+	struct stft_worker *a = &args.proto;
+	long size, hop, len;
+	int center, magnitude;
+
+	rb_scan_args(argc, argv, "1:", &pcm, &opts);
+	if (!kw[0])
+	{
+		kw[0] = rb_intern_const("size");
+		kw[1] = rb_intern_const("hop");
+		kw[2] = rb_intern_const("window");
+		kw[3] = rb_intern_const("center");
+		kw[4] = rb_intern_const("magnitude");
+		kw[5] = rb_intern_const("threads");
+	}
+	rb_get_kwargs(opts, kw, 1, 5, v);
+	size = NUM2LONG(v[0]);
+	if (size < 1)
+		rb_raise(rb_eArgError, "size must be positive");
+	hop = v[1] == Qundef || NIL_P(v[1]) ? (size >= 4 ? size / 4 : 1) : NUM2LONG(v[1]);
+	if (hop < 1)
+		rb_raise(rb_eArgError, "hop must be positive");
+	window = v[2] == Qundef || NIL_P(v[2]) ? ID2SYM(rb_intern("hann")) : v[2];
+	center = v[3] == Qundef || RTEST(v[3]);
+	magnitude = v[4] != Qundef && RTEST(v[4]);
+	if (magnitude && size / 2 + 1 > UINT16_MAX)
+		rb_raise(rb_eArgError, "size must be at most %d with magnitude: true", 2 * UINT16_MAX - 1);
+	args.threads = wave_threads_arg(v[5]);
+
+	len = rb_pcm_len(pcm);
+	if (center)
+		args.frames = len > 0 ? len / hop + 1 : 0;
+	else
+		args.frames = len == 0 ? 0 : len <= size ? 1 : (len - size + hop - 1) / hop + 1;
+
+	a->dtype = rb_pcm_dtype(pcm);
+	a->len = len;
+	a->size = size;
+	a->hop = hop;
+	a->bins = size / 2 + 1;
+	a->plan = fft_rplan_get(size, &hold);
+
+	a->offset = center ? -(size / 2) : 0;
+	if (magnitude)
+	{
+		double *w = ALLOCV_N(double, tmp, size);
+		wave_window_arg(window, size, w);
+		res = rb_frames_new(a->bins, args.frames, rb_pcm_fs(pcm), RB_FRAMES_INTERLEAVED);
+		a->w = w;
+		a->data = NULL;
+		a->mag = rb_frames_data_ptr(res);
+	}
+	else
+	{
+		res = rb_spectrogram_new(args.frames, size, hop, rb_pcm_fs(pcm), len, center);
+		wave_window_arg(window, size, rb_spectrogram_window_ptr(res));
+		a->w = rb_spectrogram_window_ptr(res);
+		a->data = rb_spectrogram_data_ptr(res);
+		a->mag = NULL;
+	}
+
+	args.pcm = pcm;
+	rb_pcm_locktmp(pcm);
+	rb_ensure(stft0, (VALUE)&args, fft_pcm_unlock, pcm);
+
+	fft_plan_put(hold);
+	ALLOCV_END(tmp);
+	RB_GC_GUARD(window);
+	return res;
+}
+
+
+/*******************************************************************************
+	Inverse short-time Fourier transform
+*******************************************************************************/
+
+/*
+ * Weighted overlap-add: the inverse transform of frame t, times the window, is
+ * added to the samples from t * hop + offset, and each sample is divided by the
+ * sum of the squared window over the frames covering it.  Between the first and
+ * the last frames, that sum only depends on the sample modulo hop, so it is
+ * tabled once; the samples near the ends, covered by fewer frames, sum it up
+ * themselves.  hop must not exceed size.
+ */
+struct wola {
+	const double *w;  // the window, size samples
+	long size, hop, offset;
+	const double *norm;  // the sums, hop samples
+	double floor;  // sums not above are not divided by
+};
+
+static void
+wola_init(struct wola *o, const double *w, long size, long hop, long offset, double *norm)
+{
+	double peak = 0.0;
+
+	for (long r = 0; r < hop; r++)
+	{
+		double e = 0.0;
+		for (long j = r; j < size; j += hop)
+			e += w[j] * w[j];
+		norm[r] = e;
+		if (e > peak)
+			peak = e;
+	}
+	o->w = w;
+	o->size = size;
+	o->hop = hop;
+	o->offset = offset;
+	o->norm = norm;
+	o->floor = peak * 1e-10;
+}
+
+static inline long
+wola_floor_div(long a, long b)
+{
+	return a >= 0 ? a / b : -((b - 1 - a) / b);
+}
+
+/* Sum of the squared window over the frames 0 to frames - 1 covering sample +n+ */
+static double
+wola_env(const struct wola *o, long n, long frames)
+{
+	const long p = n - o->offset;
+	long t0 = wola_floor_div(p - o->size, o->hop) + 1;
+	long t1 = wola_floor_div(p, o->hop);
+	double e = 0.0;
+
+	if (t0 >= 0 && t1 < frames)
+		return o->norm[p % o->hop];
+	if (t0 < 0)
+		t0 = 0;
+	if (t1 >= frames)
+		t1 = frames - 1;
+	for (long t = t0; t <= t1; t++)
+	{
+		const double w = o->w[p - t * o->hop];
+		e += w * w;
+	}
+	return e;
+}
+
+/* Normalizes the +n+ samples +y+ from sample +first+ */
+static void
+wola_normalize(const struct wola *o, double *y, long first, long n, long frames)
+{
+	for (long i = 0; i < n; i++)
+	{
+		const double e = wola_env(o, first + i, frames);
+		if (e > o->floor)
+			y[i] /= e;
+	}
+}
+
+/* y[0] ... y[n - 1] to the samples of +pcm+ from +pos+ */
+static void
+wola_store(VALUE pcm, long pos, const double *y, long n)
+{
+	if (rb_pcm_dtype(pcm) == RB_PCM_F32)
+	{
+		float *s = rb_waveform_data_ptr_f32(pcm) + pos;
+		for (long i = 0; i < n; i++)
+			s[i] = (float)y[i];
+	}
+	else
+	{
+		double *s = rb_waveform_data_ptr(pcm) + pos;
+		for (long i = 0; i < n; i++)
+			s[i] = y[i];
+	}
+}
+
+struct istft_args {
+	struct wola o;
+	const fft_rplan_t *plan;
+	const double *data;  // frames * bins complex
+	long frames, bins;
+	double *y;  // len samples
+	long len;
+	double *x, *work;
+};
+
+static void *
+istft_run(void *arg)
+{
+	struct istft_args *a = arg;
+	const struct wola *o = &a->o;
+	const double scale = 1.0 / o->size;
+
+	for (long t = 0; t < a->frames; t++)
+	{
+		const long start = t * o->hop + o->offset;
+		const long j0 = start < 0 ? -start : 0;
+		const long j1 = a->len - start < o->size ? a->len - start : o->size;
+
+		if (j0 >= j1)
+			continue;
+		fft_c2r(a->plan, a->data + 2 * t * a->bins, a->x, a->work);
+		for (long j = j0; j < j1; j++)
+			a->y[start + j] += a->x[j] * o->w[j] * scale;
+	}
+	wola_normalize(o, a->y, 0, a->len, a->frames);
+	return NULL;
+}
+
+/*
+ *  call-seq:
+ *    Wave::FFT.istft(spectrogram, window: spectrogram.window, hop: spectrogram.hop, length: nil) -> Wave::PCM
+ *
+ *  Inverse of Wave::FFT.stft: the inverse FFT of each frame of +spectrogram+, times the
+ *  synthesis window, overlap-added +hop+ samples apart and divided by the sum of the
+ *  squared window over the frames covering each sample. That sum is computed once for
+ *  the window, size and hop. +window+ is given as to Wave::FFT.stft, and +hop+ must
+ *  not exceed the size of the frames; a +hop+ other than the one of the analysis
+ *  stretches the signal in time.
+ *
+ *  Returns a Wave::PCM of +length+ samples, by default the length of the signal of
+ *  +spectrogram+, scaled by the ratio of the hops. Where no frame has a nonzero window,
+ *  the samples are 0.0.
+ *
+ *    spec = Wave::FFT.stft(pcm, size: 2048, hop: 512)
+ *    spec[10] = spec[10].map{|bins| bins * 0.5}
+ *    Wave::FFT.istft(spec) # => pcm, within rounding but for frame 10
+ */
+static VALUE
+rb_fft_s_istft(int argc, VALUE *argv, VALUE unused_obj)
+{
+	static ID kw[3];
+	VALUE spec, opts, v[3], res, tmp = 0, hold = 0;
+	struct istft_args a;
+	long size, hop, len;
+	double *w, *norm;
+
+	rb_scan_args(argc, argv, "1:", &spec, &opts);
+	if (!rb_spectrogram_p(spec))
+		rb_raise(rb_eTypeError, "not a %"PRIsVALUE"", rb_cWaveSpectrogram);
+	if (!kw[0])
+	{
+		kw[0] = rb_intern_const("window");
+		kw[1] = rb_intern_const("hop");
+		kw[2] = rb_intern_const("length");
+	}
+	rb_get_kwargs(opts, kw, 0, 3, v);
+	size = rb_spectrogram_size(spec);
+	hop = v[1] == Qundef || NIL_P(v[1]) ? rb_spectrogram_hop(spec) : NUM2LONG(v[1]);
+	if (hop < 1 || hop > size)
+		rb_raise(rb_eArgError, "hop must be in 1..%ld", size);
+	if (v[2] != Qundef && !NIL_P(v[2]))
+		len = NUM2LONG(v[2]);
+	else if (hop == rb_spectrogram_hop(spec))
+		len = rb_spectrogram_length(spec);
+	else
+		len = (long)((double)rb_spectrogram_length(spec) * hop / rb_spectrogram_hop(spec));
+	if (len < 0)
+		rb_raise(rb_eArgError, "negative length");
+
+	a.plan = fft_rplan_get(size, &hold);
+	a.x = FFT_SCRATCH(tmp, 2 * size + hop + fft_rwork_size(a.plan));
+	a.work = a.x + size;
+	w = a.work + fft_rwork_size(a.plan);
+	norm = w + size;
+	if (v[0] == Qundef || NIL_P(v[0]))
+		MEMCPY(w, rb_spectrogram_window_ptr(spec), double, size);
+	else
+		wave_window_arg(v[0], size, w);
+	wola_init(&a.o, w, size, hop, rb_spectrogram_offset(spec), norm);
+
+	res = rb_pcm_new(len, rb_spectrogram_fs(spec));
+	a.data = rb_spectrogram_data_ptr(spec);
+	a.frames = rb_spectrogram_frames(spec);
+	a.bins = rb_spectrogram_bins(spec);
+	a.y = rb_waveform_data_ptr(res);
+	a.len = len;
+	if (a.frames * size >= FFT_NOGVL_MIN)
+		rb_thread_call_without_gvl(istft_run, &a, NULL, NULL);
+	else
+		istft_run(&a);
+
+	fft_plan_put(hold);
+	ALLOCV_END(tmp);
+	RB_GC_GUARD(spec);
+	return res;
+}
+
+/*
+ *  class Wave::FFT::ISTFT
+ *
+ *  Streaming Wave::FFT.istft: the frames are pushed one by one, and each push returns
+ *  the samples that no later frame overlaps, +hop+ of them, normalized. Only the last
+ *  +size+ samples of the sum are kept, so a signal of any length is resynthesized with
+ *  neither its whole spectrogram nor the whole signal in memory.
+ *
+ *    synth = Wave::FFT::ISTFT.new(size: 2048, hop: 512, window: :hann)
+ *    spec.frames.times do |t|
+ *      io.write(synth.push(*spec[t]).to_binary)
+ *    end
+ *    io.write(synth.flush.to_binary)
+ */
+
+struct ISTFT {
+	long fs;
+	long bins;
+	long frames;  // pushed since the start
+	struct wola o;
+	const fft_rplan_t *plan;
+	double *buf;  // one allocation for the following
+	double *acc;  // size samples of the sum, from the start of the next frame
+	double *in;  // bins complex
+	double *x, *work;
+};
+
+static void
+istft_free(void *p)
+{
+	struct ISTFT *ptr = p;
+	if (ptr->buf != NULL)
+		fft_free(ptr->buf);
+	if (ptr->plan != NULL)
+		fft_rplan_release(ptr->plan);
+	xfree(ptr);
+}
+
+static size_t
+istft_memsize(const void *p)
+{
+	const struct ISTFT *ptr = p;
+	if (ptr->buf == NULL)
+		return sizeof(struct ISTFT);
+	return sizeof(struct ISTFT) + (3 * ptr->o.size + ptr->o.hop + 2 * ptr->bins + fft_rwork_size(ptr->plan)) * sizeof(double);
+}
+
+static const rb_data_type_t istft_data_type = {
+    "istft",
+    {
+	0,
+	istft_free,
+	istft_memsize,
+    },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static struct ISTFT *
+get_istft(VALUE self)
+{
+	struct ISTFT *ptr = rb_check_typeddata(self, &istft_data_type);
+
+	if (ptr->buf == NULL)
+		rb_raise(rb_eRuntimeError, "uninitialized ISTFT");
+	return ptr;
+}
+
+static VALUE
+istft_s_allocate(VALUE klass)
+{
+	struct ISTFT *ptr;
+	return TypedData_Make_Struct(klass, struct ISTFT, &istft_data_type, ptr);
+}
+
+/*
+ *  call-seq:
+ *    Wave::FFT::ISTFT.new(size:, hop: size / 4, window: :hann, center: true, fs: Wave::PCM::FS_DEF) -> Wave::FFT::ISTFT
+ *
+ *  Resynthesizer of frames of the real FFT of +size+ points, +hop+ samples apart, with
+ *  the synthesis +window+, given as to Wave::FFT.stft. +hop+ must not exceed +size+.
+ *  With <code>center: true</code>, frame +t+ is centered on sample <code>t * hop</code>
+ *  and the samples before sample 0 are dropped; +fs+ is the one of the results.
+ */
+static VALUE
+istft_initialize(int argc, VALUE *argv, VALUE self)
+{
+	static ID kw[5];
+	struct ISTFT *ptr = rb_check_typeddata(self, &istft_data_type);
+	VALUE opts, v[5];
+	long size, hop, fs;
+	size_t count;
+	double *norm;
+
+	rb_scan_args(argc, argv, ":", &opts);
+	if (!kw[0])
+	{
+		kw[0] = rb_intern_const("size");
+		kw[1] = rb_intern_const("hop");
+		kw[2] = rb_intern_const("window");
+		kw[3] = rb_intern_const("center");
+		kw[4] = rb_intern_const("fs");
+	}
+	rb_get_kwargs(opts, kw, 1, 4, v);
+	if (ptr->plan != NULL)
+		rb_raise(rb_eRuntimeError, "already initialized ISTFT");
+	size = NUM2LONG(v[0]);
+	if (size < 1)
+		rb_raise(rb_eArgError, "size must be positive");
+	hop = v[1] == Qundef || NIL_P(v[1]) ? (size >= 4 ? size / 4 : 1) : NUM2LONG(v[1]);
+	if (hop < 1 || hop > size)
+		rb_raise(rb_eArgError, "hop must be in 1..%ld", size);
+	fs = v[4] == Qundef || NIL_P(v[4]) ? FS_DEF : NUM2LONG(v[4]);
+	if (fs <= 0)
+		rb_raise(rb_eRangeError, "negative (or biggest) frequency");
+
+	ptr->plan = fft_rplan(size);
+	if (ptr->plan == NULL)
+		rb_memerror();
+	ptr->bins = size / 2 + 1;
+	count = 3 * size + hop + 2 * ptr->bins + fft_rwork_size(ptr->plan);
+	ptr->buf = fft_malloc(count * sizeof(double));
+	if (ptr->buf == NULL)
+		rb_memerror();
+	MEMZERO(ptr->buf, double, count);
+	ptr->x = ptr->buf;
+	ptr->acc = ptr->x + size;
+	ptr->in = ptr->acc + size;
+	ptr->work = ptr->in + 2 * ptr->bins;
+	norm = ptr->work + fft_rwork_size(ptr->plan);
+	wave_window_arg(v[2] == Qundef || NIL_P(v[2]) ? ID2SYM(rb_intern("hann")) : v[2], size, norm + hop);
+	wola_init(&ptr->o, norm + hop, size, hop, v[3] == Qundef || RTEST(v[3]) ? -(size / 2) : 0, norm);
+	ptr->fs = fs;
+	ptr->frames = 0;
+	return self;
+}
+
+/* Of the +n+ samples from sample +first+, the number of those from sample 0 */
+static inline long
+istft_count(long first, long n)
+{
+	return first >= 0 ? n : first + n > 0 ? first + n : 0;
+}
+
+/*
+ * Normalizes the +n+ first samples of the sum, from sample +first+, stores the
+ * ones from sample 0 to +out+ from +pos+, and drops them from the sum.
+ * Returns the number of samples stored.
+ */
+static long
+istft_emit(struct ISTFT *ptr, long first, long n, long frames, VALUE out, long pos)
+{
+	const long size = ptr->o.size;
+	const long skip = n - istft_count(first, n);
+
+	wola_normalize(&ptr->o, ptr->acc + skip, first + skip, n - skip, frames);
+	wola_store(out, pos, ptr->acc + skip, n - skip);
+	memmove(ptr->acc, ptr->acc + n, (size - n) * sizeof(double));
+	MEMZERO(ptr->acc + size - n, double, n);
+	return n - skip;
+}
+
+/* Adds the frame of the bins +in+ to the sum, and stores the finished samples */
+static long
+istft_frame(struct ISTFT *ptr, const double *in, VALUE out, long pos)
+{
+	const struct wola *o = &ptr->o;
+	const long start = ptr->frames * o->hop + o->offset;
+	const double scale = 1.0 / o->size;
+
+	fft_c2r(ptr->plan, in, ptr->x, ptr->work);
+	for (long j = 0; j < o->size; j++)
+		ptr->acc[j] += ptr->x[j] * o->w[j] * scale;
+	ptr->frames++;
+	return istft_emit(ptr, start, o->hop, LONG_MAX, out, pos);
+}
+
+/*
+ *  call-seq:
+ *    istft.push(re, im, out: nil) -> Wave::PCM
+ *    istft.push(spectrogram, out: nil) -> Wave::PCM
+ *
+ *  Adds the next frame, the <code>size / 2 + 1</code> bins of real parts +re+ and
+ *  imaginary parts +im+, and returns the +hop+ samples it finishes, fewer at the start
+ *  with <code>center: true</code>. Given a Wave::Spectrogram of frames of +size+ points,
+ *  adds all of its frames and returns the samples they finish together.
+ *  The samples are written to the Wave::PCM given as <code>out:</code>, if any, resized;
+ *  new ones are of the dtype of +re+, or double.
+ */
+static VALUE
+istft_push(int argc, VALUE *argv, VALUE self)
+{
+	struct ISTFT *ptr = get_istft(self);
+	const long hop = ptr->o.hop;
+	VALUE re, im, opts, res;
+	long count = 0, pos = 0;
+
+	rb_scan_args(argc, argv, "11:", &re, &im, &opts);
+	if (NIL_P(im) && rb_spectrogram_p(re))
+	{
+		const double *data = rb_spectrogram_data_ptr(re);
+		const long frames = rb_spectrogram_frames(re);
+
+		if (rb_spectrogram_size(re) != ptr->o.size)
+			rb_raise(rb_eArgError, "size mismatch (%ld for %ld)", rb_spectrogram_size(re), ptr->o.size);
+		for (long t = 0; t < frames; t++)
+			count += istft_count((ptr->frames + t) * hop + ptr->o.offset, hop);
+		fft_out_pcm(fft_out_opt(opts), &res, 1, count, ptr->fs, RB_PCM_F64);
+		for (long t = 0; t < frames; t++)
+			pos += istft_frame(ptr, data + 2 * t * ptr->bins, res, pos);
+		RB_GC_GUARD(re);
+		return res;
+	}
+	if (NIL_P(im))
+		rb_raise(rb_eArgError, "wrong number of arguments (given 1, expected 2)");
+	if (rb_pcm_len(re) != ptr->bins || rb_pcm_len(im) != ptr->bins)
+		rb_raise(rb_eArgError, "%ld and %ld bins for frames of %ld", rb_pcm_len(re), rb_pcm_len(im), ptr->o.size);
+	fft_load(re, ptr->in, ptr->bins, 2);
+	fft_load(im, ptr->in + 1, ptr->bins, 2);
+	count = istft_count(ptr->frames * hop + ptr->o.offset, hop);
+	fft_out_pcm(fft_out_opt(opts), &res, 1, count, ptr->fs, rb_pcm_dtype(re));
+	istft_frame(ptr, ptr->in, res, 0);
+	return res;
+}
+
+/*
+ *  call-seq:
+ *    istft.flush(out: nil) -> Wave::PCM
+ *
+ *  Returns the samples of the sum that no frame finished, the last
+ *  <code>size - hop</code> ones, and starts over for a new signal.
+ *  With <code>center: true</code>, the last <code>size / 2</code> are past the end of
+ *  the signal analyzed by Wave::FFT.stft.
+ */
+static VALUE
+istft_flush(int argc, VALUE *argv, VALUE self)
+{
+	struct ISTFT *ptr = get_istft(self);
+	const long first = ptr->frames * ptr->o.hop + ptr->o.offset;
+	const long n = ptr->o.size - ptr->o.hop;
+	VALUE opts, res;
+
+	rb_scan_args(argc, argv, ":", &opts);
+	fft_out_pcm(fft_out_opt(opts), &res, 1, ptr->frames > 0 ? istft_count(first, n) : 0, ptr->fs, RB_PCM_F64);
+	if (ptr->frames > 0)
+		istft_emit(ptr, first, n, ptr->frames, res, 0);
+	MEMZERO(ptr->acc, double, ptr->o.size);
+	ptr->frames = 0;
+	return res;
+}
+
+
+
+/*******************************************************************************
+	Modified discrete cosine transform
+*******************************************************************************/
+
+/*
+ * Blocks of size = 2m samples, m apart, to m coefficients
+ * X[k] = sum(x[n] * w[n] * cos(pi / m * (n + 1/2 + m/2) * (k + 1/2))).
+ * A block is folded to m samples, whose DCT-IV is computed as a complex
+ * FFT of m / 2 points between a pre- and a post-twiddle.  Block t starts on
+ * sample (t - 1) * m, so that each sample of the signal is in two blocks.
+ */
+struct mdct {
+	long m;
+	const fft_plan_t *plan;  // m / 2 points
+	const double *w;  // the window, 2m samples
+	const double *tw;  // m / 2 pre-twiddles, then m / 2 post-twiddles
+};
+
+static void
+mdct_init(struct mdct *d, long size, const fft_plan_t *plan, const double *w, double *tw)
+{
+	const long m = size / 2;
+
+	for (long n = 0; n < m / 2; n++)
+	{
+		tw[2 * n] = cos(M_PI * (n + 0.25) / m);
+		tw[2 * n + 1] = -sin(M_PI * (n + 0.25) / m);
+		tw[m + 2 * n] = cos(M_PI * n / m);
+		tw[m + 2 * n + 1] = -sin(M_PI * n / m);
+	}
+	d->m = m;
+	d->plan = plan;
+	d->w = w;
+	d->tw = tw;
+}
+
+/* Unnormalized DCT-IV of the m samples +u+ to +v+, with m complex +z+ */
+static void
+mdct_dct4(const struct mdct *d, const double *u, double *v, double *z, double *work)
+{
+	const long m = d->m;
+	const double *pre = d->tw, *post = d->tw + m;
+
+	for (long n = 0; n < m / 2; n++)
+	{
+		const double re = u[2 * n], im = u[m - 1 - 2 * n];
+		z[2 * n] = re * pre[2 * n] - im * pre[2 * n + 1];
+		z[2 * n + 1] = re * pre[2 * n + 1] + im * pre[2 * n];
+	}
+	fft_c2c(d->plan, z, -1, work);
+	for (long k = 0; k < m / 2; k++)
+	{
+		const double re = z[2 * k], im = z[2 * k + 1];
+		v[2 * k] = re * post[2 * k] - im * post[2 * k + 1];
+		v[m - 1 - 2 * k] = -(re * post[2 * k + 1] + im * post[2 * k]);
+	}
+}
+
+struct mdct_args {
+	struct mdct d;
+	VALUE pcm;
+	const void *s;  // the signal
+	enum rb_pcm_dtype dtype;
+	long len, blocks;
+	double *c;  // blocks * m coefficients, block by block
+	double *x, *u, *z, *work;  // scratch
+};
+
+/* Windowed block starting on sample +start+, zero past the ends of the signal */
+static double
+mdct_sample(const struct mdct_args *a, long start, long n)
+{
+	const long i = start + n;
+
+	if (i < 0 || i >= a->len)
+		return 0.0;
+	if (a->dtype == RB_PCM_F32)
+		return ((const float *)a->s)[i] * a->d.w[n];
+	return ((const double *)a->s)[i] * a->d.w[n];
+}
+
+static void *
+mdct_run(void *arg)
+{
+	struct mdct_args *a = arg;
+	const long m = a->d.m, h = m / 2;
+
+	for (long t = 0; t < a->blocks; t++)
+	{
+		const long start = (t - 1) * m;
+
+		for (long n = 0; n < 2 * m; n++)
+			a->x[n] = mdct_sample(a, start, n);
+		/* (a, b, c, d) to (-c_r - d, a - b_r), in blocks of m / 2 */
+		for (long n = 0; n < h; n++)
+		{
+			a->u[n] = -a->x[3 * h - 1 - n] - a->x[3 * h + n];
+			a->u[h + n] = a->x[n] - a->x[m - 1 - n];
+		}
+		mdct_dct4(&a->d, a->u, a->c + t * m, a->z, a->work);
+	}
+	return NULL;
+}
+
+static VALUE
+mdct0(VALUE arg)
+{
+	struct mdct_args *a = (struct mdct_args *)arg;
+
+	a->s = a->dtype == RB_PCM_F32 ?
+		(const void *)rb_waveform_data_ptr_f32(a->pcm) : (const void *)rb_waveform_data_ptr(a->pcm);
+	if (a->blocks * a->d.m >= FFT_NOGVL_MIN)
+		rb_thread_call_without_gvl(mdct_run, a, NULL, NULL);
+	else
+		mdct_run(a);
+	return Qnil;
+}
+
+/*
+ * The +window+ option of the MDCT: :sine for sin(pi * (n + 1/2) / size),
+ * :kbd alone for a Kaiser-Bessel-derived window of alpha 4, else as for
+ * wave_window_arg().
+ */
+static void
+mdct_window_arg(VALUE window, long size, double *w)
+{
+	static ID sine, kbd, kaiser_bessel_derived;
+
+	if (!sine)
+	{
+		sine = rb_intern_const("sine");
+		kbd = rb_intern_const("kbd");
+		kaiser_bessel_derived = rb_intern_const("kaiser_bessel_derived");
+	}
+	if (NIL_P(window) || window == ID2SYM(sine))
+	{
+		for (long n = 0; n < size; n++)
+			w[n] = sin(M_PI * (n + 0.5) / size);
+	}
+	else if (window == ID2SYM(kbd) || window == ID2SYM(kaiser_bessel_derived))
+		wave_window_arg(rb_assoc_new(window, DBL2NUM(4.0)), size, w);
+	else
+		wave_window_arg(window, size, w);
+}
+
+/* The +size+ option of the MDCT */
+static long
+mdct_size_arg(VALUE size)
+{
+	const long n = NUM2LONG(size);
+
+	if (n < 4 || n % 4 != 0)
+		rb_raise(rb_eArgError, "size must be a positive multiple of 4");
+	return n;
+}
+
+/*
+ *  call-seq:
+ *    Wave::FFT.mdct(pcm, size:, window: :sine) -> Wave::Frames
+ *
+ *  Modified discrete cosine transform of +pcm+, in blocks of +size+ samples,
+ *  <code>size / 2</code> apart: the <code>size / 2</code> coefficients
+ *  X[k] = sum(x[n] * w[n] * cos(pi / (size / 2) * (n + 1/2 + size / 4) * (k + 1/2)))
+ *  of each block, unnormalized. +size+ must be a multiple of 4; each block is computed
+ *  by an FFT of <code>size / 4</code> points.
+ *
+ *  Block +t+ starts on sample <code>(t - 1) * size / 2</code>, samples outside +pcm+
+ *  being 0.0, so that every sample of +pcm+ is in two blocks and Wave::FFT.imdct gives
+ *  it back. +window+ is <code>:sine</code>, <code>:kbd</code> for a Kaiser-Bessel-derived
+ *  window of alpha 4, <code>[:kbd, alpha]</code>, or any window given as to Wave::FFT.stft;
+ *  for the time-domain aliasing to cancel out, w[n]^2 + w[n + size / 2]^2 must be 1.
+ *
+ *  Returns the coefficients as interleaved Wave::Frames of <code>size / 2</code> channels,
+ *  one frame per block.
+ *
+ *    coefs = Wave::FFT.mdct(pcm, size: 2048, window: :kbd)
+ *    coefs.length # => (pcm.length + 1023) / 1024 + 1
+ *    Wave::FFT.imdct(coefs, window: :kbd, length: pcm.length) # => pcm, within rounding
+ */
+static VALUE
+rb_fft_s_mdct(int argc, VALUE *argv, VALUE unused_obj)
+{
+	static ID kw[2];
+	VALUE pcm, opts, v[2], res, tmp = 0, hold = 0;
+	const fft_plan_t *plan;
+	struct mdct_args a;
+	long size, m;
+	double *w;
+
+	rb_scan_args(argc, argv, "1:", &pcm, &opts);
+	if (!kw[0])
+	{
+		kw[0] = rb_intern_const("size");
+		kw[1] = rb_intern_const("window");
+	}
+	rb_get_kwargs(opts, kw, 1, 1, v);
+	size = mdct_size_arg(v[0]);
+	m = size / 2;
+
+	a.pcm = pcm;
+	a.dtype = rb_pcm_dtype(pcm);
+	a.len = rb_pcm_len(pcm);
+	a.blocks = a.len > 0 ? (a.len + m - 1) / m + 1 : 0;
+	res = rb_frames_new(m, a.blocks, rb_pcm_fs(pcm), RB_FRAMES_INTERLEAVED);
+	a.c = rb_frames_data_ptr(res);
+
+	plan = fft_plan_get(m / 2, &hold);
+	a.x = FFT_SCRATCH(tmp, 3 * size + 2 * m + fft_work_size(plan));
+	a.z = a.x + size;
+	a.u = a.z + m;
+	a.work = a.u + m;
+	w = a.work + fft_work_size(plan);
+	mdct_window_arg(v[1] == Qundef ? Qnil : v[1], size, w);
+	mdct_init(&a.d, size, plan, w, w + size);
+
+	rb_pcm_locktmp(pcm);
+	rb_ensure(mdct0, (VALUE)&a, fft_pcm_unlock, pcm);
+
+	fft_plan_put(hold);
+	ALLOCV_END(tmp);
+	return res;
+}
+
+struct imdct_args {
+	struct mdct d;
+	const double *c;  // the coefficients
+	long cstride, kstride;  // between blocks and between coefficients
+	long blocks;
+	double *y;  // len samples
+	long len;
+	double *x, *v, *z, *work;  // scratch
+};
+
+static void *
+imdct_run(void *arg)
+{
+	struct imdct_args *a = arg;
+	const long m = a->d.m, h = m / 2;
+	const double scale = 2.0 / m;
+
+	for (long t = 0; t < a->blocks; t++)
+	{
+		const long start = (t - 1) * m;
+		const long j0 = start < 0 ? -start : 0;
+		const long j1 = a->len - start < 2 * m ? a->len - start : 2 * m;
+
+		if (j0 >= j1)
+			continue;
+		for (long k = 0; k < m; k++)
+			a->x[k] = a->c[t * a->cstride + k * a->kstride];
+		mdct_dct4(&a->d, a->x, a->v, a->z, a->work);
+		/* v = (u1, u2) to (u2, -u2_r, -u1_r, -u1), in blocks of m / 2 */
+		for (long n = 0; n < h; n++)
+		{
+			a->x[n] = a->v[h + n];
+			a->x[h + n] = -a->v[m - 1 - n];
+			a->x[m + n] = -a->v[h - 1 - n];
+			a->x[3 * h + n] = -a->v[n];
+		}
+		for (long j = j0; j < j1; j++)
+			a->y[start + j] += a->x[j] * a->d.w[j] * scale;
+	}
+	return NULL;
+}
+
+/*
+ *  call-seq:
+ *    Wave::FFT.imdct(coefs, window: :sine, length: (coefs.length - 1) * coefs.channels) -> Wave::PCM
+ *
+ *  Inverse of Wave::FFT.mdct: the inverse transforms of the blocks of coefficients
+ *  +coefs+, Wave::Frames of <code>size / 2</code> channels, times +window+ and overlap-added
+ *  <code>size / 2</code> samples apart, so that the time-domain aliasing of the
+ *  adjacent blocks cancels out. The blocks are scaled by <code>4 / size</code>, which
+ *  gives the signal back for a window satisfying the condition of Wave::FFT.mdct.
+ *  Returns a Wave::PCM of +length+ samples, from the start of the signal given to
+ *  Wave::FFT.mdct.
+ */
+static VALUE
+rb_fft_s_imdct(int argc, VALUE *argv, VALUE unused_obj)
+{
+	static ID kw[2];
+	VALUE coefs, opts, v[2], res, tmp = 0, hold = 0;
+	const fft_plan_t *plan;
+	struct imdct_args a;
+	long size, m;
+	double *w;
+
+	rb_scan_args(argc, argv, "1:", &coefs, &opts);
+	if (!rb_frames_p(coefs))
+		rb_raise(rb_eTypeError, "not a %"PRIsVALUE"", rb_cWaveFrames);
+	if (!kw[0])
+	{
+		kw[0] = rb_intern_const("window");
+		kw[1] = rb_intern_const("length");
+	}
+	rb_get_kwargs(opts, kw, 0, 2, v);
+	m = rb_frames_channels(coefs);
+	size = mdct_size_arg(LONG2NUM(2 * m));
+	a.blocks = rb_frames_len(coefs);
+	a.len = v[1] == Qundef || NIL_P(v[1]) ? (a.blocks > 0 ? (a.blocks - 1) * m : 0) : NUM2LONG(v[1]);
+	if (a.len < 0)
+		rb_raise(rb_eArgError, "negative length");
+	if (rb_frames_layout(coefs) == RB_FRAMES_INTERLEAVED)
+	{
+		a.cstride = m;
+		a.kstride = 1;
+	}
+	else
+	{
+		a.cstride = 1;
+		a.kstride = a.blocks;
+	}
+
+	plan = fft_plan_get(m / 2, &hold);
+	a.x = FFT_SCRATCH(tmp, 3 * size + 2 * m + fft_work_size(plan));
+	a.z = a.x + size;
+	a.v = a.z + m;
+	a.work = a.v + m;
+	w = a.work + fft_work_size(plan);
+	mdct_window_arg(v[0] == Qundef ? Qnil : v[0], size, w);
+	mdct_init(&a.d, size, plan, w, w + size);
+
+	res = rb_pcm_new(a.len, rb_frames_fs(coefs));
+	a.c = rb_frames_data_ptr(coefs);
+	a.y = rb_waveform_data_ptr(res);
+	if (a.blocks * m >= FFT_NOGVL_MIN)
+		rb_thread_call_without_gvl(imdct_run, &a, NULL, NULL);
+	else
+		imdct_run(&a);
+
+	fft_plan_put(hold);
+	ALLOCV_END(tmp);
+	RB_GC_GUARD(coefs);
+	return res;
+}
+
+
+void
+InitVM_FFT(void)
+{
+	rb_define_module_function(rb_mWaveFFT, "fft", rb_fft_s_fft, -1);
+	rb_define_module_function(rb_mWaveFFT, "ifft", rb_fft_s_ifft, -1);
+	rb_define_module_function(rb_mWaveFFT, "rfft", rb_fft_s_rfft, -1);
+	rb_define_module_function(rb_mWaveFFT, "irfft", rb_fft_s_irfft, -1);
+	rb_define_module_function(rb_mWaveFFT, "stft", rb_fft_s_stft, -1);
+	rb_define_module_function(rb_mWaveFFT, "istft", rb_fft_s_istft, -1);
+	rb_define_module_function(rb_mWaveFFT, "mdct", rb_fft_s_mdct, -1);
+	rb_define_module_function(rb_mWaveFFT, "imdct", rb_fft_s_imdct, -1);
+
+	rb_define_alloc_func(rb_cWaveFFTISTFT, istft_s_allocate);
+	rb_define_method(rb_cWaveFFTISTFT, "initialize", istft_initialize, -1);
+	rb_define_method(rb_cWaveFFTISTFT, "push", istft_push, -1);
+	rb_define_method(rb_cWaveFFTISTFT, "flush", istft_flush, -1);
+}
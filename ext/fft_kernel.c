@@ -0,0 +1,644 @@
+/*******************************************************************************
+	fft_kernel.c -- Mixed-radix FFT with cached plans
+
+	$author$
+
+	@license: MIT Licence
+
+	Sizes of the form 2^a 3^b 5^c run as a Stockham autosort FFT, one pass
+	per radix 4, 2, 3 or 5 factor of the size: each pass reads one buffer
+	and writes the other in order, so that no bit-reversal permutation is
+	needed.  Other sizes go through Bluestein's algorithm, a convolution
+	computed by FFTs of a size of the first kind.  The real transforms of
+	an even size pack the samples as n/2 complex numbers.
+
+	A plan holds the twiddle factors of one size; plans are made on the
+	first request and kept in a cache of the FFT_PLAN_CACHE sizes used last,
+	so that a size in steady use costs its sines and cosines once.  Plans
+	are reference counted: one reference is the cache's and one each user's,
+	and a plan evicted from the cache is freed with its last reference.
+*******************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "internal/algorithm/fft.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+typedef struct { double r, i; } cmplx;
+
+#define FFT_MAXFCT  64
+
+/* Plans kept by the cache, of each kind, besides the ones still in use */
+#define FFT_PLAN_CACHE  16
+
+struct fft_plan {
+	long n;
+	int nfct;
+	struct {
+		int fct;
+		const cmplx *tw;  // (fct - 1) * (ido - 1) twiddles of the pass
+	} fct[FFT_MAXFCT];
+	cmplx *mem;
+	/* Bluestein, when n has a prime factor above 5 */
+	long m;
+	const fft_plan_t *sub;  // of m
+	cmplx *bk;   // chirp exp(-pi i j^2 / n), n of them
+	cmplx *bkf;  // transform of the conjugate chirp, divided by m
+	int ref;
+	struct fft_plan *next;  // in the cache, most recently used first
+};
+
+struct fft_rplan {
+	long n;
+	const fft_plan_t *cplan;  // of n/2 for an even n, of n for an odd one
+	cmplx *tw;  // exp(-2 pi i k / n) for k in 0..n/2, even n only
+	int ref;
+	struct fft_rplan *next;  // in the cache, most recently used first
+};
+
+static fft_plan_t *plans;
+static fft_rplan_t *rplans;
+static int nplans, nrplans;
+
+void *
+fft_malloc(size_t size)
+{
+	unsigned char *raw = malloc(size + FFT_ALIGN), *p;
+
+	if (raw == NULL)
+		return NULL;
+	p = raw + FFT_ALIGN - (uintptr_t)raw % FFT_ALIGN;
+	p[-1] = (unsigned char)(p - raw);
+	return p;
+}
+
+void
+fft_free(void *p)
+{
+	unsigned char *q = p;
+
+	if (q != NULL)
+		free(q - q[-1]);
+}
+
+/* exp(2 pi i x / n) */
+static cmplx
+expi(unsigned long long x, unsigned long long n)
+{
+	const double a = 2.0 * M_PI * (double)(x % n) / (double)n;
+	cmplx w;
+
+	w.r = cos(a);
+	w.i = sin(a);
+	return w;
+}
+
+/* a * w, or a * conj(w) when +sign+ is -1 */
+static inline cmplx
+twmul(cmplx a, cmplx w, int sign)
+{
+	cmplx y;
+	const double wi = sign * w.i;
+
+	y.r = a.r * w.r - a.i * wi;
+	y.i = a.r * wi + a.i * w.r;
+	return y;
+}
+
+/*******************************************************************************
+	Passes
+*******************************************************************************/
+
+/*
+ * The DFTs of +ip+ points, exp(sign * 2 pi i jk / ip), of l1 * ido sets of
+ * samples, twiddled for the next pass.  cc is ido x ip x l1, ch ido x l1 x ip.
+ */
+static inline void
+butterfly(const int ip, const cmplx *a, cmplx *y, int sign)
+{
+	switch (ip) {
+	case 2:
+		y[0].r = a[0].r + a[1].r;  y[0].i = a[0].i + a[1].i;
+		y[1].r = a[0].r - a[1].r;  y[1].i = a[0].i - a[1].i;
+		break;
+	case 3: {
+		const double s3 = sign * 0.86602540378443864676;
+		const double tr = a[1].r + a[2].r, ti = a[1].i + a[2].i;
+		const double dr = s3 * (a[1].r - a[2].r), di = s3 * (a[1].i - a[2].i);
+		const double mr = a[0].r - 0.5 * tr, mi = a[0].i - 0.5 * ti;
+		y[0].r = a[0].r + tr;  y[0].i = a[0].i + ti;
+		y[1].r = mr - di;  y[1].i = mi + dr;
+		y[2].r = mr + di;  y[2].i = mi - dr;
+		break;
+	}
+	case 4: {
+		const double sr = a[0].r + a[2].r, si = a[0].i + a[2].i;
+		const double dr = a[0].r - a[2].r, di = a[0].i - a[2].i;
+		const double tr = a[1].r + a[3].r, ti = a[1].i + a[3].i;
+		// (a1 - a3) * sign * i
+		const double ur = -sign * (a[1].i - a[3].i), ui = sign * (a[1].r - a[3].r);
+		y[0].r = sr + tr;  y[0].i = si + ti;
+		y[1].r = dr + ur;  y[1].i = di + ui;
+		y[2].r = sr - tr;  y[2].i = si - ti;
+		y[3].r = dr - ur;  y[3].i = di - ui;
+		break;
+	}
+	case 5: {
+		const double c1 = 0.30901699437494742410, c2 = -0.80901699437494742410;
+		const double s1 = sign * 0.95105651629515357212, s2 = sign * 0.58778525229247312917;
+		const double t1r = a[1].r + a[4].r, t1i = a[1].i + a[4].i;
+		const double t2r = a[2].r + a[3].r, t2i = a[2].i + a[3].i;
+		const double d1r = a[1].r - a[4].r, d1i = a[1].i - a[4].i;
+		const double d2r = a[2].r - a[3].r, d2i = a[2].i - a[3].i;
+		const double m1r = a[0].r + c1 * t1r + c2 * t2r, m1i = a[0].i + c1 * t1i + c2 * t2i;
+		const double m2r = a[0].r + c2 * t1r + c1 * t2r, m2i = a[0].i + c2 * t1i + c1 * t2i;
+		// i * (s1 d1 + s2 d2) and i * (s2 d1 - s1 d2)
+		const double n1r = -(s1 * d1i + s2 * d2i), n1i = s1 * d1r + s2 * d2r;
+		const double n2r = -(s2 * d1i - s1 * d2i), n2i = s2 * d1r - s1 * d2r;
+		y[0].r = a[0].r + t1r + t2r;  y[0].i = a[0].i + t1i + t2i;
+		y[1].r = m1r + n1r;  y[1].i = m1i + n1i;
+		y[4].r = m1r - n1r;  y[4].i = m1i - n1i;
+		y[2].r = m2r + n2r;  y[2].i = m2i + n2i;
+		y[3].r = m2r - n2r;  y[3].i = m2i - n2i;
+		break;
+	}
+	}
+}
+
+#define CC(a, b, c)  cc[(a) + ido * ((b) + ip * (c))]
+#define CH(a, b, c)  ch[(a) + ido * ((b) + l1 * (c))]
+
+static inline void
+pass_radix(const int ip, long ido, long l1, const cmplx *cc, cmplx *ch, const cmplx *wa, int sign)
+{
+	for (long k = 0; k < l1; k++)
+	{
+		cmplx a[5], y[5];
+
+		/* i == 0, no twiddle */
+		for (int j = 0; j < ip; j++)
+			a[j] = CC(0, j, k);
+		butterfly(ip, a, y, sign);
+		for (int u = 0; u < ip; u++)
+			CH(0, k, u) = y[u];
+
+		for (long i = 1; i < ido; i++)
+		{
+			for (int j = 0; j < ip; j++)
+				a[j] = CC(i, j, k);
+			butterfly(ip, a, y, sign);
+			CH(i, k, 0) = y[0];
+			for (int u = 1; u < ip; u++)
+				CH(i, k, u) = twmul(y[u], wa[(u - 1) * (ido - 1) + i - 1], sign);
+		}
+	}
+}
+
+#undef CC
+#undef CH
+
+static void
+pass(int ip, long ido, long l1, const cmplx *cc, cmplx *ch, const cmplx *wa, int sign)
+{
+	switch (ip) {
+	case 2: pass_radix(2, ido, l1, cc, ch, wa, sign); break;
+	case 3: pass_radix(3, ido, l1, cc, ch, wa, sign); break;
+	case 4: pass_radix(4, ido, l1, cc, ch, wa, sign); break;
+	case 5: pass_radix(5, ido, l1, cc, ch, wa, sign); break;
+	}
+}
+
+static void
+pass_all(const fft_plan_t *plan, cmplx *c, cmplx *ch, int sign)
+{
+	cmplx *p1 = c, *p2 = ch, *t;
+	long l1 = 1;
+
+	for (int k = 0; k < plan->nfct; k++)
+	{
+		const int ip = plan->fct[k].fct;
+		const long ido = plan->n / (l1 * ip);
+
+		pass(ip, ido, l1, p1, p2, plan->fct[k].tw, sign);
+		t = p1;  p1 = p2;  p2 = t;
+		l1 *= ip;
+	}
+	if (p1 != c)
+		memcpy(c, p1, plan->n * sizeof(cmplx));
+}
+
+/*******************************************************************************
+	Bluestein
+*******************************************************************************/
+
+static void
+bluestein(const fft_plan_t *plan, cmplx *x, int sign, cmplx *work)
+{
+	const long n = plan->n, m = plan->m;
+	cmplx *a = work;
+
+	/* the backward transform is the conjugate of the forward one of conj(x) */
+	for (long j = 0; j < n; j++)
+	{
+		cmplx xj = x[j];
+		xj.i *= -sign;
+		a[j] = twmul(xj, plan->bk[j], 1);
+	}
+	memset(a + n, 0, (m - n) * sizeof(cmplx));
+	pass_all(plan->sub, a, work + m, -1);
+	for (long k = 0; k < m; k++)
+		a[k] = twmul(a[k], plan->bkf[k], 1);
+	pass_all(plan->sub, a, work + m, 1);
+	for (long k = 0; k < n; k++)
+	{
+		x[k] = twmul(a[k], plan->bk[k], 1);
+		x[k].i *= -sign;
+	}
+}
+
+/*******************************************************************************
+	Plans
+*******************************************************************************/
+
+/* Smallest 2^a 3^b 5^c not less than n */
+static long
+good_size(long n)
+{
+	long best = 1;
+
+	while (best < n)
+		best *= 2;
+	for (long f5 = 1; f5 < best; f5 *= 5)
+	{
+		for (long f35 = f5; f35 < best; f35 *= 3)
+		{
+			long x = f35;
+			while (x < n)
+				x *= 2;
+			if (x < best)
+				best = x;
+		}
+	}
+	return best;
+}
+
+/* Factors 4, 2, 3, 5 of n, the 2 first; false if n has another prime factor */
+static int
+factorize(fft_plan_t *plan)
+{
+	long len = plan->n;
+	int nfct = 0;
+
+	while (len % 4 == 0)
+	{
+		plan->fct[nfct++].fct = 4;
+		len /= 4;
+	}
+	if (len % 2 == 0)
+	{
+		len /= 2;
+		plan->fct[nfct++].fct = 2;
+		plan->fct[nfct - 1].fct = plan->fct[0].fct;
+		plan->fct[0].fct = 2;
+	}
+	for (int d = 3; d <= 5; d += 2)
+	{
+		while (len % d == 0)
+		{
+			plan->fct[nfct++].fct = d;
+			len /= d;
+		}
+	}
+	plan->nfct = nfct;
+	return len == 1;
+}
+
+static int
+plan_twiddles(fft_plan_t *plan)
+{
+	const long n = plan->n;
+	size_t count = 0;
+	long l1 = 1;
+	cmplx *tw;
+
+	for (int k = 0; k < plan->nfct; k++)
+	{
+		const int ip = plan->fct[k].fct;
+		count += (ip - 1) * (n / (l1 * ip) - 1);
+		l1 *= ip;
+	}
+	plan->mem = tw = fft_malloc((count > 0 ? count : 1) * sizeof(cmplx));
+	if (tw == NULL)
+		return 0;
+
+	l1 = 1;
+	for (int k = 0; k < plan->nfct; k++)
+	{
+		const int ip = plan->fct[k].fct;
+		const long ido = n / (l1 * ip);
+
+		plan->fct[k].tw = tw;
+		for (int j = 1; j < ip; j++)
+			for (long i = 1; i < ido; i++)
+				tw[(j - 1) * (ido - 1) + i - 1] = expi((unsigned long long)j * l1 * i, n);
+		tw += (ip - 1) * (ido - 1);
+		l1 *= ip;
+	}
+	return 1;
+}
+
+static int
+plan_bluestein(fft_plan_t *plan)
+{
+	const long n = plan->n, m = good_size(2 * n - 1);
+	cmplx *b;
+
+	plan->m = m;
+	plan->sub = fft_plan(m);
+	plan->bk = fft_malloc(n * sizeof(cmplx));
+	plan->bkf = b = fft_malloc(2 * m * sizeof(cmplx));
+	if (plan->sub == NULL || plan->bk == NULL || b == NULL)
+		return 0;
+
+	for (long j = 0; j < n; j++)
+	{
+		// exp(-pi i j^2 / n), with j^2 reduced modulo 2n
+		const unsigned long long jj = (unsigned long long)j * j % (2ULL * n);
+		plan->bk[j] = expi(jj, 2ULL * n);
+		plan->bk[j].i = -plan->bk[j].i;
+	}
+	memset(b, 0, m * sizeof(cmplx));
+	for (long j = 0; j < n; j++)
+	{
+		const double s = 1.0 / m;
+		b[j].r = plan->bk[j].r * s;
+		b[j].i = -plan->bk[j].i * s;
+		if (j > 0)
+			b[m - j] = b[j];
+	}
+	pass_all(plan->sub, b, b + m, -1);
+	return 1;
+}
+
+static void
+plan_free(fft_plan_t *plan)
+{
+	if (plan->sub != NULL)
+		fft_plan_release(plan->sub);
+	fft_free(plan->mem);
+	fft_free(plan->bk);
+	fft_free(plan->bkf);
+	free(plan);
+}
+
+void
+fft_plan_release(const fft_plan_t *plan)
+{
+	fft_plan_t *p = (fft_plan_t *)plan;
+
+	if (--p->ref == 0)
+		plan_free(p);
+}
+
+const fft_plan_t *
+fft_plan(long n)
+{
+	fft_plan_t *plan, **pp;
+
+	if (n < 1)
+		return NULL;
+	for (pp = &plans; *pp != NULL; pp = &(*pp)->next)
+	{
+		if ((*pp)->n != n)
+			continue;
+		plan = *pp;
+		*pp = plan->next;
+		plan->next = plans;
+		plans = plan;
+		plan->ref++;
+		return plan;
+	}
+
+	plan = calloc(1, sizeof(fft_plan_t));
+	if (plan == NULL)
+		return NULL;
+	plan->n = n;
+	if (factorize(plan))
+	{
+		if (!plan_twiddles(plan))
+		{
+			plan_free(plan);
+			return NULL;
+		}
+	}
+	else
+	{
+		plan->nfct = 0;
+		if (!plan_bluestein(plan))
+		{
+			plan_free(plan);
+			return NULL;
+		}
+	}
+	plan->ref = 2;
+	plan->next = plans;
+	plans = plan;
+	if (++nplans > FFT_PLAN_CACHE)
+	{
+		for (pp = &plans; (*pp)->next != NULL; pp = &(*pp)->next)
+			;
+		fft_plan_release(*pp);
+		*pp = NULL;
+		nplans--;
+	}
+	return plan;
+}
+
+size_t
+fft_work_size(const fft_plan_t *plan)
+{
+	return 2 * (plan->m > 0 ? 2 * plan->m : plan->n);
+}
+
+void
+fft_c2c(const fft_plan_t *plan, double *x, int sign, double *work)
+{
+	if (plan->m > 0)
+		bluestein(plan, (cmplx *)x, sign, (cmplx *)work);
+	else
+		pass_all(plan, (cmplx *)x, (cmplx *)work, sign);
+}
+
+/*******************************************************************************
+	Real transforms
+*******************************************************************************/
+
+static void
+rplan_free(fft_rplan_t *plan)
+{
+	if (plan->cplan != NULL)
+		fft_plan_release(plan->cplan);
+	fft_free(plan->tw);
+	free(plan);
+}
+
+void
+fft_rplan_release(const fft_rplan_t *plan)
+{
+	fft_rplan_t *p = (fft_rplan_t *)plan;
+
+	if (--p->ref == 0)
+		rplan_free(p);
+}
+
+const fft_rplan_t *
+fft_rplan(long n)
+{
+	fft_rplan_t *plan, **pp;
+
+	if (n < 1)
+		return NULL;
+	for (pp = &rplans; *pp != NULL; pp = &(*pp)->next)
+	{
+		if ((*pp)->n != n)
+			continue;
+		plan = *pp;
+		*pp = plan->next;
+		plan->next = rplans;
+		rplans = plan;
+		plan->ref++;
+		return plan;
+	}
+
+	plan = calloc(1, sizeof(fft_rplan_t));
+	if (plan == NULL)
+		return NULL;
+	plan->n = n;
+	plan->cplan = fft_plan(n % 2 == 0 ? n / 2 : n);
+	if (plan->cplan == NULL)
+	{
+		free(plan);
+		return NULL;
+	}
+	if (n % 2 == 0)
+	{
+		plan->tw = fft_malloc((n / 2 + 1) * sizeof(cmplx));
+		if (plan->tw == NULL)
+		{
+			rplan_free(plan);
+			return NULL;
+		}
+		for (long k = 0; k <= n / 2; k++)
+		{
+			plan->tw[k] = expi(k, n);
+			plan->tw[k].i = -plan->tw[k].i;
+		}
+	}
+	plan->ref = 2;
+	plan->next = rplans;
+	rplans = plan;
+	if (++nrplans > FFT_PLAN_CACHE)
+	{
+		for (pp = &rplans; (*pp)->next != NULL; pp = &(*pp)->next)
+			;
+		fft_rplan_release(*pp);
+		*pp = NULL;
+		nrplans--;
+	}
+	return plan;
+}
+
+size_t
+fft_rwork_size(const fft_rplan_t *plan)
+{
+	return 2 * plan->cplan->n + fft_work_size(plan->cplan);
+}
+
+void
+fft_r2c(const fft_rplan_t *plan, const double *in, double *out, double *work)
+{
+	const long n = plan->n, h = plan->cplan->n;
+	cmplx *z = (cmplx *)work, *y = (cmplx *)out;
+
+	if (n % 2 != 0)
+	{
+		for (long j = 0; j < n; j++)
+		{
+			z[j].r = in[j];
+			z[j].i = 0.0;
+		}
+		fft_c2c(plan->cplan, (double *)z, -1, work + 2 * n);
+		memcpy(y, z, (n / 2 + 1) * sizeof(cmplx));
+		return;
+	}
+
+	/* z[j] = in[2j] + i in[2j+1] */
+	memcpy(z, in, n * sizeof(double));
+	fft_c2c(plan->cplan, (double *)z, -1, work + n);
+	for (long k = 0; k <= h; k++)
+	{
+		const cmplx zk = z[k < h ? k : 0], zc = z[k > 0 ? h - k : 0];
+		// even part (zk + conj(zc)) / 2, odd part (zk - conj(zc)) / 2i
+		const double er = 0.5 * (zk.r + zc.r), ei = 0.5 * (zk.i - zc.i);
+		cmplx o;
+		o.r = 0.5 * (zk.i + zc.i);
+		o.i = -0.5 * (zk.r - zc.r);
+		o = twmul(o, plan->tw[k], 1);
+		y[k].r = er + o.r;
+		y[k].i = ei + o.i;
+	}
+}
+
+void
+fft_c2r(const fft_rplan_t *plan, const double *in, double *out, double *work)
+{
+	const long n = plan->n, h = plan->cplan->n;
+	const cmplx *x = (const cmplx *)in;
+
+	if (n % 2 != 0)
+	{
+		cmplx *z = (cmplx *)work;
+
+		z[0].r = x[0].r;
+		z[0].i = 0.0;
+		for (long k = 1; k <= n / 2; k++)
+		{
+			z[k] = x[k];
+			z[n - k].r = x[k].r;
+			z[n - k].i = -x[k].i;
+		}
+		fft_c2c(plan->cplan, (double *)z, 1, work + 2 * n);
+		for (long j = 0; j < n; j++)
+			out[j] = z[j].r;
+		return;
+	}
+
+	/* z = even + i odd, built in +out+ itself */
+	{
+		cmplx *z = (cmplx *)out;
+
+		for (long k = 0; k < h; k++)
+		{
+			cmplx xk = x[k], xc = x[h - k];
+			cmplx e, o;
+
+			if (k == 0)
+			{
+				xk.i = 0.0;
+				xc.i = 0.0;
+			}
+			e.r = xk.r + xc.r;
+			e.i = xk.i - xc.i;
+			o.r = xk.r - xc.r;
+			o.i = xk.i + xc.i;
+			o = twmul(o, plan->tw[k], -1);
+			z[k].r = e.r - o.i;
+			z[k].i = e.i + o.r;
+		}
+		fft_c2c(plan->cplan, out, 1, work);
+	}
+}
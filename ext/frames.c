@@ -0,0 +1,586 @@
+/*******************************************************************************
+	frames.c -- Multichannel waveform in one allocation
+
+	$author$
+
+	@license: MIT Licence
+
+*******************************************************************************/
+#include <ruby.h>
+#include "ruby/wave/globals.h"
+#include "ruby/wave/pcm.h"
+#include "ruby/wave/frames.h"
+#include "internal/frames.h"
+#include "internal/pcm.h"
+
+struct Frames {
+	long fs;
+	long channels;
+	long length; // frames
+	enum rb_frames_layout layout;
+	double *s; // channels * length samples
+} ;
+
+static void
+frames_free(void *p)
+{
+	struct Frames *ptr = p;
+	if (ptr->s != NULL)
+		xfree(ptr->s);
+	xfree(ptr);
+}
+
+static size_t
+frames_memsize(const void *p)
+{
+	const struct Frames *ptr = p;
+	return sizeof(struct Frames) + ptr->channels * ptr->length * sizeof(double);
+}
+
+static const rb_data_type_t frames_data_type = {
+    "frames",
+    {
+	0,
+	frames_free,
+	frames_memsize,
+    },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static struct Frames *
+get_frames(VALUE self)
+{
+	struct Frames *ptr = rb_check_typeddata(self, &frames_data_type);
+
+	if (ptr->channels == 0)
+		rb_raise(rb_eRuntimeError, "uninitialized Frames");
+	return ptr;
+}
+
+static VALUE
+frames_s_allocate(VALUE klass)
+{
+	struct Frames *ptr;
+	return TypedData_Make_Struct(klass, struct Frames, &frames_data_type, ptr);
+}
+
+static void
+frames_init(struct Frames *ptr, long channels, long len, long fs, enum rb_frames_layout layout)
+{
+	if (channels <= 0 || channels > UINT16_MAX)
+		rb_raise(rb_eRangeError, "channels must be in 1..%d", UINT16_MAX);
+	if (len < 0 || len > LONG_MAX / (long)sizeof(double) / channels)
+		rb_raise(rb_eRangeError, "negative (or biggest) sample size");
+	if (fs <= 0)
+		rb_raise(rb_eRangeError, "negative (or biggest) frequency");
+	if (ptr->s != NULL)
+		rb_raise(rb_eRuntimeError, "already initialized Frames");
+
+	ptr->fs = fs;
+	ptr->channels = channels;
+	ptr->length = len;
+	ptr->layout = layout;
+	if (len > 0)
+	{
+		ptr->s = ALLOC_N(double, channels * len);
+		MEMZERO(ptr->s, double, channels * len);
+	}
+}
+
+enum rb_frames_layout
+wave_frames_layout_arg(VALUE layout)
+{
+	static ID planar, interleaved;
+	ID id;
+
+	if (NIL_P(layout))
+		return RB_FRAMES_PLANAR;
+	if (!planar)
+	{
+		planar = rb_intern_const("planar");
+		interleaved = rb_intern_const("interleaved");
+	}
+	id = SYMBOL_P(layout) ? SYM2ID(layout) : 0;
+	if (id == planar)
+		return RB_FRAMES_PLANAR;
+	if (id == interleaved)
+		return RB_FRAMES_INTERLEAVED;
+	rb_raise(rb_eArgError, "unknown layout: %"PRIsVALUE" (expected :planar or :interleaved)", layout);
+}
+
+static enum rb_frames_layout
+frames_layout_opt(VALUE opts)
+{
+	static ID kw;
+	VALUE layout = Qundef;
+
+	if (NIL_P(opts))
+		return RB_FRAMES_PLANAR;
+	if (!kw)
+		kw = rb_intern_const("layout");
+	rb_get_kwargs(opts, &kw, 0, 1, &layout);
+	return wave_frames_layout_arg(layout == Qundef ? Qnil : layout);
+}
+
+void
+wave_frames_interleave(double *interleaved, const double *planar, long channels, long len)
+{
+	if (channels == 2)
+	{
+		const double *l = planar, *r = planar + len;
+		for (long i = 0; i < len; i++)
+		{
+			interleaved[2*i] = l[i];
+			interleaved[2*i+1] = r[i];
+		}
+		return;
+	}
+	for (long ch = 0; ch < channels; ch++)
+	{
+		const double *src = planar + ch * len;
+		double *dst = interleaved + ch;
+		for (long i = 0; i < len; i++)
+			dst[i * channels] = src[i];
+	}
+}
+
+void
+wave_frames_deinterleave(double *planar, const double *interleaved, long channels, long len)
+{
+	if (channels == 2)
+	{
+		double *l = planar, *r = planar + len;
+		for (long i = 0; i < len; i++)
+		{
+			l[i] = interleaved[2*i];
+			r[i] = interleaved[2*i+1];
+		}
+		return;
+	}
+	for (long ch = 0; ch < channels; ch++)
+	{
+		const double *src = interleaved + ch;
+		double *dst = planar + ch * len;
+		for (long i = 0; i < len; i++)
+			dst[i] = src[i * channels];
+	}
+}
+
+/*
+ *  call-seq:
+ *    Wave::Frames.new(channels, len, fs = Wave::PCM::FS_DEF, layout: :planar) -> Wave::Frames
+ *
+ *  Creates +len+ frames of +channels+ channels, all 0.0, in one allocation.
+ *
+ *  With <code>layout: :planar</code> the samples are stored channel by channel, and #channel
+ *  returns each of them as a Wave::PCM without copying. With <code>layout: :interleaved</code>
+ *  they are stored frame by frame, in the order of a WAV data chunk, which suits frame-wise processing.
+ */
+static VALUE
+frames_initialize(int argc, VALUE *argv, VALUE self)
+{
+	struct Frames *ptr = rb_check_typeddata(self, &frames_data_type);
+	VALUE channels, len, fs, opts;
+
+	rb_scan_args(argc, argv, "21:", &channels, &len, &fs, &opts);
+	frames_init(ptr, NUM2LONG(channels), NUM2LONG(len), NIL_P(fs) ? FS_DEF : NUM2LONG(fs), frames_layout_opt(opts));
+
+	return self;
+}
+
+/*
+ *  call-seq:
+ *    Wave::Frames.from_pcm(pcm_ary, layout: :planar) -> Wave::Frames
+ *
+ *  Copies an array of Wave::PCM, one per channel and all of the same length and sampling frequency,
+ *  into new frames; with <code>layout: :interleaved</code> the channels are interleaved on the way.
+ */
+static VALUE
+frames_s_from_pcm(int argc, VALUE *argv, VALUE klass)
+{
+	VALUE pcm_ary, opts, obj;
+	struct Frames *ptr;
+	long channels, len = 0, fs = FS_DEF;
+
+	rb_scan_args(argc, argv, "1:", &pcm_ary, &opts);
+	Check_Type(pcm_ary, T_ARRAY);
+	channels = RARRAY_LEN(pcm_ary);
+	for (long i = 0; i < channels; i++)
+	{
+		VALUE pcm = RARRAY_AREF(pcm_ary, i);
+		if (CLASS_OF(pcm) != rb_cWavePCM)
+			rb_raise(rb_eTypeError, "not a %"PRIsVALUE"", rb_cWavePCM);
+		if (i == 0)
+		{
+			len = rb_pcm_len(pcm);
+			fs = rb_pcm_fs(pcm);
+		}
+		else if (len != rb_pcm_len(pcm))
+			rb_raise(rb_eArgError, "each channel must have the same length");
+		else if (fs != rb_pcm_fs(pcm))
+			rb_raise(rb_eArgError, "sampling frequency mismatch");
+	}
+
+	obj = frames_s_allocate(klass);
+	ptr = DATA_PTR(obj);
+	frames_init(ptr, channels, len, fs, frames_layout_opt(opts));
+	for (long i = 0; i < channels && len > 0; i++)
+	{
+		VALUE pcm = RARRAY_AREF(pcm_ary, i);
+		const long stride = ptr->layout == RB_FRAMES_PLANAR ? 1 : channels;
+		double *dst = ptr->layout == RB_FRAMES_PLANAR ? ptr->s + i * len : ptr->s + i;
+
+		if (rb_pcm_dtype(pcm) == RB_PCM_F32)
+		{
+			const float *src = rb_waveform_data_ptr_f32(pcm);
+			for (long j = 0; j < len; j++)
+				dst[j * stride] = src[j];
+		}
+		else if (stride == 1)
+		{
+			MEMCPY(dst, WaveformDataPtr(pcm), double, len);
+		}
+		else
+		{
+			const double *src = WaveformDataPtr(pcm);
+			for (long j = 0; j < len; j++)
+				dst[j * stride] = src[j];
+		}
+	}
+
+	return obj;
+}
+
+/*
+ *  call-seq:
+ *    frames.channels -> Integer
+ */
+static VALUE
+frames_channels(VALUE self)
+{
+	return LONG2NUM(get_frames(self)->channels);
+}
+
+/*
+ *  call-seq:
+ *    frames.length -> Integer
+ *
+ *  Returns the number of frames (samples per channel).
+ */
+static VALUE
+frames_length(VALUE self)
+{
+	return LONG2NUM(get_frames(self)->length);
+}
+
+/*
+ *  call-seq:
+ *    frames.fs -> Integer
+ */
+static VALUE
+frames_fs(VALUE self)
+{
+	return LONG2NUM(get_frames(self)->fs);
+}
+
+/*
+ *  call-seq:
+ *    frames.fs = fs
+ */
+static VALUE
+frames_fs_set(VALUE self, VALUE fs)
+{
+	struct Frames *ptr = get_frames(self);
+	long n = NUM2LONG(fs);
+
+	if (n <= 0)
+		rb_raise(rb_eRangeError, "negative (or biggest) frequency");
+	ptr->fs = n;
+	return fs;
+}
+
+/*
+ *  call-seq:
+ *    frames.layout -> :planar | :interleaved
+ */
+static VALUE
+frames_layout(VALUE self)
+{
+	return ID2SYM(rb_intern(get_frames(self)->layout == RB_FRAMES_PLANAR ? "planar" : "interleaved"));
+}
+
+/*
+ *  call-seq:
+ *    frames.planar? -> bool
+ */
+static VALUE
+frames_planar_p(VALUE self)
+{
+	return get_frames(self)->layout == RB_FRAMES_PLANAR ? Qtrue : Qfalse;
+}
+
+/*
+ *  call-seq:
+ *    frames.interleaved? -> bool
+ */
+static VALUE
+frames_interleaved_p(VALUE self)
+{
+	return get_frames(self)->layout == RB_FRAMES_INTERLEAVED ? Qtrue : Qfalse;
+}
+
+static double *
+frames_sample_ptr(struct Frames *ptr, VALUE ch, VALUE index)
+{
+	long c = NUM2LONG(ch), i = NUM2LONG(index);
+
+	if (c < 0)
+		c += ptr->channels;
+	if (i < 0)
+		i += ptr->length;
+	if (c < 0 || c >= ptr->channels || i < 0 || i >= ptr->length)
+		return NULL;
+	return ptr->layout == RB_FRAMES_PLANAR ? &ptr->s[c * ptr->length + i] : &ptr->s[i * ptr->channels + c];
+}
+
+/*
+ *  call-seq:
+ *    frames[ch, nth] -> Float | nil
+ *
+ *  Returns the +nth+ sample of channel +ch+, or nil out of range. Negative indices count from the end.
+ */
+static VALUE
+frames_aref(VALUE self, VALUE ch, VALUE index)
+{
+	double *p = frames_sample_ptr(get_frames(self), ch, index);
+
+	return p ? DBL2NUM(*p) : Qnil;
+}
+
+/*
+ *  call-seq:
+ *    frames[ch, nth] = value
+ */
+static VALUE
+frames_aset(VALUE self, VALUE ch, VALUE index, VALUE value)
+{
+	double *p = frames_sample_ptr(get_frames(self), ch, index);
+
+	if (!p)
+		rb_raise(rb_eIndexError, "sample [%"PRIsVALUE", %"PRIsVALUE"] out of frames", ch, index);
+	*p = NUM2DBL(value);
+	return value;
+}
+
+/*
+ *  call-seq:
+ *    frames.channel(ch) -> Wave::PCM
+ *
+ *  Returns channel +ch+ as a Wave::PCM sharing the samples of +frames+: writing to either is seen by both.
+ *  The view keeps +frames+ alive and cannot be resized; its slices and Wave::PCM#to_io_buffer copy the samples.
+ *  Raises RuntimeError for interleaved frames, whose channels are not contiguous; see #to_planar.
+ */
+static VALUE
+frames_channel(VALUE self, VALUE ch)
+{
+	struct Frames *ptr = get_frames(self);
+	long c = NUM2LONG(ch);
+
+	if (ptr->layout != RB_FRAMES_PLANAR)
+		rb_raise(rb_eRuntimeError, "channel views need the planar layout");
+	if (c < 0)
+		c += ptr->channels;
+	if (c < 0 || c >= ptr->channels)
+		rb_raise(rb_eIndexError, "channel %"PRIsVALUE" out of 0...%ld", ch, ptr->channels);
+	return rb_pcm_wrap(ptr->s ? ptr->s + c * ptr->length : NULL, ptr->length, ptr->fs, self);
+}
+
+/*
+ *  call-seq:
+ *    frames.to_pcm_ary -> [*Wave::PCM]
+ *
+ *  Copies the channels into new Wave::PCM objects, deinterleaving them if needed.
+ */
+static VALUE
+frames_to_pcm_ary(VALUE self)
+{
+	struct Frames *ptr = get_frames(self);
+	VALUE pcm_ary = rb_ary_new2(ptr->channels);
+
+	for (long c = 0; c < ptr->channels; c++)
+	{
+		VALUE pcm = rb_pcm_new(ptr->length, ptr->fs);
+		double *dst = WaveformDataPtr(pcm);
+
+		rb_ary_store(pcm_ary, c, pcm);
+		if (ptr->length == 0)
+			continue;
+		if (ptr->layout == RB_FRAMES_PLANAR)
+		{
+			MEMCPY(dst, ptr->s + c * ptr->length, double, ptr->length);
+		}
+		else
+		{
+			for (long i = 0; i < ptr->length; i++)
+				dst[i] = ptr->s[i * ptr->channels + c];
+		}
+	}
+	return pcm_ary;
+}
+
+static VALUE
+frames_relayout(VALUE self, enum rb_frames_layout layout)
+{
+	struct Frames *ptr = get_frames(self);
+	VALUE obj;
+	struct Frames *dst;
+
+	if (ptr->layout == layout)
+		return self;
+	obj = rb_frames_new(ptr->channels, ptr->length, ptr->fs, layout);
+	dst = DATA_PTR(obj);
+	if (ptr->length > 0)
+	{
+		if (layout == RB_FRAMES_INTERLEAVED)
+			wave_frames_interleave(dst->s, ptr->s, ptr->channels, ptr->length);
+		else
+			wave_frames_deinterleave(dst->s, ptr->s, ptr->channels, ptr->length);
+	}
+	return obj;
+}
+
+/*
+ *  call-seq:
+ *    frames.to_planar -> Wave::Frames
+ *
+ *  Returns planar frames with the same samples: +self+ if already planar, otherwise a deinterleaved copy.
+ */
+static VALUE
+frames_to_planar(VALUE self)
+{
+	return frames_relayout(self, RB_FRAMES_PLANAR);
+}
+
+/*
+ *  call-seq:
+ *    frames.to_interleaved -> Wave::Frames
+ *
+ *  Returns interleaved frames with the same samples: +self+ if already interleaved, otherwise an interleaved copy.
+ */
+static VALUE
+frames_to_interleaved(VALUE self)
+{
+	return frames_relayout(self, RB_FRAMES_INTERLEAVED);
+}
+
+/*
+ *  call-seq:
+ *    frames.stats(clip: 32767.0 / 32768, threads: 1) -> [Hash]
+ *
+ *  Same as Wave::PCM#stats for each channel, in either layout.
+ *  With +threads+ greater than 1, the channels are shared among that many native threads.
+ */
+static VALUE
+frames_stats(int argc, VALUE *argv, VALUE self)
+{
+	struct Frames *ptr = get_frames(self);
+	struct wave_stats_channel *ch;
+	VALUE opts, ret, tmp = 0;
+	double clip;
+	int threads;
+
+	rb_scan_args(argc, argv, ":", &opts);
+	wave_stats_opts(opts, &clip, &threads);
+
+	ch = ALLOCV_N(struct wave_stats_channel, tmp, ptr->channels);
+	for (long c = 0; c < ptr->channels; c++)
+	{
+		const bool planar = ptr->layout == RB_FRAMES_PLANAR;
+		ch[c].s = ptr->length > 0 ? ptr->s + (planar ? c * ptr->length : c) : NULL;
+		ch[c].dtype = RB_PCM_F64;
+		ch[c].len = ptr->length;
+		ch[c].stride = planar ? 1 : ptr->channels;
+	}
+	// The storage of frames is never reallocated, so it needs no lock.
+	ret = wave_stats_channels(ch, ptr->channels, clip, threads);
+	ALLOCV_END(tmp);
+
+	RB_GC_GUARD(self);
+	return ret;
+}
+
+
+void
+InitVM_Frames(void)
+{
+	rb_define_alloc_func(rb_cWaveFrames, frames_s_allocate);
+
+	rb_define_singleton_method(rb_cWaveFrames, "from_pcm", frames_s_from_pcm, -1);
+	rb_define_method(rb_cWaveFrames, "initialize", frames_initialize, -1);
+
+	rb_define_method(rb_cWaveFrames, "channels", frames_channels, 0);
+	rb_define_method(rb_cWaveFrames, "length", frames_length, 0);
+	rb_define_method(rb_cWaveFrames, "fs", frames_fs, 0);
+	rb_define_method(rb_cWaveFrames, "fs=", frames_fs_set, 1);
+	rb_define_method(rb_cWaveFrames, "layout", frames_layout, 0);
+	rb_define_method(rb_cWaveFrames, "planar?", frames_planar_p, 0);
+	rb_define_method(rb_cWaveFrames, "interleaved?", frames_interleaved_p, 0);
+	rb_define_method(rb_cWaveFrames, "[]", frames_aref, 2);
+	rb_define_method(rb_cWaveFrames, "[]=", frames_aset, 3);
+
+	rb_define_method(rb_cWaveFrames, "channel", frames_channel, 1);
+	rb_define_method(rb_cWaveFrames, "to_pcm_ary", frames_to_pcm_ary, 0);
+	rb_define_method(rb_cWaveFrames, "to_planar", frames_to_planar, 0);
+	rb_define_method(rb_cWaveFrames, "to_interleaved", frames_to_interleaved, 0);
+	rb_define_method(rb_cWaveFrames, "stats", frames_stats, -1);
+}
+
+/*******************************************************************************
+	For C API
+*******************************************************************************/
+
+VALUE
+rb_frames_new(long channels, long len, long fs, enum rb_frames_layout layout)
+{
+	struct Frames *ptr;
+	VALUE obj = TypedData_Make_Struct(rb_cWaveFrames, struct Frames, &frames_data_type, ptr);
+
+	frames_init(ptr, channels, len, fs, layout);
+	return obj;
+}
+
+int
+rb_frames_p(VALUE obj)
+{
+	return rb_typeddata_is_kind_of(obj, &frames_data_type);
+}
+
+long
+rb_frames_channels(VALUE frames)
+{
+	return get_frames(frames)->channels;
+}
+
+long
+rb_frames_len(VALUE frames)
+{
+	return get_frames(frames)->length;
+}
+
+long
+rb_frames_fs(VALUE frames)
+{
+	return get_frames(frames)->fs;
+}
+
+enum rb_frames_layout
+rb_frames_layout(VALUE frames)
+{
+	return get_frames(frames)->layout;
+}
+
+double *
+rb_frames_data_ptr(VALUE frames)
+{
+	return get_frames(frames)->s;
+}
@@ -0,0 +1,89 @@
+#ifndef RB_WAVE_FRAMES_H_INCLUDED
+#define RB_WAVE_FRAMES_H_INCLUDED
+/**
+ * @file
+ * @author     $Author$
+ */
+#include <ruby/internal/value.h> // VALUE
+
+
+/**
+ * Order of the samples in Wave::Frames.
+ */
+enum rb_frames_layout {
+	RB_FRAMES_PLANAR,       /**< Channel by channel: `s[ch * length + i]` */
+	RB_FRAMES_INTERLEAVED   /**< Frame by frame, as in a data chunk: `s[i * channels + ch]` */
+};
+
+/**
+ *  Create a new Wave::Frames object in C level.  The samples are initialized to
+ *  0.0.
+ *
+ * @param[in]  channels        Number of channels.
+ * @param[in]  len             Number of frames.
+ * @param[in]  fs              Sampling frequency.
+ * @param[in]  layout          Order of the samples.
+ * @exception  rb_eRangeError  Parameter out of range.
+ * @return     Wave::Frames object.
+ */
+VALUE rb_frames_new(long channels, long len, long fs, enum rb_frames_layout layout);
+
+/**
+ * Queries whether the object is a Wave::Frames.
+ *
+ * @param[in]  obj  Object in question.
+ * @return     Nonzero if `obj` is a Wave::Frames.
+ */
+int rb_frames_p(VALUE obj);
+
+/**
+ * Queries number of channels.
+ *
+ * @param[in]  frames  Wave::Frames in question.
+ * @return     Its number of channels.
+ * @pre        `frames` must be an instance of Wave::Frames.
+ */
+long rb_frames_channels(VALUE frames);
+
+/**
+ * Queries number of frames (samples per channel).
+ *
+ * @param[in]  frames  Wave::Frames in question.
+ * @return     Its number of frames.
+ * @pre        `frames` must be an instance of Wave::Frames.
+ */
+long rb_frames_len(VALUE frames);
+
+/**
+ * Queries sampling frequency.
+ *
+ * @param[in]  frames  Wave::Frames in question.
+ * @return     Its sampling frequency.
+ * @pre        `frames` must be an instance of Wave::Frames.
+ */
+long rb_frames_fs(VALUE frames);
+
+/**
+ * Queries order of the samples.
+ *
+ * @param[in]  frames  Wave::Frames in question.
+ * @return     Its layout.
+ * @pre        `frames` must be an instance of Wave::Frames.
+ */
+enum rb_frames_layout rb_frames_layout(VALUE frames);
+
+/**
+ * Pointer to the samples: `channels * length` doubles in one allocation, in the
+ * order given  by  rb_frames_layout().   The storage  is never  reallocated, so
+ * the pointer stays valid as long as the object is alive.  It is `NULL` when
+ * there is no sample.
+ *
+ * @param[in]  obj            Wave::Frames object.
+ * @exception  rb_eTypeError  `obj` is not a Wave::Frames object.
+ * @note       Do not free() to this pointer.
+ */
+double *rb_frames_data_ptr(VALUE obj);
+#define FramesDataPtr  rb_frames_data_ptr
+
+
+#endif /* RB_WAVE_FRAMES_H_INCLUDED */
@@ -10,9 +10,16 @@ extern "C" {
 
 RUBY_EXT_EXTERN VALUE rb_mWave;
 RUBY_EXT_EXTERN VALUE rb_cWavePCM;
+RUBY_EXT_EXTERN VALUE rb_cWaveFrames;
 RUBY_EXT_EXTERN VALUE rb_mWaveFFT;
+RUBY_EXT_EXTERN VALUE rb_cWaveFFTISTFT;
+RUBY_EXT_EXTERN VALUE rb_cWaveSpectrogram;
+RUBY_EXT_EXTERN VALUE rb_cWaveConvolver;
 RUBY_EXT_EXTERN VALUE rb_mWaveWindowFunction;
 RUBY_EXT_EXTERN VALUE rb_cWaveRIFF;
+RUBY_EXT_EXTERN VALUE rb_cWaveRIFFReader;
+RUBY_EXT_EXTERN VALUE rb_cWaveRIFFWriter;
+RUBY_EXT_EXTERN VALUE rb_cWaveRIFFStreamReader;
 RUBY_EXT_EXTERN VALUE rb_eWaveSemanticError;
 
 #if defined(__cplusplus)
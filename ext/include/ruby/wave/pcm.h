@@ -15,6 +15,15 @@
 #define FS_DEF  48000
 
 
+/**
+ * Storage type of the waveform data.
+ */
+enum rb_pcm_dtype {
+	RB_PCM_F64,     /**< double (the default) */
+	RB_PCM_F32      /**< float */
+};
+
+
 /**
  *  Create a new Wave::PCM object in C level. 
  * 
@@ -25,12 +34,40 @@
  */
 VALUE rb_pcm_new(long len, long fs);
 
+/**
+ *  Same as rb_pcm_new(), with the storage type of the samples.
+ * 
+ * @param[in]  len             Length of the waveform data.
+ * @param[in]  fs              Sampling frequency.
+ * @param[in]  dtype           Storage type.
+ * @exception  rb_eRangeError  Parameter out of range.
+ * @return     Wave::PCM object.
+ */
+VALUE rb_pcm_new2(long len, long fs, enum rb_pcm_dtype dtype);
+
 /* Variant for creation in 44kHz */
 #define rb_pcm_44k_new(len)  rb_pcm_new(len, 44100)
 
 /* Variant for creation in 48kHz */
 #define rb_pcm_48k_new(len)  rb_pcm_new(len, 48000)
 
+/**
+ * Create a Wave::PCM object viewing  samples  owned  by another object,  such as
+ * a channel  of  a  Wave::Frames.  The samples  are  neither  copied nor freed;
+ * `owner` is marked by the view, so it must keep `s` valid and unmoved for its
+ * whole lifetime.  The view cannot be resized,  and its slices and IO::Buffer
+ * get a copy of the samples, since `owner` may change them in place.
+ * 
+ * @param[in]  s                `len` samples.
+ * @param[in]  len              Length of the waveform data.
+ * @param[in]  fs               Sampling frequency.
+ * @param[in]  owner            Object holding the samples.
+ * @exception  rb_eArgError     `owner` is nil.
+ * @exception  rb_eRangeError   Parameter out of range.
+ * @return     Wave::PCM object.
+ */
+VALUE rb_pcm_wrap(double *s, long len, long fs, VALUE owner);
+
 /**
  * Queries sampling frequency number of the waveform data.
  * 
@@ -40,6 +77,16 @@ VALUE rb_pcm_new(long len, long fs);
  */
 long rb_pcm_fs(VALUE pcm);
 
+/**
+ * Queries storage type of the waveform data.
+ * 
+ * @param[in]  pcm  Wave:PCM in question.
+ * @return     Its storage type, which selects the pointer accessor to use:
+ *             WaveformDataPtr for RB_PCM_F64, WaveformDataPtrF32 for RB_PCM_F32.
+ * @pre        `pcm` must be an instance of Wave::PCM.
+ */
+enum rb_pcm_dtype rb_pcm_dtype(VALUE pcm);
+
 /**
  * Queries length of the waveform data.
  * 
@@ -50,10 +97,79 @@ long rb_pcm_fs(VALUE pcm);
 long rb_pcm_len(VALUE pcm);
 #define RPCM_LEN  rb_pcm_len                            /* alias rb_pcm_len() */
 
+/**
+ * Resizes the waveform data.  Same as `pcm.length = len` on Ruby level:  grown
+ * elements are initialized to 0.0.  The storage is reallocated only when `len`
+ * exceeds rb_pcm_capacity(),  and then the pointer obtained by WaveformDataPtr
+ * before the call is invalidated.  Resizing to 0 frees the storage.  A view made
+ * by rb_pcm_wrap() cannot change its length.   A slice sharing its samples gets
+ * a copy of its own as with rb_pcm_modify() when its length changes.
+ * 
+ * @param[in]  pcm             Wave:PCM in question.
+ * @param[in]  len             New length of the waveform data.
+ * @exception  rb_eRangeError  Parameter out of range.
+ * @exception  rb_eRuntimeError  `pcm` is locked or a view.
+ * @pre        `pcm` must be an instance of Wave::PCM.
+ */
+void rb_pcm_resize(VALUE pcm, long len);
+
+/**
+ * Prepares the waveform data to be written through WaveformDataPtr.  A Wave::PCM
+ * sharing its samples with slices (`pcm[start, len]` on Ruby level) gets a copy
+ * of its own,  so  that  the  others  do not see the change;  the pointer obtained
+ * before the call is invalidated then.  Otherwise it does nothing.
+ * 
+ * @param[in]  pcm               Wave:PCM in question.
+ * @exception  rb_eRuntimeError  `pcm` is shared and locked.
+ * @pre        `pcm` must be an instance of Wave::PCM.
+ */
+void rb_pcm_modify(VALUE pcm);
+
+/**
+ * Queries the number of samples  the  waveform data  can hold  without  being
+ * reallocated.
+ * 
+ * @param[in]  pcm  Wave:PCM in question.
+ * @return     Its capacity, not less than its length; 0 while the samples are
+ *             shared with slices.
+ * @pre        `pcm` must be an instance of Wave::PCM.
+ */
+long rb_pcm_capacity(VALUE pcm);
+
+/**
+ * Sets sampling frequency of the waveform data.  Same as `pcm.fs = fs` on Ruby
+ * level.
+ * 
+ * @param[in]  pcm             Wave:PCM in question.
+ * @param[in]  fs              New sampling frequency.
+ * @exception  rb_eRangeError  Parameter out of range.
+ * @pre        `pcm` must be an instance of Wave::PCM.
+ */
+void rb_pcm_set_fs(VALUE pcm, long fs);
+
+/**
+ * Temporarily locks  the  waveform data  so that  it  cannot be resized,  e.g.
+ * while  the  pointer  obtained  by  WaveformDataPtr  is  used  without  the GVL.
+ * Calls nest; each one must be paired with rb_pcm_unlocktmp().
+ * 
+ * @param[in]  pcm  Wave:PCM in question.
+ * @pre        `pcm` must be an instance of Wave::PCM.
+ */
+void rb_pcm_locktmp(VALUE pcm);
+
+/**
+ * Releases a lock taken by rb_pcm_locktmp().
+ * 
+ * @param[in]  pcm                 Wave:PCM in question.
+ * @exception  rb_eRuntimeError    `pcm` is not locked.
+ * @pre        `pcm` must be an instance of Wave::PCM.
+ */
+void rb_pcm_unlocktmp(VALUE pcm);
+
 /**
  * Pointer to  PCM class  waveform data.  Returns  the beginning  of  the array.
  * The implementation  is  double  type.   It  is  `NULL`  when  the  length  of
- * arrays is 0.
+ * arrays is 0.  Call rb_pcm_modify() first to write samples.
  * 
  * It does require a technique.
  * 
@@ -72,11 +188,23 @@ long rb_pcm_len(VALUE pcm);
  * ```
  * 
  * @param[in]  obj            Wave::PCM object.
- * @exception  rb_eTypeError  `obj` is not a Wave::PCM object.
+ * @exception  rb_eTypeError  `obj` is not a Wave::PCM object, or not of dtype f64.
  * @note       Do not free() to this pointer. It will core-dump.
  */
 double *rb_waveform_data_ptr(VALUE obj);
 #define WaveformDataPtr  rb_waveform_data_ptr
+#define rb_waveform_data_ptr_f64  rb_waveform_data_ptr
+
+/**
+ * Same as WaveformDataPtr for the single precision waveform data of a Wave::PCM
+ * of dtype f32.
+ * 
+ * @param[in]  obj            Wave::PCM object.
+ * @exception  rb_eTypeError  `obj` is not a Wave::PCM object, or not of dtype f32.
+ * @note       Do not free() to this pointer.
+ */
+float *rb_waveform_data_ptr_f32(VALUE obj);
+#define WaveformDataPtrF32  rb_waveform_data_ptr_f32
 
 
 #endif /* RB_WAVE_PCM_H_INCLUDED */
@@ -0,0 +1,120 @@
+#ifndef RB_WAVE_SPECTROGRAM_H_INCLUDED
+#define RB_WAVE_SPECTROGRAM_H_INCLUDED
+/**
+ * @file
+ * @author     $Author$
+ */
+#include <ruby/internal/value.h> // VALUE
+
+
+/**
+ *  Create a new Wave::Spectrogram object in C level: `frames` frames of the
+ *  `size / 2 + 1` bins of a real FFT of `size` points, `hop` samples apart.
+ *  The bins are initialized to 0.0 and the window to 1.0.
+ *
+ * @param[in]  frames          Number of frames.
+ * @param[in]  size            Size of the transform of a frame.
+ * @param[in]  hop             Samples between the starts of two frames.
+ * @param[in]  fs              Sampling frequency of the signal.
+ * @param[in]  length          Number of samples of the signal.
+ * @param[in]  center          Nonzero when frame `t` is centered on the sample
+ *                             `t * hop`, zero when it starts there.
+ * @exception  rb_eRangeError  Parameter out of range.
+ * @return     Wave::Spectrogram object.
+ */
+VALUE rb_spectrogram_new(long frames, long size, long hop, long fs, long length, int center);
+
+/**
+ * Queries whether the object is a Wave::Spectrogram.
+ *
+ * @param[in]  obj  Object in question.
+ * @return     Nonzero if `obj` is a Wave::Spectrogram.
+ */
+int rb_spectrogram_p(VALUE obj);
+
+/**
+ * Queries number of frames.
+ *
+ * @param[in]  spec  Wave::Spectrogram in question.
+ * @return     Its number of frames.
+ * @pre        `spec` must be an instance of Wave::Spectrogram.
+ */
+long rb_spectrogram_frames(VALUE spec);
+
+/**
+ * Queries number of bins of a frame, `size / 2 + 1`.
+ *
+ * @param[in]  spec  Wave::Spectrogram in question.
+ * @return     Its number of bins.
+ * @pre        `spec` must be an instance of Wave::Spectrogram.
+ */
+long rb_spectrogram_bins(VALUE spec);
+
+/**
+ * Queries size of the transform of a frame.
+ *
+ * @param[in]  spec  Wave::Spectrogram in question.
+ * @return     Its transform size.
+ * @pre        `spec` must be an instance of Wave::Spectrogram.
+ */
+long rb_spectrogram_size(VALUE spec);
+
+/**
+ * Queries samples between the starts of two frames.
+ *
+ * @param[in]  spec  Wave::Spectrogram in question.
+ * @return     Its hop size.
+ * @pre        `spec` must be an instance of Wave::Spectrogram.
+ */
+long rb_spectrogram_hop(VALUE spec);
+
+/**
+ * Queries sampling frequency of the signal.
+ *
+ * @param[in]  spec  Wave::Spectrogram in question.
+ * @return     Its sampling frequency.
+ * @pre        `spec` must be an instance of Wave::Spectrogram.
+ */
+long rb_spectrogram_fs(VALUE spec);
+
+/**
+ * Queries number of samples of the signal.
+ *
+ * @param[in]  spec  Wave::Spectrogram in question.
+ * @return     Its signal length.
+ * @pre        `spec` must be an instance of Wave::Spectrogram.
+ */
+long rb_spectrogram_length(VALUE spec);
+
+/**
+ * Queries the sample on which frame 0 starts: `-(size / 2)` for centered
+ * frames, otherwise 0.  Frame `t` starts `t * hop` samples later.
+ *
+ * @param[in]  spec  Wave::Spectrogram in question.
+ * @return     Its offset.
+ * @pre        `spec` must be an instance of Wave::Spectrogram.
+ */
+long rb_spectrogram_offset(VALUE spec);
+
+/**
+ * Pointer to the bins: `frames * bins` complex numbers in one allocation,
+ * each a pair of double (real, then imaginary part), frame by frame.  The
+ * storage is never reallocated.  It is `NULL` when there is no frame.
+ *
+ * @param[in]  obj            Wave::Spectrogram object.
+ * @exception  rb_eTypeError  `obj` is not a Wave::Spectrogram object.
+ * @note       Do not free() to this pointer.
+ */
+double *rb_spectrogram_data_ptr(VALUE obj);
+
+/**
+ * Pointer to the `size` samples of the analysis window.
+ *
+ * @param[in]  obj            Wave::Spectrogram object.
+ * @exception  rb_eTypeError  `obj` is not a Wave::Spectrogram object.
+ * @note       Do not free() to this pointer.
+ */
+double *rb_spectrogram_window_ptr(VALUE obj);
+
+
+#endif /* RB_WAVE_SPECTROGRAM_H_INCLUDED */
@@ -0,0 +1,62 @@
+#ifndef RB_WAVE_ALGO_FFT_H_INCLUDED
+#define RB_WAVE_ALGO_FFT_H_INCLUDED
+
+#include <stddef.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*
+ * Complex numbers are pairs of double, re then im, so that an array of n
+ * complex numbers is an array of 2n doubles.
+ */
+
+/* Alignment of fft_malloc(), a cache line */
+#define FFT_ALIGN  64
+
+typedef struct fft_plan fft_plan_t;    // complex transform of n points
+typedef struct fft_rplan fft_rplan_t;  // real transform of n points
+
+/*
+ * A reference to the plan of size +n+, NULL when out of memory, to be given
+ * back by fft_plan_release() or fft_rplan_release().  The plans of the sizes
+ * used last are cached, the others freed with their last reference.
+ * Getting and releasing plans is not thread safe, so it must be serialized
+ * (the Ruby binding does it under the GVL); a plan may be used by any number
+ * of threads at once, each with its own work area, while it is referenced.
+ */
+const fft_plan_t *fft_plan(long n);
+const fft_rplan_t *fft_rplan(long n);
+void fft_plan_release(const fft_plan_t *plan);
+void fft_rplan_release(const fft_rplan_t *plan);
+
+/* Size of the work area of a transform, in doubles */
+size_t fft_work_size(const fft_plan_t *plan);
+size_t fft_rwork_size(const fft_rplan_t *plan);
+
+/*
+ * In-place transform of the n complex numbers +x+: forward (exp(-2 pi i jk/n))
+ * when +sign+ is -1, backward (exp(+2 pi i jk/n)) when it is +1, unnormalized.
+ */
+void fft_c2c(const fft_plan_t *plan, double *x, int sign, double *work);
+
+/*
+ * Forward transform of the n real samples +in+ to the n/2+1 complex numbers
+ * +out+ (the other half being their conjugates), and the unnormalized
+ * backward transform of n/2+1 complex numbers to n real samples.  The
+ * imaginary parts of out[0], and of out[n/2] for an even n, are ignored by
+ * fft_c2r().  +in+ and +out+ must not overlap.
+ */
+void fft_r2c(const fft_rplan_t *plan, const double *in, double *out, double *work);
+void fft_c2r(const fft_rplan_t *plan, const double *in, double *out, double *work);
+
+/* Allocation aligned to FFT_ALIGN, NULL when out of memory */
+void *fft_malloc(size_t size);
+void fft_free(void *p);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* RB_WAVE_ALGO_FFT_H_INCLUDED */
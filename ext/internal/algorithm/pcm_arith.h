@@ -0,0 +1,42 @@
+#ifndef RB_WAVE_ALGO_PCM_ARITH_H_INCLUDED
+#define RB_WAVE_ALGO_PCM_ARITH_H_INCLUDED
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+enum pcm_arith_op {
+	PCM_ARITH_ADD,
+	PCM_ARITH_SUB,
+	PCM_ARITH_MUL,
+	PCM_ARITH_DIV,
+	PCM_ARITH_NEG,  // unary
+	PCM_ARITH_ABS   // unary
+};
+
+/*
+ * dst[i] = a[i] op b[i], and dst[i] = a[i] op b, for the binary +op+;
+ * dst[i] = op a[i] for the unary one.
+ */
+void pcm_arith_vv(enum pcm_arith_op op, double *dst, const double *a, const double *b, long n);
+void pcm_arith_vs(enum pcm_arith_op op, double *dst, const double *a, double b, long n);
+void pcm_arith_unary(enum pcm_arith_op op, double *dst, const double *a, long n);
+
+/* dst[i] = min(max(a[i], lo), hi) */
+void pcm_arith_clip(double *dst, const double *a, double lo, double hi, long n);
+
+/* dst[i] = a[i] * (m ? m[i] : ms) + (c ? c[i] : cs), rounded after each step */
+void pcm_arith_fma(double *dst, const double *a, const double *m, double ms, const double *c, double cs, long n);
+
+/* Same for float (Wave::PCM of dtype f32). */
+void pcm_arith_vv_f32(enum pcm_arith_op op, float *dst, const float *a, const float *b, long n);
+void pcm_arith_vs_f32(enum pcm_arith_op op, float *dst, const float *a, float b, long n);
+void pcm_arith_unary_f32(enum pcm_arith_op op, float *dst, const float *a, long n);
+void pcm_arith_clip_f32(float *dst, const float *a, float lo, float hi, long n);
+void pcm_arith_fma_f32(float *dst, const float *a, const float *m, float ms, const float *c, float cs, long n);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* RB_WAVE_ALGO_PCM_ARITH_H_INCLUDED */
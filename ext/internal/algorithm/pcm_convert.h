@@ -0,0 +1,30 @@
+#ifndef RB_WAVE_ALGO_PCM_CONVERT_H_INCLUDED
+#define RB_WAVE_ALGO_PCM_CONVERT_H_INCLUDED
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*
+ * Interleaved little-endian integer PCM <-> planar double.
+ * +bits+ is one of 8, 16, 24 or 32; +mat+ holds one array per channel,
+ * and +idx+ is the sample index in those arrays of the first frame.
+ */
+void pcm_decode_frames(int bits, const unsigned char *buf, long frames, int channels, double **mat, long idx);
+void pcm_encode_frames(int bits, unsigned char *buf, long frames, int channels, double **mat, long idx);
+
+/* Same for interleaved little-endian IEEE float; +bits+ is 32 or 64. */
+void pcm_decode_float_frames(int bits, const unsigned char *buf, long frames, int channels, double **mat, long idx);
+void pcm_encode_float_frames(int bits, unsigned char *buf, long frames, int channels, double **mat, long idx);
+
+/* Same for planar float (Wave::PCM of dtype f32). */
+void pcm_decode_frames_f32(int bits, const unsigned char *buf, long frames, int channels, float **mat, long idx);
+void pcm_encode_frames_f32(int bits, unsigned char *buf, long frames, int channels, float **mat, long idx);
+void pcm_decode_float_frames_f32(int bits, const unsigned char *buf, long frames, int channels, float **mat, long idx);
+void pcm_encode_float_frames_f32(int bits, unsigned char *buf, long frames, int channels, float **mat, long idx);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* RB_WAVE_ALGO_PCM_CONVERT_H_INCLUDED */
@@ -0,0 +1,42 @@
+#ifndef RB_WAVE_ALGO_PCM_STATS_H_INCLUDED
+#define RB_WAVE_ALGO_PCM_STATS_H_INCLUDED
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define PCM_STATS_LANES  4
+
+/* Running state of pcm_stats_update(); the sample n goes to lane n % 4. */
+typedef struct {
+	long count;
+	double prev;  // last sample, for the zero crossings
+	double min[PCM_STATS_LANES], max[PCM_STATS_LANES];
+	double sum[PCM_STATS_LANES], sum_c[PCM_STATS_LANES];  // Kahan sums and compensations
+	double sq[PCM_STATS_LANES], sq_c[PCM_STATS_LANES];
+	long zero_crossings;
+	long clipped;
+	double clip;  // a sample is clipped when its magnitude reaches this
+} pcm_stats_t;
+
+typedef struct {
+	long count;
+	double min, max;  // HUGE_VAL and -HUGE_VAL when count is 0
+	double sum, sum_sq;
+	long zero_crossings;  // sign changes between consecutive samples
+	long clipped;
+} pcm_stats_result_t;
+
+void pcm_stats_init(pcm_stats_t *st, double clip);
+
+/* Adds +n+ samples following the ones added so far. */
+void pcm_stats_update(pcm_stats_t *st, const double *s, long n);
+void pcm_stats_update_f32(pcm_stats_t *st, const float *s, long n);
+
+void pcm_stats_finish(const pcm_stats_t *st, pcm_stats_result_t *r);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* RB_WAVE_ALGO_PCM_STATS_H_INCLUDED */
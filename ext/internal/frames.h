@@ -0,0 +1,16 @@
+#ifndef INTERNAL_FRAMES_H
+#define INTERNAL_FRAMES_H
+
+#include "ruby/wave/frames.h"
+
+/* The +layout:+ option: nil or :planar, or :interleaved */
+enum rb_frames_layout wave_frames_layout_arg(VALUE layout);
+
+/*
+ * Interleaving and deinterleaving of +len+ frames of +channels+ channels,
+ * between +planar+ (channel by channel) and +interleaved+.
+ */
+void wave_frames_interleave(double *interleaved, const double *planar, long channels, long len);
+void wave_frames_deinterleave(double *planar, const double *interleaved, long channels, long len);
+
+#endif /* INTERNAL_FRAMES_H */
@@ -0,0 +1,26 @@
+#ifndef INTERNAL_PARALLEL_H
+#define INTERNAL_PARALLEL_H
+
+#include <stddef.h>
+#include <ruby/internal/value.h> // VALUE
+
+/*
+ * Upper bound of the +threads:+ options.
+ */
+#define WAVE_THREADS_MAX  256
+
+/*
+ * Calls func(args + i * arg_size) for each i in [0, n): n - 1 of the calls on
+ * native worker threads, one on the calling thread, then joins the workers.
+ * Meant to be called without the GVL, so func must not touch Ruby objects.
+ * When threads are unavailable (or cannot be created) the calls run in turn.
+ */
+void wave_parallel_run(void *(*func)(void *), void *args, size_t arg_size, int n);
+
+/*
+ * The +threads:+ option: 1 when nil or Qundef, otherwise checked to be in
+ * 1..WAVE_THREADS_MAX.
+ */
+int wave_threads_arg(VALUE threads);
+
+#endif /* INTERNAL_PARALLEL_H */
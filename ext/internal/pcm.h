@@ -0,0 +1,23 @@
+#ifndef INTERNAL_PCM_H
+#define INTERNAL_PCM_H
+
+#include "ruby/wave/pcm.h"
+
+/* The +dtype:+ option: nil or :f64, or :f32 */
+enum rb_pcm_dtype wave_pcm_dtype_arg(VALUE dtype);
+
+/* One channel for wave_stats_channels(): +len+ samples, +stride+ apart (f64 only) */
+struct wave_stats_channel {
+	const void *s;
+	enum rb_pcm_dtype dtype;
+	long len;
+	long stride;
+};
+
+/* The +clip:+ and, unless +threads+ is NULL, +threads:+ options of the statistics */
+void wave_stats_opts(VALUE opts, double *clip, int *threads);
+
+/* Wave::PCM#stats of each channel, as an Array of Hash */
+VALUE wave_stats_channels(const struct wave_stats_channel *ch, long channels, double clip, int threads);
+
+#endif /* INTERNAL_PCM_H */
@@ -0,0 +1,91 @@
+#ifndef INTERNAL_RIFF_H
+#define INTERNAL_RIFF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "ruby/wave/pcm.h"
+#include "internal/riffchunk.h"
+
+// Shared between riff.c and the RIFF stream classes.
+
+/* RIFF + 'ds64' + 'fmt ' (extensible) + 'fact' + 'data' chunk headers */
+#define WAVE_HEADER_SIZE_MAX  (12 + 8 + 28 + 8 + 40 + 12 + 8)
+
+/* Container written by wave_header_pack() */
+enum wave_layout {
+	WAVE_LAYOUT_RIFF,       /* plain RIFF, 32-bit sizes */
+	WAVE_LAYOUT_RIFF_JUNK,  /* RIFF with a JUNK chunk keeping room for 'ds64' */
+	WAVE_LAYOUT_RF64        /* RF64 with 'ds64' */
+};
+
+/* The +rf64:+ option of the writers */
+enum wave_rf64 {
+	WAVE_RF64_NEVER,
+	WAVE_RF64_AUTO,
+	WAVE_RF64_ALWAYS
+};
+
+static inline uint16_t
+u16le(const unsigned char *ptr)
+{
+	return (uint16_t)(ptr[0] | ptr[1] << 8);
+}
+
+static inline uint32_t
+u32le(const unsigned char *ptr)
+{
+	return (uint32_t)ptr[0] | (uint32_t)ptr[1] << 8 | 
+		(uint32_t)ptr[2] << 16 | (uint32_t)ptr[3] << 24;
+}
+
+static inline uint64_t
+u64le(const unsigned char *ptr)
+{
+	return (uint64_t)u32le(ptr) | (uint64_t)u32le(ptr+4) << 32;
+}
+
+bool wave_riff_header_check(const unsigned char *ptr);
+uint64_t wave_ds64_data_size(const unsigned char *ptr, uint64_t size);
+void wave_fmt_check(const FormatChunk *fmt);
+void wave_fmt_unpack(const unsigned char *ptr, uint32_t size, FormatChunk *fmt);
+void wave_bits_check(const FormatChunk *fmt);
+void wave_decode_frames(const FormatChunk *fmt, const unsigned char *buf, long frames, double **mat, long idx);
+/* Same as wave_decode_frames() and wave_encode_frames(), for channel arrays of +dtype+. */
+void wave_decode_frames_dtype(const FormatChunk *fmt, const unsigned char *buf, long frames, enum rb_pcm_dtype dtype, void **mat, long idx);
+void wave_encode_frames_dtype(const FormatChunk *fmt, unsigned char *buf, long frames, enum rb_pcm_dtype dtype, void **mat, long idx);
+/* Samples of a Wave::PCM, of whichever dtype. */
+void *wave_pcm_data_ptr(VALUE pcm);
+/* Points +mat+ at a Wave::Frames, adjusting +fmt+ for the interleaved layout; returns the rows to convert. */
+long wave_frames_mat(VALUE frames, FormatChunk *fmt, void **mat);
+
+/* One entry of the chunk index, built in one pass over the file. */
+typedef struct {
+	ChunkID   id;
+	uint64_t  size;
+	long      offset; /* of the chunk body */
+} ChunkEntry;
+
+typedef struct {
+	long        len;
+	long        capa;
+	ChunkEntry *ptr;
+} ChunkIndex;
+
+void wave_chunk_index_push(ChunkIndex *index, ChunkID id, uint64_t size, long offset);
+
+/* Walks the chunks of +io+ up to 'data' (to the end if +index+ is given); returns 'data_chunk_size'. */
+uint64_t wave_read_header(VALUE io, VALUE io_buf, FormatChunk *fmt, long *data_offset, ChunkIndex *index);
+uint64_t wave_read_header_mem(const unsigned char *ptr, size_t size, FormatChunk *fmt, const unsigned char **data);
+long wave_io_read(VALUE io, VALUE io_buf, long len);
+/* File descriptor of the open IO +io+. */
+int wave_io_fd(VALUE io);
+
+void wave_fmt_init(FormatChunk *fmt, int format_tag, long channels, long samples_per_sec, int bits, bool extensible);
+void wave_format_opts(VALUE opts, int *format_tag, bool *extensible, enum wave_rf64 *rf64);
+void wave_encode_frames(const FormatChunk *fmt, unsigned char *buf, long frames, double **mat, long idx);
+long wave_header_size(const FormatChunk *fmt, enum wave_layout layout);
+bool wave_riff_fits(const FormatChunk *fmt, enum wave_layout layout, uint64_t data_chunk_size);
+long wave_header_pack(const FormatChunk *fmt, uint64_t data_chunk_size, enum wave_layout layout, unsigned char buf[WAVE_HEADER_SIZE_MAX]);
+void wave_io_write(VALUE io, const unsigned char *buf, long len);
+
+#endif /* INTERNAL_RIFF_H */
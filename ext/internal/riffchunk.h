@@ -9,7 +9,10 @@ typedef uint32_t  ChunkID;
  ( (uint32_t)(uint8_t)(ch2) << 16 ) | ( (uint32_t)(uint8_t)(ch3) << 24 ) )
 
 #define FOURCC_RIFF            MakeFOURCC('R', 'I', 'F', 'F')
+#define FOURCC_RF64            MakeFOURCC('R', 'F', '6', '4')
+#define FOURCC_BW64            MakeFOURCC('B', 'W', '6', '4')
 #define FOURCC_WAVE            MakeFOURCC('W', 'A', 'V', 'E')
+#define ChunkID_DS64           MakeFOURCC('d', 's', '6', '4')
 #define ChunkID_Format         MakeFOURCC('f', 'm', 't', ' ')
 #define ChunkID_Data           MakeFOURCC('d', 'a', 't', 'a')
 #define ChunkID_Cue            MakeFOURCC('c', 'u', 'e', ' ')
@@ -21,22 +24,40 @@ typedef uint32_t  ChunkID;
 #define ChunkID_LabeledText    MakeFOURCC('l', 't', 'x', 't')
 #define ChunkID_Sample         MakeFOURCC('s', 'm', 'p', 'l')
 #define ChunkID_Instrument     MakeFOURCC('i', 'n', 's', 't')
+#define ChunkID_LIST           MakeFOURCC('L', 'I', 'S', 'T')
+#define ChunkID_Info           MakeFOURCC('I', 'N', 'F', 'O')
+#define ChunkID_Fact           MakeFOURCC('f', 'a', 'c', 't')
+#define ChunkID_Junk           MakeFOURCC('J', 'U', 'N', 'K')
+#define ChunkID_Bext           MakeFOURCC('b', 'e', 'x', 't')
 
 
+/* Format Tags */
+#define WAVE_FORMAT_PCM         0x0001
+#define WAVE_FORMAT_IEEE_FLOAT  0x0003
+#define WAVE_FORMAT_EXTENSIBLE  0xFFFE
+
 /* Format Chunk */
 typedef struct {
 	ChunkID   chunk_ID; /* 'fmt ' */
 	int32_t   chunk_size;
 
-	int16_t   format_tag;
+	uint16_t  format_tag;
 	uint16_t  channels;
 	uint32_t  samples_per_sec;
 	uint32_t  bytes_per_sec;
 	uint16_t  block_size;
 	uint16_t  bits_per_sample;
 
+	/* WAVE_FORMAT_EXTENSIBLE */
+	uint16_t  valid_bits_per_sample;
+	uint32_t  channel_mask;
+	uint16_t  sub_format; /* format tag carried by the SubFormat GUID */
 } FormatChunk;
 
+/* Format tag of the samples, looking through WAVE_FORMAT_EXTENSIBLE */
+#define WAVE_FORMAT_TAG(fmt) \
+ ( (fmt)->format_tag == WAVE_FORMAT_EXTENSIBLE ? (fmt)->sub_format : (fmt)->format_tag )
+
 /* Data Chunk */
 typedef struct {
 	ChunkID   chunk_ID; /* 'data' */
@@ -163,6 +184,7 @@ typedef struct {
 } InstrumentChunk;
 
 
+/* KSDATAFORMAT_SUBTYPE_*: the format tag, then a tail shared by all of them */
 static const unsigned char SUB_FORMAT_GUID_PCM[16] = {
 	0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71
 };
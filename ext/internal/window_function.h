@@ -0,0 +1,13 @@
+#ifndef INTERNAL_WINDOW_FUNCTION_H
+#define INTERNAL_WINDOW_FUNCTION_H
+
+#include <ruby/internal/value.h> // VALUE
+
+/*
+ * The +window:+ option: the name of a Wave::WindowFunction such as :hann,
+ * or [name, param] for one with a parameter, or +len+ samples given as an
+ * Array or a Wave::PCM.  Writes the window to w[0, len).
+ */
+void wave_window_arg(VALUE window, long len, double *w);
+
+#endif /* INTERNAL_WINDOW_FUNCTION_H */
@@ -8,20 +8,41 @@
 #include "ruby/wave/globals.h"
 
 void InitVM_PCM(void);
+void InitVM_Frames(void);
+void InitVM_FFT(void);
+void InitVM_Spectrogram(void);
+void InitVM_Convolver(void);
 void InitVM_WindowFunction(void);
 void InitVM_RIFF(void);
+void InitVM_RIFFReader(void);
+void InitVM_RIFFWriter(void);
+void InitVM_RIFFStreamReader(void);
 
 void
 Init_wave(void)
 {
 	rb_mWave = rb_define_module("Wave");
 	rb_cWavePCM = rb_define_class_under(rb_mWave, "PCM", rb_cObject);
+	rb_cWaveFrames = rb_define_class_under(rb_mWave, "Frames", rb_cObject);
 	rb_cWaveRIFF = rb_define_class_under(rb_mWave, "RIFF", rb_cObject);
+	rb_cWaveRIFFReader = rb_define_class_under(rb_cWaveRIFF, "Reader", rb_cObject);
+	rb_cWaveRIFFWriter = rb_define_class_under(rb_cWaveRIFF, "Writer", rb_cObject);
+	rb_cWaveRIFFStreamReader = rb_define_class_under(rb_cWaveRIFF, "StreamReader", rb_cObject);
 	rb_mWaveFFT = rb_define_module_under(rb_mWave, "FFT");
+	rb_cWaveFFTISTFT = rb_define_class_under(rb_mWaveFFT, "ISTFT", rb_cObject);
+	rb_cWaveSpectrogram = rb_define_class_under(rb_mWave, "Spectrogram", rb_cObject);
+	rb_cWaveConvolver = rb_define_class_under(rb_mWave, "Convolver", rb_cObject);
 	rb_mWaveWindowFunction = rb_define_module_under(rb_mWave, "WindowFunction");
 	rb_eWaveSemanticError = rb_define_class_under(rb_mWave, "SemanticError", rb_eStandardError);
 	
 	InitVM(PCM);
+	InitVM(Frames);
+	InitVM(FFT);
+	InitVM(Spectrogram);
+	InitVM(Convolver);
 	InitVM(WindowFunction);
 	InitVM(RIFF);
+	InitVM(RIFFReader);
+	InitVM(RIFFWriter);
+	InitVM(RIFFStreamReader);
 }
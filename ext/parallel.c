@@ -0,0 +1,52 @@
+/*******************************************************************************
+	parallel.c -- Fork-join helper for the native worker threads
+
+	$author$
+
+	@license: MIT Licence
+
+*******************************************************************************/
+#include <ruby.h>
+#include "internal/parallel.h"
+#ifdef HAVE_PTHREAD_CREATE
+#include <pthread.h>
+#endif
+
+void
+wave_parallel_run(void *(*func)(void *), void *args, size_t arg_size, int n)
+{
+	char *p = args;
+#ifdef HAVE_PTHREAD_CREATE
+	pthread_t th[WAVE_THREADS_MAX];
+	int started[WAVE_THREADS_MAX];
+	
+	if (n > WAVE_THREADS_MAX)
+		n = WAVE_THREADS_MAX;
+	for (int i = 1; i < n; i++)
+		started[i] = pthread_create(&th[i], NULL, func, p + i * arg_size) == 0;
+	func(p);
+	for (int i = 1; i < n; i++)
+	{
+		if (started[i])
+			pthread_join(th[i], NULL);
+		else
+			func(p + i * arg_size);
+	}
+#else
+	for (int i = 0; i < n; i++)
+		func(p + i * arg_size);
+#endif
+}
+
+int
+wave_threads_arg(VALUE threads)
+{
+	int n;
+	
+	if (threads == Qundef || NIL_P(threads))
+		return 1;
+	n = NUM2INT(threads);
+	if (n < 1 || n > WAVE_THREADS_MAX)
+		rb_raise(rb_eArgError, "threads must be in 1..%d", WAVE_THREADS_MAX);
+	return n;
+}
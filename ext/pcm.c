@@ -4,13 +4,27 @@
 	$author$
 *******************************************************************************/
 #include <ruby.h>
+#include <ruby/thread.h>
+#include <math.h>
 #include "ruby/wave/globals.h"
 #include "ruby/wave/pcm.h"
+#include "internal/pcm.h"
+#include "internal/algorithm/pcm_arith.h"
+#include "internal/algorithm/pcm_stats.h"
+#include "internal/parallel.h"
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING
+#include <ruby/io/buffer.h>
+#endif
 
 struct PCM {
 	long fs;
 	long length;
-	double *s;
+	void *s; // double, or float for RB_PCM_F32
+	enum rb_pcm_dtype dtype;
+	long capa; // allocated samples; shrinking keeps the storage
+	unsigned int lock; // rb_pcm_locktmp() nesting count
+	VALUE owner; // holds +s+ for a view made by rb_pcm_wrap() or a slice, or nil
+	bool shared; // +s+ is a slice of +owner+, copied on write
 } ;
 
 static struct PCM *
@@ -20,9 +34,71 @@ pcm_alloc(void)
 	ptr->fs = FS_DEF;
 	ptr->length = 0;
 	ptr->s = NULL;
+	ptr->dtype = RB_PCM_F64;
+	ptr->capa = 0;
+	ptr->lock = 0;
+	ptr->owner = Qnil;
+	ptr->shared = false;
 	return ptr;
 }
 
+static inline size_t
+pcm_sample_size(const struct PCM *ptr)
+{
+	return ptr->dtype == RB_PCM_F32 ? sizeof(float) : sizeof(double);
+}
+
+static inline double
+pcm_get(const struct PCM *ptr, long i)
+{
+	if (ptr->dtype == RB_PCM_F32)
+		return ((const float *)ptr->s)[i];
+	return ((const double *)ptr->s)[i];
+}
+
+static inline void
+pcm_set(struct PCM *ptr, long i, double x)
+{
+	if (ptr->dtype == RB_PCM_F32)
+		((float *)ptr->s)[i] = (float)x;
+	else
+		((double *)ptr->s)[i] = x;
+}
+
+/*
+ * Give a slice its own storage of +n+ samples, keeping the shared ones.
+ */
+static void
+pcm_unshare(struct PCM *ptr, long n)
+{
+	const size_t size = pcm_sample_size(ptr);
+	const long copied = n < ptr->length ? n : ptr->length;
+	void *s = n > 0 ? ruby_xmalloc2(n, size) : NULL;
+	
+	if (copied > 0)
+		memcpy(s, ptr->s, copied * size);
+	if (n > copied)
+		memset((char *)s + copied * size, 0, (n - copied) * size);
+	ptr->s = s;
+	ptr->length = n;
+	ptr->capa = n;
+	ptr->owner = Qnil;
+	ptr->shared = false;
+}
+
+/*
+ * Called before writing samples: copy them if they are shared.
+ */
+static void
+pcm_modify(struct PCM *ptr)
+{
+	if (!ptr->shared)
+		return;
+	if (ptr->lock)
+		rb_raise(rb_eRuntimeError, "can't modify PCM; temporarily locked");
+	pcm_unshare(ptr, ptr->length);
+}
+
 static void
 pcm_resize(struct PCM *ptr, long n)
 {
@@ -30,33 +106,43 @@ pcm_resize(struct PCM *ptr, long n)
 	
 	if (n < 0)
 		rb_raise(rb_eRangeError, "negative (or biggest) sample size");
-	else if (n == 0)
+	if (ptr->lock && n != ptr->length)
+		rb_raise(rb_eRuntimeError, "can't resize PCM; temporarily locked");
+	if (ptr->shared)
+	{
+		if (n != ptr->length)
+			pcm_unshare(ptr, n);
+		return;
+	}
+	if (!NIL_P(ptr->owner))
+	{
+		if (n != ptr->length)
+			rb_raise(rb_eRuntimeError, "can't resize PCM; a view of %"PRIsVALUE"", rb_obj_class(ptr->owner));
+		return;
+	}
+	if (n == 0)
 	{
 		if (ptr->s != NULL)
 			xfree(ptr->s);
+		ptr->s = NULL;
 		ptr->length = 0;
+		ptr->capa = 0;
 	}
-	else /* if (n > 1) */
+	else if (ptr->length != n)
 	{
-		if (ptr->length != n)
+		const size_t size = pcm_sample_size(ptr);
+		
+		if (ptr->capa < n)
 		{
-			if (ptr->length == 0)
-			{
-				RUBY_ASSERT(ptr->s != NULL);
-				ptr->s = ALLOC_N(double, n);
-				for (volatile long i = 0; i < n; i++)
-					ptr->s[i] = 0.;
-			}
-			else if (ptr->length != n)
-			{
-				RUBY_ASSERT(ptr->s == NULL);
-				REALLOC_N(ptr->s, double, n);
-				if (ptr->length < n)
-					for (volatile long i = ptr->length; i < n; i++)
-						ptr->s[i] = 0.;
-			}
-			ptr->length = n;
+			if (ptr->s == NULL)
+				ptr->s = ruby_xmalloc2(n, size);
+			else
+				ptr->s = ruby_xrealloc2(ptr->s, n, size);
+			ptr->capa = n;
 		}
+		if (ptr->length < n)
+			memset((char *)ptr->s + ptr->length * size, 0, (n - ptr->length) * size);
+		ptr->length = n;
 	}
 }
 
@@ -70,11 +156,18 @@ pcm_fs_set(struct PCM *ptr, long fs)
 	ptr->fs = fs;
 }
 
+static void
+pcm_mark(void *p)
+{
+	struct PCM *ptr = p;
+	rb_gc_mark(ptr->owner);
+}
+
 static void
 pcm_free(void *p)
 {
 	struct PCM *ptr = p;
-	if (ptr->s != NULL)
+	if (ptr->s != NULL && NIL_P(ptr->owner))
 		xfree(ptr->s);
 	xfree(ptr);
 }
@@ -84,14 +177,14 @@ pcm_memsize(const void *p)
 {
 	size_t sz = sizeof(struct PCM);
 	const struct PCM *ptr = p;
-	sz += ptr->length * sizeof(double);
+	sz += ptr->capa * pcm_sample_size(ptr);
 	return sz;
 }
 
 static const rb_data_type_t pcm_data_type = {
     "pcm",
     {
-	0,
+	pcm_mark,
 	pcm_free,
 	pcm_memsize,
     },
@@ -111,21 +204,106 @@ get_pcm(VALUE self)
     return ptr;
 }
 
+enum rb_pcm_dtype
+wave_pcm_dtype_arg(VALUE dtype)
+{
+	static ID f64, f32;
+	ID id;
+	
+	if (NIL_P(dtype))
+		return RB_PCM_F64;
+	if (!f64)
+	{
+		f64 = rb_intern_const("f64");
+		f32 = rb_intern_const("f32");
+	}
+	id = SYMBOL_P(dtype) ? SYM2ID(dtype) : 0;
+	if (id == f64)
+		return RB_PCM_F64;
+	if (id == f32)
+		return RB_PCM_F32;
+	rb_raise(rb_eArgError, "unknown dtype: %"PRIsVALUE" (expected :f64 or :f32)", dtype);
+}
+
 static VALUE
 pcm_s_allocate(VALUE klass)
 {
 	return TypedData_Wrap_Struct(klass, &pcm_data_type, 0);
 }
 
+/*
+ * Let the storage of +ptr+ be shared, and return its owner.  The storage of
+ * a PCM which owns it moves to a hidden root object first, so that the PCM
+ * itself and everything sharing it are copied on write alike.
+ */
+static VALUE
+pcm_share(struct PCM *ptr)
+{
+	if (NIL_P(ptr->owner))
+	{
+		struct PCM *root;
+		VALUE root_obj = TypedData_Make_Struct(0, struct PCM, &pcm_data_type, root);
+		
+		*root = *ptr;
+		root->lock = 0;
+		ptr->owner = root_obj;
+		ptr->shared = true;
+		ptr->capa = 0;
+	}
+	return ptr->owner;
+}
+
+/*
+ * A slice of +len+ samples of +self+ from +beg+, sharing its storage.  The
+ * owner of a view made by rb_pcm_wrap() writes the samples without copy on
+ * write, so a slice of a view gets a copy of its own instead.
+ */
+static VALUE
+pcm_subseq(VALUE self, struct PCM *ptr, long beg, long len)
+{
+	struct PCM *sub;
+	VALUE obj;
+	
+	if (beg < 0 || beg > ptr->length || len < 0)
+		return Qnil;
+	if (len > ptr->length - beg)
+		len = ptr->length - beg;
+	if (len == 0)
+		return rb_pcm_new2(0, ptr->fs, ptr->dtype);
+	if (!NIL_P(ptr->owner) && !ptr->shared)
+	{
+		obj = rb_pcm_new2(len, ptr->fs, ptr->dtype);
+		memcpy(get_pcm(obj)->s, (char *)ptr->s + beg * pcm_sample_size(ptr), len * pcm_sample_size(ptr));
+		return obj;
+	}
+	
+	pcm_share(ptr);
+	obj = TypedData_Make_Struct(rb_cWavePCM, struct PCM, &pcm_data_type, sub);
+	sub->fs = ptr->fs;
+	sub->length = len;
+	sub->dtype = ptr->dtype;
+	sub->s = (char *)ptr->s + beg * pcm_sample_size(ptr);
+	sub->capa = 0;
+	sub->lock = 0;
+	sub->owner = ptr->owner;
+	sub->shared = true;
+	
+	RB_GC_GUARD(self);
+	return obj;
+}
+
 /*
  *  call-seq:
- *    Wave::PCM.new(len, fs = Wave::PCM::FS_DEF) -> Wave::PCM
- *    Wave::PCM.new(len, fs = Wave::PCM::FS_DEF){|index| ...} -> Wave::PCM
+ *    Wave::PCM.new(len, fs = Wave::PCM::FS_DEF, dtype: :f64) -> Wave::PCM
+ *    Wave::PCM.new(len, fs = Wave::PCM::FS_DEF, dtype: :f64){|index| ...} -> Wave::PCM
  *  
  *  Create a new PCM class object with a length of +len+.
  *  The second argument +fs+ specifies the sampling frequency.
  *  The default value is constant of Wave::PCM::FS_DEF.
  *  
+ *  <code>dtype: :f32</code> stores the samples in single precision, half the memory of the
+ *  default <code>:f64</code>; they are still read and written as Float.
+ *  
  *  If with block given, calls the block with each +index+ in the range (0...len)
  *  
  *    ```
@@ -162,14 +340,29 @@ static VALUE
 rb_pcm_initialize(int argc, VALUE *argv, VALUE self)
 {
 	struct PCM *ptr = check_pcm(self);
-	VALUE len, fs;
+	VALUE len, fs, opts;
+	enum rb_pcm_dtype dtype = RB_PCM_F64;
 	
 	if (!ptr)
 		DATA_PTR(self) = ptr = pcm_alloc();
 	
-	rb_scan_args(argc, argv, "11", &len, &fs);
-	if (argc == 1)  fs = LONG2FIX(FS_DEF);
+	rb_scan_args(argc, argv, "11:", &len, &fs, &opts);
+	if (NIL_P(fs))  fs = LONG2FIX(FS_DEF);
+	if (!NIL_P(opts))
+	{
+		static ID kw;
+		VALUE v = Qundef;
+		if (!kw)
+			kw = rb_intern_const("dtype");
+		rb_get_kwargs(opts, &kw, 0, 1, &v);
+		dtype = wave_pcm_dtype_arg(v == Qundef ? Qnil : v);
+	}
 	
+	if (ptr->dtype != dtype)
+	{
+		pcm_resize(ptr, 0);
+		ptr->dtype = dtype;
+	}
 	pcm_resize(ptr, NUM2LONG(len));
 	pcm_fs_set(ptr, NUM2LONG(fs));
 	
@@ -178,7 +371,8 @@ rb_pcm_initialize(int argc, VALUE *argv, VALUE self)
 		for (volatile long i = 0; i < ptr->length; i++)
 		{
 			VALUE snd = rb_yield(LONG2NUM(i));
-			ptr->s[i] = NUM2DBL(snd);
+			pcm_modify(ptr);
+			pcm_set(ptr, i, NUM2DBL(snd));
 		}
 	}
 	
@@ -217,6 +411,20 @@ rb_pcm_fs_set(VALUE pcm, VALUE fs)
 	return fs;
 }
 
+/*
+ *  call-seq:
+ *    pcm.dtype -> :f64 | :f32
+ *  
+ *  Return the storage type of the samples.
+ */
+static VALUE
+rb_pcm_dtype_get(VALUE pcm)
+{
+	struct PCM *ptr = get_pcm(pcm);
+	
+	return ID2SYM(rb_intern(ptr->dtype == RB_PCM_F32 ? "f32" : "f64"));
+}
+
 /*
  *  call-seq:
  *    pcm.length -> Integer
@@ -239,7 +447,9 @@ rb_pcm_len_get(VALUE pcm)
  *  
  *  Set PCM's sample length. 
  *  If +len+ is greater than the sample length itself, 
- *  memory is reallocated and initialized them to 0.0.
+ *  the new samples are initialized to 0.0; memory is reallocated only when +len+ exceeds
+ *  what has been allocated before, as shrinking keeps the storage for reuse.
+ *  A PCM sharing its samples with slices (see Wave::PCM#[]) gets a copy of its own.
  */
 static VALUE
 rb_pcm_len_set(VALUE pcm, VALUE len)
@@ -254,9 +464,25 @@ rb_pcm_len_set(VALUE pcm, VALUE len)
 /*
  *  call-seq:
  *    pcm[nth] -> Float | nil
+ *    pcm[start, length] -> Wave::PCM | nil
+ *    pcm[range] -> Wave::PCM | nil
+ *    pcm.slice(nth) -> Float | nil
+ *    pcm.slice(start, length) -> Wave::PCM | nil
+ *    pcm.slice(range) -> Wave::PCM | nil
  *  
  *  Returns the nth element. If the nth element does not exist, returns nil.
  *  Negative index values are supported, for example '-1' will returns the last value. The behavior is the same as the array class.
+ *  
+ *  Given +start+ and +length+ or a +range+, returns a slice of the samples as a new PCM
+ *  with the same sampling frequency and dtype, selected as by Array#slice.
+ *  The slice shares the samples instead of copying them; the first of +self+ or its slices
+ *  to be changed by Wave::PCM#map! or Wave::PCM#length= gets a copy of its own,
+ *  so they never see each other's changes. A slice of a channel of Wave::Frames
+ *  (see Wave::Frames#channel), whose samples the frames change in place, is a copy.
+ *  
+ *    samples = Wave::RIFF.read_linear_pcm("session.wav")[0]
+ *    hop = samples.fs / 50 # 20 ms
+ *    windows = (0...samples.length / hop).map{|i| samples[i * hop, hop]}
  */
 static VALUE
 pcm_snd_take1(struct PCM *ptr, long index)
@@ -265,25 +491,45 @@ pcm_snd_take1(struct PCM *ptr, long index)
 	{
 		if (ptr->length <= index)
 			return Qnil;
-		return DBL2NUM(ptr->s[index]);
+		return DBL2NUM(pcm_get(ptr, index));
 	}
 	else
 	{
 		if ((ptr->length + index) < 0)
 			return Qnil;
-		return DBL2NUM(ptr->s[ptr->length+index]);
+		return DBL2NUM(pcm_get(ptr, ptr->length+index));
 	}
 }
 
 static VALUE
-rb_pcm_snd_take(VALUE pcm, VALUE index)
+rb_pcm_snd_take(int argc, VALUE *argv, VALUE pcm)
 {
 	struct PCM *ptr = get_pcm(pcm);
+	long beg, len;
 	
 	RUBY_ASSERT(ptr->length < 0);
 	
-	return pcm_snd_take1(ptr, NUM2LONG(index));
-
+	rb_check_arity(argc, 1, 2);
+	if (argc == 2)
+	{
+		beg = NUM2LONG(argv[0]);
+		len = NUM2LONG(argv[1]);
+		if (beg < 0)
+			beg += ptr->length;
+		return pcm_subseq(pcm, ptr, beg, len);
+	}
+	if (FIXNUM_P(argv[0]))
+		return pcm_snd_take1(ptr, FIX2LONG(argv[0]));
+	switch (rb_range_beg_len(argv[0], &beg, &len, ptr->length, 0))
+	{
+	case Qfalse:
+		break;
+	case Qnil:
+		return Qnil;
+	default:
+		return pcm_subseq(pcm, ptr, beg, len);
+	}
+	return pcm_snd_take1(ptr, NUM2LONG(argv[0]));
 }
 
 
@@ -306,9 +552,10 @@ rb_pcm_eql(VALUE pcm, VALUE other_pcm)
 	
 	if (lhs->fs != rhs->fs)  return Qfalse;
 	if (lhs->length != rhs->length)  return Qfalse;
+	if (lhs->dtype != rhs->dtype)  return Qfalse;
 	for (volatile long i = 0; i < lhs->length; i++)
 	{
-		if (lhs->s[i] != rhs->s[i])
+		if (pcm_get(lhs, i) != pcm_get(rhs, i))
 			return Qfalse;
 	}
 	return Qtrue;
@@ -340,7 +587,7 @@ rb_pcm_each(VALUE pcm)
 	ptr = get_pcm(pcm);
 	for (volatile long i = 0; i < ptr->length; i++)
 	{
-		rb_yield(DBL2NUM(ptr->s[i]));
+		rb_yield(DBL2NUM(pcm_get(ptr, i)));
 	}
 	return pcm;
 }
@@ -399,75 +646,1209 @@ rb_pcm_collect_bang(VALUE pcm)
 	ptr = get_pcm(pcm);
 	for (volatile long i = 0; i < ptr->length; i++)
 	{
-		const double s = ptr->s[i];
+		const double s = pcm_get(ptr, i);
 		VALUE retval = rb_yield(DBL2NUM(s));
-		ptr->s[i] = NUM2DBL(retval);
+		pcm_modify(ptr);
+		pcm_set(ptr, i, NUM2DBL(retval));
 	}
 	return pcm;
 }
 
 
+/*******************************************************************************
+	Conversion
 
-void
-InitVM_PCM(void)
+	Binary strings and IO::Buffer hold the samples as they are in memory:
+	doubles or floats in the native byte order.
+*******************************************************************************/
+
+/*
+ *  call-seq:
+ *    Wave::PCM.from_array(ary, fs = Wave::PCM::FS_DEF, dtype: :f64) -> Wave::PCM
+ *  
+ *  Create a new PCM from an Array of samples. Floats are stored as they are,
+ *  without a method call; other elements are converted as by Float().
+ *  
+ *    pcm = Wave::PCM.from_array([0.0, 0.5, -0.5], 8000)
+ *    pcm.to_a #=> [0.0, 0.5, -0.5]
+ */
+static VALUE
+rb_pcm_s_from_array(int argc, VALUE *argv, VALUE klass)
 {
+	VALUE ary, fs, opts, obj;
+	enum rb_pcm_dtype dtype = RB_PCM_F64;
+	struct PCM *ptr;
+	long i = 0, len;
 	
-	rb_include_module(rb_cWavePCM, rb_mEnumerable);
-	rb_define_alloc_func(rb_cWavePCM, pcm_s_allocate);
+	rb_scan_args(argc, argv, "11:", &ary, &fs, &opts);
+	if (NIL_P(fs))  fs = LONG2FIX(FS_DEF);
+	if (!NIL_P(opts))
+	{
+		static ID kw;
+		VALUE v = Qundef;
+		if (!kw)
+			kw = rb_intern_const("dtype");
+		rb_get_kwargs(opts, &kw, 0, 1, &v);
+		dtype = wave_pcm_dtype_arg(v == Qundef ? Qnil : v);
+	}
+	ary = rb_Array(ary);
+	len = RARRAY_LEN(ary);
+	obj = rb_pcm_new2(len, NUM2LONG(fs), dtype);
+	ptr = get_pcm(obj);
 	
-	rb_define_const(rb_cWavePCM, "FS_DEF", LONG2NUM(FS_DEF));
+	/* Floats only: nothing can run behind our back and change +ary+ */
+	if (dtype == RB_PCM_F32)
+	{
+		const VALUE *p = RARRAY_CONST_PTR(ary);
+		float *s = ptr->s;
+		for (; i < len && RB_FLOAT_TYPE_P(p[i]); i++)
+			s[i] = (float)RFLOAT_VALUE(p[i]);
+	}
+	else
+	{
+		const VALUE *p = RARRAY_CONST_PTR(ary);
+		double *s = ptr->s;
+		for (; i < len && RB_FLOAT_TYPE_P(p[i]); i++)
+			s[i] = RFLOAT_VALUE(p[i]);
+	}
+	for (; i < len; i++)
+		pcm_set(ptr, i, NUM2DBL(rb_ary_entry(ary, i)));
 	
-	rb_define_method(rb_cWavePCM, "initialize", rb_pcm_initialize, -1);
+	RB_GC_GUARD(ary);
+	return obj;
+}
+
+/*
+ *  call-seq:
+ *    pcm.to_a -> Array
+ *  
+ *  Return the samples as an Array of Float.
+ */
+static VALUE
+rb_pcm_to_a(VALUE pcm)
+{
+	struct PCM *ptr = get_pcm(pcm);
+	const long len = ptr->length;
+	VALUE ary = rb_ary_new_capa(len);
 	
-	rb_define_method(rb_cWavePCM, "fs", rb_pcm_fs_get, 0);
-	rb_define_method(rb_cWavePCM, "fs=", rb_pcm_fs_set, 1);
-	rb_define_method(rb_cWavePCM, "length", rb_pcm_len_get, 0);
-	rb_define_method(rb_cWavePCM, "length=", rb_pcm_len_set, 1);
-	rb_define_method(rb_cWavePCM, "[]", rb_pcm_snd_take, 1);
+	for (long i = 0; i < len; i++)
+		rb_ary_push(ary, DBL2NUM(pcm_get(ptr, i)));
+	return ary;
+}
+
+/*
+ *  call-seq:
+ *    Wave::PCM.from_binary(str, dtype = :f64, fs = Wave::PCM::FS_DEF) -> Wave::PCM
+ *  
+ *  Create a new PCM from the bytes of +str+: doubles (<code>:f64</code>) or
+ *  floats (<code>:f32</code>) in the native byte order, as packed by
+ *  <code>Array#pack("d*")</code> or <code>Array#pack("f*")</code>.
+ *  The new PCM is of that +dtype+, and the bytes are copied with no conversion.
+ *  Raises ArgumentError unless the size of +str+ is a multiple of that of a sample.
+ */
+static VALUE
+rb_pcm_s_from_binary(int argc, VALUE *argv, VALUE klass)
+{
+	VALUE str, dtype, fs, obj;
+	enum rb_pcm_dtype dt;
+	size_t size;
+	long len;
 	
-	rb_define_method(rb_cWavePCM, "eql?", rb_pcm_eql, 1);
+	rb_scan_args(argc, argv, "12", &str, &dtype, &fs);
+	if (NIL_P(fs))  fs = LONG2FIX(FS_DEF);
+	StringValue(str);
+	dt = wave_pcm_dtype_arg(dtype);
+	size = dt == RB_PCM_F32 ? sizeof(float) : sizeof(double);
+	if (RSTRING_LEN(str) % size != 0)
+		rb_raise(rb_eArgError, "string size %ld is not a multiple of %d", RSTRING_LEN(str), (int)size);
+	len = RSTRING_LEN(str) / size;
+	obj = rb_pcm_new2(len, NUM2LONG(fs), dt);
+	if (len > 0)
+		memcpy(get_pcm(obj)->s, RSTRING_PTR(str), len * size);
 	
-	rb_define_method(rb_cWavePCM, "each", rb_pcm_each, 0);
-	rb_define_method(rb_cWavePCM, "map!", rb_pcm_collect_bang, 0);
+	RB_GC_GUARD(str);
+	return obj;
 }
 
-/*******************************************************************************
-	For C API
-*******************************************************************************/
+/*
+ *  call-seq:
+ *    pcm.to_binary(dtype = pcm.dtype) -> String
+ *  
+ *  Return the samples as a binary String of doubles (<code>:f64</code>) or floats
+ *  (<code>:f32</code>) in the native byte order; the reverse of Wave::PCM.from_binary.
+ *  The samples of the same dtype are copied as they are.
+ */
+static VALUE
+rb_pcm_to_binary(int argc, VALUE *argv, VALUE pcm)
+{
+	struct PCM *ptr = get_pcm(pcm);
+	enum rb_pcm_dtype dt;
+	VALUE str;
+	
+	rb_check_arity(argc, 0, 1);
+	dt = argc > 0 && !NIL_P(argv[0]) ? wave_pcm_dtype_arg(argv[0]) : ptr->dtype;
+	if (dt == ptr->dtype)
+		return rb_str_new(ptr->s, ptr->length * pcm_sample_size(ptr));
+	
+	str = rb_str_new(NULL, ptr->length * (dt == RB_PCM_F32 ? sizeof(float) : sizeof(double)));
+	if (dt == RB_PCM_F32)
+	{
+		float *d = (float *)RSTRING_PTR(str);
+		const double *s = ptr->s;
+		for (long i = 0; i < ptr->length; i++)
+			d[i] = (float)s[i];
+	}
+	else
+	{
+		double *d = (double *)RSTRING_PTR(str);
+		const float *s = ptr->s;
+		for (long i = 0; i < ptr->length; i++)
+			d[i] = s[i];
+	}
+	return str;
+}
 
-VALUE
-rb_pcm_new(long len, long fs)
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING
+/*
+ *  call-seq:
+ *    pcm.to_io_buffer -> IO::Buffer
+ *  
+ *  Return a read-only IO::Buffer over the samples of +self+, without copying them:
+ *  <code>pcm.length</code> doubles or floats, as Wave::PCM#dtype tells, in the native byte order
+ *  (<code>buffer.get_value(:f64, 8 * i)</code> on a little-endian host).
+ *  
+ *  +self+ shares the samples with the buffer as with its slices (see Wave::PCM#[]),
+ *  so the buffer keeps the samples of the time it was made: +self+ gets a copy of
+ *  its own when it is changed. The buffer keeps the samples alive.
+ */
+static VALUE
+rb_pcm_to_io_buffer(VALUE pcm)
 {
-	struct PCM *ptr;
-	VALUE obj = TypedData_Make_Struct(rb_cWavePCM, struct PCM, &pcm_data_type, ptr);
+	static ID id_pcm;
+	struct PCM *ptr = get_pcm(pcm);
+	VALUE owner, buf;
 	
-	pcm_resize(ptr, len);
-	pcm_fs_set(ptr, fs);
+	if (!id_pcm)
+		id_pcm = rb_intern_const("pcm");
+	if (ptr->length == 0)
+		return rb_io_buffer_new(NULL, 0, RB_IO_BUFFER_EXTERNAL | RB_IO_BUFFER_READONLY);
+	if (!NIL_P(ptr->owner) && !ptr->shared)
+	{
+		pcm = pcm_subseq(pcm, ptr, 0, ptr->length);
+		ptr = get_pcm(pcm);
+	}
+	owner = pcm_share(ptr);
+	buf = rb_io_buffer_new(ptr->s, ptr->length * pcm_sample_size(ptr), RB_IO_BUFFER_EXTERNAL | RB_IO_BUFFER_READONLY);
+	rb_ivar_set(buf, id_pcm, owner); // hidden, for GC
+	return buf;
+}
+
+/* Finalizer of the root of the samples of an IO::Buffer: unlock it. */
+static VALUE
+pcm_io_buffer_release(RB_BLOCK_CALL_FUNC_ARGLIST(unused_obj, buf))
+{
+	return rb_io_buffer_unlock(buf);
+}
+
+/*
+ *  call-seq:
+ *    Wave::PCM.from_io_buffer(io_buffer, dtype = :f64, fs = Wave::PCM::FS_DEF) -> Wave::PCM
+ *  
+ *  Create a new PCM over the bytes of +io_buffer+, without copying them:
+ *  doubles (<code>:f64</code>) or floats (<code>:f32</code>) in the native byte order.
+ *  Raises ArgumentError unless the size of +io_buffer+ is a multiple of that of a sample.
+ *  
+ *  The PCM shares the samples as a slice does (see Wave::PCM#[]): it sees the later
+ *  writes to +io_buffer+, and gets a copy of its own when it is changed itself.
+ *  For the PCM to never lose its samples, +io_buffer+ is locked, and can be neither
+ *  freed nor resized, as long as the PCM or a slice of it shares them; it is unlocked
+ *  when the last of those is garbage collected after it has been changed or dropped.
+ *  An +io_buffer+ locked already raises IO::Buffer::LockedError. The bytes are copied,
+ *  though, if they are not aligned for +dtype+, e.g. in an odd slice of a buffer.
+ *  
+ *    buffer = IO::Buffer.map(File.open("samples.f32"), nil, 0, IO::Buffer::READONLY)
+ *    pcm = Wave::PCM.from_io_buffer(buffer, :f32, 48000)
+ */
+static VALUE
+rb_pcm_s_from_io_buffer(int argc, VALUE *argv, VALUE klass)
+{
+	VALUE buf, dtype, fs, obj, root_obj;
+	enum rb_pcm_dtype dt;
+	const void *base;
+	size_t bytes, size;
+	struct PCM *ptr, *root;
+	
+	rb_scan_args(argc, argv, "12", &buf, &dtype, &fs);
+	if (NIL_P(fs))  fs = LONG2FIX(FS_DEF);
+	if (!rb_obj_is_kind_of(buf, rb_cIOBuffer))
+		rb_raise(rb_eTypeError, "wrong argument type %"PRIsVALUE" (expected IO::Buffer)", rb_obj_class(buf));
+	dt = wave_pcm_dtype_arg(dtype);
+	size = dt == RB_PCM_F32 ? sizeof(float) : sizeof(double);
+	rb_io_buffer_get_bytes_for_reading(buf, &base, &bytes);
+	if (bytes % size != 0)
+		rb_raise(rb_eArgError, "buffer size %"PRIuSIZE" is not a multiple of %d", bytes, (int)size);
+	
+	if (bytes == 0 || (uintptr_t)base % size != 0)
+	{
+		obj = rb_pcm_new2(bytes / size, NUM2LONG(fs), dt);
+		if (bytes > 0)
+			memcpy(get_pcm(obj)->s, base, bytes);
+		return obj;
+	}
+	
+	obj = TypedData_Make_Struct(klass, struct PCM, &pcm_data_type, ptr);
+	ptr->owner = Qnil;
+	ptr->shared = false;
+	ptr->dtype = dt;
+	pcm_fs_set(ptr, NUM2LONG(fs));
+	
+	/*
+	 * The PCM and its slices share a hidden root holding the lock, given back
+	 * by the finalizer of the root once none of them refer to it any more.
+	 * Not from pcm_free(): the buffer may be swept in the same GC.
+	 */
+	root_obj = TypedData_Make_Struct(0, struct PCM, &pcm_data_type, root);
+	*root = *ptr;
+	root->s = (void *)base;
+	root->length = bytes / size;
+	root->owner = buf;
+	root->shared = true;
+	rb_io_buffer_lock(buf);
+	rb_define_finalizer(root_obj, rb_proc_new(pcm_io_buffer_release, buf));
+	
+	ptr->s = root->s;
+	ptr->length = root->length;
+	ptr->capa = 0;
+	ptr->owner = root_obj;
+	ptr->shared = true;
 	
 	return obj;
 }
+#endif /* HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING */
 
 
-long
-rb_pcm_fs(VALUE pcm)
+/*******************************************************************************
+	Arithmetic
+
+	The samples are processed by the vector kernels of pcm_arith.c; only
+	operands of different dtypes go sample by sample, in double precision.
+*******************************************************************************/
+
+#define pcm_p(obj)  rb_typeddata_is_kind_of((obj), &pcm_data_type)
+
+static struct PCM *
+pcm_operand(const struct PCM *ptr, VALUE other)
 {
-	struct PCM *ptr = get_pcm(pcm);
+	struct PCM *rhs = get_pcm(other);
 	
-	return ptr->fs;
+	if (rhs->length != ptr->length)
+		rb_raise(rb_eArgError, "length mismatch (%ld for %ld)", rhs->length, ptr->length);
+	if (rhs->fs != ptr->fs)
+		rb_raise(rb_eArgError, "sampling frequency mismatch");
+	return rhs;
 }
 
-long
-rb_pcm_len(VALUE pcm)
+static inline double
+pcm_op1(enum pcm_arith_op op, double a, double b)
 {
-	struct PCM *ptr = get_pcm(pcm);
+	switch (op) {
+	case PCM_ARITH_ADD:  return a + b;
+	case PCM_ARITH_SUB:  return a - b;
+	case PCM_ARITH_MUL:  return a * b;
+	default:             return a / b;
+	}
+}
+
+/*
+ * dst = a op other, where +other+ is a Wave::PCM or a Numeric; +dst+ has
+ * the length of +a+ and may be +a+ itself.
+ */
+static void
+pcm_binary(enum pcm_arith_op op, struct PCM *dst, const struct PCM *a, VALUE other)
+{
+	if (pcm_p(other))
+	{
+		const struct PCM *b = pcm_operand(a, other);
+		
+		if (dst->dtype == a->dtype && a->dtype == b->dtype)
+		{
+			if (a->dtype == RB_PCM_F32)
+				pcm_arith_vv_f32(op, dst->s, a->s, b->s, a->length);
+			else
+				pcm_arith_vv(op, dst->s, a->s, b->s, a->length);
+		}
+		else
+		{
+			for (long i = 0; i < a->length; i++)
+				pcm_set(dst, i, pcm_op1(op, pcm_get(a, i), pcm_get(b, i)));
+		}
+	}
+	else
+	{
+		const double x = NUM2DBL(other);
+		
+		if (dst->dtype == RB_PCM_F32)
+			pcm_arith_vs_f32(op, dst->s, a->s, (float)x, a->length);
+		else
+			pcm_arith_vs(op, dst->s, a->s, x, a->length);
+	}
+}
+
+/*
+ * A new PCM for the result of an operation on +ptr+ and +other+: of dtype
+ * f64 unless both of them are f32.
+ */
+static VALUE
+pcm_new_result(const struct PCM *ptr, VALUE other)
+{
+	enum rb_pcm_dtype dtype = ptr->dtype;
 	
-	return ptr->length;
+	if (pcm_p(other) && get_pcm(other)->dtype != dtype)
+		dtype = RB_PCM_F64;
+	return rb_pcm_new2(ptr->length, ptr->fs, dtype);
 }
 
-double *
-rb_waveform_data_ptr(VALUE pcm)
+static VALUE
+pcm_binary_op(enum pcm_arith_op op, VALUE self, VALUE other)
+{
+	struct PCM *ptr = get_pcm(self);
+	VALUE obj;
+	
+	if (pcm_p(other))
+		pcm_operand(ptr, other);
+	obj = pcm_new_result(ptr, other);
+	pcm_binary(op, get_pcm(obj), ptr, other);
+	
+	RB_GC_GUARD(other);
+	return obj;
+}
+
+static VALUE
+pcm_binary_op_bang(enum pcm_arith_op op, VALUE self, VALUE other)
+{
+	struct PCM *ptr = get_pcm(self);
+	
+	if (pcm_p(other))
+		pcm_operand(ptr, other);
+	pcm_modify(ptr);
+	pcm_binary(op, ptr, ptr, other);
+	
+	RB_GC_GUARD(other);
+	return self;
+}
+
+/*
+ *  call-seq:
+ *    pcm + other -> Wave::PCM
+ *    pcm - other -> Wave::PCM
+ *    pcm * other -> Wave::PCM
+ *    pcm / other -> Wave::PCM
+ *  
+ *  Returns a new PCM of the sample-by-sample sum, difference, product or quotient
+ *  of +self+ and +other+, a Numeric or a Wave::PCM of the same length and sampling frequency.
+ *  The result is of dtype f32 if both operands are, and f64 otherwise.
+ *  
+ *    mix = (vocal * 0.8) + (guitar * 0.5)
+ */
+static VALUE
+rb_pcm_plus(VALUE self, VALUE other)
+{
+	return pcm_binary_op(PCM_ARITH_ADD, self, other);
+}
+
+static VALUE
+rb_pcm_minus(VALUE self, VALUE other)
+{
+	return pcm_binary_op(PCM_ARITH_SUB, self, other);
+}
+
+static VALUE
+rb_pcm_mul(VALUE self, VALUE other)
+{
+	return pcm_binary_op(PCM_ARITH_MUL, self, other);
+}
+
+static VALUE
+rb_pcm_div(VALUE self, VALUE other)
+{
+	return pcm_binary_op(PCM_ARITH_DIV, self, other);
+}
+
+/*
+ *  call-seq:
+ *    pcm.add!(other) -> self
+ *    pcm.sub!(other) -> self
+ *    pcm.mul!(other) -> self
+ *    pcm.div!(other) -> self
+ *  
+ *  Same as Wave::PCM#+, Wave::PCM#-, Wave::PCM#* and Wave::PCM#/,
+ *  but stores the result in +self+, keeping its dtype.
+ */
+static VALUE
+rb_pcm_add_bang(VALUE self, VALUE other)
+{
+	return pcm_binary_op_bang(PCM_ARITH_ADD, self, other);
+}
+
+static VALUE
+rb_pcm_sub_bang(VALUE self, VALUE other)
+{
+	return pcm_binary_op_bang(PCM_ARITH_SUB, self, other);
+}
+
+static VALUE
+rb_pcm_mul_bang(VALUE self, VALUE other)
+{
+	return pcm_binary_op_bang(PCM_ARITH_MUL, self, other);
+}
+
+static VALUE
+rb_pcm_div_bang(VALUE self, VALUE other)
+{
+	return pcm_binary_op_bang(PCM_ARITH_DIV, self, other);
+}
+
+/*
+ *  call-seq:
+ *    pcm.scale!(gain) -> self
+ *  
+ *  Multiplies each sample by the Numeric +gain+.
+ *  
+ *    pcm.scale!(10 ** (-6.0 / 20)) # -6 dB
+ */
+static VALUE
+rb_pcm_scale_bang(VALUE self, VALUE gain)
+{
+	struct PCM *ptr = get_pcm(self);
+	const double x = NUM2DBL(gain);
+	
+	pcm_modify(ptr);
+	if (ptr->dtype == RB_PCM_F32)
+		pcm_arith_vs_f32(PCM_ARITH_MUL, ptr->s, ptr->s, (float)x, ptr->length);
+	else
+		pcm_arith_vs(PCM_ARITH_MUL, ptr->s, ptr->s, x, ptr->length);
+	return self;
+}
+
+/*
+ *  call-seq:
+ *    pcm.fma!(mul, add) -> self
+ *  
+ *  Replaces each sample +s+ with <code>s * mul + add</code>, where +mul+ and +add+ are
+ *  each a Numeric or a Wave::PCM of the same length and sampling frequency.
+ *  The product is rounded before the sum is taken.
+ *  
+ *    mix.fma!(1.0 - fade, guitar * fade) # crossfade into guitar
+ */
+static VALUE
+rb_pcm_fma_bang(VALUE self, VALUE mul, VALUE add)
+{
+	struct PCM *ptr = get_pcm(self);
+	struct PCM *m = pcm_p(mul) ? pcm_operand(ptr, mul) : NULL;
+	struct PCM *c = pcm_p(add) ? pcm_operand(ptr, add) : NULL;
+	const double ms = m ? 0.0 : NUM2DBL(mul);
+	const double cs = c ? 0.0 : NUM2DBL(add);
+	
+	pcm_modify(ptr);
+	if ((m && m->dtype != ptr->dtype) || (c && c->dtype != ptr->dtype))
+	{
+		for (long i = 0; i < ptr->length; i++)
+		{
+			double x = pcm_get(ptr, i) * (m ? pcm_get(m, i) : ms);
+			pcm_set(ptr, i, x + (c ? pcm_get(c, i) : cs));
+		}
+	}
+	else if (ptr->dtype == RB_PCM_F32)
+	{
+		pcm_arith_fma_f32(ptr->s, ptr->s, m ? m->s : NULL, (float)ms, c ? c->s : NULL, (float)cs, ptr->length);
+	}
+	else
+	{
+		pcm_arith_fma(ptr->s, ptr->s, m ? m->s : NULL, ms, c ? c->s : NULL, cs, ptr->length);
+	}
+	
+	RB_GC_GUARD(mul);
+	RB_GC_GUARD(add);
+	return self;
+}
+
+static void
+pcm_unary(enum pcm_arith_op op, struct PCM *dst, const struct PCM *a)
+{
+	if (a->dtype == RB_PCM_F32)
+		pcm_arith_unary_f32(op, dst->s, a->s, a->length);
+	else
+		pcm_arith_unary(op, dst->s, a->s, a->length);
+}
+
+static VALUE
+pcm_unary_op(enum pcm_arith_op op, VALUE self, bool bang)
+{
+	struct PCM *ptr = get_pcm(self);
+	VALUE obj = self;
+	
+	if (bang)
+		pcm_modify(ptr);
+	else
+		obj = rb_pcm_new2(ptr->length, ptr->fs, ptr->dtype);
+	pcm_unary(op, get_pcm(obj), ptr);
+	
+	return obj;
+}
+
+/*
+ *  call-seq:
+ *    -pcm -> Wave::PCM
+ *    pcm.negate -> Wave::PCM
+ *    pcm.negate! -> self
+ *  
+ *  Inverts the polarity of each sample.
+ */
+static VALUE
+rb_pcm_negate(VALUE self)
+{
+	return pcm_unary_op(PCM_ARITH_NEG, self, false);
+}
+
+static VALUE
+rb_pcm_negate_bang(VALUE self)
+{
+	return pcm_unary_op(PCM_ARITH_NEG, self, true);
+}
+
+/*
+ *  call-seq:
+ *    pcm.abs -> Wave::PCM
+ *    pcm.abs! -> self
+ *  
+ *  Takes the absolute value of each sample.
+ */
+static VALUE
+rb_pcm_abs(VALUE self)
+{
+	return pcm_unary_op(PCM_ARITH_ABS, self, false);
+}
+
+static VALUE
+rb_pcm_abs_bang(VALUE self)
+{
+	return pcm_unary_op(PCM_ARITH_ABS, self, true);
+}
+
+static VALUE
+pcm_clip_op(int argc, VALUE *argv, VALUE self, bool bang)
+{
+	struct PCM *ptr = get_pcm(self);
+	VALUE obj = self;
+	double lo = -1.0, hi = 1.0;
+	
+	rb_check_arity(argc, 0, 2);
+	if (argc > 0)
+		lo = NUM2DBL(argv[0]);
+	if (argc > 1)
+		hi = NUM2DBL(argv[1]);
+	if (lo > hi)
+		rb_raise(rb_eArgError, "min argument must be less than or equal to max argument");
+	
+	if (bang)
+		pcm_modify(ptr);
+	else
+		obj = rb_pcm_new2(ptr->length, ptr->fs, ptr->dtype);
+	if (ptr->dtype == RB_PCM_F32)
+		pcm_arith_clip_f32(get_pcm(obj)->s, ptr->s, (float)lo, (float)hi, ptr->length);
+	else
+		pcm_arith_clip(get_pcm(obj)->s, ptr->s, lo, hi, ptr->length);
+	
+	return obj;
+}
+
+/*
+ *  call-seq:
+ *    pcm.clip(min = -1.0, max = 1.0) -> Wave::PCM
+ *    pcm.clip!(min = -1.0, max = 1.0) -> self
+ *  
+ *  Limits each sample to the range from +min+ to +max+; the default is the full scale of
+ *  the integer formats of Wave::RIFF.
+ */
+static VALUE
+rb_pcm_clip(int argc, VALUE *argv, VALUE self)
+{
+	return pcm_clip_op(argc, argv, self, false);
+}
+
+static VALUE
+rb_pcm_clip_bang(int argc, VALUE *argv, VALUE self)
+{
+	return pcm_clip_op(argc, argv, self, true);
+}
+
+
+/*******************************************************************************
+	Statistics
+*******************************************************************************/
+
+/* The positive full scale of 16-bit PCM, so that clipping counts on both sides */
+#define CLIP_DEF  (32767.0 / 32768.0)
+
+static void
+pcm_stats_of(const struct PCM *ptr, double clip, pcm_stats_result_t *r)
+{
+	pcm_stats_t st;
+	
+	pcm_stats_init(&st, clip);
+	if (ptr->dtype == RB_PCM_F32)
+		pcm_stats_update_f32(&st, ptr->s, ptr->length);
+	else
+		pcm_stats_update(&st, ptr->s, ptr->length);
+	pcm_stats_finish(&st, r);
+}
+
+static inline double
+stats_peak(const pcm_stats_result_t *r)
+{
+	return fabs(r->min) > fabs(r->max) ? fabs(r->min) : fabs(r->max);
+}
+
+static inline double
+stats_rms(const pcm_stats_result_t *r)
+{
+	return sqrt(r->sum_sq / r->count);
+}
+
+static VALUE
+stats_hash(const pcm_stats_result_t *r)
+{
+	VALUE h = rb_hash_new();
+	const bool empty = r->count == 0;
+	
+#define STATS_SET(key, val)  rb_hash_aset(h, ID2SYM(rb_intern(key)), (val))
+	STATS_SET("min", empty ? Qnil : DBL2NUM(r->min));
+	STATS_SET("max", empty ? Qnil : DBL2NUM(r->max));
+	STATS_SET("peak", empty ? Qnil : DBL2NUM(stats_peak(r)));
+	STATS_SET("rms", empty ? Qnil : DBL2NUM(stats_rms(r)));
+	STATS_SET("dc", empty ? Qnil : DBL2NUM(r->sum / r->count));
+	STATS_SET("crest", empty ? Qnil : DBL2NUM(stats_peak(r) / stats_rms(r)));
+	STATS_SET("zero_crossings", LONG2NUM(r->zero_crossings));
+	STATS_SET("clipped", LONG2NUM(r->clipped));
+#undef STATS_SET
+	return h;
+}
+
+void
+wave_stats_opts(VALUE opts, double *clip, int *threads)
+{
+	static ID kw[2];
+	VALUE v[2] = {Qundef, Qundef};
+	
+	if (!NIL_P(opts))
+	{
+		if (!kw[0])
+		{
+			kw[0] = rb_intern_const("clip");
+			kw[1] = rb_intern_const("threads");
+		}
+		rb_get_kwargs(opts, kw, 0, threads ? 2 : 1, v);
+	}
+	*clip = v[0] == Qundef ? CLIP_DEF : NUM2DBL(v[0]);
+	if (threads)
+		*threads = wave_threads_arg(v[1]);
+}
+
+struct wave_stats_worker {
+	const struct wave_stats_channel *ch;
+	pcm_stats_result_t *r;
+	long channels;
+	long first; // takes the channels first, first + step, ...
+	long step;
+	double clip;
+};
+
+static void *
+wave_stats_worker_run(void *arg)
+{
+	struct wave_stats_worker *w = arg;
+	
+	for (long c = w->first; c < w->channels; c += w->step)
+	{
+		const struct wave_stats_channel *ch = &w->ch[c];
+		pcm_stats_t st;
+		
+		pcm_stats_init(&st, w->clip);
+		if (ch->dtype == RB_PCM_F32)
+		{
+			pcm_stats_update_f32(&st, ch->s, ch->len);
+		}
+		else if (ch->stride == 1)
+		{
+			pcm_stats_update(&st, ch->s, ch->len);
+		}
+		else
+		{
+			double buf[1024];
+			const double *s = ch->s;
+			
+			for (long i = 0; i < ch->len; i += 1024)
+			{
+				const long n = ch->len - i < 1024 ? ch->len - i : 1024;
+				for (long j = 0; j < n; j++)
+					buf[j] = s[(i + j) * ch->stride];
+				pcm_stats_update(&st, buf, n);
+			}
+		}
+		pcm_stats_finish(&st, &w->r[c]);
+	}
+	return NULL;
+}
+
+struct wave_stats_set {
+	struct wave_stats_worker *w;
+	int n;
+};
+
+static void *
+wave_stats_nogvl(void *arg)
+{
+	struct wave_stats_set *set = arg;
+	
+	wave_parallel_run(wave_stats_worker_run, set->w, sizeof(struct wave_stats_worker), set->n);
+	return NULL;
+}
+
+VALUE
+wave_stats_channels(const struct wave_stats_channel *ch, long channels, double clip, int threads)
+{
+	VALUE ary = rb_ary_new2(channels), tmp = 0;
+	pcm_stats_result_t *r = ALLOCV_N(pcm_stats_result_t, tmp, channels);
+	struct wave_stats_set set;
+	
+	set.n = channels < threads ? (int)channels : threads;
+	set.w = ALLOCA_N(struct wave_stats_worker, set.n > 0 ? set.n : 1);
+	for (int i = 0; i < set.n; i++)
+	{
+		set.w[i].ch = ch;
+		set.w[i].r = r;
+		set.w[i].channels = channels;
+		set.w[i].first = i;
+		set.w[i].step = set.n;
+		set.w[i].clip = clip;
+	}
+	if (set.n > 1)
+		rb_thread_call_without_gvl(wave_stats_nogvl, &set, NULL, NULL);
+	else if (set.n == 1)
+		wave_stats_worker_run(set.w);
+	
+	for (long c = 0; c < channels; c++)
+		rb_ary_push(ary, stats_hash(&r[c]));
+	ALLOCV_END(tmp);
+	return ary;
+}
+
+/*
+ *  call-seq:
+ *    pcm.stats(clip: 32767.0 / 32768) -> Hash
+ *  
+ *  Computes in one pass over the samples, and returns as a Hash:
+ *  
+ *  +min+, +max+, +peak+::  The extremes, and the larger magnitude of them.
+ *  +rms+, +dc+::  Root mean square and mean, from compensated sums.
+ *  +crest+::  +peak+ divided by +rms+.
+ *  +zero_crossings+::  Sign changes between consecutive samples, 0.0 counting as positive.
+ *  +clipped+::  Samples whose magnitude reaches +clip+; the default is the positive
+ *               full scale of 16-bit PCM, so that clipping counts on both sides.
+ *  
+ *  The Float values are nil for an empty PCM; NaN samples are left out of +min+ and +max+.
+ *  See also Wave::PCM.stats for several channels at once.
+ *  
+ *    Wave::RIFF.read_linear_pcm("take1.wav").map(&:stats)
+ *    # => [{min: -0.71, max: 0.69, peak: 0.71, rms: 0.12, dc: -2.1e-05, crest: 5.9,
+ *    #      zero_crossings: 118231, clipped: 0}, ...]
+ */
+static VALUE
+rb_pcm_stats(int argc, VALUE *argv, VALUE self)
+{
+	struct PCM *ptr = get_pcm(self);
+	pcm_stats_result_t r;
+	VALUE opts;
+	double clip;
+	
+	rb_scan_args(argc, argv, ":", &opts);
+	wave_stats_opts(opts, &clip, NULL);
+	pcm_stats_of(ptr, clip, &r);
+	return stats_hash(&r);
+}
+
+struct pcm_stats_ary_arg {
+	VALUE pcm_ary;
+	struct wave_stats_channel *ch;
+	double clip;
+	int threads;
+};
+
+static VALUE
+pcm_stats_ary0(VALUE arg)
+{
+	struct pcm_stats_ary_arg *p = (struct pcm_stats_ary_arg *)arg;
+	return wave_stats_channels(p->ch, RARRAY_LEN(p->pcm_ary), p->clip, p->threads);
+}
+
+static VALUE
+pcm_stats_ary_ensure(VALUE arg)
+{
+	struct pcm_stats_ary_arg *p = (struct pcm_stats_ary_arg *)arg;
+	
+	for (long i = 0; i < RARRAY_LEN(p->pcm_ary); i++)
+		rb_pcm_unlocktmp(RARRAY_AREF(p->pcm_ary, i));
+	return Qnil;
+}
+
+/*
+ *  call-seq:
+ *    Wave::PCM.stats(pcm_ary, clip: 32767.0 / 32768, threads: 1) -> [Hash]
+ *  
+ *  Same as Wave::PCM#stats for each Wave::PCM of +pcm_ary+.
+ *  With +threads+ greater than 1, the channels are shared among that many native threads.
+ */
+static VALUE
+rb_pcm_s_stats(int argc, VALUE *argv, VALUE unused_obj)
+{
+	struct pcm_stats_ary_arg arg;
+	VALUE pcm_ary, opts, tmp = 0, ret;
+	long channels;
+	
+	rb_scan_args(argc, argv, "1:", &pcm_ary, &opts);
+	Check_Type(pcm_ary, T_ARRAY);
+	wave_stats_opts(opts, &arg.clip, &arg.threads);
+	
+	arg.pcm_ary = pcm_ary = rb_ary_dup(pcm_ary);
+	channels = RARRAY_LEN(pcm_ary);
+	arg.ch = ALLOCV_N(struct wave_stats_channel, tmp, channels);
+	for (long i = 0; i < channels; i++)
+	{
+		struct PCM *ptr = get_pcm(RARRAY_AREF(pcm_ary, i));
+		arg.ch[i].s = ptr->s;
+		arg.ch[i].dtype = ptr->dtype;
+		arg.ch[i].len = ptr->length;
+		arg.ch[i].stride = 1;
+	}
+	for (long i = 0; i < channels; i++)
+		rb_pcm_locktmp(RARRAY_AREF(pcm_ary, i));
+	ret = rb_ensure(pcm_stats_ary0, (VALUE)&arg, pcm_stats_ary_ensure, (VALUE)&arg);
+	ALLOCV_END(tmp);
+	return ret;
+}
+
+/*
+ *  call-seq:
+ *    pcm.peak -> Float | nil
+ *    pcm.rms -> Float | nil
+ *    pcm.dc -> Float | nil
+ *    pcm.crest_factor -> Float | nil
+ *    pcm.zero_crossings -> Integer
+ *    pcm.clipped(clip = 32767.0 / 32768) -> Integer
+ *  
+ *  Each of the values of Wave::PCM#stats, computed natively on its own.
+ */
+static VALUE
+rb_pcm_peak(VALUE self)
+{
+	pcm_stats_result_t r;
+	
+	pcm_stats_of(get_pcm(self), CLIP_DEF, &r);
+	return r.count ? DBL2NUM(stats_peak(&r)) : Qnil;
+}
+
+static VALUE
+rb_pcm_rms(VALUE self)
+{
+	pcm_stats_result_t r;
+	
+	pcm_stats_of(get_pcm(self), CLIP_DEF, &r);
+	return r.count ? DBL2NUM(stats_rms(&r)) : Qnil;
+}
+
+static VALUE
+rb_pcm_dc(VALUE self)
+{
+	pcm_stats_result_t r;
+	
+	pcm_stats_of(get_pcm(self), CLIP_DEF, &r);
+	return r.count ? DBL2NUM(r.sum / r.count) : Qnil;
+}
+
+static VALUE
+rb_pcm_crest_factor(VALUE self)
+{
+	pcm_stats_result_t r;
+	
+	pcm_stats_of(get_pcm(self), CLIP_DEF, &r);
+	return r.count ? DBL2NUM(stats_peak(&r) / stats_rms(&r)) : Qnil;
+}
+
+static VALUE
+rb_pcm_zero_crossings(VALUE self)
+{
+	pcm_stats_result_t r;
+	
+	pcm_stats_of(get_pcm(self), CLIP_DEF, &r);
+	return LONG2NUM(r.zero_crossings);
+}
+
+static VALUE
+rb_pcm_clipped(int argc, VALUE *argv, VALUE self)
+{
+	pcm_stats_result_t r;
+	
+	rb_check_arity(argc, 0, 1);
+	pcm_stats_of(get_pcm(self), argc > 0 ? NUM2DBL(argv[0]) : CLIP_DEF, &r);
+	return LONG2NUM(r.clipped);
+}
+
+/*
+ *  call-seq:
+ *    pcm.min -> Float | nil
+ *    pcm.max -> Float | nil
+ *    pcm.minmax -> [Float, Float] | [nil, nil]
+ *  
+ *  Same as the methods of Enumerable, computed natively when neither an argument
+ *  nor a block is given.
+ */
+static VALUE
+rb_pcm_min(int argc, VALUE *argv, VALUE self)
+{
+	pcm_stats_result_t r;
+	
+	if (argc > 0 || rb_block_given_p())
+		return rb_call_super(argc, argv);
+	pcm_stats_of(get_pcm(self), CLIP_DEF, &r);
+	return r.count ? DBL2NUM(r.min) : Qnil;
+}
+
+static VALUE
+rb_pcm_max(int argc, VALUE *argv, VALUE self)
+{
+	pcm_stats_result_t r;
+	
+	if (argc > 0 || rb_block_given_p())
+		return rb_call_super(argc, argv);
+	pcm_stats_of(get_pcm(self), CLIP_DEF, &r);
+	return r.count ? DBL2NUM(r.max) : Qnil;
+}
+
+static VALUE
+rb_pcm_minmax(int argc, VALUE *argv, VALUE self)
+{
+	pcm_stats_result_t r;
+	
+	if (argc > 0 || rb_block_given_p())
+		return rb_call_super(argc, argv);
+	pcm_stats_of(get_pcm(self), CLIP_DEF, &r);
+	if (!r.count)
+		return rb_assoc_new(Qnil, Qnil);
+	return rb_assoc_new(DBL2NUM(r.min), DBL2NUM(r.max));
+}
+
+
+void
+InitVM_PCM(void)
+{
+	
+	rb_include_module(rb_cWavePCM, rb_mEnumerable);
+	rb_define_alloc_func(rb_cWavePCM, pcm_s_allocate);
+	
+	rb_define_const(rb_cWavePCM, "FS_DEF", LONG2NUM(FS_DEF));
+	
+	rb_define_method(rb_cWavePCM, "initialize", rb_pcm_initialize, -1);
+	
+	rb_define_method(rb_cWavePCM, "fs", rb_pcm_fs_get, 0);
+	rb_define_method(rb_cWavePCM, "fs=", rb_pcm_fs_set, 1);
+	rb_define_method(rb_cWavePCM, "dtype", rb_pcm_dtype_get, 0);
+	rb_define_method(rb_cWavePCM, "length", rb_pcm_len_get, 0);
+	rb_define_method(rb_cWavePCM, "length=", rb_pcm_len_set, 1);
+	rb_define_method(rb_cWavePCM, "[]", rb_pcm_snd_take, -1);
+	rb_define_method(rb_cWavePCM, "slice", rb_pcm_snd_take, -1);
+	
+	rb_define_method(rb_cWavePCM, "eql?", rb_pcm_eql, 1);
+	
+	rb_define_method(rb_cWavePCM, "each", rb_pcm_each, 0);
+	rb_define_method(rb_cWavePCM, "map!", rb_pcm_collect_bang, 0);
+	
+	rb_define_singleton_method(rb_cWavePCM, "from_array", rb_pcm_s_from_array, -1);
+	rb_define_method(rb_cWavePCM, "to_a", rb_pcm_to_a, 0);
+	rb_define_singleton_method(rb_cWavePCM, "from_binary", rb_pcm_s_from_binary, -1);
+	rb_define_method(rb_cWavePCM, "to_binary", rb_pcm_to_binary, -1);
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING
+	rb_define_singleton_method(rb_cWavePCM, "from_io_buffer", rb_pcm_s_from_io_buffer, -1);
+	rb_define_method(rb_cWavePCM, "to_io_buffer", rb_pcm_to_io_buffer, 0);
+#endif
+	
+	rb_define_method(rb_cWavePCM, "+", rb_pcm_plus, 1);
+	rb_define_method(rb_cWavePCM, "-", rb_pcm_minus, 1);
+	rb_define_method(rb_cWavePCM, "*", rb_pcm_mul, 1);
+	rb_define_method(rb_cWavePCM, "/", rb_pcm_div, 1);
+	rb_define_method(rb_cWavePCM, "add!", rb_pcm_add_bang, 1);
+	rb_define_method(rb_cWavePCM, "sub!", rb_pcm_sub_bang, 1);
+	rb_define_method(rb_cWavePCM, "mul!", rb_pcm_mul_bang, 1);
+	rb_define_method(rb_cWavePCM, "div!", rb_pcm_div_bang, 1);
+	rb_define_method(rb_cWavePCM, "scale!", rb_pcm_scale_bang, 1);
+	rb_define_method(rb_cWavePCM, "fma!", rb_pcm_fma_bang, 2);
+	rb_define_method(rb_cWavePCM, "-@", rb_pcm_negate, 0);
+	rb_define_method(rb_cWavePCM, "negate", rb_pcm_negate, 0);
+	rb_define_method(rb_cWavePCM, "negate!", rb_pcm_negate_bang, 0);
+	rb_define_method(rb_cWavePCM, "abs", rb_pcm_abs, 0);
+	rb_define_method(rb_cWavePCM, "abs!", rb_pcm_abs_bang, 0);
+	rb_define_method(rb_cWavePCM, "clip", rb_pcm_clip, -1);
+	rb_define_method(rb_cWavePCM, "clip!", rb_pcm_clip_bang, -1);
+	
+	rb_define_singleton_method(rb_cWavePCM, "stats", rb_pcm_s_stats, -1);
+	rb_define_method(rb_cWavePCM, "stats", rb_pcm_stats, -1);
+	rb_define_method(rb_cWavePCM, "peak", rb_pcm_peak, 0);
+	rb_define_method(rb_cWavePCM, "rms", rb_pcm_rms, 0);
+	rb_define_method(rb_cWavePCM, "dc", rb_pcm_dc, 0);
+	rb_define_method(rb_cWavePCM, "crest_factor", rb_pcm_crest_factor, 0);
+	rb_define_method(rb_cWavePCM, "zero_crossings", rb_pcm_zero_crossings, 0);
+	rb_define_method(rb_cWavePCM, "clipped", rb_pcm_clipped, -1);
+	rb_define_method(rb_cWavePCM, "min", rb_pcm_min, -1);
+	rb_define_method(rb_cWavePCM, "max", rb_pcm_max, -1);
+	rb_define_method(rb_cWavePCM, "minmax", rb_pcm_minmax, -1);
+}
+
+/*******************************************************************************
+	For C API
+*******************************************************************************/
+
+VALUE
+rb_pcm_new(long len, long fs)
+{
+	return rb_pcm_new2(len, fs, RB_PCM_F64);
+}
+
+VALUE
+rb_pcm_new2(long len, long fs, enum rb_pcm_dtype dtype)
+{
+	struct PCM *ptr;
+	VALUE obj = TypedData_Make_Struct(rb_cWavePCM, struct PCM, &pcm_data_type, ptr);
+	
+	ptr->owner = Qnil;
+	ptr->shared = false;
+	ptr->dtype = dtype;
+	pcm_resize(ptr, len);
+	pcm_fs_set(ptr, fs);
+	
+	return obj;
+}
+
+VALUE
+rb_pcm_wrap(double *s, long len, long fs, VALUE owner)
+{
+	struct PCM *ptr;
+	VALUE obj = TypedData_Make_Struct(rb_cWavePCM, struct PCM, &pcm_data_type, ptr);
+	
+	ptr->owner = Qnil;
+	ptr->shared = false;
+	if (NIL_P(owner))
+		rb_raise(rb_eArgError, "no owner of the samples");
+	if (len < 0)
+		rb_raise(rb_eRangeError, "negative (or biggest) sample size");
+	pcm_fs_set(ptr, fs);
+	ptr->dtype = RB_PCM_F64;
+	ptr->s = len > 0 ? s : NULL;
+	ptr->length = len;
+	ptr->owner = owner;
+	
+	return obj;
+}
+
+
+long
+rb_pcm_fs(VALUE pcm)
+{
+	struct PCM *ptr = get_pcm(pcm);
+	
+	return ptr->fs;
+}
+
+long
+rb_pcm_len(VALUE pcm)
+{
+	struct PCM *ptr = get_pcm(pcm);
+	
+	return ptr->length;
+}
+
+void
+rb_pcm_resize(VALUE pcm, long len)
+{
+	struct PCM *ptr = get_pcm(pcm);
+	
+	pcm_resize(ptr, len);
+}
+
+void
+rb_pcm_modify(VALUE pcm)
+{
+	struct PCM *ptr = get_pcm(pcm);
+	
+	pcm_modify(ptr);
+}
+
+void
+rb_pcm_set_fs(VALUE pcm, long fs)
+{
+	struct PCM *ptr = get_pcm(pcm);
+	
+	pcm_fs_set(ptr, fs);
+}
+
+long
+rb_pcm_capacity(VALUE pcm)
+{
+	struct PCM *ptr = get_pcm(pcm);
+	
+	return ptr->capa;
+}
+
+void
+rb_pcm_locktmp(VALUE pcm)
+{
+	struct PCM *ptr = get_pcm(pcm);
+	
+	ptr->lock++;
+}
+
+void
+rb_pcm_unlocktmp(VALUE pcm)
+{
+	struct PCM *ptr = get_pcm(pcm);
+	
+	if (ptr->lock == 0)
+		rb_raise(rb_eRuntimeError, "temporal unlocking already unlocked PCM");
+	ptr->lock--;
+}
+
+enum rb_pcm_dtype
+rb_pcm_dtype(VALUE pcm)
+{
+	struct PCM *ptr = get_pcm(pcm);
+	
+	return ptr->dtype;
+}
+
+double *
+rb_waveform_data_ptr(VALUE pcm)
+{
+	struct PCM *ptr = get_pcm(pcm);
+	
+	if (ptr->dtype != RB_PCM_F64)
+		rb_raise(rb_eTypeError, "not a PCM of dtype f64");
+	return ptr->s;
+}
+
+float *
+rb_waveform_data_ptr_f32(VALUE pcm)
 {
 	struct PCM *ptr = get_pcm(pcm);
 	
+	if (ptr->dtype != RB_PCM_F32)
+		rb_raise(rb_eTypeError, "not a PCM of dtype f32");
 	return ptr->s;
 }
@@ -0,0 +1,281 @@
+/*******************************************************************************
+	pcm_arith.c -- Element-wise arithmetic kernels
+
+	$author$
+
+	@license: MIT Licence
+
+	The arithmetic of Wave::PCM, over arrays of double (f64) or float (f32).
+	The loops run on SSE2, or on AVX when the CPU has it; the tail of each
+	array, and hosts with neither, run on the scalar loops.  Each lane does
+	exactly what the scalar loop does (the multiply-add is not fused), so all
+	the paths give bit-identical results.
+
+	+dst+ may be the same array as an operand.
+*******************************************************************************/
+#include <stddef.h>
+#include <math.h>
+#include "internal/algorithm/pcm_arith.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define PCM_ARITH_AVX
+# define TARGET_AVX  __attribute__((target("avx")))
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
+/*******************************************************************************
+	Scalar
+*******************************************************************************/
+
+#define SCALAR_KERNELS(T, sfx) \
+static void \
+scalar_vv_##sfx(enum pcm_arith_op op, T *d, const T *a, const T *b, long n) \
+{ \
+	switch (op) { \
+	case PCM_ARITH_ADD: for (long i = 0; i < n; i++) d[i] = a[i] + b[i]; break; \
+	case PCM_ARITH_SUB: for (long i = 0; i < n; i++) d[i] = a[i] - b[i]; break; \
+	case PCM_ARITH_MUL: for (long i = 0; i < n; i++) d[i] = a[i] * b[i]; break; \
+	case PCM_ARITH_DIV: for (long i = 0; i < n; i++) d[i] = a[i] / b[i]; break; \
+	default: break; \
+	} \
+} \
+\
+static void \
+scalar_vs_##sfx(enum pcm_arith_op op, T *d, const T *a, T b, long n) \
+{ \
+	switch (op) { \
+	case PCM_ARITH_ADD: for (long i = 0; i < n; i++) d[i] = a[i] + b; break; \
+	case PCM_ARITH_SUB: for (long i = 0; i < n; i++) d[i] = a[i] - b; break; \
+	case PCM_ARITH_MUL: for (long i = 0; i < n; i++) d[i] = a[i] * b; break; \
+	case PCM_ARITH_DIV: for (long i = 0; i < n; i++) d[i] = a[i] / b; break; \
+	default: break; \
+	} \
+} \
+\
+static void \
+scalar_unary_##sfx(enum pcm_arith_op op, T *d, const T *a, long n) \
+{ \
+	switch (op) { \
+	case PCM_ARITH_NEG: for (long i = 0; i < n; i++) d[i] = -a[i]; break; \
+	case PCM_ARITH_ABS: for (long i = 0; i < n; i++) d[i] = (T)fabs(a[i]); break; \
+	default: break; \
+	} \
+} \
+\
+static void \
+scalar_clip_##sfx(T *d, const T *a, T lo, T hi, long n) \
+{ \
+	for (long i = 0; i < n; i++) \
+	{ \
+		T x = a[i] > lo ? a[i] : lo; \
+		d[i] = x < hi ? x : hi; \
+	} \
+} \
+\
+static void \
+scalar_fma_##sfx(T *d, const T *a, const T *m, T ms, const T *c, T cs, long n) \
+{ \
+	if (m && c) \
+		for (long i = 0; i < n; i++) { T x = a[i] * m[i]; d[i] = x + c[i]; } \
+	else if (m) \
+		for (long i = 0; i < n; i++) { T x = a[i] * m[i]; d[i] = x + cs; } \
+	else if (c) \
+		for (long i = 0; i < n; i++) { T x = a[i] * ms; d[i] = x + c[i]; } \
+	else \
+		for (long i = 0; i < n; i++) { T x = a[i] * ms; d[i] = x + cs; } \
+}
+
+SCALAR_KERNELS(double, f64)
+SCALAR_KERNELS(float, f32)
+
+/*******************************************************************************
+	Vector loops
+
+	I(op) names the intrinsic of +op+ for a vector of L lanes of T, e.g.
+	_mm256_add_pd; the tail is left to the scalar loops.
+*******************************************************************************/
+
+#define VLOOP(L, body)  for (; i + (L) <= n; i += (L)) { body; }
+
+#define VECTOR_KERNELS(isa, TARGET, T, VT, L, I, sfx) \
+TARGET static void \
+isa##_vv_##sfx(enum pcm_arith_op op, T *d, const T *a, const T *b, long n) \
+{ \
+	long i = 0; \
+	switch (op) { \
+	case PCM_ARITH_ADD: VLOOP(L, I(storeu)(d + i, I(add)(I(loadu)(a + i), I(loadu)(b + i)))) break; \
+	case PCM_ARITH_SUB: VLOOP(L, I(storeu)(d + i, I(sub)(I(loadu)(a + i), I(loadu)(b + i)))) break; \
+	case PCM_ARITH_MUL: VLOOP(L, I(storeu)(d + i, I(mul)(I(loadu)(a + i), I(loadu)(b + i)))) break; \
+	case PCM_ARITH_DIV: VLOOP(L, I(storeu)(d + i, I(div)(I(loadu)(a + i), I(loadu)(b + i)))) break; \
+	default: break; \
+	} \
+	scalar_vv_##sfx(op, d + i, a + i, b + i, n - i); \
+} \
+\
+TARGET static void \
+isa##_vs_##sfx(enum pcm_arith_op op, T *d, const T *a, T b, long n) \
+{ \
+	const VT vb = I(set1)(b); \
+	long i = 0; \
+	switch (op) { \
+	case PCM_ARITH_ADD: VLOOP(L, I(storeu)(d + i, I(add)(I(loadu)(a + i), vb))) break; \
+	case PCM_ARITH_SUB: VLOOP(L, I(storeu)(d + i, I(sub)(I(loadu)(a + i), vb))) break; \
+	case PCM_ARITH_MUL: VLOOP(L, I(storeu)(d + i, I(mul)(I(loadu)(a + i), vb))) break; \
+	case PCM_ARITH_DIV: VLOOP(L, I(storeu)(d + i, I(div)(I(loadu)(a + i), vb))) break; \
+	default: break; \
+	} \
+	scalar_vs_##sfx(op, d + i, a + i, b, n - i); \
+} \
+\
+TARGET static void \
+isa##_unary_##sfx(enum pcm_arith_op op, T *d, const T *a, long n) \
+{ \
+	const VT sign = I(set1)((T)-0.0); \
+	long i = 0; \
+	switch (op) { \
+	case PCM_ARITH_NEG: VLOOP(L, I(storeu)(d + i, I(xor)(I(loadu)(a + i), sign))) break; \
+	case PCM_ARITH_ABS: VLOOP(L, I(storeu)(d + i, I(andnot)(sign, I(loadu)(a + i)))) break; \
+	default: break; \
+	} \
+	scalar_unary_##sfx(op, d + i, a + i, n - i); \
+} \
+\
+TARGET static void \
+isa##_clip_##sfx(T *d, const T *a, T lo, T hi, long n) \
+{ \
+	const VT vlo = I(set1)(lo), vhi = I(set1)(hi); \
+	long i = 0; \
+	VLOOP(L, I(storeu)(d + i, I(min)(I(max)(I(loadu)(a + i), vlo), vhi))) \
+	scalar_clip_##sfx(d + i, a + i, lo, hi, n - i); \
+} \
+\
+TARGET static void \
+isa##_fma_##sfx(T *d, const T *a, const T *m, T ms, const T *c, T cs, long n) \
+{ \
+	const VT vm = I(set1)(ms), vc = I(set1)(cs); \
+	long i = 0; \
+	if (m && c) \
+		VLOOP(L, I(storeu)(d + i, I(add)(I(mul)(I(loadu)(a + i), I(loadu)(m + i)), I(loadu)(c + i)))) \
+	else if (m) \
+		VLOOP(L, I(storeu)(d + i, I(add)(I(mul)(I(loadu)(a + i), I(loadu)(m + i)), vc))) \
+	else if (c) \
+		VLOOP(L, I(storeu)(d + i, I(add)(I(mul)(I(loadu)(a + i), vm), I(loadu)(c + i)))) \
+	else \
+		VLOOP(L, I(storeu)(d + i, I(add)(I(mul)(I(loadu)(a + i), vm), vc))) \
+	scalar_fma_##sfx(d + i, a + i, m ? m + i : NULL, ms, c ? c + i : NULL, cs, n - i); \
+}
+
+/*******************************************************************************
+	SSE2
+*******************************************************************************/
+#ifdef __SSE2__
+
+#define SSE2_PD(op)  _mm_##op##_pd
+#define SSE2_PS(op)  _mm_##op##_ps
+
+VECTOR_KERNELS(sse2, , double, __m128d, 2, SSE2_PD, f64)
+VECTOR_KERNELS(sse2, , float, __m128, 4, SSE2_PS, f32)
+
+#endif /* __SSE2__ */
+
+/*******************************************************************************
+	AVX, selected at run time
+*******************************************************************************/
+#ifdef PCM_ARITH_AVX
+
+static int
+cpu_has_avx(void)
+{
+	static int has_avx = -1;
+	if (has_avx < 0)
+	{
+		__builtin_cpu_init();
+		has_avx = __builtin_cpu_supports("avx") ? 1 : 0;
+	}
+	return has_avx;
+}
+
+#define AVX_PD(op)  _mm256_##op##_pd
+#define AVX_PS(op)  _mm256_##op##_ps
+
+VECTOR_KERNELS(avx, TARGET_AVX, double, __m256d, 4, AVX_PD, f64)
+VECTOR_KERNELS(avx, TARGET_AVX, float, __m256, 8, AVX_PS, f32)
+
+#endif /* PCM_ARITH_AVX */
+
+/*******************************************************************************
+	Entry points
+*******************************************************************************/
+
+#ifdef PCM_ARITH_AVX
+# define DISPATCH_AVX(call)  if (cpu_has_avx()) { avx_##call; return; }
+#else
+# define DISPATCH_AVX(call)
+#endif
+#ifdef __SSE2__
+# define DISPATCH(call)  DISPATCH_AVX(call) sse2_##call;
+#else
+# define DISPATCH(call)  DISPATCH_AVX(call) scalar_##call;
+#endif
+
+void
+pcm_arith_vv(enum pcm_arith_op op, double *dst, const double *a, const double *b, long n)
+{
+	DISPATCH(vv_f64(op, dst, a, b, n))
+}
+
+void
+pcm_arith_vs(enum pcm_arith_op op, double *dst, const double *a, double b, long n)
+{
+	DISPATCH(vs_f64(op, dst, a, b, n))
+}
+
+void
+pcm_arith_unary(enum pcm_arith_op op, double *dst, const double *a, long n)
+{
+	DISPATCH(unary_f64(op, dst, a, n))
+}
+
+void
+pcm_arith_clip(double *dst, const double *a, double lo, double hi, long n)
+{
+	DISPATCH(clip_f64(dst, a, lo, hi, n))
+}
+
+void
+pcm_arith_fma(double *dst, const double *a, const double *m, double ms, const double *c, double cs, long n)
+{
+	DISPATCH(fma_f64(dst, a, m, ms, c, cs, n))
+}
+
+void
+pcm_arith_vv_f32(enum pcm_arith_op op, float *dst, const float *a, const float *b, long n)
+{
+	DISPATCH(vv_f32(op, dst, a, b, n))
+}
+
+void
+pcm_arith_vs_f32(enum pcm_arith_op op, float *dst, const float *a, float b, long n)
+{
+	DISPATCH(vs_f32(op, dst, a, b, n))
+}
+
+void
+pcm_arith_unary_f32(enum pcm_arith_op op, float *dst, const float *a, long n)
+{
+	DISPATCH(unary_f32(op, dst, a, n))
+}
+
+void
+pcm_arith_clip_f32(float *dst, const float *a, float lo, float hi, long n)
+{
+	DISPATCH(clip_f32(dst, a, lo, hi, n))
+}
+
+void
+pcm_arith_fma_f32(float *dst, const float *a, const float *m, float ms, const float *c, float cs, long n)
+{
+	DISPATCH(fma_f32(dst, a, m, ms, c, cs, n))
+}
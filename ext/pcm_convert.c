@@ -0,0 +1,828 @@
+/*******************************************************************************
+	pcm_convert.c -- Sample format conversion kernels
+
+	$author$
+
+	@license: MIT Licence
+
+	Interleaved integer PCM is converted to planar doubles (and back) one
+	buffer at a time.  Mono and stereo run on SSE2, or on AVX2 when the CPU
+	has it, at every bit depth; the tail of each buffer runs on the scalar
+	loops.  All the paths give bit-identical results.
+
+	Three channels or more stay on the scalar loops: a channel is then a
+	strided walk through the buffer, and neither 4-lane scatters of a frame
+	nor AVX2 gathers along a channel measured faster than them.
+
+	IEEE float samples are copied as they are, with neither scaling nor
+	clipping; 64-bit mono is a plain memcpy() on little-endian hosts.  The
+	other float layouts are scalar.
+
+	The single precision (f32) entry points run the mono and stereo kernels
+	over up to 1024 samples at a time into doubles on the stack, narrowed
+	to float with SSE2 (or widened from it before encoding), which rounds
+	each sample once as the scalar conversions do.
+*******************************************************************************/
+#include <stdint.h>
+#include <string.h>
+#include "internal/algorithm/pcm_convert.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define PCM_CONVERT_AVX2
+# define TARGET_AVX2  __attribute__((target("avx2")))
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
+#define SCALE_8   (1.0 / 0x80)
+#define SCALE_16  (1.0 / 0x8000)
+#define SCALE_24  (1.0 / 0x800000)
+#define SCALE_32  (1.0 / 0x80000000)
+
+/*******************************************************************************
+	Scalar
+*******************************************************************************/
+
+static inline double
+pcm_decode1(const int bits, const unsigned char *p)
+{
+	switch (bits) {
+	case 8:
+		return ((int)p[0] - 0x80) * SCALE_8;
+	case 16:
+		return (int16_t)(p[0] | p[1] << 8) * SCALE_16;
+	case 24: {
+		int32_t data = p[0] | p[1] << 8 | p[2] << 16;
+		if (data & 0x800000)  data -= 0x1000000;
+		return data * SCALE_24;
+	}
+	default:
+		return (int32_t)((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+			(uint32_t)p[2] << 16 | (uint32_t)p[3] << 24) * SCALE_32;
+	}
+}
+
+static inline double
+fclip(double x, double min, double max)
+{
+	return x < min ? min : (x > max ? max : x);
+}
+
+static inline void
+pcm_encode1(const int bits, unsigned char *p, double x)
+{
+	if (x != x)  x = 0;
+	switch (bits) {
+	case 8:
+		p[0] = (unsigned char)(fclip(x * 0x80, INT8_MIN, INT8_MAX) + 0x80);
+		break;
+	case 16: {
+		int16_t bytes = (int16_t)fclip(x * 0x8000, INT16_MIN, INT16_MAX);
+		p[0] = bytes & 0xFF;
+		p[1] = (bytes >> 8) & 0xFF;
+		break;
+	}
+	case 24: {
+		int32_t bytes = (int32_t)fclip(x * 0x800000, -0x800000, 0x7FFFFF);
+		p[0] = bytes & 0xFF;
+		p[1] = (bytes >> 8) & 0xFF;
+		p[2] = (bytes >> 16) & 0xFF;
+		break;
+	}
+	default: {
+		int32_t bytes = (int32_t)fclip(x * 0x80000000, INT32_MIN, INT32_MAX);
+		p[0] = bytes & 0xFF;
+		p[1] = (bytes >> 8) & 0xFF;
+		p[2] = (bytes >> 16) & 0xFF;
+		p[3] = (bytes >> 24) & 0xFF;
+		break;
+	}
+	}
+}
+
+/* Frames [from, to) of every channel; +bits+ is a constant after inlining. */
+static inline void
+pcm_decode_scalar(const int bits, const unsigned char *buf, long from, long to, int channels, double **mat, long idx)
+{
+	const long sample_size = bits / 8;
+	const long block_size = sample_size * channels;
+
+	for (int c = 0; c < channels; c++)
+	{
+		const unsigned char *p = buf + from * block_size + c * sample_size;
+		double *s = mat[c] + idx;
+		for (long n = from; n < to; n++, p += block_size)
+			s[n] = pcm_decode1(bits, p);
+	}
+}
+
+static inline void
+pcm_encode_scalar(const int bits, unsigned char *buf, long from, long to, int channels, double **mat, long idx)
+{
+	const long sample_size = bits / 8;
+	const long block_size = sample_size * channels;
+
+	for (int c = 0; c < channels; c++)
+	{
+		unsigned char *p = buf + from * block_size + c * sample_size;
+		const double *s = mat[c] + idx;
+		for (long n = from; n < to; n++, p += block_size)
+			pcm_encode1(bits, p, s[n]);
+	}
+}
+
+static void
+pcm_decode_frames_scalar(int bits, const unsigned char *buf, long frames, int channels, double **mat, long idx)
+{
+	switch (bits) {
+	case 8:  pcm_decode_scalar(8, buf, 0, frames, channels, mat, idx);  break;
+	case 16: pcm_decode_scalar(16, buf, 0, frames, channels, mat, idx); break;
+	case 24: pcm_decode_scalar(24, buf, 0, frames, channels, mat, idx); break;
+	case 32: pcm_decode_scalar(32, buf, 0, frames, channels, mat, idx); break;
+	}
+}
+
+static void
+pcm_encode_frames_scalar(int bits, unsigned char *buf, long frames, int channels, double **mat, long idx)
+{
+	switch (bits) {
+	case 8:  pcm_encode_scalar(8, buf, 0, frames, channels, mat, idx);  break;
+	case 16: pcm_encode_scalar(16, buf, 0, frames, channels, mat, idx); break;
+	case 24: pcm_encode_scalar(24, buf, 0, frames, channels, mat, idx); break;
+	case 32: pcm_encode_scalar(32, buf, 0, frames, channels, mat, idx); break;
+	}
+}
+
+/*******************************************************************************
+	SSE2 (all bit depths)
+
+	A kernel step handles 4 consecutive samples: 4 frames of mono,
+	or 2 frames of stereo, which are [L0 R0 L1 R1] in the buffer.
+*******************************************************************************/
+#ifdef __SSE2__
+
+static inline __m128i
+sse2_load4_8(const unsigned char *p)
+{
+	const __m128i zero = _mm_setzero_si128();
+	int32_t t;
+	memcpy(&t, p, 4);
+	__m128i v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(t), zero), zero);
+	return _mm_sub_epi32(v, _mm_set1_epi32(0x80));
+}
+
+static inline __m128i
+sse2_load4_16(const unsigned char *p)
+{
+	__m128i v = _mm_loadl_epi64((const __m128i *)p);
+	return _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+}
+
+static inline __m128i
+sse2_load4_24(const unsigned char *p)
+{
+	int32_t t;
+	__m128i v;
+	memcpy(&t, p + 8, 4);
+	v = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)p), _mm_cvtsi32_si128(t));
+	// sample i to the low bytes of lane i, then to its top 3 bytes, where the arithmetic shift sign-extends it
+	v = _mm_unpacklo_epi64(_mm_unpacklo_epi32(v, _mm_srli_si128(v, 3)),
+		_mm_unpacklo_epi32(_mm_srli_si128(v, 6), _mm_srli_si128(v, 9)));
+	return _mm_srai_epi32(_mm_slli_epi32(v, 8), 8);
+}
+
+static inline __m128i
+sse2_load4_32(const unsigned char *p)
+{
+	return _mm_loadu_si128((const __m128i *)p);
+}
+
+static inline void
+sse2_store4_8(unsigned char *p, __m128i v)
+{
+	int32_t t = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(v, v), v));
+	memcpy(p, &t, 4);
+}
+
+static inline void
+sse2_store4_16(unsigned char *p, __m128i v)
+{
+	_mm_storel_epi64((__m128i *)p, _mm_packs_epi32(v, v));
+}
+
+static inline void
+sse2_store4_24(unsigned char *p, __m128i v)
+{
+	const __m128i m = _mm_setr_epi32(0xFFFFFF, 0, 0, 0);
+	int32_t t;
+	// the low 3 bytes of lane i move down by i bytes, next to those of lane i - 1
+	v = _mm_or_si128(_mm_or_si128(_mm_and_si128(v, m),
+			_mm_srli_si128(_mm_and_si128(v, _mm_slli_si128(m, 4)), 1)),
+		_mm_or_si128(_mm_srli_si128(_mm_and_si128(v, _mm_slli_si128(m, 8)), 2),
+			_mm_srli_si128(_mm_and_si128(v, _mm_slli_si128(m, 12)), 3)));
+	_mm_storel_epi64((__m128i *)p, v);
+	t = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+	memcpy(p + 8, &t, 4);
+}
+
+static inline void
+sse2_store4_32(unsigned char *p, __m128i v)
+{
+	_mm_storeu_si128((__m128i *)p, v);
+}
+
+/* x * rate, NaN to 0, clipped to [lo, hi], plus bias, truncated. */
+static inline __m128i
+sse2_quantize2(__m128d x, __m128d rate, __m128d lo, __m128d hi, __m128d bias)
+{
+	x = _mm_mul_pd(x, rate);
+	x = _mm_and_pd(x, _mm_cmpord_pd(x, x));
+	x = _mm_min_pd(_mm_max_pd(x, lo), hi);
+	return _mm_cvttpd_epi32(_mm_add_pd(x, bias));
+}
+
+#define SSE2_KERNELS(bits, lo, hi, bias) \
+static void \
+pcm_decode_sse2_##bits(const unsigned char *buf, long frames, int channels, double **mat, long idx) \
+{ \
+	const __m128d scale = _mm_set1_pd(SCALE_##bits); \
+	const unsigned char *p = buf; \
+	long n = 0; \
+	if (channels == 1) \
+	{ \
+		double *s = mat[0] + idx; \
+		for ( ; n + 4 <= frames; n += 4, p += 4 * (bits / 8)) \
+		{ \
+			__m128i v = sse2_load4_##bits(p); \
+			_mm_storeu_pd(s + n, _mm_mul_pd(_mm_cvtepi32_pd(v), scale)); \
+			_mm_storeu_pd(s + n + 2, _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(v, 8)), scale)); \
+		} \
+	} \
+	else \
+	{ \
+		double *l = mat[0] + idx, *r = mat[1] + idx; \
+		for ( ; n + 2 <= frames; n += 2, p += 4 * (bits / 8)) \
+		{ \
+			__m128i v = _mm_shuffle_epi32(sse2_load4_##bits(p), _MM_SHUFFLE(3, 1, 2, 0)); \
+			_mm_storeu_pd(l + n, _mm_mul_pd(_mm_cvtepi32_pd(v), scale)); \
+			_mm_storeu_pd(r + n, _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(v, 8)), scale)); \
+		} \
+	} \
+	pcm_decode_scalar(bits, buf, n, frames, channels, mat, idx); \
+} \
+\
+static void \
+pcm_encode_sse2_##bits(unsigned char *buf, long frames, int channels, double **mat, long idx) \
+{ \
+	const __m128d rate = _mm_set1_pd(1.0 / SCALE_##bits); \
+	const __m128d vlo = _mm_set1_pd(lo), vhi = _mm_set1_pd(hi), vbias = _mm_set1_pd(bias); \
+	unsigned char *p = buf; \
+	long n = 0; \
+	if (channels == 1) \
+	{ \
+		const double *s = mat[0] + idx; \
+		for ( ; n + 4 <= frames; n += 4, p += 4 * (bits / 8)) \
+		{ \
+			__m128i a = sse2_quantize2(_mm_loadu_pd(s + n), rate, vlo, vhi, vbias); \
+			__m128i b = sse2_quantize2(_mm_loadu_pd(s + n + 2), rate, vlo, vhi, vbias); \
+			sse2_store4_##bits(p, _mm_unpacklo_epi64(a, b)); \
+		} \
+	} \
+	else \
+	{ \
+		const double *l = mat[0] + idx, *r = mat[1] + idx; \
+		for ( ; n + 2 <= frames; n += 2, p += 4 * (bits / 8)) \
+		{ \
+			__m128i a = sse2_quantize2(_mm_loadu_pd(l + n), rate, vlo, vhi, vbias); \
+			__m128i b = sse2_quantize2(_mm_loadu_pd(r + n), rate, vlo, vhi, vbias); \
+			sse2_store4_##bits(p, _mm_unpacklo_epi32(a, b)); \
+		} \
+	} \
+	pcm_encode_scalar(bits, buf, n, frames, channels, mat, idx); \
+}
+
+SSE2_KERNELS(8, INT8_MIN, INT8_MAX, 0x80)
+SSE2_KERNELS(16, INT16_MIN, INT16_MAX, 0)
+SSE2_KERNELS(24, -0x800000, 0x7FFFFF, 0)
+SSE2_KERNELS(32, INT32_MIN, INT32_MAX, 0)
+
+#endif /* __SSE2__ */
+
+/*******************************************************************************
+	AVX2 (all bit depths), selected at run time
+*******************************************************************************/
+#ifdef PCM_CONVERT_AVX2
+
+static int
+cpu_has_avx2(void)
+{
+	static int has_avx2 = -1;
+	if (has_avx2 < 0)
+	{
+		__builtin_cpu_init();
+		has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+	}
+	return has_avx2;
+}
+
+TARGET_AVX2 static inline __m128i
+avx2_load4_8(const unsigned char *p)
+{
+	int32_t t;
+	memcpy(&t, p, 4);
+	return _mm_sub_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(t)), _mm_set1_epi32(0x80));
+}
+
+TARGET_AVX2 static inline __m128i
+avx2_load4_16(const unsigned char *p)
+{
+	return _mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i *)p));
+}
+
+TARGET_AVX2 static inline __m128i
+avx2_load4_24(const unsigned char *p)
+{
+	const __m128i mask = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+	int32_t t;
+	memcpy(&t, p + 8, 4);
+	// the 3 bytes go to the top of each lane, then the arithmetic shift sign-extends them
+	return _mm_srai_epi32(_mm_shuffle_epi8(_mm_insert_epi32(_mm_loadl_epi64((const __m128i *)p), t, 2), mask), 8);
+}
+
+TARGET_AVX2 static inline __m128i
+avx2_load4_32(const unsigned char *p)
+{
+	return _mm_loadu_si128((const __m128i *)p);
+}
+
+TARGET_AVX2 static inline void
+avx2_store4_8(unsigned char *p, __m128i v)
+{
+	int32_t t = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(v, v), v));
+	memcpy(p, &t, 4);
+}
+
+TARGET_AVX2 static inline void
+avx2_store4_16(unsigned char *p, __m128i v)
+{
+	_mm_storel_epi64((__m128i *)p, _mm_packs_epi32(v, v));
+}
+
+TARGET_AVX2 static inline void
+avx2_store4_24(unsigned char *p, __m128i v)
+{
+	const __m128i mask = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	int32_t t;
+	v = _mm_shuffle_epi8(v, mask);
+	_mm_storel_epi64((__m128i *)p, v);
+	t = _mm_extract_epi32(v, 2);
+	memcpy(p + 8, &t, 4);
+}
+
+TARGET_AVX2 static inline void
+avx2_store4_32(unsigned char *p, __m128i v)
+{
+	_mm_storeu_si128((__m128i *)p, v);
+}
+
+TARGET_AVX2 static inline __m128i
+avx2_quantize4(__m256d x, __m256d rate, __m256d lo, __m256d hi, __m256d bias)
+{
+	x = _mm256_mul_pd(x, rate);
+	x = _mm256_and_pd(x, _mm256_cmp_pd(x, x, _CMP_ORD_Q));
+	x = _mm256_min_pd(_mm256_max_pd(x, lo), hi);
+	return _mm256_cvttpd_epi32(_mm256_add_pd(x, bias));
+}
+
+#define AVX2_KERNELS(bits, lo, hi, bias) \
+TARGET_AVX2 static void \
+pcm_decode_avx2_##bits(const unsigned char *buf, long frames, int channels, double **mat, long idx) \
+{ \
+	const __m256d scale = _mm256_set1_pd(SCALE_##bits); \
+	const unsigned char *p = buf; \
+	long n = 0; \
+	if (channels == 1) \
+	{ \
+		double *s = mat[0] + idx; \
+		for ( ; n + 4 <= frames; n += 4, p += 4 * (bits / 8)) \
+			_mm256_storeu_pd(s + n, _mm256_mul_pd(_mm256_cvtepi32_pd(avx2_load4_##bits(p)), scale)); \
+	} \
+	else \
+	{ \
+		double *l = mat[0] + idx, *r = mat[1] + idx; \
+		for ( ; n + 2 <= frames; n += 2, p += 4 * (bits / 8)) \
+		{ \
+			__m128i v = _mm_shuffle_epi32(avx2_load4_##bits(p), _MM_SHUFFLE(3, 1, 2, 0)); \
+			__m256d d = _mm256_mul_pd(_mm256_cvtepi32_pd(v), scale); \
+			_mm_storeu_pd(l + n, _mm256_castpd256_pd128(d)); \
+			_mm_storeu_pd(r + n, _mm256_extractf128_pd(d, 1)); \
+		} \
+	} \
+	pcm_decode_scalar(bits, buf, n, frames, channels, mat, idx); \
+} \
+\
+TARGET_AVX2 static void \
+pcm_encode_avx2_##bits(unsigned char *buf, long frames, int channels, double **mat, long idx) \
+{ \
+	const __m256d rate = _mm256_set1_pd(1.0 / SCALE_##bits); \
+	const __m256d vlo = _mm256_set1_pd(lo), vhi = _mm256_set1_pd(hi), vbias = _mm256_set1_pd(bias); \
+	unsigned char *p = buf; \
+	long n = 0; \
+	if (channels == 1) \
+	{ \
+		const double *s = mat[0] + idx; \
+		for ( ; n + 4 <= frames; n += 4, p += 4 * (bits / 8)) \
+			avx2_store4_##bits(p, avx2_quantize4(_mm256_loadu_pd(s + n), rate, vlo, vhi, vbias)); \
+	} \
+	else \
+	{ \
+		const double *l = mat[0] + idx, *r = mat[1] + idx; \
+		for ( ; n + 2 <= frames; n += 2, p += 4 * (bits / 8)) \
+		{ \
+			__m256d d = _mm256_insertf128_pd(_mm256_castpd128_pd256(_mm_loadu_pd(l + n)), _mm_loadu_pd(r + n), 1); \
+			__m128i v = avx2_quantize4(d, rate, vlo, vhi, vbias); \
+			avx2_store4_##bits(p, _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 1, 2, 0))); \
+		} \
+	} \
+	pcm_encode_scalar(bits, buf, n, frames, channels, mat, idx); \
+}
+
+AVX2_KERNELS(8, INT8_MIN, INT8_MAX, 0x80)
+AVX2_KERNELS(16, INT16_MIN, INT16_MAX, 0)
+AVX2_KERNELS(24, -0x800000, 0x7FFFFF, 0)
+AVX2_KERNELS(32, INT32_MIN, INT32_MAX, 0)
+
+#endif /* PCM_CONVERT_AVX2 */
+
+/*******************************************************************************
+	IEEE float
+*******************************************************************************/
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+# define PCM_CONVERT_LITTLE_ENDIAN
+#endif
+
+static inline double
+float_decode1(const int bits, const unsigned char *p)
+{
+	if (bits == 32)
+	{
+		uint32_t u = (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+			(uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+		float f;
+		memcpy(&f, &u, sizeof(f));
+		return f;
+	}
+	else
+	{
+		uint64_t u = 0;
+		double d;
+		for (int i = 7; i >= 0; i--)
+			u = u << 8 | p[i];
+		memcpy(&d, &u, sizeof(d));
+		return d;
+	}
+}
+
+static inline void
+float_encode1(const int bits, unsigned char *p, double x)
+{
+	if (bits == 32)
+	{
+		float f = (float)x;
+		uint32_t u;
+		memcpy(&u, &f, sizeof(u));
+		for (int i = 0; i < 4; i++, u >>= 8)
+			p[i] = u & 0xFF;
+	}
+	else
+	{
+		uint64_t u;
+		memcpy(&u, &x, sizeof(u));
+		for (int i = 0; i < 8; i++, u >>= 8)
+			p[i] = u & 0xFF;
+	}
+}
+
+static inline void
+float_decode_frames(const int bits, const unsigned char *buf, long frames, int channels, double **mat, long idx)
+{
+	const long sample_size = bits / 8;
+	const long block_size = sample_size * channels;
+
+#ifdef PCM_CONVERT_LITTLE_ENDIAN
+	if (bits == 64 && channels == 1)
+	{
+		memcpy(mat[0] + idx, buf, frames * sizeof(double));
+		return;
+	}
+#endif
+	for (int c = 0; c < channels; c++)
+	{
+		const unsigned char *p = buf + c * sample_size;
+		double *s = mat[c] + idx;
+		for (long n = 0; n < frames; n++, p += block_size)
+			s[n] = float_decode1(bits, p);
+	}
+}
+
+static inline void
+float_encode_frames(const int bits, unsigned char *buf, long frames, int channels, double **mat, long idx)
+{
+	const long sample_size = bits / 8;
+	const long block_size = sample_size * channels;
+
+#ifdef PCM_CONVERT_LITTLE_ENDIAN
+	if (bits == 64 && channels == 1)
+	{
+		memcpy(buf, mat[0] + idx, frames * sizeof(double));
+		return;
+	}
+#endif
+	for (int c = 0; c < channels; c++)
+	{
+		unsigned char *p = buf + c * sample_size;
+		const double *s = mat[c] + idx;
+		for (long n = 0; n < frames; n++, p += block_size)
+			float_encode1(bits, p, s[n]);
+	}
+}
+
+/*******************************************************************************
+	Single precision
+*******************************************************************************/
+
+static inline void
+pcm_decode_f32(const int bits, const unsigned char *buf, long frames, int channels, float **mat, long idx)
+{
+	const long sample_size = bits / 8;
+	const long block_size = sample_size * channels;
+
+	for (int c = 0; c < channels; c++)
+	{
+		const unsigned char *p = buf + c * sample_size;
+		float *s = mat[c] + idx;
+		for (long n = 0; n < frames; n++, p += block_size)
+			s[n] = (float)pcm_decode1(bits, p);
+	}
+}
+
+static inline void
+pcm_encode_f32(const int bits, unsigned char *buf, long frames, int channels, float **mat, long idx)
+{
+	const long sample_size = bits / 8;
+	const long block_size = sample_size * channels;
+
+	for (int c = 0; c < channels; c++)
+	{
+		unsigned char *p = buf + c * sample_size;
+		const float *s = mat[c] + idx;
+		for (long n = 0; n < frames; n++, p += block_size)
+			pcm_encode1(bits, p, s[n]);
+	}
+}
+
+static inline void
+float_decode_f32(const int bits, const unsigned char *buf, long frames, int channels, float **mat, long idx)
+{
+	const long sample_size = bits / 8;
+	const long block_size = sample_size * channels;
+
+#ifdef PCM_CONVERT_LITTLE_ENDIAN
+	if (bits == 32 && channels == 1)
+	{
+		memcpy(mat[0] + idx, buf, frames * sizeof(float));
+		return;
+	}
+#endif
+	for (int c = 0; c < channels; c++)
+	{
+		const unsigned char *p = buf + c * sample_size;
+		float *s = mat[c] + idx;
+		for (long n = 0; n < frames; n++, p += block_size)
+			s[n] = (float)float_decode1(bits, p);
+	}
+}
+
+static inline void
+float_encode_f32(const int bits, unsigned char *buf, long frames, int channels, float **mat, long idx)
+{
+	const long sample_size = bits / 8;
+	const long block_size = sample_size * channels;
+
+#ifdef PCM_CONVERT_LITTLE_ENDIAN
+	if (bits == 32 && channels == 1)
+	{
+		memcpy(buf, mat[0] + idx, frames * sizeof(float));
+		return;
+	}
+#endif
+	for (int c = 0; c < channels; c++)
+	{
+		unsigned char *p = buf + c * sample_size;
+		const float *s = mat[c] + idx;
+		for (long n = 0; n < frames; n++, p += block_size)
+			float_encode1(bits, p, s[n]);
+	}
+}
+
+#ifdef __SSE2__
+
+#define PCM_STAGE_SIZE  1024  // doubles staged on the stack, for 1 or 2 channels
+
+/* d[i] = (float)s[i], rounded to nearest as by the cast */
+static void
+pcm_narrow(float *d, const double *s, long n)
+{
+	long i = 0;
+	for ( ; i + 4 <= n; i += 4)
+		_mm_storeu_ps(d + i, _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(s + i)), _mm_cvtpd_ps(_mm_loadu_pd(s + i + 2))));
+	for ( ; i < n; i++)
+		d[i] = (float)s[i];
+}
+
+static void
+pcm_widen(double *d, const float *s, long n)
+{
+	long i = 0;
+	for ( ; i + 4 <= n; i += 4)
+	{
+		__m128 v = _mm_loadu_ps(s + i);
+		_mm_storeu_pd(d + i, _mm_cvtps_pd(v));
+		_mm_storeu_pd(d + i + 2, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+	}
+	for ( ; i < n; i++)
+		d[i] = s[i];
+}
+
+/* Mono or stereo through the double kernels a few frames at a time, narrowed to float */
+static void
+pcm_decode_staged(int bits, const unsigned char *buf, long frames, int channels, float **mat, long idx)
+{
+	double stage[PCM_STAGE_SIZE], *sm[2];
+	const long step = PCM_STAGE_SIZE / channels;
+	const long block_size = bits / 8 * channels;
+
+	for (int c = 0; c < channels; c++)
+		sm[c] = stage + c * step;
+	for (long n = 0; n < frames; n += step)
+	{
+		const long k = frames - n < step ? frames - n : step;
+		pcm_decode_frames(bits, buf + n * block_size, k, channels, sm, 0);
+		for (int c = 0; c < channels; c++)
+			pcm_narrow(mat[c] + idx + n, sm[c], k);
+	}
+}
+
+static void
+pcm_encode_staged(int bits, unsigned char *buf, long frames, int channels, float **mat, long idx)
+{
+	double stage[PCM_STAGE_SIZE], *sm[2];
+	const long step = PCM_STAGE_SIZE / channels;
+	const long block_size = bits / 8 * channels;
+
+	for (int c = 0; c < channels; c++)
+		sm[c] = stage + c * step;
+	for (long n = 0; n < frames; n += step)
+	{
+		const long k = frames - n < step ? frames - n : step;
+		for (int c = 0; c < channels; c++)
+			pcm_widen(sm[c], mat[c] + idx + n, k);
+		pcm_encode_frames(bits, buf + n * block_size, k, channels, sm, 0);
+	}
+}
+
+#endif /* __SSE2__ */
+
+/*******************************************************************************
+	Entry points
+*******************************************************************************/
+
+void
+pcm_decode_frames(int bits, const unsigned char *buf, long frames, int channels, double **mat, long idx)
+{
+	if (channels <= 2)
+	{
+#ifdef PCM_CONVERT_AVX2
+		if (cpu_has_avx2())
+		{
+			switch (bits) {
+			case 8:  pcm_decode_avx2_8(buf, frames, channels, mat, idx);  return;
+			case 16: pcm_decode_avx2_16(buf, frames, channels, mat, idx); return;
+			case 24: pcm_decode_avx2_24(buf, frames, channels, mat, idx); return;
+			case 32: pcm_decode_avx2_32(buf, frames, channels, mat, idx); return;
+			}
+		}
+#endif
+#ifdef __SSE2__
+		switch (bits) {
+		case 8:  pcm_decode_sse2_8(buf, frames, channels, mat, idx);  return;
+		case 16: pcm_decode_sse2_16(buf, frames, channels, mat, idx); return;
+		case 24: pcm_decode_sse2_24(buf, frames, channels, mat, idx); return;
+		case 32: pcm_decode_sse2_32(buf, frames, channels, mat, idx); return;
+		}
+#endif
+	}
+	pcm_decode_frames_scalar(bits, buf, frames, channels, mat, idx);
+}
+
+void
+pcm_encode_frames(int bits, unsigned char *buf, long frames, int channels, double **mat, long idx)
+{
+	if (channels <= 2)
+	{
+#ifdef PCM_CONVERT_AVX2
+		if (cpu_has_avx2())
+		{
+			switch (bits) {
+			case 8:  pcm_encode_avx2_8(buf, frames, channels, mat, idx);  return;
+			case 16: pcm_encode_avx2_16(buf, frames, channels, mat, idx); return;
+			case 24: pcm_encode_avx2_24(buf, frames, channels, mat, idx); return;
+			case 32: pcm_encode_avx2_32(buf, frames, channels, mat, idx); return;
+			}
+		}
+#endif
+#ifdef __SSE2__
+		switch (bits) {
+		case 8:  pcm_encode_sse2_8(buf, frames, channels, mat, idx);  return;
+		case 16: pcm_encode_sse2_16(buf, frames, channels, mat, idx); return;
+		case 24: pcm_encode_sse2_24(buf, frames, channels, mat, idx); return;
+		case 32: pcm_encode_sse2_32(buf, frames, channels, mat, idx); return;
+		}
+#endif
+	}
+	pcm_encode_frames_scalar(bits, buf, frames, channels, mat, idx);
+}
+
+void
+pcm_decode_float_frames(int bits, const unsigned char *buf, long frames, int channels, double **mat, long idx)
+{
+	if (bits == 32)
+		float_decode_frames(32, buf, frames, channels, mat, idx);
+	else
+		float_decode_frames(64, buf, frames, channels, mat, idx);
+}
+
+void
+pcm_encode_float_frames(int bits, unsigned char *buf, long frames, int channels, double **mat, long idx)
+{
+	if (bits == 32)
+		float_encode_frames(32, buf, frames, channels, mat, idx);
+	else
+		float_encode_frames(64, buf, frames, channels, mat, idx);
+}
+
+void
+pcm_decode_frames_f32(int bits, const unsigned char *buf, long frames, int channels, float **mat, long idx)
+{
+#ifdef __SSE2__
+	if (channels <= 2)
+	{
+		pcm_decode_staged(bits, buf, frames, channels, mat, idx);
+		return;
+	}
+#endif
+	switch (bits) {
+	case 8:  pcm_decode_f32(8, buf, frames, channels, mat, idx);  break;
+	case 16: pcm_decode_f32(16, buf, frames, channels, mat, idx); break;
+	case 24: pcm_decode_f32(24, buf, frames, channels, mat, idx); break;
+	case 32: pcm_decode_f32(32, buf, frames, channels, mat, idx); break;
+	}
+}
+
+void
+pcm_encode_frames_f32(int bits, unsigned char *buf, long frames, int channels, float **mat, long idx)
+{
+#ifdef __SSE2__
+	if (channels <= 2)
+	{
+		pcm_encode_staged(bits, buf, frames, channels, mat, idx);
+		return;
+	}
+#endif
+	switch (bits) {
+	case 8:  pcm_encode_f32(8, buf, frames, channels, mat, idx);  break;
+	case 16: pcm_encode_f32(16, buf, frames, channels, mat, idx); break;
+	case 24: pcm_encode_f32(24, buf, frames, channels, mat, idx); break;
+	case 32: pcm_encode_f32(32, buf, frames, channels, mat, idx); break;
+	}
+}
+
+void
+pcm_decode_float_frames_f32(int bits, const unsigned char *buf, long frames, int channels, float **mat, long idx)
+{
+	if (bits == 32)
+		float_decode_f32(32, buf, frames, channels, mat, idx);
+	else
+		float_decode_f32(64, buf, frames, channels, mat, idx);
+}
+
+void
+pcm_encode_float_frames_f32(int bits, unsigned char *buf, long frames, int channels, float **mat, long idx)
+{
+	if (bits == 32)
+		float_encode_f32(32, buf, frames, channels, mat, idx);
+	else
+		float_encode_f32(64, buf, frames, channels, mat, idx);
+}
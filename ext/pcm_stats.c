@@ -0,0 +1,391 @@
+/*******************************************************************************
+	pcm_stats.c -- One-pass statistics kernels
+
+	$author$
+
+	@license: MIT Licence
+
+	Min, max, sum, sum of squares, zero crossings and clipped samples are
+	gathered in a single pass.  The samples are dealt to four lanes in turn,
+	each with its own min and max and its own Kahan-compensated sums, which
+	pcm_stats_finish() merges in a fixed order.  The lanes map onto an AVX
+	register, or two SSE2 ones, or plain arrays on the scalar loops; since the
+	lanes do the same operations in the same order on every path, the results
+	do not depend on the instruction set, nor on how the samples are split
+	between calls to pcm_stats_update().
+*******************************************************************************/
+#include <math.h>
+#include "internal/algorithm/pcm_stats.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define PCM_STATS_AVX
+# define TARGET_AVX  __attribute__((target("avx")))
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
+void
+pcm_stats_init(pcm_stats_t *st, double clip)
+{
+	st->count = 0;
+	st->prev = 0.0;
+	for (int k = 0; k < PCM_STATS_LANES; k++)
+	{
+		st->min[k] = HUGE_VAL;
+		st->max[k] = -HUGE_VAL;
+		st->sum[k] = st->sum_c[k] = 0.0;
+		st->sq[k] = st->sq_c[k] = 0.0;
+	}
+	st->zero_crossings = 0;
+	st->clipped = 0;
+	st->clip = clip;
+}
+
+/*******************************************************************************
+	Scalar
+*******************************************************************************/
+
+static inline void
+kahan_add(double *sum, double *c, double x)
+{
+	const double y = x - *c;
+	const double t = *sum + y;
+	*c = (t - *sum) - y;
+	*sum = t;
+}
+
+static inline void
+stats1(pcm_stats_t *st, double x)
+{
+	const int k = (int)(st->count % PCM_STATS_LANES);
+
+	st->min[k] = x < st->min[k] ? x : st->min[k];
+	st->max[k] = x > st->max[k] ? x : st->max[k];
+	kahan_add(&st->sum[k], &st->sum_c[k], x);
+	kahan_add(&st->sq[k], &st->sq_c[k], x * x);
+	if (st->count > 0 && (x < 0) != (st->prev < 0))
+		st->zero_crossings++;
+	if (fabs(x) >= st->clip)
+		st->clipped++;
+	st->prev = x;
+	st->count++;
+}
+
+/*
+ * Takes samples one by one until the lanes are aligned and the previous
+ * sample can be read from +s+, leaving +i+ at the one to go on from.
+ */
+#define STATS_PROLOGUE(st, s, n) \
+	long i = 0; \
+	while (i < (n) && (i == 0 || (st)->count % PCM_STATS_LANES)) \
+		stats1((st), (s)[i++]);
+
+#define STATS_EPILOGUE(st, s, n) \
+	while (i < (n)) \
+		stats1((st), (s)[i++]);
+
+#ifndef __SSE2__
+static void
+scalar_update_f64(pcm_stats_t *st, const double *s, long n)
+{
+	for (long i = 0; i < n; i++)
+		stats1(st, s[i]);
+}
+
+static void
+scalar_update_f32(pcm_stats_t *st, const float *s, long n)
+{
+	for (long i = 0; i < n; i++)
+		stats1(st, s[i]);
+}
+#endif
+
+/*******************************************************************************
+	SSE2: lanes 0-1 and 2-3 in two registers
+*******************************************************************************/
+#ifdef __SSE2__
+
+struct sse2_acc {
+	__m128d min[2], max[2], sum[2], sum_c[2], sq[2], sq_c[2];
+	__m128d zero, sign, clip;
+};
+
+static inline void
+sse2_kahan(__m128d *sum, __m128d *c, __m128d x)
+{
+	const __m128d y = _mm_sub_pd(x, *c);
+	const __m128d t = _mm_add_pd(*sum, y);
+	*c = _mm_sub_pd(_mm_sub_pd(t, *sum), y);
+	*sum = t;
+}
+
+static inline void
+sse2_load(struct sse2_acc *a, const pcm_stats_t *st)
+{
+	for (int h = 0; h < 2; h++)
+	{
+		a->min[h] = _mm_loadu_pd(st->min + 2 * h);
+		a->max[h] = _mm_loadu_pd(st->max + 2 * h);
+		a->sum[h] = _mm_loadu_pd(st->sum + 2 * h);
+		a->sum_c[h] = _mm_loadu_pd(st->sum_c + 2 * h);
+		a->sq[h] = _mm_loadu_pd(st->sq + 2 * h);
+		a->sq_c[h] = _mm_loadu_pd(st->sq_c + 2 * h);
+	}
+	a->zero = _mm_setzero_pd();
+	a->sign = _mm_set1_pd(-0.0);
+	a->clip = _mm_set1_pd(st->clip);
+}
+
+static inline void
+sse2_store(const struct sse2_acc *a, pcm_stats_t *st)
+{
+	for (int h = 0; h < 2; h++)
+	{
+		_mm_storeu_pd(st->min + 2 * h, a->min[h]);
+		_mm_storeu_pd(st->max + 2 * h, a->max[h]);
+		_mm_storeu_pd(st->sum + 2 * h, a->sum[h]);
+		_mm_storeu_pd(st->sum_c + 2 * h, a->sum_c[h]);
+		_mm_storeu_pd(st->sq + 2 * h, a->sq[h]);
+		_mm_storeu_pd(st->sq_c + 2 * h, a->sq_c[h]);
+	}
+}
+
+/* Lanes 2h and 2h+1 take +x+, whose previous samples are +xp+. */
+static inline void
+sse2_step(struct sse2_acc *a, int h, __m128d x, __m128d xp, pcm_stats_t *st)
+{
+	const __m128d neg = _mm_cmplt_pd(x, a->zero);
+	const __m128d neg_prev = _mm_cmplt_pd(xp, a->zero);
+	const __m128d clipped = _mm_cmpge_pd(_mm_andnot_pd(a->sign, x), a->clip);
+
+	a->min[h] = _mm_min_pd(x, a->min[h]);
+	a->max[h] = _mm_max_pd(x, a->max[h]);
+	sse2_kahan(&a->sum[h], &a->sum_c[h], x);
+	sse2_kahan(&a->sq[h], &a->sq_c[h], _mm_mul_pd(x, x));
+	st->zero_crossings += __builtin_popcount(_mm_movemask_pd(_mm_xor_pd(neg, neg_prev)));
+	st->clipped += __builtin_popcount(_mm_movemask_pd(clipped));
+}
+
+static void
+sse2_update_f64(pcm_stats_t *st, const double *s, long n)
+{
+	struct sse2_acc a;
+	STATS_PROLOGUE(st, s, n)
+
+	sse2_load(&a, st);
+	for (; i + 4 <= n; i += 4)
+	{
+		sse2_step(&a, 0, _mm_loadu_pd(s + i), _mm_loadu_pd(s + i - 1), st);
+		sse2_step(&a, 1, _mm_loadu_pd(s + i + 2), _mm_loadu_pd(s + i + 1), st);
+		st->count += 4;
+		st->prev = s[i + 3];
+	}
+	sse2_store(&a, st);
+	STATS_EPILOGUE(st, s, n)
+}
+
+static void
+sse2_update_f32(pcm_stats_t *st, const float *s, long n)
+{
+	struct sse2_acc a;
+	STATS_PROLOGUE(st, s, n)
+
+	sse2_load(&a, st);
+	for (; i + 4 <= n; i += 4)
+	{
+		const __m128 x = _mm_loadu_ps(s + i);
+		const __m128 xp = _mm_loadu_ps(s + i - 1);
+		sse2_step(&a, 0, _mm_cvtps_pd(x), _mm_cvtps_pd(xp), st);
+		sse2_step(&a, 1, _mm_cvtps_pd(_mm_movehl_ps(x, x)), _mm_cvtps_pd(_mm_movehl_ps(xp, xp)), st);
+		st->count += 4;
+		st->prev = s[i + 3];
+	}
+	sse2_store(&a, st);
+	STATS_EPILOGUE(st, s, n)
+}
+
+#endif /* __SSE2__ */
+
+/*******************************************************************************
+	AVX: the four lanes in one register, selected at run time
+*******************************************************************************/
+#ifdef PCM_STATS_AVX
+
+static int
+cpu_has_avx(void)
+{
+	static int has_avx = -1;
+	if (has_avx < 0)
+	{
+		__builtin_cpu_init();
+		has_avx = __builtin_cpu_supports("avx") ? 1 : 0;
+	}
+	return has_avx;
+}
+
+struct avx_acc {
+	__m256d min, max, sum, sum_c, sq, sq_c;
+	__m256d zero, sign, clip;
+};
+
+TARGET_AVX static inline void
+avx_kahan(__m256d *sum, __m256d *c, __m256d x)
+{
+	const __m256d y = _mm256_sub_pd(x, *c);
+	const __m256d t = _mm256_add_pd(*sum, y);
+	*c = _mm256_sub_pd(_mm256_sub_pd(t, *sum), y);
+	*sum = t;
+}
+
+TARGET_AVX static inline void
+avx_load(struct avx_acc *a, const pcm_stats_t *st)
+{
+	a->min = _mm256_loadu_pd(st->min);
+	a->max = _mm256_loadu_pd(st->max);
+	a->sum = _mm256_loadu_pd(st->sum);
+	a->sum_c = _mm256_loadu_pd(st->sum_c);
+	a->sq = _mm256_loadu_pd(st->sq);
+	a->sq_c = _mm256_loadu_pd(st->sq_c);
+	a->zero = _mm256_setzero_pd();
+	a->sign = _mm256_set1_pd(-0.0);
+	a->clip = _mm256_set1_pd(st->clip);
+}
+
+TARGET_AVX static inline void
+avx_store(const struct avx_acc *a, pcm_stats_t *st)
+{
+	_mm256_storeu_pd(st->min, a->min);
+	_mm256_storeu_pd(st->max, a->max);
+	_mm256_storeu_pd(st->sum, a->sum);
+	_mm256_storeu_pd(st->sum_c, a->sum_c);
+	_mm256_storeu_pd(st->sq, a->sq);
+	_mm256_storeu_pd(st->sq_c, a->sq_c);
+}
+
+TARGET_AVX static inline void
+avx_step(struct avx_acc *a, __m256d x, __m256d xp, pcm_stats_t *st)
+{
+	const __m256d neg = _mm256_cmp_pd(x, a->zero, _CMP_LT_OQ);
+	const __m256d neg_prev = _mm256_cmp_pd(xp, a->zero, _CMP_LT_OQ);
+	const __m256d clipped = _mm256_cmp_pd(_mm256_andnot_pd(a->sign, x), a->clip, _CMP_GE_OQ);
+
+	a->min = _mm256_min_pd(x, a->min);
+	a->max = _mm256_max_pd(x, a->max);
+	avx_kahan(&a->sum, &a->sum_c, x);
+	avx_kahan(&a->sq, &a->sq_c, _mm256_mul_pd(x, x));
+	st->zero_crossings += __builtin_popcount(_mm256_movemask_pd(_mm256_xor_pd(neg, neg_prev)));
+	st->clipped += __builtin_popcount(_mm256_movemask_pd(clipped));
+}
+
+TARGET_AVX static void
+avx_update_f64(pcm_stats_t *st, const double *s, long n)
+{
+	struct avx_acc a;
+	STATS_PROLOGUE(st, s, n)
+
+	avx_load(&a, st);
+	for (; i + 4 <= n; i += 4)
+	{
+		avx_step(&a, _mm256_loadu_pd(s + i), _mm256_loadu_pd(s + i - 1), st);
+		st->count += 4;
+		st->prev = s[i + 3];
+	}
+	avx_store(&a, st);
+	STATS_EPILOGUE(st, s, n)
+}
+
+TARGET_AVX static void
+avx_update_f32(pcm_stats_t *st, const float *s, long n)
+{
+	struct avx_acc a;
+	STATS_PROLOGUE(st, s, n)
+
+	avx_load(&a, st);
+	for (; i + 4 <= n; i += 4)
+	{
+		avx_step(&a, _mm256_cvtps_pd(_mm_loadu_ps(s + i)), _mm256_cvtps_pd(_mm_loadu_ps(s + i - 1)), st);
+		st->count += 4;
+		st->prev = s[i + 3];
+	}
+	avx_store(&a, st);
+	STATS_EPILOGUE(st, s, n)
+}
+
+#endif /* PCM_STATS_AVX */
+
+/*******************************************************************************
+	Entry points
+*******************************************************************************/
+
+void
+pcm_stats_update(pcm_stats_t *st, const double *s, long n)
+{
+#ifdef PCM_STATS_AVX
+	if (cpu_has_avx())
+	{
+		avx_update_f64(st, s, n);
+		return;
+	}
+#endif
+#ifdef __SSE2__
+	sse2_update_f64(st, s, n);
+#else
+	scalar_update_f64(st, s, n);
+#endif
+}
+
+void
+pcm_stats_update_f32(pcm_stats_t *st, const float *s, long n)
+{
+#ifdef PCM_STATS_AVX
+	if (cpu_has_avx())
+	{
+		avx_update_f32(st, s, n);
+		return;
+	}
+#endif
+#ifdef __SSE2__
+	sse2_update_f32(st, s, n);
+#else
+	scalar_update_f32(st, s, n);
+#endif
+}
+
+/*
+ * Neumaier's sum of the lane sums and their compensations.
+ */
+static double
+lanes_sum(const double *sum, const double *c)
+{
+	double total = 0.0, comp = 0.0;
+
+	for (int k = 0; k < 2 * PCM_STATS_LANES; k++)
+	{
+		const double x = k < PCM_STATS_LANES ? sum[k] : -c[k - PCM_STATS_LANES];
+		const double t = total + x;
+		if (fabs(total) >= fabs(x))
+			comp += (total - t) + x;
+		else
+			comp += (x - t) + total;
+		total = t;
+	}
+	return total + comp;
+}
+
+void
+pcm_stats_finish(const pcm_stats_t *st, pcm_stats_result_t *r)
+{
+	r->count = st->count;
+	r->min = st->min[0];
+	r->max = st->max[0];
+	for (int k = 1; k < PCM_STATS_LANES; k++)
+	{
+		r->min = st->min[k] < r->min ? st->min[k] : r->min;
+		r->max = st->max[k] > r->max ? st->max[k] : r->max;
+	}
+	r->sum = lanes_sum(st->sum, st->sum_c);
+	r->sum_sq = lanes_sum(st->sq, st->sq_c);
+	r->zero_crossings = st->zero_crossings;
+	r->clipped = st->clipped;
+}
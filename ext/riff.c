@@ -10,8 +10,30 @@
 #include <ruby/io.h>
 #include "ruby/wave/globals.h"
 #include "ruby/wave/pcm.h"
-#include "internal/riffchunk.h"
+#include "ruby/wave/frames.h"
+#include "internal/riff.h"
+#include "internal/pcm.h"
+#include "internal/frames.h"
+#include "internal/algorithm/pcm_convert.h"
+#include "internal/parallel.h"
 #include <stdint.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#include <errno.h>
+#include <ruby/thread.h>
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING
+#include <ruby/io/buffer.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
 
 #define SupportedVersion "1.0.0"
 
@@ -26,519 +48,1631 @@ struct RIFF {
 
 
 
-static uint16_t
-dbyte2u16le(VALUE bytes)
+static inline void
+must_be_nonzero_error(const char *memb)
 {
-	unsigned char *ptr = (unsigned char *)StringValuePtr(bytes);
-	uint16_t size = ptr[0] | ptr[1] << 8;
-	return size;
+	rb_raise(rb_eWaveSemanticError, "'%s' must be non-zero", memb);
 }
 
-static uint32_t
-qbyte2u32le(VALUE bytes)
+void
+wave_fmt_check(const FormatChunk *fmt)
 {
-	unsigned char *ptr = (unsigned char *)StringValuePtr(bytes);
-	uint32_t size = ptr[0] | ptr[1] << 8 | ptr[2] << 16 | ptr[3] << 24;
-	return size;
+	switch (WAVE_FORMAT_TAG(fmt)) {
+	case WAVE_FORMAT_PCM: case WAVE_FORMAT_IEEE_FLOAT:
+		break;
+	case 0:
+		if (fmt->format_tag == WAVE_FORMAT_EXTENSIBLE)
+			rb_raise(rb_eWaveSemanticError, "unsupported sub format GUID");
+		/* FALLTHROUGH */
+	default:
+		rb_raise(rb_eWaveSemanticError, "not a linear PCM nor IEEE float (format tag: 0x%04x)", 
+			WAVE_FORMAT_TAG(fmt));
+	}
+	if (!fmt->channels)
+		must_be_nonzero_error("channels");
+	if (!fmt->samples_per_sec)
+		must_be_nonzero_error("samples_per_sec");
+	if (!fmt->bytes_per_sec)
+		must_be_nonzero_error("bytes_per_sec");
+	if (!fmt->block_size)
+		must_be_nonzero_error("block_size");
+	if (!fmt->bits_per_sample)
+		must_be_nonzero_error("bits_per_sample");
+	
+	if ((fmt->bits_per_sample / 8 * fmt->channels) != fmt->block_size)
+		rb_raise(rb_eWaveSemanticError, "'block_size' mismatch");
+	
+	if ((fmt->samples_per_sec * fmt->block_size) != fmt->bytes_per_sec)
+		rb_raise(rb_eWaveSemanticError, "'bytes_per_sec' mismatch");
+	
+	if (fmt->valid_bits_per_sample > fmt->bits_per_sample)
+		rb_raise(rb_eWaveSemanticError, "'valid_bits_per_sample' exceeds 'bits_per_sample'");
+	
+	wave_bits_check(fmt);
 }
 
-
+/*
+ * Unpack the first +size+ bytes (at least 16) of a 'fmt ' chunk body.
+ * The WAVE_FORMAT_EXTENSIBLE fields need the whole 40 bytes; a sub format
+ * GUID out of the KSDATAFORMAT_SUBTYPE family leaves 'sub_format' 0.
+ */
 void
-pcm_read_8bit(unsigned char buf[], double s[])
+wave_fmt_unpack(const unsigned char *ptr, uint32_t size, FormatChunk *fmt)
 {
-	char data = (buf[0] - 0x80);
-	*s = data / (double)0x80;
+	fmt->format_tag = u16le(ptr);
+	fmt->channels = u16le(ptr+2);
+	fmt->samples_per_sec = u32le(ptr+4);
+	fmt->bytes_per_sec = u32le(ptr+8);
+	fmt->block_size = u16le(ptr+12);
+	fmt->bits_per_sample = u16le(ptr+14);
+	
+	fmt->valid_bits_per_sample = fmt->bits_per_sample;
+	fmt->channel_mask = 0;
+	fmt->sub_format = fmt->format_tag;
+	if (fmt->format_tag == WAVE_FORMAT_EXTENSIBLE)
+	{
+		if (size < 40 || u16le(ptr+16) < 22)
+			rb_raise(rb_eWaveSemanticError, "truncated extensible format chunk");
+		fmt->valid_bits_per_sample = u16le(ptr+18);
+		fmt->channel_mask = u32le(ptr+20);
+		if (memcmp(ptr+26, SUB_FORMAT_GUID_PCM+2, 14) == 0)
+			fmt->sub_format = u16le(ptr+24);
+		else
+			fmt->sub_format = 0;
+	}
 }
 
-
 void
-pcm_read_16bit(unsigned char buf[], double s[])
+wave_bits_check(const FormatChunk *fmt)
 {
-	int16_t data = (int16_t)(buf[0] | buf[1] << 8);
-	*s = data / (double)0x8000;
+	if (WAVE_FORMAT_TAG(fmt) == WAVE_FORMAT_IEEE_FLOAT)
+	{
+		switch (fmt->bits_per_sample) {
+		case 32: case 64:
+			return;
+		}
+	}
+	else
+	{
+		switch (fmt->bits_per_sample) {
+		case 8: case 16: case 24: case 32:
+			return;
+		}
+	}
+	rb_raise(rb_eWaveSemanticError, 
+		"unrecognized (or unsupported) bits per sample: %d (for wave format type: %d)", 
+		fmt->bits_per_sample, WAVE_FORMAT_TAG(fmt));
 }
 
+/*
+ * Deinterleave +frames+ blocks of +buf+ into the channel arrays of +mat+,
+ * starting at the sample index +idx+.
+ */
 void
-pcm_read_24bit(unsigned char buf[], double s[])
+wave_decode_frames(const FormatChunk *fmt, const unsigned char *buf, long frames, double **mat, long idx)
 {
-	 int data = (buf[0] | buf[1] << 8 | buf[2] << 16);
-	 if (data & 0x800000)  data -= 0x1000000;
-	*s = data / (double)0x800000;
+	if (WAVE_FORMAT_TAG(fmt) == WAVE_FORMAT_IEEE_FLOAT)
+		pcm_decode_float_frames(fmt->bits_per_sample, buf, frames, fmt->channels, mat, idx);
+	else
+		pcm_decode_frames(fmt->bits_per_sample, buf, frames, fmt->channels, mat, idx);
 }
 
 void
-pcm_read_32bit(unsigned char buf[], double s[])
+wave_decode_frames_dtype(const FormatChunk *fmt, const unsigned char *buf, long frames, 
+	enum rb_pcm_dtype dtype, void **mat, long idx)
 {
-	int32_t data = (int32_t)(buf[0] | buf[1] << 8 | buf[2] << 16 | buf[3] << 24);
-	*s = data / (double)0x80000000;
+	if (dtype == RB_PCM_F64)
+		wave_decode_frames(fmt, buf, frames, (double **)mat, idx);
+	else if (WAVE_FORMAT_TAG(fmt) == WAVE_FORMAT_IEEE_FLOAT)
+		pcm_decode_float_frames_f32(fmt->bits_per_sample, buf, frames, fmt->channels, (float **)mat, idx);
+	else
+		pcm_decode_frames_f32(fmt->bits_per_sample, buf, frames, fmt->channels, (float **)mat, idx);
 }
 
-static inline void
-must_be_nonzero_error(const char *memb)
+void *
+wave_pcm_data_ptr(VALUE pcm)
 {
-	rb_raise(rb_eWaveSemanticError, "'%s' must be non-zero", memb);
+	if (rb_pcm_dtype(pcm) == RB_PCM_F32)
+		return rb_waveform_data_ptr_f32(pcm);
+	return rb_waveform_data_ptr(pcm);
+}
+
+static VALUE
+wave_pcm_ary_new(const FormatChunk *fmt, long length, enum rb_pcm_dtype dtype, void **mat)
+{
+	VALUE pcm_ary = rb_ary_new2(fmt->channels);
+	for (long i = 0; i < fmt->channels; i++)
+	{
+		VALUE obj = rb_pcm_new2(length, fmt->samples_per_sec, dtype);
+		rb_ary_store(pcm_ary, i, obj);
+		mat[i] = wave_pcm_data_ptr(obj);
+	}
+	return pcm_ary;
+}
+
+/*
+ * The dtype shared by the Wave::PCM objects of +pcm_ary+.
+ */
+static enum rb_pcm_dtype
+wave_pcm_ary_dtype(VALUE pcm_ary)
+{
+	enum rb_pcm_dtype dtype = RB_PCM_F64;
+	
+	for (long i = 0; i < RARRAY_LEN(pcm_ary); i++)
+	{
+		enum rb_pcm_dtype d = rb_pcm_dtype(RARRAY_AREF(pcm_ary, i));
+		if (i == 0)
+			dtype = d;
+		else if (d != dtype)
+			rb_raise(rb_eArgError, "each channel must have the same dtype");
+	}
+	return dtype;
+}
+
+/*
+ * Resize each Wave::PCM of +pcm_ary+ to +length+ samples at the sampling
+ * frequency of +fmt+, and store their samples in +mat+. The storage is
+ * reallocated only for a Wave::PCM which has never held +length+ samples.
+ */
+static void
+wave_pcm_ary_reuse(VALUE pcm_ary, const FormatChunk *fmt, long length, void **mat)
+{
+	if (RARRAY_LEN(pcm_ary) != fmt->channels)
+		rb_raise(rb_eArgError, "wrong number of channels (given %ld, expected %d)",
+			RARRAY_LEN(pcm_ary), fmt->channels);
+	for (long i = 0; i < fmt->channels; i++)
+	{
+		VALUE obj = RARRAY_AREF(pcm_ary, i);
+		rb_pcm_resize(obj, length);
+		rb_pcm_modify(obj);
+		rb_pcm_set_fs(obj, fmt->samples_per_sec);
+		mat[i] = wave_pcm_data_ptr(obj);
+	}
+}
+
+/*
+ * Store the samples of the Wave::Frames +frames+ in +mat+ and return the
+ * number of rows to convert with +fmt+. Interleaved samples are in the
+ * order of the data chunk itself, so +fmt+ is turned into one channel
+ * and the rows are the single samples.
+ */
+long
+wave_frames_mat(VALUE frames, FormatChunk *fmt, void **mat)
+{
+	double *s = FramesDataPtr(frames);
+	long length = rb_frames_len(frames);
+	
+	if (rb_frames_layout(frames) == RB_FRAMES_INTERLEAVED)
+	{
+		length *= fmt->channels;
+		fmt->block_size /= fmt->channels;
+		fmt->channels = 1;
+		mat[0] = s;
+	}
+	else
+	{
+		for (long i = 0; i < fmt->channels; i++)
+			mat[i] = s + i * length;
+	}
+	return length;
+}
+
+static bool
+ary_all_pcm_p(VALUE ary)
+{
+	if (TYPE(ary) != T_ARRAY)
+		rb_raise(rb_eTypeError, "not an %"PRIsVALUE" includes %"PRIsVALUE"", rb_cArray, rb_cWavePCM);
+	for (long i = 0; i < RARRAY_LEN(ary); i++)
+	{
+		VALUE elem = rb_ary_entry(ary, i);
+		if (CLASS_OF(elem) != rb_cWavePCM)
+			return false;
+	}
+	return true;
+}
+
+static uint16_t
+wave_pcm_ary_channels(VALUE pcm_ary)
+{
+	if (!ary_all_pcm_p(pcm_ary))
+		rb_raise(rb_eArgError, "not a %"PRIsVALUE"", rb_cWavePCM);
+	if (RARRAY_LEN(pcm_ary) > UINT16_MAX)
+		rb_raise(rb_eRangeError, "too many PCM classes");
+	return (uint16_t)RARRAY_LEN(pcm_ary);
+}
+
+static void
+wave_pcm_ary_locktmp(VALUE pcm_ary)
+{
+	for (long i = 0; i < RARRAY_LEN(pcm_ary); i++)
+		rb_pcm_locktmp(RARRAY_AREF(pcm_ary, i));
 }
 
 static void
-io_readpartial(VALUE io, VALUE io_buf, long len)
+wave_pcm_ary_unlocktmp(VALUE pcm_ary)
 {
-	static ID readpartial;
-	if (!readpartial)
-		readpartial = rb_intern_const("readpartial");
-	rb_funcall(io, readpartial, 2, LONG2FIX(len), io_buf);
+	for (long i = 0; i < RARRAY_LEN(pcm_ary); i++)
+		rb_pcm_unlocktmp(RARRAY_AREF(pcm_ary, i));
 }
 
 
-static inline VALUE
-wave_read_linear_pcm(char *file_name)
+/*
+ * Like IO#read(len, io_buf): keeps reading until +len+ bytes arrived or EOF.
+ * Returns the number of bytes stored in +io_buf+.
+ */
+long
+wave_io_read(VALUE io, VALUE io_buf, long len)
+{
+	static ID read;
+	if (!read)
+		read = rb_intern_const("read");
+	if (NIL_P(rb_funcall(io, read, 2, LONG2FIX(len), io_buf)))
+		rb_str_resize(io_buf, 0);
+	return RSTRING_LEN(io_buf);
+}
+
+void
+wave_chunk_index_push(ChunkIndex *index, ChunkID id, uint64_t size, long offset)
+{
+	if (index->len == index->capa)
+	{
+		index->capa = index->capa ? index->capa * 2 : 8;
+		REALLOC_N(index->ptr, ChunkEntry, index->capa);
+	}
+	index->ptr[index->len].id = id;
+	index->ptr[index->len].size = size;
+	index->ptr[index->len].offset = offset;
+	index->len++;
+}
+
+static void
+io_seek(VALUE io, long offset)
+{
+	static ID seek;
+	if (!seek)
+		seek = rb_intern_const("seek");
+	rb_funcall(io, seek, 1, LONG2NUM(offset));
+}
+
+/*
+ * Check the 12-byte RIFF header. Returns true for RF64/BW64, whose 'data'
+ * size is 0xFFFFFFFF and has to be looked up in the 'ds64' chunk.
+ */
+bool
+wave_riff_header_check(const unsigned char *ptr)
 {
-	const int BUFFER_SIZE = 0x1000;
-	VALUE io = rb_file_open(file_name, "rb");
-	VALUE io_buf = rb_str_new(0,0);
+	ChunkID id = u32le(ptr);
 	
-	uint32_t riff_chunk_size;
-	uint32_t fmt_chunk_size;
-	uint16_t wave_format_type;
-	uint16_t channels;
-	uint32_t samples_per_sec;
-	uint32_t bytes_per_sec;
-	uint16_t block_size;
-	uint16_t bits_per_sample;
-	uint32_t data_chunk_size;
+	if (id != FOURCC_RIFF && id != FOURCC_RF64 && id != FOURCC_BW64)
+		rb_raise(rb_eWaveSemanticError, "unknown RIFF chunk ID: %.4s", ptr);
+	if (u32le(ptr+8) != FOURCC_WAVE)
+		rb_raise(rb_eWaveSemanticError, "unknown file format type: %.4s", ptr+8);
+	return id != FOURCC_RIFF;
+}
+
+/*
+ * The 64-bit 'data' size from the body of a 'ds64' chunk
+ * (riffSize, dataSize and sampleCount, then the table, which is not used).
+ */
+uint64_t
+wave_ds64_data_size(const unsigned char *ptr, uint64_t size)
+{
+	if (size < 28)
+		rb_raise(rb_eWaveSemanticError, "truncated ds64 chunk");
+	return u64le(ptr+8);
+}
+
+/*
+ * Walk the chunks of a RIFF/WAVE file in one pass. Only the 'fmt ' body is
+ * read; every other payload is skipped with a seek. When +index+ is given,
+ * each chunk is recorded and the walk goes on to the end of the file (LIST
+ * chunks often follow the samples); the IO is left at the first sample
+ * either way, and its offset is stored in +data_offset+.
+ */
+uint64_t
+wave_read_header(VALUE io, VALUE io_buf, FormatChunk *fmt, long *data_offset, ChunkIndex *index)
+{
+	uint64_t data_chunk_size = 0;
+	uint64_t ds64_data_size = 0;
+	bool fmt_found = false;
+	bool rf64, ds64_found = false;
+	long offset;
 	
-	VALUE pcm_ary;
-	double **mat;
-	long length;
-	void (*func)(unsigned char *, double *);
-	long idx;
-	int buffer_size;
-	uint16_t samples_per_block = 1;
+	*data_offset = 0;
 	
 	// RIFF chunk
-	io_readpartial(io, io_buf, 4);
-	if (!RTEST(rb_str_equal(io_buf, rb_str_new_cstr("RIFF"))))
-		rb_raise(rb_eWaveSemanticError, "unknown RIFF chunk ID: %"PRIsVALUE"", io_buf);
+	if (wave_io_read(io, io_buf, 12) != 12)
+		rb_raise(rb_eWaveSemanticError, "too short for a RIFF/WAVE file");
+	rf64 = wave_riff_header_check((unsigned char *)RSTRING_PTR(io_buf));
+	offset = 12;
 	
-	io_readpartial(io, io_buf, 4);
-	riff_chunk_size = qbyte2u32le(io_buf);
+	for ( ; ; )
+	{
+		ChunkID id;
+		uint64_t size;
+		
+		if (wave_io_read(io, io_buf, 8) != 8)
+			break;
+		id = u32le((unsigned char *)RSTRING_PTR(io_buf));
+		size = u32le((unsigned char *)RSTRING_PTR(io_buf)+4);
+		offset += 8;
+		if (rf64 && id == ChunkID_Data && size == UINT32_MAX)
+		{
+			if (!ds64_found)
+				rb_raise(rb_eWaveSemanticError, "no ds64 chunk");
+			size = ds64_data_size;
+		}
+		if (index)
+			wave_chunk_index_push(index, id, size, offset);
+		
+		if (rf64 && id == ChunkID_DS64 && !ds64_found)
+		{
+			if (wave_io_read(io, io_buf, 28) != 28)
+				rb_raise(rb_eWaveSemanticError, "truncated ds64 chunk");
+			ds64_data_size = wave_ds64_data_size((unsigned char *)RSTRING_PTR(io_buf), size);
+			ds64_found = true;
+			if (size > 28)
+				io_seek(io, offset + size + (size % 2));
+		}
+		else if (id == ChunkID_Format && !fmt_found)
+		{
+			long len = size < 40 ? size : 40;
+			
+			if (size < 16 || wave_io_read(io, io_buf, len) != len)
+				rb_raise(rb_eWaveSemanticError, "truncated format chunk");
+			wave_fmt_unpack((unsigned char *)RSTRING_PTR(io_buf), len, fmt);
+			wave_fmt_check(fmt);
+			fmt_found = true;
+			if (size > (uint64_t)len || size % 2)
+				io_seek(io, offset + size + (size % 2));
+		}
+		else if (id == ChunkID_Data && !*data_offset)
+		{
+			if (!fmt_found)
+				rb_raise(rb_eWaveSemanticError, "no format chunk");
+			data_chunk_size = size;
+			*data_offset = offset;
+			if (!index)
+				break;
+			io_seek(io, offset + size + (size % 2));
+		}
+		else
+		{
+			io_seek(io, offset + size + (size % 2));
+		}
+		offset += size + (size % 2);
+	}
 	
-	io_readpartial(io, io_buf, 4);
-	if (!RTEST(rb_str_equal(io_buf, rb_str_new_cstr("WAVE"))))
-		rb_raise(rb_eWaveSemanticError, "unknown file format type: %"PRIsVALUE"", io_buf);
-
-	// format chunk
-	io_readpartial(io, io_buf, 4);
-	if (!RTEST(rb_str_equal(io_buf, rb_str_new_cstr("fmt "))))
+	if (!fmt_found)
 		rb_raise(rb_eWaveSemanticError, "no format chunk");
+	if (!*data_offset)
+		rb_raise(rb_eWaveSemanticError, "no data chunk");
+	if ((data_chunk_size % fmt->block_size) != 0)
+		rb_raise(rb_eWaveSemanticError, "'data_chunk_size' is not a multiple of 'block_size'");
+	if (index)
+		io_seek(io, *data_offset);
 	
-	io_readpartial(io, io_buf, 4);
-	fmt_chunk_size = qbyte2u32le(io_buf);
-	
-	io_readpartial(io, io_buf, 2);
+	return data_chunk_size;
+}
 
-	wave_format_type = dbyte2u16le(io_buf);
-	if (wave_format_type != 1)
-		rb_raise(rb_eWaveSemanticError, "not a linear PCM");
+/*
+ * Same walk as wave_read_header() over a RIFF/WAVE image in memory.
+ * Returns 'data_chunk_size' and stores the first sample in +data+.
+ */
+uint64_t
+wave_read_header_mem(const unsigned char *ptr, size_t size, FormatChunk *fmt, const unsigned char **data)
+{
+	uint64_t data_chunk_size = 0;
+	uint64_t ds64_data_size = 0;
+	bool fmt_found = false;
+	bool rf64, ds64_found = false;
+	size_t offset;
 	
-	io_readpartial(io, io_buf, 2);
-	channels = dbyte2u16le(io_buf);
-	if (!channels)
-		must_be_nonzero_error("channels");
+	*data = NULL;
+	if (size < 12)
+		rb_raise(rb_eWaveSemanticError, "too short for a RIFF/WAVE file");
+	rf64 = wave_riff_header_check(ptr);
 	
-	io_readpartial(io, io_buf, 4);
-	samples_per_sec = qbyte2u32le(io_buf);
-	if (!samples_per_sec)
-		must_be_nonzero_error("samples_per_sec");
+	for (offset = 12; size - offset >= 8; )
+	{
+		ChunkID id = u32le(ptr+offset);
+		uint64_t chunk_size = u32le(ptr+offset+4);
+		offset += 8;
+		
+		if (rf64 && id == ChunkID_Data && chunk_size == UINT32_MAX)
+		{
+			if (!ds64_found)
+				rb_raise(rb_eWaveSemanticError, "no ds64 chunk");
+			chunk_size = ds64_data_size;
+		}
+		
+		if (rf64 && id == ChunkID_DS64 && !ds64_found)
+		{
+			ds64_data_size = wave_ds64_data_size(ptr+offset, chunk_size < size - offset ? chunk_size : size - offset);
+			ds64_found = true;
+		}
+		else if (id == ChunkID_Format && !fmt_found)
+		{
+			if (chunk_size < 16 || size - offset < 16)
+				rb_raise(rb_eWaveSemanticError, "truncated format chunk");
+			wave_fmt_unpack(ptr+offset, chunk_size < size - offset ? chunk_size : size - offset, fmt);
+			wave_fmt_check(fmt);
+			fmt_found = true;
+		}
+		else if (id == ChunkID_Data)
+		{
+			if (!fmt_found)
+				rb_raise(rb_eWaveSemanticError, "no format chunk");
+			if (chunk_size > size - offset)
+				rb_raise(rb_eWaveSemanticError, "truncated data chunk");
+			data_chunk_size = chunk_size;
+			*data = ptr+offset;
+			break;
+		}
+		if (chunk_size + (chunk_size % 2) > size - offset)
+			break;
+		offset += chunk_size + (chunk_size % 2);
+	}
 	
-	io_readpartial(io, io_buf, 4);
-	bytes_per_sec = qbyte2u32le(io_buf);
-	if (!bytes_per_sec)
-		must_be_nonzero_error("bytes_per_sec");
+	if (!fmt_found)
+		rb_raise(rb_eWaveSemanticError, "no format chunk");
+	if (!*data)
+		rb_raise(rb_eWaveSemanticError, "no data chunk");
+	if ((data_chunk_size % fmt->block_size) != 0)
+		rb_raise(rb_eWaveSemanticError, "'data_chunk_size' is not a multiple of 'block_size'");
 	
-	io_readpartial(io, io_buf, 2);
-	block_size = dbyte2u16le(io_buf);
-	if (!block_size)
-		must_be_nonzero_error("block_size");
+	return data_chunk_size;
+}
+
+/*******************************************************************************
+	GVL-free payload I/O
 	
-	io_readpartial(io, io_buf, 2);
-	bits_per_sample = dbyte2u16le(io_buf);
-	if (!bits_per_sample)
-		must_be_nonzero_error("bits_per_sample");
+	The headers are parsed with the GVL held (they are a few bytes), then the
+	payload is read or written with pread(2)/write(2) and converted by
+	pcm_convert.c without the GVL, so other Ruby threads keep running.
+	An interrupt (Thread#raise, Thread#kill, signals) stops the loop at a
+	buffer boundary; it is resumed when the interrupt turns out harmless.
 	
-	if ((bits_per_sample / 8 * channels) != block_size)
-		rb_raise(rb_eWaveSemanticError, "'block_size' mismatch");
+	Decoding can be split into buffer-aligned frame ranges, each converted
+	by its own native thread into a disjoint slice of the channel arrays.
+*******************************************************************************/
+#define NOGVL_BUFFER_SIZE  0x10000
+
+struct wave_nogvl {
+	const FormatChunk *fmt;
+	int fd;
+	off_t offset; // file offset of the first sample (decoding from fd)
+	const unsigned char *src; // decode from memory instead of fd
+	unsigned char *dst; // encode into memory instead of fd
+	const unsigned char *head; // written before the samples (encoding)
+	long head_len;
+	int pad; // write a pad byte after the samples (encoding)
+	unsigned char *buf;
+	long buf_frames;
+	enum rb_pcm_dtype dtype;
+	void **mat;
+	long base; // first frame of this range
+	long length;
+	long done;
+	volatile int interrupted;
+	int err; // errno, or -1 on unexpected EOF
+};
+
+struct wave_nogvl_set {
+	void *(*func)(void *);
+	struct wave_nogvl *a;
+	int n;
+};
+
+static void *
+wave_nogvl_dispatch(void *arg)
+{
+	struct wave_nogvl_set *set = arg;
 	
-	if ((samples_per_sec * block_size) != bytes_per_sec)
-		rb_raise(rb_eWaveSemanticError, "'bytes_per_sec' mismatch");
+	if (set->n == 1)
+		set->func(set->a);
+	else
+		wave_parallel_run(set->func, set->a, sizeof(struct wave_nogvl), set->n);
+	return NULL;
+}
+
+static void
+wave_nogvl_ubf(void *arg)
+{
+	struct wave_nogvl_set *set = arg;
 	
-	// data chunk
-	io_readpartial(io, io_buf, 4);
-	if (!RTEST(rb_str_equal(io_buf, rb_str_new_cstr("data"))))
-		rb_raise(rb_eWaveSemanticError, "no data chunk");
+	for (int i = 0; i < set->n; i++)
+		set->a[i].interrupted = 1;
+}
+
+static int
+fd_read_full(int fd, unsigned char *buf, size_t len, off_t offset)
+{
+	while (len > 0)
+	{
+#ifdef HAVE_PREAD
+		ssize_t r = pread(fd, buf, len, offset);
+#else
+		ssize_t r = lseek(fd, offset, SEEK_SET) < 0 ? -1 : read(fd, buf, len);
+#endif
+		if (r < 0)
+		{
+			if (errno == EINTR)  continue;
+			return errno;
+		}
+		if (r == 0)
+			return -1;
+		buf += r;
+		len -= r;
+		offset += r;
+	}
+	return 0;
+}
+
+static int
+fd_write_full(int fd, const unsigned char *buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t r = write(fd, buf, len);
+		if (r < 0)
+		{
+			if (errno == EINTR)  continue;
+			return errno;
+		}
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+static void *
+wave_decode_nogvl(void *arg)
+{
+	struct wave_nogvl *a = arg;
+	const long block_size = a->fmt->block_size;
 	
-	io_readpartial(io, io_buf, 4);
-	data_chunk_size = qbyte2u32le(io_buf);
+	while (a->done < a->length && !a->interrupted)
+	{
+		long frames = a->length - a->done < a->buf_frames ? a->length - a->done : a->buf_frames;
+		long idx = a->base + a->done;
+		const unsigned char *p;
+		
+		if (a->src)
+		{
+			p = a->src + idx * block_size;
+		}
+		else
+		{
+			if ((a->err = fd_read_full(a->fd, a->buf, frames * block_size, a->offset + idx * block_size)))
+				break;
+			p = a->buf;
+		}
+		wave_decode_frames_dtype(a->fmt, p, frames, a->dtype, a->mat, idx);
+		a->done += frames;
+	}
+	return NULL;
+}
+
+static void *
+wave_encode_nogvl(void *arg)
+{
+	struct wave_nogvl *a = arg;
+	const long block_size = a->fmt->block_size;
 	
-	if ((data_chunk_size % block_size) != 0)
-		rb_raise(rb_eWaveSemanticError, "'data_chunk_size' is not a multiple of 'block_size'");
+	if (a->head)
+	{
+		if ((a->err = fd_write_full(a->fd, a->head, a->head_len)))
+			return NULL;
+		a->head = NULL;
+	}
+	while (a->done < a->length && !a->interrupted)
+	{
+		long frames = a->length - a->done < a->buf_frames ? a->length - a->done : a->buf_frames;
+		long idx = a->base + a->done;
+		
+		if (a->dst)
+		{
+			wave_encode_frames_dtype(a->fmt, a->dst + idx * block_size, frames, a->dtype, a->mat, idx);
+		}
+		else
+		{
+			wave_encode_frames_dtype(a->fmt, a->buf, frames, a->dtype, a->mat, idx);
+			if ((a->err = fd_write_full(a->fd, a->buf, frames * block_size)))
+				return NULL;
+		}
+		a->done += frames;
+	}
+	if (a->done == a->length && a->pad)
+	{
+		if ((a->err = fd_write_full(a->fd, (const unsigned char *)"", 1)))
+			return NULL;
+		a->pad = 0;
+	}
+	return NULL;
+}
+
+static int
+wave_nogvl_pending(const struct wave_nogvl *a, int n, int *err)
+{
+	int pending = 0;
 	
-	switch (bits_per_sample) {
-	case 8:  func = pcm_read_8bit;  break;
-	case 16: func = pcm_read_16bit; break;
-	case 24: func = pcm_read_24bit; break;
-	case 32: func = pcm_read_32bit; break;
-	default: rb_raise(rb_eWaveSemanticError, 
-		"unrecognized (or unsupported) bits per sample: %d (for wave format type: %d)", 
-		bits_per_sample, wave_format_type);
-		break;
+	*err = 0;
+	for (int i = 0; i < n; i++)
+	{
+		if (a[i].err)
+		{
+			*err = a[i].err;
+			return 0;
+		}
+		if (a[i].done < a[i].length || a[i].head || a[i].pad)
+			pending = 1;
 	}
+	return pending;
+}
+
+/*
+ * Runs +func+ over the +n+ ranges in +a+ without the GVL until all of them
+ * are done, handling interrupts between the rounds.
+ */
+static void
+wave_nogvl_run(void *(*func)(void *), struct wave_nogvl *a, int n)
+{
+	struct wave_nogvl_set set = { func, a, n };
+	int err;
 	
-	length = data_chunk_size / block_size;
-	pcm_ary = rb_ary_new2(channels);
-	for (long i = 0; i < channels; i++)
+	for ( ; ; )
 	{
-		rb_ary_store(pcm_ary, i, rb_pcm_new(length, samples_per_sec));
+		for (int i = 0; i < n; i++)
+			a[i].interrupted = 0;
+		rb_thread_call_without_gvl(wave_nogvl_dispatch, &set, wave_nogvl_ubf, &set);
+		if (!wave_nogvl_pending(a, n, &err))
+			break;
+		rb_thread_check_ints();
 	}
+	if (err == -1)
+		rb_raise(rb_eWaveSemanticError, "truncated data chunk");
+	else if (err)
+		rb_syserr_fail(err, NULL);
+}
+
+int
+wave_io_fd(VALUE io)
+{
+#ifdef HAVE_RB_IO_DESCRIPTOR
+	return rb_io_descriptor(io);
+#else
+	rb_io_t *fptr;
+	GetOpenFile(io, fptr);
+	return fptr->fd;
+#endif
+}
+
+static void
+wave_nogvl_init(struct wave_nogvl *a, const FormatChunk *fmt, enum rb_pcm_dtype dtype, void **mat, long length)
+{
+	MEMZERO(a, struct wave_nogvl, 1);
+	a->fmt = fmt;
+	a->fd = -1;
+	a->dtype = dtype;
+	a->mat = mat;
+	a->length = length;
+	a->buf_frames = NOGVL_BUFFER_SIZE / fmt->block_size;
+	if (a->buf_frames == 0)
+		a->buf_frames = 1;
+}
+
+/*
+ * Splits the frames of a[0] into at most +n+ buffer-aligned ranges a[0..],
+ * and returns the number of ranges.
+ */
+static int
+wave_nogvl_split(struct wave_nogvl *a, int n)
+{
+	const long length = a->length;
+	long buffers = (length + a->buf_frames - 1) / a->buf_frames;
+	long per_range;
 	
-	mat = ALLOCA_N(double*, channels);
-	for (long i = 0; i < channels; i++)
+	if (n > buffers)
+		n = buffers > 0 ? (int)buffers : 1;
+	per_range = (buffers + n - 1) / n * a->buf_frames;
+	n = length > 0 ? (int)((length + per_range - 1) / per_range) : 1;
+	
+	for (int i = 0; i < n; i++)
 	{
-		VALUE obj = rb_ary_entry(pcm_ary, i);
-		mat[i] = WaveformDataPtr(obj);
+		a[i] = a[0];
+		a[i].base = i * per_range;
+		a[i].length = length - a[i].base < per_range ? length - a[i].base : per_range;
 	}
+	return n;
+}
+
+static int
+wave_threads_opt(VALUE opts)
+{
+	static ID kw;
+	VALUE threads = Qundef;
 	
-	buffer_size = BUFFER_SIZE / block_size * block_size;
+	if (NIL_P(opts))
+		return 1;
+	if (!kw)
+		kw = rb_intern_const("threads");
+	rb_get_kwargs(opts, &kw, 0, 1, &threads);
+	return wave_threads_arg(threads);
+}
+
+/*
+ * Reads the +threads:+ and +dtype:+ options of the readers returning Wave::PCM.
+ */
+static void
+wave_read_opts(VALUE opts, int *threads, enum rb_pcm_dtype *dtype)
+{
+	static ID kw[2];
+	VALUE v[2] = {Qundef, Qundef};
 	
-	idx = 0;
-	for (long data_offset = 0; data_offset < data_chunk_size; data_offset += buffer_size)
+	if (!NIL_P(opts))
 	{
-		if ((1. * data_offset + buffer_size) > data_chunk_size)
-			buffer_size = data_chunk_size - data_offset;
-		io_readpartial(io, io_buf, buffer_size);
-		unsigned char *buf_ptr = (unsigned char *)RSTRING_PTR(io_buf);
-		for ( ; ; )
+		if (!kw[0])
 		{
-			for (long i = 0; i < channels; i++)
-			{
-				double *s_ptr = mat[i];
-				func(buf_ptr+(i*block_size/channels), s_ptr+idx);
-			}
-			idx += samples_per_block;
-			buf_ptr += block_size;
-			
-			if (buf_ptr == (unsigned char *)RSTRING_END(io_buf))
-				break;
+			kw[0] = rb_intern_const("threads");
+			kw[1] = rb_intern_const("dtype");
 		}
+		rb_get_kwargs(opts, kw, 0, 2, v);
+	}
+	*threads = wave_threads_arg(v[0]);
+	*dtype = wave_pcm_dtype_arg(v[1] == Qundef ? Qnil : v[1]);
+}
+
+
+struct wave_read_arg {
+	VALUE io;
+	VALUE io_buf;
+	VALUE pcm_ary; // decode into these instead of new ones, unless nil
+	bool locked;
+	int layout; // decode into a new Wave::Frames of this layout, unless -1
+	enum rb_pcm_dtype dtype; // of new Wave::PCM objects
+	int threads;
+};
+
+static VALUE
+wave_read_linear_pcm0(VALUE arg)
+{
+	struct wave_read_arg *p = (struct wave_read_arg *)arg;
+	struct wave_nogvl *a = ALLOCA_N(struct wave_nogvl, p->threads);
+	uint64_t data_chunk_size;
+	long data_offset;
+	FormatChunk fmt;
+	
+	VALUE pcm_ary;
+	void **mat;
+	long length;
+	int n;
+	
+	data_chunk_size = wave_read_header(p->io, p->io_buf, &fmt, &data_offset, NULL);
+	
+	length = data_chunk_size / fmt.block_size;
+	mat = ALLOCA_N(void*, fmt.channels);
+	if (p->layout >= 0)
+	{
+		pcm_ary = rb_frames_new(fmt.channels, length, fmt.samples_per_sec, p->layout);
+		length = wave_frames_mat(pcm_ary, &fmt, mat);
+	}
+	else if (NIL_P(p->pcm_ary))
+	{
+		pcm_ary = wave_pcm_ary_new(&fmt, length, p->dtype, mat);
+	}
+	else
+	{
+		pcm_ary = p->pcm_ary;
+		wave_pcm_ary_reuse(pcm_ary, &fmt, length, mat);
+		wave_pcm_ary_locktmp(pcm_ary);
+		p->locked = true;
 	}
-	rb_str_resize(io_buf, 0);
-	rb_io_close(io);
+	
+	wave_nogvl_init(a, &fmt, p->dtype, mat, length);
+	a->fd = wave_io_fd(p->io);
+	a->offset = data_offset;
+	n = wave_nogvl_split(a, p->threads);
+	rb_str_resize(p->io_buf, n * a->buf_frames * fmt.block_size);
+	for (int i = 0; i < n; i++)
+		a[i].buf = (unsigned char *)RSTRING_PTR(p->io_buf) + i * a->buf_frames * fmt.block_size;
+	wave_nogvl_run(wave_decode_nogvl, a, n);
+	
+	RB_GC_GUARD(pcm_ary);
 	return pcm_ary;
 }
 
 static VALUE
-test_wave_read_linear_pcm(VALUE unused_obj, VALUE fname)
+wave_read_linear_pcm_ensure(VALUE arg)
 {
-	return wave_read_linear_pcm(StringValuePtr(fname));
+	struct wave_read_arg *p = (struct wave_read_arg *)arg;
+	
+	if (p->locked)
+		wave_pcm_ary_unlocktmp(p->pcm_ary);
+	return rb_io_close(p->io);
 }
 
-static bool
-ary_all_pcm_p(VALUE ary)
+static inline VALUE
+wave_read_linear_pcm(char *file_name, VALUE pcm_ary, int layout, enum rb_pcm_dtype dtype, int threads)
 {
-	if (TYPE(ary) != T_ARRAY)
-		rb_raise(rb_eTypeError, "not an %"PRIsVALUE" includes %"PRIsVALUE"", rb_cArray, rb_cWavePCM);
-	for (long i = 0; i < RARRAY_LEN(ary); i++)
+	struct wave_read_arg arg;
+	
+	arg.io = rb_file_open(file_name, "rb");
+	arg.io_buf = rb_str_tmp_new(0);
+	arg.pcm_ary = pcm_ary;
+	arg.locked = false;
+	arg.layout = layout;
+	arg.dtype = dtype;
+	arg.threads = threads;
+	
+	return rb_ensure(wave_read_linear_pcm0, (VALUE)&arg, wave_read_linear_pcm_ensure, (VALUE)&arg);
+}
+
+/*
+ *  call-seq:
+ *    Wave::RIFF.read_linear_pcm(file_name, threads: 1, dtype: :f64) -> [*Wave::PCM]
+ *  
+ *  Reads a linear PCM file and returns a Wave::PCM per channel.
+ *  With +threads+ greater than 1, the data chunk is split into frame ranges
+ *  that are read and converted in parallel by native threads.
+ *  With <code>dtype: :f32</code> the samples are stored in single precision.
+ */
+static VALUE
+test_wave_read_linear_pcm(int argc, VALUE *argv, VALUE unused_obj)
+{
+	VALUE fname, opts;
+	enum rb_pcm_dtype dtype;
+	int threads;
+	
+	rb_scan_args(argc, argv, "1:", &fname, &opts);
+	wave_read_opts(opts, &threads, &dtype);
+	return wave_read_linear_pcm(StringValuePtr(fname), Qnil, -1, dtype, threads);
+}
+
+/*
+ *  call-seq:
+ *    Wave::RIFF.read_into(file_name, pcm_ary, threads: 1) -> pcm_ary
+ *  
+ *  Same as Wave::RIFF.read_linear_pcm, but decodes into the Wave::PCM objects of +pcm_ary+,
+ *  one per channel, instead of allocating new ones. Each of them is resized to the length
+ *  of the file and takes its sampling frequency; its storage is reallocated only when it
+ *  has never been that long, so one set of buffers can serve any number of files.
+ *  The samples are stored in the dtype of the buffers, which must all be the same.
+ *  
+ *    bufs = [Wave::PCM.new(0), Wave::PCM.new(0)]
+ *    clips.each do |path|
+ *      left, right = Wave::RIFF.read_into(path, bufs)
+ *      ...
+ *    end
+ */
+static VALUE
+rb_riff_s_read_into(int argc, VALUE *argv, VALUE unused_obj)
+{
+	VALUE fname, pcm_ary, opts;
+	int threads;
+	
+	rb_scan_args(argc, argv, "2:", &fname, &pcm_ary, &opts);
+	FilePathValue(fname);
+	Check_Type(pcm_ary, T_ARRAY);
+	wave_pcm_ary_channels(pcm_ary);
+	threads = wave_threads_opt(opts);
+	
+	wave_read_linear_pcm(StringValueCStr(fname), rb_ary_dup(pcm_ary), -1, 
+		wave_pcm_ary_dtype(pcm_ary), threads);
+	return pcm_ary;
+}
+
+/*
+ *  call-seq:
+ *    Wave::RIFF.read_frames(file_name, layout: :planar, threads: 1) -> Wave::Frames
+ *  
+ *  Same as Wave::RIFF.read_linear_pcm, but decodes all the channels into one Wave::Frames.
+ *  With <code>layout: :interleaved</code> the samples keep the order of the data chunk,
+ *  and are converted as a single run without being scattered per channel.
+ */
+static VALUE
+rb_riff_s_read_frames(int argc, VALUE *argv, VALUE unused_obj)
+{
+	static ID kw[2];
+	VALUE fname, opts, v[2] = {Qundef, Qundef};
+	
+	rb_scan_args(argc, argv, "1:", &fname, &opts);
+	FilePathValue(fname);
+	if (!NIL_P(opts))
 	{
-		VALUE elem = rb_ary_entry(ary, i);
-		if (CLASS_OF(elem) != rb_cWavePCM)
-			return false;
+		if (!kw[0])
+		{
+			kw[0] = rb_intern_const("layout");
+			kw[1] = rb_intern_const("threads");
+		}
+		rb_get_kwargs(opts, kw, 0, 2, v);
 	}
-	return true;
+	return wave_read_linear_pcm(StringValueCStr(fname), Qnil, 
+		wave_frames_layout_arg(v[0] == Qundef ? Qnil : v[0]), RB_PCM_F64, wave_threads_arg(v[1]));
 }
 
 
-static inline double
-fclip(double x, double min, double max)
+static VALUE rb_sWaveRIFFHeader;
+
+struct wave_probe_arg {
+	VALUE io;
+	VALUE io_buf;
+};
+
+static VALUE
+wave_probe0(VALUE arg)
 {
-	return fmin(fmax(min, x), max);
+	struct wave_probe_arg *p = (struct wave_probe_arg *)arg;
+	FormatChunk fmt;
+	long data_offset;
+	uint64_t data_chunk_size;
+	long length;
+	
+	data_chunk_size = wave_read_header(p->io, p->io_buf, &fmt, &data_offset, NULL);
+	length = data_chunk_size / fmt.block_size;
+	
+	return rb_struct_new(rb_sWaveRIFFHeader, 
+		INT2FIX(WAVE_FORMAT_TAG(&fmt)), 
+		INT2FIX(fmt.channels), 
+		ULONG2NUM(fmt.samples_per_sec), 
+		INT2FIX(fmt.bits_per_sample), 
+		LONG2NUM(length), 
+		DBL2NUM((double)length / fmt.samples_per_sec));
 }
 
-static inline double
-wave_normalize(double x, double min, double max, double rate)
+static VALUE
+wave_probe(VALUE fname, VALUE io_buf)
 {
-	if (x != x)  x = 0;
-	return fclip(x * rate, min, max);
+	struct wave_probe_arg arg;
+	
+	FilePathValue(fname);
+	arg.io = rb_file_open_str(fname, "rb");
+	arg.io_buf = io_buf;
+	
+	return rb_ensure(wave_probe0, (VALUE)&arg, rb_io_close, arg.io);
 }
 
-void
-pcm_write_8bit(unsigned char buf[], double s[])
+/*
+ *  call-seq:
+ *    Wave::RIFF.probe(file_name) -> Wave::RIFF::Header
+ *    Wave::RIFF.probe([*file_name]) -> [*Wave::RIFF::Header]
+ *  
+ *  Reads only the chunk headers of +file_name+ and returns its format as a Wave::RIFF::Header,
+ *  a Struct of +format+, +channels+, +fs+, +bits+, +length+ (frames) and +duration+ (seconds).
+ *  The format and data chunks are validated in the same way as Wave::RIFF.read_linear_pcm,
+ *  but no Wave::PCM is allocated and the samples are not read.
+ *  
+ *  Given an array of file names, probes each of them in turn and returns the array of results.
+ *  
+ *    Wave::RIFF.probe("take1.wav")
+ *    # => #<struct Wave::RIFF::Header format=1, channels=2, fs=48000, bits=24, length=2880000, duration=60.0>
+ *    Wave::RIFF.probe(Dir.glob("archive/take_*.wav")).sum(&:duration)
+ */
+static VALUE
+rb_riff_s_probe(VALUE unused_obj, VALUE fname)
 {
-	double digitize = wave_normalize(s[0], INT8_MIN, INT8_MAX, 0x80);
+	VALUE io_buf = rb_str_new(0, 0);
 	
-	*buf = (unsigned char)(digitize + 0x80);
+	if (RB_TYPE_P(fname, T_ARRAY))
+	{
+		VALUE ary = rb_ary_new2(RARRAY_LEN(fname));
+		for (long i = 0; i < RARRAY_LEN(fname); i++)
+			rb_ary_push(ary, wave_probe(rb_ary_entry(fname, i), io_buf));
+		return ary;
+	}
+	return wave_probe(fname, io_buf);
 }
 
-void
-pcm_write_16bit(unsigned char buf[], double s[])
+
+/*
+ * Parse a whole RIFF/WAVE image held in memory. The chunk headers are read
+ * in place, and the samples are converted straight out of +ptr+.
+ */
+static VALUE
+wave_read_linear_pcm_mem(const unsigned char *ptr, size_t size, enum rb_pcm_dtype dtype, int threads)
 {
-	double digitize = wave_normalize(s[0], INT16_MIN, INT16_MAX, 0x8000);
-	int16_t bytes = (int16_t)digitize;
+	FormatChunk fmt;
+	uint64_t data_chunk_size;
+	const unsigned char *data;
+	VALUE pcm_ary;
+	void **mat;
+	long length;
+	struct wave_nogvl *a = ALLOCA_N(struct wave_nogvl, threads);
+	int n;
+	
+	data_chunk_size = wave_read_header_mem(ptr, size, &fmt, &data);
+	
+	length = data_chunk_size / fmt.block_size;
+	mat = ALLOCA_N(void*, fmt.channels);
+	pcm_ary = wave_pcm_ary_new(&fmt, length, dtype, mat);
+	
+	wave_nogvl_init(a, &fmt, dtype, mat, length);
+	a->src = data;
+	n = wave_nogvl_split(a, threads);
+	wave_nogvl_run(wave_decode_nogvl, a, n);
 	
-	buf[0] = bytes & 0xFF;
-	buf[1] = (bytes >> 8) & 0xFF;
+	RB_GC_GUARD(pcm_ary);
+	return pcm_ary;
 }
 
-void
-pcm_write_24bit(unsigned char buf[], double s[])
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+struct wave_mmap {
+	int fd;
+	void *addr;
+	size_t size;
+	enum rb_pcm_dtype dtype;
+	int threads;
+};
+
+static VALUE
+wave_mmap_read(VALUE arg)
 {
-	double digitize = wave_normalize(s[0], -0x800000, 0x7FFFFF, 0x800000);
-	int32_t bytes = (int32_t)digitize;
+	struct wave_mmap *m = (struct wave_mmap *)arg;
+	return wave_read_linear_pcm_mem(m->addr, m->size, m->dtype, m->threads);
+}
 
-	buf[0] = bytes & 0xFF;
-	buf[1] = (bytes >> 8) & 0xFF;
-	buf[2] = (bytes >> 16) & 0xFF;
+static VALUE
+wave_mmap_unmap(VALUE arg)
+{
+	struct wave_mmap *m = (struct wave_mmap *)arg;
+	munmap(m->addr, m->size);
+	close(m->fd);
+	return Qnil;
 }
 
+/*
+ *  call-seq:
+ *    Wave::RIFF.mmap(file_name, threads: 1, dtype: :f64) -> [*Wave::PCM]
+ *  
+ *  Same as Wave::RIFF.read_linear_pcm, but maps +file_name+ into memory with mmap(2)
+ *  instead of reading it through the IO class.
+ *  The chunk headers are parsed from the mapping, and the samples are converted
+ *  straight out of the mapped pages; the file is unmapped before returning.
+ */
+static VALUE
+rb_riff_s_mmap(int argc, VALUE *argv, VALUE unused_obj)
+{
+	struct wave_mmap m;
+	struct stat st;
+	VALUE fname, opts;
+	
+	rb_scan_args(argc, argv, "1:", &fname, &opts);
+	wave_read_opts(opts, &m.threads, &m.dtype);
+	FilePathValue(fname);
+	m.fd = rb_cloexec_open(RSTRING_PTR(fname), O_RDONLY, 0);
+	if (m.fd < 0)
+		rb_sys_fail_str(fname);
+	rb_update_max_fd(m.fd);
+	
+	if (fstat(m.fd, &st) < 0)
+	{
+		int e = errno;
+		close(m.fd);
+		rb_syserr_fail_str(e, fname);
+	}
+	if (st.st_size < 12)
+	{
+		close(m.fd);
+		rb_raise(rb_eWaveSemanticError, "too short for a RIFF/WAVE file");
+	}
+	
+	m.size = (size_t)st.st_size;
+	m.addr = mmap(NULL, m.size, PROT_READ, MAP_PRIVATE, m.fd, 0);
+	if (m.addr == MAP_FAILED)
+	{
+		int e = errno;
+		close(m.fd);
+		rb_syserr_fail_str(e, fname);
+	}
+#ifdef HAVE_MADVISE
+	madvise(m.addr, m.size, MADV_SEQUENTIAL);
+#endif
+	
+	return rb_ensure(wave_mmap_read, (VALUE)&m, wave_mmap_unmap, (VALUE)&m);
+}
+#else
+#define rb_riff_s_mmap rb_f_notimplement
+#endif
+
+
 void
-pcm_write_32bit(unsigned char buf[], double s[])
+wave_io_write(VALUE io, const unsigned char *buf, long len)
 {
-	double digitize = wave_normalize(s[0], INT32_MIN, INT32_MAX, 0x80000000);
-	int32_t bytes = (int32_t)digitize;
+	if (rb_io_bufwrite(io, buf, len) == -1)
+		rb_raise(rb_eIOError, "write failure");
+}
 
-	buf[0] = bytes & 0xFF;
-	buf[1] = (bytes >> 8) & 0xFF;
-	buf[2] = (bytes >> 16) & 0xFF;
-	buf[3] = (bytes >> 24) & 0xFF;
+static inline void
+u16le_pack(unsigned char *ptr, uint16_t value)
+{
+	ptr[0] = value & 0xFF;
+	ptr[1] = (value >> 8) & 0xFF;
 }
 
-static void
-io_writepartial(VALUE io, VALUE buf)
+static inline void
+u32le_pack(unsigned char *ptr, uint32_t value)
 {
-	if (rb_io_bufwrite(io, (unsigned char *)StringValuePtr(buf), RSTRING_LEN(buf)) == -1)
-		rb_raise(rb_eIOError, "write failure");
+	ptr[0] = value & 0xFF;
+	ptr[1] = (value >> 8) & 0xFF;
+	ptr[2] = (value >> 16) & 0xFF;
+	ptr[3] = (value >> 24) & 0xFF;
 }
 
-static VALUE
-rb_str_cat_uintle(VALUE str, uint32_t value, size_t sz)
+static inline void
+u64le_pack(unsigned char *ptr, uint64_t value)
 {
-	static char s[4];
-	rb_integer_pack(ULL2NUM(value), s, sz, 8, 0, 
-		INTEGER_PACK_LITTLE_ENDIAN | INTEGER_PACK_2COMP);
-	return rb_str_buf_cat(str, s, sz);
+	u32le_pack(ptr, (uint32_t)value);
+	u32le_pack(ptr+4, (uint32_t)(value >> 32));
 }
 
-static VALUE
-rb_str_buf_z_new(long len)
+/*
+ * Speaker positions for the usual layouts of 1 to 8 channels (mono, stereo,
+ * 3.0, quad, 5.0, 5.1, 6.1, 7.1); other counts leave them unspecified.
+ */
+static uint32_t
+wave_default_channel_mask(long channels)
+{
+	static const uint32_t masks[] = {
+		0, 0x4, 0x3, 0x7, 0x33, 0x37, 0x3F, 0x13F, 0x63F
+	};
+	return channels < (long)(sizeof(masks) / sizeof(masks[0])) ? masks[channels] : 0;
+}
+
+void
+wave_fmt_init(FormatChunk *fmt, int format_tag, long channels, long samples_per_sec, int bits, bool extensible)
 {
-	VALUE bin = rb_str_buf_new(len);
-	char *ptr = RSTRING_PTR(bin);
-	rb_str_resize(bin, len);
-	MEMZERO(ptr, char, len);
+	if (channels <= 0 || channels > UINT16_MAX)
+		rb_raise(rb_eRangeError, "channels out of range: %ld", channels);
+	if (samples_per_sec <= 0 || (unsigned long)samples_per_sec > UINT32_MAX)
+		rb_raise(rb_eRangeError, "sampling frequency out of range: %ld", samples_per_sec);
 	
-	return bin;
+	fmt->chunk_ID = ChunkID_Format;
+	fmt->format_tag = extensible ? WAVE_FORMAT_EXTENSIBLE : format_tag;
+	fmt->chunk_size = extensible ? 40 : (format_tag == WAVE_FORMAT_PCM ? 16 : 18);
+	fmt->channels = (uint16_t)channels;
+	fmt->samples_per_sec = (uint32_t)samples_per_sec;
+	fmt->bits_per_sample = (uint16_t)bits;
+	fmt->block_size = bits / 8 * channels;
+	fmt->bytes_per_sec = fmt->samples_per_sec * fmt->block_size;
+	fmt->valid_bits_per_sample = (uint16_t)bits;
+	fmt->channel_mask = extensible ? wave_default_channel_mask(channels) : 0;
+	fmt->sub_format = format_tag;
+	wave_bits_check(fmt);
+	if (fmt->block_size == 0 || fmt->block_size != bits / 8 * channels)
+		rb_raise(rb_eRangeError, "block size out of range");
 }
 
-static VALUE
-rb_str_buf_z_resize(VALUE bin, long len)
+/*
+ * Reads the +format:+ (:pcm or :float), +extensible:+ and +rf64:+ (:auto,
+ * true or false) options of the writers; the outputs are left as they are
+ * when absent.
+ */
+void
+wave_format_opts(VALUE opts, int *format_tag, bool *extensible, enum wave_rf64 *rf64)
 {
-	char *ptr = RSTRING_PTR(bin);
-	if (RSTRING_LEN(bin) == len)
+	static ID kw[3];
+	VALUE vals[3];
+	
+	if (NIL_P(opts))
+		return;
+	if (!kw[0])
 	{
-		MEMZERO(ptr, char, len);
+		kw[0] = rb_intern_const("format");
+		kw[1] = rb_intern_const("extensible");
+		kw[2] = rb_intern_const("rf64");
 	}
-	else if (RSTRING_LEN(bin) < len)
+	rb_get_kwargs(opts, kw, 0, 3, vals);
+	if (vals[0] != Qundef)
 	{
-		rb_str_resize(bin, len);
-		MEMZERO(ptr, char, len);
+		if (vals[0] == ID2SYM(rb_intern("pcm")))
+			*format_tag = WAVE_FORMAT_PCM;
+		else if (vals[0] == ID2SYM(rb_intern("float")))
+			*format_tag = WAVE_FORMAT_IEEE_FLOAT;
+		else
+			rb_raise(rb_eArgError, "unknown format: %"PRIsVALUE" (expected :pcm or :float)", vals[0]);
 	}
-	else if (RSTRING_LEN(bin) > len)
+	if (vals[1] != Qundef)
+		*extensible = RTEST(vals[1]);
+	if (vals[2] != Qundef)
 	{
-		rb_str_resize(bin, len);
+		if (NIL_P(vals[2]) || vals[2] == ID2SYM(rb_intern("auto")))
+			*rf64 = WAVE_RF64_AUTO;
+		else
+			*rf64 = RTEST(vals[2]) ? WAVE_RF64_ALWAYS : WAVE_RF64_NEVER;
 	}
+}
+
+/*
+ * Interleave +frames+ samples of each channel array of +mat+,
+ * starting at the sample index +idx+, into +buf+.
+ */
+void
+wave_encode_frames(const FormatChunk *fmt, unsigned char *buf, long frames, double **mat, long idx)
+{
+	if (WAVE_FORMAT_TAG(fmt) == WAVE_FORMAT_IEEE_FLOAT)
+		pcm_encode_float_frames(fmt->bits_per_sample, buf, frames, fmt->channels, mat, idx);
+	else
+		pcm_encode_frames(fmt->bits_per_sample, buf, frames, fmt->channels, mat, idx);
+}
 
-	return bin;
+void
+wave_encode_frames_dtype(const FormatChunk *fmt, unsigned char *buf, long frames, 
+	enum rb_pcm_dtype dtype, void **mat, long idx)
+{
+	if (dtype == RB_PCM_F64)
+		wave_encode_frames(fmt, buf, frames, (double **)mat, idx);
+	else if (WAVE_FORMAT_TAG(fmt) == WAVE_FORMAT_IEEE_FLOAT)
+		pcm_encode_float_frames_f32(fmt->bits_per_sample, buf, frames, fmt->channels, (float **)mat, idx);
+	else
+		pcm_encode_frames_f32(fmt->bits_per_sample, buf, frames, fmt->channels, (float **)mat, idx);
 }
 
+/*
+ * Size of the chunks in front of the samples written by wave_header_pack().
+ */
+long
+wave_header_size(const FormatChunk *fmt, enum wave_layout layout)
+{
+	return 12 + (layout != WAVE_LAYOUT_RIFF ? 8 + 28 : 0) + 
+		8 + fmt->chunk_size + (WAVE_FORMAT_TAG(fmt) != WAVE_FORMAT_PCM ? 12 : 0) + 8;
+}
 
-static inline VALUE
-wave_write_linear_pcm(VALUE pcm_ary, int16_t bits, char *file_name)
+/*
+ * Whether the RIFF chunk size of a file with +data_chunk_size+ bytes of
+ * samples fits in 32 bits, i.e. whether it can do without RF64.
+ */
+bool
+wave_riff_fits(const FormatChunk *fmt, enum wave_layout layout, uint64_t data_chunk_size)
 {
-	const int BUFFER_SIZE = 0x1000;
+	return wave_header_size(fmt, layout) - 8 + data_chunk_size + (data_chunk_size % 2) <= UINT32_MAX;
+}
+
+/*
+ * Pack the RIFF (or RF64) header, the 'ds64' chunk (or a JUNK chunk keeping
+ * its room), the 'fmt ' chunk (16 bytes for integer PCM, 18 for float, 40
+ * for extensible), a 'fact' chunk for float and the header of 'data', and
+ * return their size. The chunk size of 'data' excludes the pad byte, while
+ * the RIFF chunk size counts it. For RF64 the 32-bit sizes are 0xFFFFFFFF
+ * and the real ones are in 'ds64'.
+ */
+long
+wave_header_pack(const FormatChunk *fmt, uint64_t data_chunk_size, enum wave_layout layout, unsigned char buf[WAVE_HEADER_SIZE_MAX])
+{
+	const long header_size = wave_header_size(fmt, layout);
+	const uint64_t riff_size = header_size - 8 + data_chunk_size + (data_chunk_size % 2);
+	const uint64_t frames = data_chunk_size / fmt->block_size;
+	const bool rf64 = layout == WAVE_LAYOUT_RF64;
+	unsigned char *p = buf + 12;
 	
-	if (!ary_all_pcm_p(pcm_ary))
-		rb_raise(rb_eArgError, "not a %"PRIsVALUE"", rb_cWavePCM);
+	u32le_pack(buf, rf64 ? FOURCC_RF64 : FOURCC_RIFF);
+	u32le_pack(buf+4, rf64 ? UINT32_MAX : (uint32_t)riff_size);
+	u32le_pack(buf+8, FOURCC_WAVE);
 	
-	VALUE io = rb_file_open(file_name, "wb");
-	VALUE io_buf;
+	if (layout != WAVE_LAYOUT_RIFF)
+	{
+		u32le_pack(p, rf64 ? ChunkID_DS64 : ChunkID_Junk);
+		u32le_pack(p+4, 28);
+		memset(p+8, 0, 28);
+		if (rf64)
+		{
+			u64le_pack(p+8, riff_size);
+			u64le_pack(p+16, data_chunk_size);
+			u64le_pack(p+24, frames);
+		}
+		p += 8 + 28;
+	}
+	
+	u32le_pack(p, ChunkID_Format);
+	u32le_pack(p+4, fmt->chunk_size);
+	u16le_pack(p+8, fmt->format_tag);
+	u16le_pack(p+10, fmt->channels);
+	u32le_pack(p+12, fmt->samples_per_sec);
+	u32le_pack(p+16, fmt->bytes_per_sec);
+	u16le_pack(p+20, fmt->block_size);
+	u16le_pack(p+22, fmt->bits_per_sample);
+	if (fmt->chunk_size >= 18)
+		u16le_pack(p+24, fmt->chunk_size - 18);
+	if (fmt->chunk_size >= 40)
+	{
+		u16le_pack(p+26, fmt->valid_bits_per_sample);
+		u32le_pack(p+28, fmt->channel_mask);
+		memcpy(p+32, fmt->sub_format == WAVE_FORMAT_IEEE_FLOAT ? SUB_FORMAT_GUID_FLOAT : SUB_FORMAT_GUID_PCM, 16);
+	}
+	p += 8 + fmt->chunk_size;
+	
+	if (WAVE_FORMAT_TAG(fmt) != WAVE_FORMAT_PCM)
+	{
+		u32le_pack(p, ChunkID_Fact);
+		u32le_pack(p+4, 4);
+		u32le_pack(p+8, frames > UINT32_MAX ? UINT32_MAX : (uint32_t)frames);
+		p += 12;
+	}
 	
-	char riff_chunk_ID[4];
-	uint32_t riff_chunk_size;
-	char file_format_type[4];
-	char fmt_chunk_ID[4];
-	uint32_t fmt_chunk_size;
-	uint16_t wave_format_type;
+	u32le_pack(p, ChunkID_Data);
+	u32le_pack(p+4, rf64 ? UINT32_MAX : (uint32_t)data_chunk_size);
+	
+	return header_size;
+}
+
+
+struct wave_write_arg {
+	struct wave_nogvl a;
+	VALUE pcm_ary;
+	VALUE io_buf;
+	FormatChunk fmt;
+	FormatChunk conv_fmt; // the samples are converted with this one; see wave_frames_mat()
+	unsigned char header[WAVE_HEADER_SIZE_MAX];
+	long header_size;
+	uint64_t data_chunk_size;
+};
+
+/*
+ * Number of channels of +src+: an array of Wave::PCM, or a Wave::Frames.
+ */
+static uint16_t
+wave_write_src_channels(VALUE src)
+{
+	if (rb_frames_p(src))
+		return (uint16_t)rb_frames_channels(src);
+	if (TYPE(src) != T_ARRAY)
+		rb_raise(rb_eTypeError, "not an Array or %"PRIsVALUE"", rb_cWaveFrames);
+	return wave_pcm_ary_channels(src);
+}
+
+/*
+ * Check the channels of +src+ (see wave_write_src_channels()), store their
+ * samples in +mat+ and pack the header for them into +arg+.
+ */
+static void
+wave_write_setup(struct wave_write_arg *arg, VALUE src, void **mat, 
+	int16_t bits, int format_tag, bool extensible, enum wave_rf64 rf64)
+{
+	const bool frames = rb_frames_p(src);
+	enum rb_pcm_dtype dtype = RB_PCM_F64;
 	uint16_t channels;
 	uint32_t samples_per_sec;
-	uint32_t bytes_per_sec;
-	uint16_t block_size;
-	uint16_t bits_per_sample;
-	char data_chunk_ID[4];
-	uint32_t data_chunk_size;
-	
-	double **mat;
+	enum wave_layout layout;
 	long length;
-	void (*func)(unsigned char *, double *);
-	long idx;
-	int buffer_size;
-	uint16_t samples_per_block = 1;
-	
-	riff_chunk_ID[0] = 'R';
-	riff_chunk_ID[1] = 'I';
-	riff_chunk_ID[2] = 'F';
-	riff_chunk_ID[3] = 'F';
-
-	file_format_type[0] = 'W';
-	file_format_type[1] = 'A';
-	file_format_type[2] = 'V';
-	file_format_type[3] = 'E';
-	
-	fmt_chunk_ID[0] = 'f';
-	fmt_chunk_ID[1] = 'm';
-	fmt_chunk_ID[2] = 't';
-	fmt_chunk_ID[3] = ' ';
-	fmt_chunk_size = 16;
-	wave_format_type = 1;
-
-	if (RARRAY_LEN(pcm_ary) > UINT16_MAX)
-		rb_raise(rb_eRangeError, "too many PCM classes");
-	channels = (uint16_t)RARRAY_LEN(pcm_ary);
 
 	samples_per_sec = 0;
 	length = 0;
-	mat = ALLOCA_N(double*, channels);
-	for (long i = 0; i < channels; i++)
+	if (frames)
 	{
-		VALUE obj = rb_ary_entry(pcm_ary, i);
-		mat[i] = WaveformDataPtr(obj);
-		if (!samples_per_sec)
-			samples_per_sec = rb_pcm_fs(obj);
-		else
-			if (samples_per_sec != rb_pcm_fs(obj))
-				rb_raise(rb_eRuntimeError, 
-				"Exporting each channel's the different sampling frequency is not supported yet");
-		if (!length)
-			length = rb_pcm_len(obj);
-		else
-			if (length != rb_pcm_len(obj))
-				rb_raise(rb_eRuntimeError, 
-				"Exporting each channel's the different length is not supported yet");
+		channels = (uint16_t)rb_frames_channels(src);
+		samples_per_sec = rb_frames_fs(src);
+		length = rb_frames_len(src);
 	}
-	
-
-	bits_per_sample = bits;
-	switch (bits_per_sample) {
-	case 8:  func = pcm_write_8bit;  break;
-	case 16: func = pcm_write_16bit; break;
-	case 24: func = pcm_write_24bit; break;
-	case 32: func = pcm_write_32bit; break;
-	default: rb_raise(rb_eWaveSemanticError, 
-		"unrecognized (or unsupported) bits per sample: %d (for wave format type: %d)", 
-		bits_per_sample, wave_format_type);
-		break;
+	else
+	{
+		channels = (uint16_t)RARRAY_LEN(src);
+		dtype = wave_pcm_ary_dtype(src);
+		for (long i = 0; i < channels; i++)
+		{
+			VALUE obj = rb_ary_entry(src, i);
+			mat[i] = wave_pcm_data_ptr(obj);
+			if (!samples_per_sec)
+				samples_per_sec = rb_pcm_fs(obj);
+			else
+				if (samples_per_sec != rb_pcm_fs(obj))
+					rb_raise(rb_eRuntimeError, 
+					"Exporting each channel's the different sampling frequency is not supported yet");
+			if (!length)
+				length = rb_pcm_len(obj);
+			else
+				if (length != rb_pcm_len(obj))
+					rb_raise(rb_eRuntimeError, 
+					"Exporting each channel's the different length is not supported yet");
+		}
 	}
 	
-	bytes_per_sec = samples_per_sec * bits_per_sample / 8 * channels;
-	block_size = bits_per_sample / 8 * channels;
-	
-	data_chunk_ID[0] = 'd';
-	data_chunk_ID[1] = 'a';
-	data_chunk_ID[2] = 't';
-	data_chunk_ID[3] = 'a';
-	data_chunk_size = length * bits_per_sample / 8 * channels;
-	
-	riff_chunk_size = 36 + data_chunk_size;
-	if (riff_chunk_size % 2 == 1)  riff_chunk_size++;
-	
-	io_buf = rb_str_new(0, 0);
-	rb_str_buf_cat(io_buf, riff_chunk_ID, 4);
-	rb_str_cat_uintle(io_buf, riff_chunk_size, 4);
-	rb_str_buf_cat(io_buf, file_format_type, 4);
-	io_writepartial(io, io_buf);
-	
-	io_buf = rb_str_new(0, 0);
-	rb_str_buf_cat(io_buf, fmt_chunk_ID, 4);
-	rb_str_cat_uintle(io_buf, fmt_chunk_size, 4);
-	rb_str_cat_uintle(io_buf, wave_format_type, 2);
-	rb_str_cat_uintle(io_buf, channels, 2);
-	rb_str_cat_uintle(io_buf, samples_per_sec, 4);
-	rb_str_cat_uintle(io_buf, bytes_per_sec, 4);
-	rb_str_cat_uintle(io_buf, block_size, 2);
-	rb_str_cat_uintle(io_buf, bits_per_sample, 2);
-	io_writepartial(io, io_buf);
-	
-	io_buf = rb_str_new(0, 0);
-	rb_str_buf_cat(io_buf, data_chunk_ID, 4);
-	if (data_chunk_size % 2 == 1)
-		rb_str_cat_uintle(io_buf, data_chunk_size + 1, 4);
+	wave_fmt_init(&arg->fmt, format_tag, channels, samples_per_sec, bits, extensible);
+	
+	arg->data_chunk_size = (uint64_t)length * arg->fmt.block_size;
+	if (rf64 == WAVE_RF64_ALWAYS || 
+		(rf64 == WAVE_RF64_AUTO && !wave_riff_fits(&arg->fmt, WAVE_LAYOUT_RIFF, arg->data_chunk_size)))
+		layout = WAVE_LAYOUT_RF64;
+	else if (wave_riff_fits(&arg->fmt, WAVE_LAYOUT_RIFF, arg->data_chunk_size))
+		layout = WAVE_LAYOUT_RIFF;
 	else
-		rb_str_cat_uintle(io_buf, data_chunk_size, 4);
-
-	io_writepartial(io, io_buf);
+		rb_raise(rb_eRangeError, "data chunk too large for a RIFF file");
+	arg->header_size = wave_header_pack(&arg->fmt, arg->data_chunk_size, layout, arg->header);
 	
-	io_buf = rb_str_new(0, 0);
-	buffer_size = BUFFER_SIZE / block_size * block_size;
-	idx = 0;
-	for (long data_offset = 0; data_offset < data_chunk_size; data_offset += buffer_size)
+	arg->conv_fmt = arg->fmt;
+	if (frames)
 	{
-		if ((1. * data_offset + buffer_size) > data_chunk_size)
-			buffer_size = data_chunk_size - data_offset;
-		
-		if (data_offset == 0)
-			io_buf = rb_str_buf_z_new(buffer_size);
-		else if (RSTRING_LEN(io_buf) != buffer_size)
-			rb_str_buf_z_resize(io_buf, buffer_size);
-		
-		unsigned char *buf_ptr = (unsigned char *)RSTRING_PTR(io_buf);
-		for ( ; ; )
-		{
-			for (long i = 0; i < channels; i++)
-			{
-				double *s_ptr = mat[i];
-				func(buf_ptr+(i*block_size/channels), s_ptr+idx);
-			}
-			idx += samples_per_block;
-			buf_ptr += block_size;
-			
-			if (buf_ptr == (unsigned char *)RSTRING_END(io_buf))
-			{
-				io_writepartial(io, io_buf);
-				break;
-			}
-		}
-		
+		// A Wave::Frames is never resized, so it needs no lock.
+		length = wave_frames_mat(src, &arg->conv_fmt, mat);
+		arg->pcm_ary = rb_ary_new();
 	}
-	if (data_chunk_size % 2 == 1)
-		io_writepartial(io, rb_str_buf_z_new(1));
-		
-	rb_str_resize(io_buf, 0);
-	rb_io_close(io);
+	else
+	{
+		arg->pcm_ary = rb_ary_dup(src);
+	}
+	wave_nogvl_init(&arg->a, &arg->conv_fmt, dtype, mat, length);
+	arg->io_buf = Qnil;
+}
+
+static VALUE
+wave_write_linear_pcm0(VALUE arg)
+{
+	wave_nogvl_run(wave_encode_nogvl, &((struct wave_write_arg *)arg)->a, 1);
+	return Qnil;
+}
+
+static VALUE
+wave_write_linear_pcm_ensure(VALUE arg)
+{
+	struct wave_write_arg *p = (struct wave_write_arg *)arg;
+	
+	wave_pcm_ary_unlocktmp(p->pcm_ary);
+	if (p->a.fd >= 0)
+		close(p->a.fd);
+	if (!NIL_P(p->io_buf))
+		rb_str_resize(p->io_buf, 0);
+	return Qnil;
+}
+
+static inline VALUE
+wave_write_linear_pcm(VALUE pcm_ary, int16_t bits, char *file_name, int format_tag, bool extensible, enum wave_rf64 rf64)
+{
+	struct wave_write_arg arg;
+	void **mat;
+	
+	mat = ALLOCA_N(void*, wave_write_src_channels(pcm_ary));
+	wave_write_setup(&arg, pcm_ary, mat, bits, format_tag, extensible, rf64);
+	
+	arg.a.head = arg.header;
+	arg.a.head_len = arg.header_size;
+	arg.a.pad = arg.data_chunk_size % 2;
+	arg.io_buf = rb_str_tmp_new(arg.a.buf_frames * arg.conv_fmt.block_size);
+	arg.a.buf = (unsigned char *)RSTRING_PTR(arg.io_buf);
+	
+	arg.a.fd = rb_cloexec_open(file_name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+	if (arg.a.fd < 0)
+		rb_sys_fail(file_name);
+	rb_update_max_fd(arg.a.fd);
+	wave_pcm_ary_locktmp(arg.pcm_ary);
+	
+	rb_ensure(wave_write_linear_pcm0, (VALUE)&arg, wave_write_linear_pcm_ensure, (VALUE)&arg);
 	
 	return Qtrue; // TODO: must be return a wrote byte-size
 }
 
+/*
+ *  call-seq:
+ *    Wave::RIFF.write_linear_pcm(file_name, pcm_ary, bits, format: :pcm, extensible: false, rf64: :auto) -> true
+ *    Wave::RIFF.write_linear_pcm(file_name, frames, bits, **opts) -> true
+ *  
+ *  Writes a Wave::PCM per channel, or the channels of a Wave::Frames, to +file_name+.
+ *  With <code>format: :pcm</code> +bits+ is one of 8, 16, 24 and 32; with <code>format: :float</code>
+ *  the samples are stored as IEEE floats of 32 or 64 bits, without clipping.
+ *  <code>extensible: true</code> writes a WAVE_FORMAT_EXTENSIBLE format chunk.
+ *  
+ *  Files of 4 GiB or more are written as RF64 (with a 'ds64' chunk holding the 64-bit sizes).
+ *  <code>rf64: true</code> always writes RF64, and <code>rf64: false</code> raises RangeError instead.
+ */
+static VALUE
+test_wave_write_linear_pcm(int argc, VALUE *argv, VALUE unused_obj)
+{
+	VALUE fname, pcm_ary, bits, opts;
+	int format_tag = WAVE_FORMAT_PCM;
+	bool extensible = false;
+	enum wave_rf64 rf64 = WAVE_RF64_AUTO;
+	
+	rb_scan_args(argc, argv, "3:", &fname, &pcm_ary, &bits, &opts);
+	wave_format_opts(opts, &format_tag, &extensible, &rf64);
+	return wave_write_linear_pcm(pcm_ary, NUM2INT(bits), StringValuePtr(fname), format_tag, extensible, rf64);
+}
 
+/*
+ *  call-seq:
+ *    Wave::RIFF.dump(pcm_ary, bits, format: :pcm, extensible: false, rf64: :auto) -> String
+ *    Wave::RIFF.dump(frames, bits, **opts) -> String
+ *  
+ *  Same as Wave::RIFF.write_linear_pcm, but returns the whole file as a binary String.
+ *  The samples are encoded straight into the String, which is allocated once.
+ *  
+ *    body = Wave::RIFF.dump([left, right], 16)
+ */
 static VALUE
-test_wave_write_linear_pcm(VALUE unused_obj, VALUE fname, VALUE pcm_ary, VALUE bits)
+rb_riff_s_dump(int argc, VALUE *argv, VALUE unused_obj)
 {
-	if (TYPE(pcm_ary) != T_ARRAY)
-		rb_raise(rb_eTypeError, "not an Array");
-	return wave_write_linear_pcm(pcm_ary, NUM2INT(bits), StringValuePtr(fname));
+	VALUE pcm_ary, bits, opts, str;
+	int format_tag = WAVE_FORMAT_PCM;
+	bool extensible = false;
+	enum wave_rf64 rf64 = WAVE_RF64_AUTO;
+	struct wave_write_arg arg;
+	void **mat;
+	
+	rb_scan_args(argc, argv, "2:", &pcm_ary, &bits, &opts);
+	wave_format_opts(opts, &format_tag, &extensible, &rf64);
+	
+	mat = ALLOCA_N(void*, wave_write_src_channels(pcm_ary));
+	wave_write_setup(&arg, pcm_ary, mat, NUM2INT(bits), format_tag, extensible, rf64);
+	if (arg.data_chunk_size >= (uint64_t)(LONG_MAX - arg.header_size))
+		rb_raise(rb_eRangeError, "data chunk too large for a String");
+	
+	str = rb_str_new(NULL, arg.header_size + arg.data_chunk_size + (arg.data_chunk_size % 2));
+	memcpy(RSTRING_PTR(str), arg.header, arg.header_size);
+	if (arg.data_chunk_size % 2)
+		RSTRING_PTR(str)[RSTRING_LEN(str) - 1] = 0;
+	arg.a.dst = (unsigned char *)RSTRING_PTR(str) + arg.header_size;
+	wave_pcm_ary_locktmp(arg.pcm_ary);
+	
+	rb_ensure(wave_write_linear_pcm0, (VALUE)&arg, wave_write_linear_pcm_ensure, (VALUE)&arg);
+	
+	RB_GC_GUARD(str);
+	return str;
+}
+
+struct wave_parse_arg {
+	const unsigned char *ptr;
+	size_t size;
+	enum rb_pcm_dtype dtype;
+	int threads;
+};
+
+static VALUE
+wave_parse0(VALUE arg)
+{
+	struct wave_parse_arg *p = (struct wave_parse_arg *)arg;
+	return wave_read_linear_pcm_mem(p->ptr, p->size, p->dtype, p->threads);
+}
+
+/*
+ *  call-seq:
+ *    Wave::RIFF.parse(string, threads: 1, dtype: :f64) -> [*Wave::PCM]
+ *    Wave::RIFF.parse(io_buffer, threads: 1, dtype: :f64) -> [*Wave::PCM]
+ *  
+ *  Same as Wave::RIFF.read_linear_pcm over a whole file held in a String or an IO::Buffer:
+ *  the chunks are parsed and the samples are converted in place, without copying the bytes.
+ *  The String (unless frozen) or the IO::Buffer is locked while it is being read.
+ *  
+ *    left, right = Wave::RIFF.parse(request.body.read)
+ */
+static VALUE
+rb_riff_s_parse(int argc, VALUE *argv, VALUE unused_obj)
+{
+	struct wave_parse_arg arg;
+	VALUE src, opts;
+	
+	rb_scan_args(argc, argv, "1:", &src, &opts);
+	wave_read_opts(opts, &arg.threads, &arg.dtype);
+	
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING
+	if (rb_obj_is_kind_of(src, rb_cIOBuffer))
+	{
+		const void *base;
+		
+		rb_io_buffer_get_bytes_for_reading(src, &base, &arg.size);
+		arg.ptr = base;
+		rb_io_buffer_lock(src);
+		return rb_ensure(wave_parse0, (VALUE)&arg, rb_io_buffer_unlock, src);
+	}
+#endif
+	StringValue(src);
+	arg.ptr = (const unsigned char *)RSTRING_PTR(src);
+	arg.size = RSTRING_LEN(src);
+	if (OBJ_FROZEN(src))
+		return wave_parse0((VALUE)&arg);
+	rb_str_locktmp(src);
+	return rb_ensure(wave_parse0, (VALUE)&arg, rb_str_unlocktmp, src);
 }
 
 void
 InitVM_RIFF(void)
 {
 	rb_define_const(rb_cWaveRIFF, "SupportedVersion", rb_str_new_cstr(SupportedVersion));
-	rb_define_singleton_method(rb_cWaveRIFF, "write_linear_pcm", test_wave_write_linear_pcm, 3);
-	rb_define_singleton_method(rb_cWaveRIFF, "read_linear_pcm", test_wave_read_linear_pcm, 1);
+	rb_define_singleton_method(rb_cWaveRIFF, "write_linear_pcm", test_wave_write_linear_pcm, -1);
+	rb_define_singleton_method(rb_cWaveRIFF, "read_linear_pcm", test_wave_read_linear_pcm, -1);
+	rb_define_singleton_method(rb_cWaveRIFF, "read_into", rb_riff_s_read_into, -1);
+	rb_define_singleton_method(rb_cWaveRIFF, "read_frames", rb_riff_s_read_frames, -1);
+	rb_define_singleton_method(rb_cWaveRIFF, "mmap", rb_riff_s_mmap, -1);
+	rb_define_singleton_method(rb_cWaveRIFF, "probe", rb_riff_s_probe, 1);
+	rb_define_singleton_method(rb_cWaveRIFF, "parse", rb_riff_s_parse, -1);
+	rb_define_singleton_method(rb_cWaveRIFF, "dump", rb_riff_s_dump, -1);
+	
+	rb_sWaveRIFFHeader = rb_struct_define_under(rb_cWaveRIFF, "Header", 
+		"format", "channels", "fs", "bits", "length", "duration", NULL);
 }
 
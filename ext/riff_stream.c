@@ -0,0 +1,630 @@
+/*******************************************************************************
+	riff_stream.c -- Reader for RIFF/WAVE on non-seekable streams
+
+	$author$
+
+	@license: MIT Licence
+
+*******************************************************************************/
+#include <ruby.h>
+#include <ruby/io.h>
+#include <ruby/thread.h>
+#include "ruby/wave/globals.h"
+#include "ruby/wave/pcm.h"
+#include "internal/riff.h"
+#include <errno.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#define BLOCK_SIZE_DEF  4096
+#define STREAM_BUFFER_SIZE  0x10000
+
+/* 'data' chunk whose size was not known when the header was written */
+#define DATA_SIZE_UNKNOWN  UINT64_MAX
+
+struct RIFFStreamReader {
+	VALUE io;
+	VALUE io_buf; // for IOs read through #readpartial or #read
+	VALUE blocks; // Array of Wave::PCM, reused by every read
+	FormatChunk fmt;
+	unsigned char *buf; // bytes read but not consumed yet are buf[head...tail]
+	long capa;
+	long head;
+	long tail;
+	uint64_t remaining; // bytes left in the data chunk
+	long pos; // current frame
+	bool eof;
+	bool reading;
+} ;
+
+static void
+riff_stream_mark(void *p)
+{
+	struct RIFFStreamReader *ptr = p;
+	rb_gc_mark(ptr->io);
+	rb_gc_mark(ptr->io_buf);
+	rb_gc_mark(ptr->blocks);
+}
+
+static void
+riff_stream_free(void *p)
+{
+	struct RIFFStreamReader *ptr = p;
+	if (ptr->buf != NULL)
+		xfree(ptr->buf);
+	xfree(ptr);
+}
+
+static size_t
+riff_stream_memsize(const void *p)
+{
+	const struct RIFFStreamReader *ptr = p;
+	return sizeof(struct RIFFStreamReader) + ptr->capa;
+}
+
+static const rb_data_type_t riff_stream_data_type = {
+    "riff_stream_reader",
+    {
+	riff_stream_mark,
+	riff_stream_free,
+	riff_stream_memsize,
+    },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static struct RIFFStreamReader *
+get_riff_stream(VALUE self)
+{
+	struct RIFFStreamReader *ptr = rb_check_typeddata(self, &riff_stream_data_type);
+
+	if (NIL_P(ptr->io))
+		rb_raise(rb_eIOError, "uninitialized stream reader");
+	return ptr;
+}
+
+static VALUE
+riff_stream_s_allocate(VALUE klass)
+{
+	struct RIFFStreamReader *ptr;
+	VALUE obj = TypedData_Make_Struct(klass, struct RIFFStreamReader, &riff_stream_data_type, ptr);
+	ptr->io = Qnil;
+	ptr->io_buf = Qnil;
+	ptr->blocks = Qnil;
+	return obj;
+}
+
+
+struct stream_read_arg {
+	struct RIFFStreamReader *ptr;
+	int fd;
+	unsigned char *dst;
+	long len;
+	long result;
+	int err;
+};
+
+static void *
+stream_read_nogvl(void *p)
+{
+	struct stream_read_arg *a = p;
+	ssize_t r = read(a->fd, a->dst, a->len);
+
+	a->result = r;
+	a->err = r < 0 ? errno : 0;
+	return NULL;
+}
+
+/*
+ * read(2) straight into the native buffer, without the GVL.
+ * A non-blocking descriptor (the default for pipes and sockets) is waited on
+ * with the scheduler-aware rb_io_wait().
+ */
+static void
+stream_read_fd(struct stream_read_arg *a)
+{
+	for ( ; ; )
+	{
+		a->result = -1;
+		a->err = EINTR;
+		rb_thread_call_without_gvl2(stream_read_nogvl, a, RUBY_UBF_IO, NULL);
+		if (a->result >= 0)
+			return;
+		if (a->err == EINTR)
+		{
+			rb_thread_check_ints();
+			continue;
+		}
+		if (a->err == EAGAIN || a->err == EWOULDBLOCK)
+		{
+#ifdef HAVE_RB_IO_WAIT
+			rb_io_wait(a->ptr->io, RB_INT2NUM(RUBY_IO_READABLE), Qnil);
+#else
+			rb_io_wait_readable(a->fd);
+#endif
+			continue;
+		}
+		rb_syserr_fail(a->err, "read");
+	}
+}
+
+static VALUE
+stream_readpartial(VALUE arg)
+{
+	struct stream_read_arg *a = (struct stream_read_arg *)arg;
+	static ID readpartial;
+	if (!readpartial)
+		readpartial = rb_intern_const("readpartial");
+
+	return rb_funcall(a->ptr->io, readpartial, 2, LONG2NUM(a->len), a->ptr->io_buf);
+}
+
+static VALUE
+stream_rescue_eof(VALUE arg, VALUE exc)
+{
+	return Qnil;
+}
+
+static VALUE
+stream_read0(VALUE arg)
+{
+	struct stream_read_arg *a = (struct stream_read_arg *)arg;
+	VALUE io = a->ptr->io;
+	VALUE str;
+	static ID id_readpartial, id_read;
+	if (!id_readpartial)
+		id_readpartial = rb_intern_const("readpartial");
+	if (!id_read)
+		id_read = rb_intern_const("read");
+
+	if (RB_TYPE_P(io, T_FILE))
+	{
+		rb_io_t *fptr;
+
+		GetOpenFile(io, fptr);
+		rb_io_check_readable(fptr);
+		if (!rb_io_read_pending(fptr))
+		{
+			a->fd = wave_io_fd(io);
+			stream_read_fd(a);
+			return Qnil;
+		}
+	}
+
+	// Bytes buffered by the IO itself, or an IO-like object such as StringIO.
+	if (rb_respond_to(io, id_readpartial))
+		str = rb_rescue2(stream_readpartial, arg, stream_rescue_eof, Qnil, rb_eEOFError, (VALUE)0);
+	else
+		str = rb_funcall(io, id_read, 2, LONG2NUM(a->len), a->ptr->io_buf);
+	if (NIL_P(str))
+	{
+		a->result = 0;
+		return Qnil;
+	}
+	StringValue(str);
+	if (RSTRING_LEN(str) > a->len)
+		rb_raise(rb_eIOError, "read more than requested (%ld for %ld)", RSTRING_LEN(str), a->len);
+	a->result = RSTRING_LEN(str);
+	memcpy(a->dst, RSTRING_PTR(str), a->result);
+	return Qnil;
+}
+
+static VALUE
+stream_read_ensure(VALUE arg)
+{
+	((struct stream_read_arg *)arg)->ptr->reading = false;
+	return Qnil;
+}
+
+/*
+ * Reads what is available after the pending bytes, at least one byte,
+ * moving the pending bytes to the start of the buffer first.
+ * Returns false at the end of the stream.
+ */
+static bool
+stream_fill(struct RIFFStreamReader *ptr)
+{
+	struct stream_read_arg a;
+
+	if (ptr->eof)
+		return false;
+	if (ptr->head > 0)
+	{
+		memmove(ptr->buf, ptr->buf + ptr->head, ptr->tail - ptr->head);
+		ptr->tail -= ptr->head;
+		ptr->head = 0;
+	}
+
+	a.ptr = ptr;
+	a.dst = ptr->buf + ptr->tail;
+	a.len = ptr->capa - ptr->tail;
+	a.result = 0;
+	ptr->reading = true;
+	rb_ensure(stream_read0, (VALUE)&a, stream_read_ensure, (VALUE)&a);
+
+	if (a.result == 0)
+	{
+		ptr->eof = true;
+		return false;
+	}
+	ptr->tail += a.result;
+	return true;
+}
+
+/* Waits until +n+ bytes are pending. Returns false if the stream ends first. */
+static bool
+stream_need(struct RIFFStreamReader *ptr, long n)
+{
+	if (n > ptr->capa)
+	{
+		REALLOC_N(ptr->buf, unsigned char, n);
+		ptr->capa = n;
+	}
+	while (ptr->tail - ptr->head < n)
+	{
+		if (!stream_fill(ptr))
+			return false;
+	}
+	return true;
+}
+
+/* Consumes +n+ bytes. Returns false if the stream ends first. */
+static bool
+stream_skip(struct RIFFStreamReader *ptr, uint64_t n)
+{
+	while (n > 0)
+	{
+		long avail = ptr->tail - ptr->head;
+
+		if (avail == 0)
+		{
+			if (!stream_fill(ptr))
+				return false;
+			continue;
+		}
+		if ((uint64_t)avail > n)
+			avail = (long)n;
+		ptr->head += avail;
+		n -= avail;
+	}
+	return true;
+}
+
+/*
+ * Same walk as wave_read_header(), consuming the chunks in order, up to the
+ * first sample. A 0xFFFFFFFF 'data' size (written by encoders that cannot
+ * seek back) leaves the length unknown: the samples run to the end of the stream.
+ */
+static void
+riff_stream_read_header(struct RIFFStreamReader *ptr)
+{
+	uint64_t ds64_data_size = 0;
+	bool fmt_found = false;
+	bool rf64, ds64_found = false;
+
+	// RIFF chunk
+	if (!stream_need(ptr, 12))
+		rb_raise(rb_eWaveSemanticError, "too short for a RIFF/WAVE file");
+	rf64 = wave_riff_header_check(ptr->buf + ptr->head);
+	ptr->head += 12;
+
+	for ( ; ; )
+	{
+		const unsigned char *p;
+		ChunkID id;
+		uint64_t size;
+
+		if (!stream_need(ptr, 8))
+			rb_raise(rb_eWaveSemanticError, fmt_found ? "no data chunk" : "no format chunk");
+		p = ptr->buf + ptr->head;
+		id = u32le(p);
+		size = u32le(p+4);
+		ptr->head += 8;
+
+		if (rf64 && id == ChunkID_DS64 && !ds64_found)
+		{
+			if (!stream_need(ptr, 28))
+				rb_raise(rb_eWaveSemanticError, "truncated ds64 chunk");
+			ds64_data_size = wave_ds64_data_size(ptr->buf + ptr->head, size);
+			ds64_found = true;
+		}
+		else if (id == ChunkID_Format && !fmt_found)
+		{
+			long len = size < 40 ? size : 40;
+
+			if (size < 16 || !stream_need(ptr, len))
+				rb_raise(rb_eWaveSemanticError, "truncated format chunk");
+			wave_fmt_unpack(ptr->buf + ptr->head, len, &ptr->fmt);
+			wave_fmt_check(&ptr->fmt);
+			fmt_found = true;
+		}
+		else if (id == ChunkID_Data)
+		{
+			if (!fmt_found)
+				rb_raise(rb_eWaveSemanticError, "no format chunk");
+			if (size == UINT32_MAX)
+				size = rf64 && ds64_found && ds64_data_size ? ds64_data_size : DATA_SIZE_UNKNOWN;
+			if (size != DATA_SIZE_UNKNOWN)
+				size -= size % ptr->fmt.block_size;
+			ptr->remaining = size;
+			return;
+		}
+		if (!stream_skip(ptr, size + (size % 2)))
+			rb_raise(rb_eWaveSemanticError, fmt_found ? "no data chunk" : "no format chunk");
+	}
+}
+
+/*
+ *  call-seq:
+ *    Wave::RIFF::StreamReader.new(io) -> Wave::RIFF::StreamReader
+ *
+ *  Reads the header of a RIFF/WAVE stream from +io+, which does not have to be seekable:
+ *  a pipe, a socket, <code>$stdin</code>, or any object responding to +readpartial+ or +read+ (such as StringIO).
+ *  Waits until the header up to the data chunk has arrived; the chunks before it are consumed, not indexed.
+ *
+ *  The bytes go through one native buffer owned by the reader. For an IO with no bytes buffered
+ *  on the Ruby side, they are read straight into it with read(2), releasing the GVL while waiting.
+ *
+ *  Streaming encoders that cannot seek back write 0xFFFFFFFF as the size of the data chunk;
+ *  then #length is nil and the samples run to the end of the stream. A stream that ends
+ *  before the size given in the header is not an error either: the last partial frame is dropped.
+ *
+ *  +io+ is not closed by the reader.
+ *
+ *    # sox input.flac -t wav - | ruby ingest.rb
+ *    reader = Wave::RIFF::StreamReader.new($stdin)
+ *    reader.each_block(1024){|blocks| ... }
+ */
+static VALUE
+riff_stream_initialize(VALUE self, VALUE io)
+{
+	struct RIFFStreamReader *ptr = rb_check_typeddata(self, &riff_stream_data_type);
+
+	ptr->io = io;
+	ptr->io_buf = rb_str_new(0, 0);
+	if (ptr->buf == NULL)
+	{
+		ptr->buf = ALLOC_N(unsigned char, STREAM_BUFFER_SIZE);
+		ptr->capa = STREAM_BUFFER_SIZE;
+	}
+	ptr->head = ptr->tail = 0;
+	ptr->eof = false;
+	ptr->pos = 0;
+
+	riff_stream_read_header(ptr);
+
+	ptr->blocks = rb_ary_new2(ptr->fmt.channels);
+	for (long i = 0; i < ptr->fmt.channels; i++)
+		rb_ary_store(ptr->blocks, i, rb_pcm_new(0, ptr->fmt.samples_per_sec));
+
+	return self;
+}
+
+/*
+ *  call-seq:
+ *    reader.io -> IO
+ */
+static VALUE
+riff_stream_io(VALUE self)
+{
+	return get_riff_stream(self)->io;
+}
+
+/*
+ *  call-seq:
+ *    reader.channels -> Integer
+ */
+static VALUE
+riff_stream_channels(VALUE self)
+{
+	return INT2FIX(get_riff_stream(self)->fmt.channels);
+}
+
+/*
+ *  call-seq:
+ *    reader.fs -> Integer
+ */
+static VALUE
+riff_stream_fs(VALUE self)
+{
+	return ULONG2NUM(get_riff_stream(self)->fmt.samples_per_sec);
+}
+
+/*
+ *  call-seq:
+ *    reader.bits -> Integer
+ */
+static VALUE
+riff_stream_bits(VALUE self)
+{
+	return INT2FIX(get_riff_stream(self)->fmt.bits_per_sample);
+}
+
+/*
+ *  call-seq:
+ *    reader.length -> Integer | nil
+ *
+ *  Returns the number of frames given by the header, or nil if the stream did not tell.
+ *  Once the stream turned out to end early, returns the number of frames actually read.
+ */
+static VALUE
+riff_stream_length(VALUE self)
+{
+	struct RIFFStreamReader *ptr = get_riff_stream(self);
+
+	if (ptr->remaining == DATA_SIZE_UNKNOWN)
+		return Qnil;
+	return LONG2NUM(ptr->pos + (long)(ptr->remaining / ptr->fmt.block_size));
+}
+
+/*
+ *  call-seq:
+ *    reader.pos -> Integer
+ *
+ *  Returns the number of frames read so far.
+ */
+static VALUE
+riff_stream_pos(VALUE self)
+{
+	return LONG2NUM(get_riff_stream(self)->pos);
+}
+
+static void
+riff_stream_check_reading(struct RIFFStreamReader *ptr)
+{
+	if (ptr->reading)
+		rb_raise(rb_eIOError, "stream reader in use by another thread");
+}
+
+/*
+ * Decodes at most +n+ frames into the blocks; with +partial+, returns as soon
+ * as one frame is there instead of waiting for +n+.
+ */
+static VALUE
+riff_stream_read_block(struct RIFFStreamReader *ptr, long n, bool partial)
+{
+	const long block_size = ptr->fmt.block_size;
+	const uint16_t channels = ptr->fmt.channels;
+	double **mat;
+	long frames;
+
+	if (n < 0)
+		rb_raise(rb_eArgError, "negative block size");
+	riff_stream_check_reading(ptr);
+	if (ptr->remaining < (uint64_t)block_size)
+		return Qnil;
+	if ((uint64_t)n > ptr->remaining / block_size)
+		n = (long)(ptr->remaining / block_size);
+
+	stream_need(ptr, partial && n > 0 ? block_size : n * block_size);
+	frames = (ptr->tail - ptr->head) / block_size;
+	if (frames > n)
+		frames = n;
+	if (frames == 0 && n > 0)
+	{
+		ptr->remaining = 0;
+		return Qnil;
+	}
+
+	mat = ALLOCA_N(double*, channels);
+	for (long i = 0; i < channels; i++)
+	{
+		VALUE obj = rb_ary_entry(ptr->blocks, i);
+		if (rb_pcm_len(obj) != frames)
+			rb_pcm_resize(obj, frames);
+		rb_pcm_modify(obj);
+		mat[i] = WaveformDataPtr(obj);
+	}
+	wave_decode_frames(&ptr->fmt, ptr->buf + ptr->head, frames, mat, 0);
+	ptr->head += frames * block_size;
+	if (ptr->remaining != DATA_SIZE_UNKNOWN)
+		ptr->remaining -= frames * block_size;
+	ptr->pos += frames;
+
+	return ptr->blocks;
+}
+
+/*
+ *  call-seq:
+ *    reader.read(n = 4096) -> [*Wave::PCM] | nil
+ *
+ *  Waits for the next +n+ frames (fewer at the end of the stream) and returns them as an array of Wave::PCM,
+ *  one per channel. Returns nil at the end of the stream.
+ *
+ *  As with Wave::RIFF::Reader#read, the returned objects are overwritten by the next read.
+ */
+static VALUE
+riff_stream_read(int argc, VALUE *argv, VALUE self)
+{
+	VALUE n;
+
+	rb_scan_args(argc, argv, "01", &n);
+
+	return riff_stream_read_block(get_riff_stream(self), NIL_P(n) ? BLOCK_SIZE_DEF : NUM2LONG(n), false);
+}
+
+/*
+ *  call-seq:
+ *    reader.readpartial(n = 4096) -> [*Wave::PCM] | nil
+ *
+ *  Same as #read, but returns as soon as at least one frame has arrived,
+ *  with every whole frame available at that point, up to +n+.
+ *  Use it for the lowest latency when the blocks do not need a fixed length.
+ */
+static VALUE
+riff_stream_readpartial(int argc, VALUE *argv, VALUE self)
+{
+	VALUE n;
+
+	rb_scan_args(argc, argv, "01", &n);
+
+	return riff_stream_read_block(get_riff_stream(self), NIL_P(n) ? BLOCK_SIZE_DEF : NUM2LONG(n), true);
+}
+
+/*
+ *  call-seq:
+ *    reader.each_block(n = 4096){|blocks| ... } -> reader
+ *    reader.each_block(n = 4096) -> Enumerator
+ *
+ *  Calls #read until the end of the stream, and yields each block.
+ */
+static VALUE
+riff_stream_each_block(int argc, VALUE *argv, VALUE self)
+{
+	struct RIFFStreamReader *ptr;
+	VALUE n, blocks;
+	long len;
+
+	RETURN_ENUMERATOR(self, argc, argv);
+	rb_scan_args(argc, argv, "01", &n);
+	len = NIL_P(n) ? BLOCK_SIZE_DEF : NUM2LONG(n);
+	if (len <= 0)
+		rb_raise(rb_eArgError, "block size must be positive");
+
+	ptr = get_riff_stream(self);
+	while (!NIL_P(blocks = riff_stream_read_block(ptr, len, false)))
+	{
+		rb_yield(blocks);
+		ptr = get_riff_stream(self);
+	}
+	return self;
+}
+
+/*
+ *  call-seq:
+ *    reader.eof? -> bool
+ *
+ *  Returns true if no frame is left. Like IO#eof?, waits for the next frame to find out.
+ */
+static VALUE
+riff_stream_eof_p(VALUE self)
+{
+	struct RIFFStreamReader *ptr = get_riff_stream(self);
+
+	riff_stream_check_reading(ptr);
+	if (ptr->remaining < ptr->fmt.block_size)
+		return Qtrue;
+	return stream_need(ptr, ptr->fmt.block_size) ? Qfalse : Qtrue;
+}
+
+
+void
+InitVM_RIFFStreamReader(void)
+{
+	rb_define_alloc_func(rb_cWaveRIFFStreamReader, riff_stream_s_allocate);
+	rb_define_const(rb_cWaveRIFFStreamReader, "BLOCK_SIZE_DEF", INT2FIX(BLOCK_SIZE_DEF));
+
+	rb_define_method(rb_cWaveRIFFStreamReader, "initialize", riff_stream_initialize, 1);
+	rb_define_method(rb_cWaveRIFFStreamReader, "io", riff_stream_io, 0);
+
+	rb_define_method(rb_cWaveRIFFStreamReader, "channels", riff_stream_channels, 0);
+	rb_define_method(rb_cWaveRIFFStreamReader, "fs", riff_stream_fs, 0);
+	rb_define_method(rb_cWaveRIFFStreamReader, "bits", riff_stream_bits, 0);
+	rb_define_method(rb_cWaveRIFFStreamReader, "length", riff_stream_length, 0);
+	rb_define_method(rb_cWaveRIFFStreamReader, "pos", riff_stream_pos, 0);
+
+	rb_define_method(rb_cWaveRIFFStreamReader, "read", riff_stream_read, -1);
+	rb_define_method(rb_cWaveRIFFStreamReader, "readpartial", riff_stream_readpartial, -1);
+	rb_define_method(rb_cWaveRIFFStreamReader, "each_block", riff_stream_each_block, -1);
+	rb_define_method(rb_cWaveRIFFStreamReader, "eof?", riff_stream_eof_p, 0);
+}
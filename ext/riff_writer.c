@@ -0,0 +1,333 @@
+/*******************************************************************************
+	riff_writer.c -- Streaming writer for RIFF/WAVE
+
+	$author$
+
+	@license: MIT Licence
+
+*******************************************************************************/
+#include <ruby.h>
+#include <ruby/io.h>
+#include "ruby/wave/globals.h"
+#include "ruby/wave/pcm.h"
+#include "ruby/wave/frames.h"
+#include "internal/riff.h"
+
+struct RIFFWriter {
+	VALUE io;
+	VALUE io_buf;
+	FormatChunk fmt;
+	enum wave_rf64 rf64;
+	long length; // frames written so far
+} ;
+
+static void
+riff_writer_mark(void *p)
+{
+	struct RIFFWriter *ptr = p;
+	rb_gc_mark(ptr->io);
+	rb_gc_mark(ptr->io_buf);
+}
+
+static size_t
+riff_writer_memsize(const void *p)
+{
+	return sizeof(struct RIFFWriter);
+}
+
+static const rb_data_type_t riff_writer_data_type = {
+    "riff_writer",
+    {
+	riff_writer_mark,
+	RUBY_TYPED_DEFAULT_FREE,
+	riff_writer_memsize,
+    },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static struct RIFFWriter *
+get_riff_writer(VALUE self)
+{
+	struct RIFFWriter *ptr = rb_check_typeddata(self, &riff_writer_data_type);
+
+	if (NIL_P(ptr->io))
+		rb_raise(rb_eIOError, "closed writer");
+	return ptr;
+}
+
+static VALUE
+riff_writer_s_allocate(VALUE klass)
+{
+	struct RIFFWriter *ptr;
+	VALUE obj = TypedData_Make_Struct(klass, struct RIFFWriter, &riff_writer_data_type, ptr);
+	ptr->io = Qnil;
+	ptr->io_buf = Qnil;
+	return obj;
+}
+
+static void
+riff_writer_write_header(struct RIFFWriter *ptr)
+{
+	const uint64_t data_chunk_size = (uint64_t)ptr->length * ptr->fmt.block_size;
+	unsigned char header[WAVE_HEADER_SIZE_MAX];
+	enum wave_layout layout;
+	long header_size;
+
+	switch (ptr->rf64) {
+	case WAVE_RF64_NEVER:
+		layout = WAVE_LAYOUT_RIFF;
+		break;
+	case WAVE_RF64_ALWAYS:
+		layout = WAVE_LAYOUT_RF64;
+		break;
+	default:
+		layout = wave_riff_fits(&ptr->fmt, WAVE_LAYOUT_RIFF_JUNK, data_chunk_size) ? 
+			WAVE_LAYOUT_RIFF_JUNK : WAVE_LAYOUT_RF64;
+		break;
+	}
+	header_size = wave_header_pack(&ptr->fmt, data_chunk_size, layout, header);
+	wave_io_write(ptr->io, header, header_size);
+}
+
+/*
+ *  call-seq:
+ *    Wave::RIFF::Writer.new(file_name, channels, fs = Wave::PCM::FS_DEF, bits = 16, format: :pcm, extensible: false, rf64: :auto) -> Wave::RIFF::Writer
+ *
+ *  Creates +file_name+ and writes a placeholder header for a linear PCM file.
+ *  The samples are appended with #write, and the RIFF and data chunk sizes are patched by #close,
+ *  so the whole take never has to be held in memory.
+ *
+ *  <code>format: :float</code> stores IEEE floats (+bits+ 32 by default, or 64) instead of integers,
+ *  and <code>extensible: true</code> writes a WAVE_FORMAT_EXTENSIBLE format chunk.
+ *
+ *  As the final size is unknown, the header keeps room for a 'ds64' chunk in a JUNK chunk,
+ *  and #close turns the file into RF64 if the samples went past 4 GiB.
+ *  <code>rf64: true</code> always writes RF64; <code>rf64: false</code> writes the plain 44-byte
+ *  header (for integer PCM) and makes #write raise RangeError at the limit.
+ */
+static VALUE
+riff_writer_initialize(int argc, VALUE *argv, VALUE self)
+{
+	struct RIFFWriter *ptr = rb_check_typeddata(self, &riff_writer_data_type);
+	VALUE fname, channels, fs, bits, opts;
+	int format_tag = WAVE_FORMAT_PCM;
+	bool extensible = false;
+
+	rb_scan_args(argc, argv, "22:", &fname, &channels, &fs, &bits, &opts);
+	FilePathValue(fname);
+	ptr->rf64 = WAVE_RF64_AUTO;
+	wave_format_opts(opts, &format_tag, &extensible, &ptr->rf64);
+
+	wave_fmt_init(&ptr->fmt, format_tag, NUM2LONG(channels), NIL_P(fs) ? FS_DEF : NUM2LONG(fs), 
+		NIL_P(bits) ? (format_tag == WAVE_FORMAT_PCM ? 16 : 32) : NUM2INT(bits), extensible);
+	ptr->length = 0;
+
+	ptr->io = rb_file_open_str(fname, "wb");
+	ptr->io_buf = rb_str_new(0, 0);
+	riff_writer_write_header(ptr);
+
+	return self;
+}
+
+/*
+ *  call-seq:
+ *    writer.close -> nil
+ *
+ *  Writes the pad byte if needed, patches the chunk sizes in the header and closes the file.
+ */
+static VALUE
+riff_writer_close(VALUE self)
+{
+	struct RIFFWriter *ptr = rb_check_typeddata(self, &riff_writer_data_type);
+	static ID seek;
+	VALUE io = ptr->io;
+
+	if (NIL_P(io))
+		return Qnil;
+	if (!seek)
+		seek = rb_intern_const("seek");
+
+	if ((ptr->length * ptr->fmt.block_size) % 2 == 1)
+		wave_io_write(io, (const unsigned char *)"", 1);
+	rb_funcall(io, seek, 1, INT2FIX(0));
+	riff_writer_write_header(ptr);
+
+	ptr->io = Qnil;
+	rb_str_resize(ptr->io_buf, 0);
+	rb_io_close(io);
+	return Qnil;
+}
+
+/*
+ *  call-seq:
+ *    writer.closed? -> bool
+ */
+static VALUE
+riff_writer_closed_p(VALUE self)
+{
+	struct RIFFWriter *ptr = rb_check_typeddata(self, &riff_writer_data_type);
+
+	return NIL_P(ptr->io) ? Qtrue : Qfalse;
+}
+
+/*
+ *  call-seq:
+ *    Wave::RIFF::Writer.open(file_name, channels, fs = Wave::PCM::FS_DEF, bits = 16, **opts) -> Wave::RIFF::Writer
+ *    Wave::RIFF::Writer.open(file_name, channels, fs = Wave::PCM::FS_DEF, bits = 16, **opts){|writer| ... } -> object
+ *
+ *  Same as Wave::RIFF::Writer.new. With block given, passes the writer to the block,
+ *  closes it when the block terminates, and returns the value of the block.
+ */
+static VALUE
+riff_writer_s_open(int argc, VALUE *argv, VALUE klass)
+{
+	VALUE writer = rb_class_new_instance_kw(argc, argv, klass, RB_PASS_CALLED_KEYWORDS);
+
+	if (rb_block_given_p())
+		return rb_ensure(rb_yield, writer, riff_writer_close, writer);
+	return writer;
+}
+
+/*
+ *  call-seq:
+ *    writer.write(pcm_ary) -> Integer
+ *    writer.write(frames) -> Integer
+ *
+ *  Appends one block: an array with a Wave::PCM per channel, all of the same length, or a Wave::Frames.
+ *  The length may differ from call to call. Returns the number of frames written.
+ *
+ *    Wave::RIFF::Writer.open("render.wav", 2, 48000, 24) do |writer|
+ *      renderer.each_block{|l, r| writer.write([l, r])}
+ *    end
+ */
+static VALUE
+riff_writer_write(VALUE self, VALUE pcm_ary)
+{
+	const int BUFFER_SIZE = 0x1000;
+	struct RIFFWriter *ptr = get_riff_writer(self);
+	const uint16_t channels = ptr->fmt.channels;
+	FormatChunk fmt = ptr->fmt;
+	enum rb_pcm_dtype dtype = RB_PCM_F64;
+	void **mat;
+	long length = 0, rows;
+	long frames_per_buffer;
+
+	mat = ALLOCA_N(void*, channels);
+	if (rb_frames_p(pcm_ary))
+	{
+		if (rb_frames_channels(pcm_ary) != channels)
+			rb_raise(rb_eArgError, "wrong number of channels (given %ld, expected %d)",
+				rb_frames_channels(pcm_ary), channels);
+		if (rb_frames_fs(pcm_ary) != (long)ptr->fmt.samples_per_sec)
+			rb_raise(rb_eArgError, "sampling frequency mismatch");
+		length = rb_frames_len(pcm_ary);
+		rows = wave_frames_mat(pcm_ary, &fmt, mat);
+	}
+	else
+	{
+		Check_Type(pcm_ary, T_ARRAY);
+		if (RARRAY_LEN(pcm_ary) != channels)
+			rb_raise(rb_eArgError, "wrong number of channels (given %ld, expected %d)",
+				RARRAY_LEN(pcm_ary), channels);
+
+		for (long i = 0; i < channels; i++)
+		{
+			VALUE obj = rb_ary_entry(pcm_ary, i);
+			if (CLASS_OF(obj) != rb_cWavePCM)
+				rb_raise(rb_eTypeError, "not a %"PRIsVALUE"", rb_cWavePCM);
+			if (rb_pcm_fs(obj) != (long)ptr->fmt.samples_per_sec)
+				rb_raise(rb_eArgError, "sampling frequency mismatch");
+			if (i == 0)
+			{
+				length = rb_pcm_len(obj);
+				dtype = rb_pcm_dtype(obj);
+			}
+			else if (length != rb_pcm_len(obj))
+				rb_raise(rb_eArgError, "each channel must have the same length");
+			else if (dtype != rb_pcm_dtype(obj))
+				rb_raise(rb_eArgError, "each channel must have the same dtype");
+			mat[i] = wave_pcm_data_ptr(obj);
+		}
+		rows = length;
+	}
+	if (ptr->rf64 == WAVE_RF64_NEVER && 
+		!wave_riff_fits(&ptr->fmt, WAVE_LAYOUT_RIFF, (uint64_t)(ptr->length + length) * ptr->fmt.block_size))
+		rb_raise(rb_eRangeError, "data chunk too large for a RIFF file");
+
+	frames_per_buffer = BUFFER_SIZE / fmt.block_size;
+	if (frames_per_buffer == 0)
+		frames_per_buffer = 1;
+	for (long idx = 0; idx < rows; idx += frames_per_buffer)
+	{
+		long frames = rows - idx < frames_per_buffer ? rows - idx : frames_per_buffer;
+
+		rb_str_resize(ptr->io_buf, frames * fmt.block_size);
+		wave_encode_frames_dtype(&fmt, (unsigned char *)RSTRING_PTR(ptr->io_buf), frames, dtype, mat, idx);
+		wave_io_write(ptr->io, (unsigned char *)RSTRING_PTR(ptr->io_buf), RSTRING_LEN(ptr->io_buf));
+	}
+	ptr->length += length;
+
+	RB_GC_GUARD(pcm_ary);
+	return LONG2NUM(length);
+}
+
+/*
+ *  call-seq:
+ *    writer.channels -> Integer
+ */
+static VALUE
+riff_writer_channels(VALUE self)
+{
+	return INT2FIX(get_riff_writer(self)->fmt.channels);
+}
+
+/*
+ *  call-seq:
+ *    writer.fs -> Integer
+ */
+static VALUE
+riff_writer_fs(VALUE self)
+{
+	return ULONG2NUM(get_riff_writer(self)->fmt.samples_per_sec);
+}
+
+/*
+ *  call-seq:
+ *    writer.bits -> Integer
+ */
+static VALUE
+riff_writer_bits(VALUE self)
+{
+	return INT2FIX(get_riff_writer(self)->fmt.bits_per_sample);
+}
+
+/*
+ *  call-seq:
+ *    writer.length -> Integer
+ *
+ *  Returns the number of frames written so far.
+ */
+static VALUE
+riff_writer_length(VALUE self)
+{
+	return LONG2NUM(get_riff_writer(self)->length);
+}
+
+
+void
+InitVM_RIFFWriter(void)
+{
+	rb_define_alloc_func(rb_cWaveRIFFWriter, riff_writer_s_allocate);
+
+	rb_define_singleton_method(rb_cWaveRIFFWriter, "open", riff_writer_s_open, -1);
+	rb_define_method(rb_cWaveRIFFWriter, "initialize", riff_writer_initialize, -1);
+	rb_define_method(rb_cWaveRIFFWriter, "close", riff_writer_close, 0);
+	rb_define_method(rb_cWaveRIFFWriter, "closed?", riff_writer_closed_p, 0);
+
+	rb_define_method(rb_cWaveRIFFWriter, "channels", riff_writer_channels, 0);
+	rb_define_method(rb_cWaveRIFFWriter, "fs", riff_writer_fs, 0);
+	rb_define_method(rb_cWaveRIFFWriter, "bits", riff_writer_bits, 0);
+	rb_define_method(rb_cWaveRIFFWriter, "length", riff_writer_length, 0);
+
+	rb_define_method(rb_cWaveRIFFWriter, "write", riff_writer_write, 1);
+}
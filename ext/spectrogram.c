@@ -0,0 +1,381 @@
+/*******************************************************************************
+	spectrogram.c -- Frames of a short-time Fourier transform
+
+	$author$
+
+	@license: MIT Licence
+
+*******************************************************************************/
+#include <ruby.h>
+#include <math.h>
+#include "ruby/wave/globals.h"
+#include "ruby/wave/pcm.h"
+#include "ruby/wave/frames.h"
+#include "ruby/wave/spectrogram.h"
+
+struct Spectrogram {
+	long fs;
+	long frames;
+	long size; // points of the transform of a frame
+	long bins; // size / 2 + 1
+	long hop;
+	long length; // samples of the signal
+	long offset; // sample on which frame 0 starts
+	double *window; // size samples
+	double *s; // frames * bins complex numbers, frame by frame
+} ;
+
+static void
+spectrogram_free(void *p)
+{
+	struct Spectrogram *ptr = p;
+	if (ptr->window != NULL)
+		xfree(ptr->window);
+	if (ptr->s != NULL)
+		xfree(ptr->s);
+	xfree(ptr);
+}
+
+static size_t
+spectrogram_memsize(const void *p)
+{
+	const struct Spectrogram *ptr = p;
+	return sizeof(struct Spectrogram) + (ptr->size + 2 * ptr->frames * ptr->bins) * sizeof(double);
+}
+
+static const rb_data_type_t spectrogram_data_type = {
+    "spectrogram",
+    {
+	0,
+	spectrogram_free,
+	spectrogram_memsize,
+    },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static struct Spectrogram *
+get_spectrogram(VALUE self)
+{
+	return rb_check_typeddata(self, &spectrogram_data_type);
+}
+
+/*
+ *  class Wave::Spectrogram
+ *
+ *  The frames of a short-time Fourier transform, as made by Wave::FFT.stft:
+ *  +frames+ frames of +bins+ complex bins, the size / 2 + 1 bins from 0 to the Nyquist
+ *  frequency of a real FFT of +size+ points, stored frame by frame in one allocation.
+ *  Frame +t+ is the transform of the samples from <code>t * hop + offset</code>, times the window.
+ */
+
+/*
+ *  call-seq:
+ *    spectrogram.frames -> Integer
+ *
+ *  Returns the number of frames.
+ */
+static VALUE
+spectrogram_frames(VALUE self)
+{
+	return LONG2NUM(get_spectrogram(self)->frames);
+}
+
+/*
+ *  call-seq:
+ *    spectrogram.bins -> Integer
+ *
+ *  Returns the number of bins of a frame, <code>size / 2 + 1</code>.
+ */
+static VALUE
+spectrogram_bins(VALUE self)
+{
+	return LONG2NUM(get_spectrogram(self)->bins);
+}
+
+/*
+ *  call-seq:
+ *    spectrogram.size -> Integer
+ *
+ *  Returns the number of points of the transform of a frame.
+ */
+static VALUE
+spectrogram_size(VALUE self)
+{
+	return LONG2NUM(get_spectrogram(self)->size);
+}
+
+/*
+ *  call-seq:
+ *    spectrogram.hop -> Integer
+ *
+ *  Returns the number of samples between the starts of two frames.
+ */
+static VALUE
+spectrogram_hop(VALUE self)
+{
+	return LONG2NUM(get_spectrogram(self)->hop);
+}
+
+/*
+ *  call-seq:
+ *    spectrogram.fs -> Integer
+ *
+ *  Returns the sampling frequency of the signal.
+ */
+static VALUE
+spectrogram_fs(VALUE self)
+{
+	return LONG2NUM(get_spectrogram(self)->fs);
+}
+
+/*
+ *  call-seq:
+ *    spectrogram.length -> Integer
+ *
+ *  Returns the number of samples of the signal.
+ */
+static VALUE
+spectrogram_length(VALUE self)
+{
+	return LONG2NUM(get_spectrogram(self)->length);
+}
+
+/*
+ *  call-seq:
+ *    spectrogram.offset -> Integer
+ *
+ *  Returns the sample on which frame 0 starts: <code>-(size / 2)</code> when the frames are
+ *  centered on the multiples of +hop+, otherwise 0.
+ */
+static VALUE
+spectrogram_offset(VALUE self)
+{
+	return LONG2NUM(get_spectrogram(self)->offset);
+}
+
+/*
+ *  call-seq:
+ *    spectrogram.window -> Wave::PCM
+ *
+ *  Returns a copy of the analysis window, +size+ samples.
+ */
+static VALUE
+spectrogram_window(VALUE self)
+{
+	struct Spectrogram *ptr = get_spectrogram(self);
+	VALUE pcm = rb_pcm_new(ptr->size, ptr->fs);
+
+	MEMCPY(rb_waveform_data_ptr(pcm), ptr->window, double, ptr->size);
+	return pcm;
+}
+
+static long
+spectrogram_frame_index(const struct Spectrogram *ptr, VALUE t)
+{
+	long i = NUM2LONG(t);
+
+	if (i < 0)
+		i += ptr->frames;
+	if (i < 0 || i >= ptr->frames)
+		rb_raise(rb_eIndexError, "frame %ld out of spectrogram", NUM2LONG(t));
+	return i;
+}
+
+/*
+ *  call-seq:
+ *    spectrogram[t] -> [re, im]
+ *
+ *  Returns a copy of the bins of frame +t+, as a pair of Wave::PCM of their real and
+ *  imaginary parts. Negative +t+ counts from the last frame.
+ */
+static VALUE
+spectrogram_aref(VALUE self, VALUE t)
+{
+	struct Spectrogram *ptr = get_spectrogram(self);
+	const double *row = ptr->s + 2 * spectrogram_frame_index(ptr, t) * ptr->bins;
+	VALUE re = rb_pcm_new(ptr->bins, ptr->fs), im = rb_pcm_new(ptr->bins, ptr->fs);
+	double *r = rb_waveform_data_ptr(re), *i = rb_waveform_data_ptr(im);
+
+	for (long k = 0; k < ptr->bins; k++)
+	{
+		r[k] = row[2 * k];
+		i[k] = row[2 * k + 1];
+	}
+	return rb_assoc_new(re, im);
+}
+
+/*
+ *  call-seq:
+ *    spectrogram[t] = [re, im]
+ *
+ *  Sets the bins of frame +t+ from a pair of Wave::PCM of +bins+ samples, their real
+ *  and imaginary parts, as after editing the ones returned by Wave::Spectrogram#[].
+ */
+static VALUE
+spectrogram_aset(VALUE self, VALUE t, VALUE bins)
+{
+	struct Spectrogram *ptr = get_spectrogram(self);
+	double *row = ptr->s + 2 * spectrogram_frame_index(ptr, t) * ptr->bins;
+	VALUE ary = rb_check_array_type(bins);
+
+	if (NIL_P(ary) || RARRAY_LEN(ary) != 2)
+		rb_raise(rb_eArgError, "bins must be a pair of Wave::PCM");
+	for (int c = 0; c < 2; c++)
+	{
+		VALUE pcm = RARRAY_AREF(ary, c);
+
+		if (rb_pcm_len(pcm) != ptr->bins)
+			rb_raise(rb_eArgError, "length mismatch (%ld for %ld)", rb_pcm_len(pcm), ptr->bins);
+		if (rb_pcm_dtype(pcm) == RB_PCM_F32)
+		{
+			const float *s = rb_waveform_data_ptr_f32(pcm);
+			for (long k = 0; k < ptr->bins; k++)
+				row[2 * k + c] = s[k];
+		}
+		else
+		{
+			const double *s = rb_waveform_data_ptr(pcm);
+			for (long k = 0; k < ptr->bins; k++)
+				row[2 * k + c] = s[k];
+		}
+	}
+	return bins;
+}
+
+/*
+ *  call-seq:
+ *    spectrogram.magnitude -> Wave::Frames
+ *
+ *  Returns the magnitudes of the bins as Wave::Frames of +bins+ channels and +frames+
+ *  frames, interleaved: one frame of the frames per frame of the spectrogram, and
+ *  a channel per frequency, frame by frame in one allocation.
+ */
+static VALUE
+spectrogram_magnitude(VALUE self)
+{
+	struct Spectrogram *ptr = get_spectrogram(self);
+	VALUE frames = rb_frames_new(ptr->bins, ptr->frames, ptr->fs, RB_FRAMES_INTERLEAVED);
+	double *m = rb_frames_data_ptr(frames);
+	const long n = ptr->frames * ptr->bins;
+
+	for (long k = 0; k < n; k++)
+		m[k] = sqrt(ptr->s[2 * k] * ptr->s[2 * k] + ptr->s[2 * k + 1] * ptr->s[2 * k + 1]);
+	return frames;
+}
+
+
+void
+InitVM_Spectrogram(void)
+{
+	rb_undef_alloc_func(rb_cWaveSpectrogram);
+
+	rb_define_method(rb_cWaveSpectrogram, "frames", spectrogram_frames, 0);
+	rb_define_method(rb_cWaveSpectrogram, "bins", spectrogram_bins, 0);
+	rb_define_method(rb_cWaveSpectrogram, "size", spectrogram_size, 0);
+	rb_define_method(rb_cWaveSpectrogram, "hop", spectrogram_hop, 0);
+	rb_define_method(rb_cWaveSpectrogram, "fs", spectrogram_fs, 0);
+	rb_define_method(rb_cWaveSpectrogram, "length", spectrogram_length, 0);
+	rb_define_method(rb_cWaveSpectrogram, "offset", spectrogram_offset, 0);
+	rb_define_method(rb_cWaveSpectrogram, "window", spectrogram_window, 0);
+	rb_define_method(rb_cWaveSpectrogram, "[]", spectrogram_aref, 1);
+	rb_define_method(rb_cWaveSpectrogram, "[]=", spectrogram_aset, 2);
+	rb_define_method(rb_cWaveSpectrogram, "magnitude", spectrogram_magnitude, 0);
+}
+
+/*******************************************************************************
+	For C API
+*******************************************************************************/
+
+VALUE
+rb_spectrogram_new(long frames, long size, long hop, long fs, long length, int center)
+{
+	struct Spectrogram *ptr;
+	VALUE obj = TypedData_Make_Struct(rb_cWaveSpectrogram, struct Spectrogram, &spectrogram_data_type, ptr);
+	const long bins = size / 2 + 1;
+
+	if (size <= 0)
+		rb_raise(rb_eRangeError, "negative (or biggest) transform size");
+	if (hop <= 0)
+		rb_raise(rb_eRangeError, "negative (or biggest) hop size");
+	if (frames < 0 || length < 0 || frames > LONG_MAX / (long)(2 * sizeof(double)) / bins)
+		rb_raise(rb_eRangeError, "negative (or biggest) spectrogram size");
+	if (fs <= 0)
+		rb_raise(rb_eRangeError, "negative (or biggest) frequency");
+
+	ptr->fs = fs;
+	ptr->size = size;
+	ptr->bins = bins;
+	ptr->hop = hop;
+	ptr->length = length;
+	ptr->offset = center ? -(size / 2) : 0;
+	ptr->window = ALLOC_N(double, size);
+	for (long j = 0; j < size; j++)
+		ptr->window[j] = 1.0;
+	if (frames > 0)
+	{
+		ptr->s = ALLOC_N(double, 2 * frames * bins);
+		MEMZERO(ptr->s, double, 2 * frames * bins);
+	}
+	ptr->frames = frames;
+	return obj;
+}
+
+int
+rb_spectrogram_p(VALUE obj)
+{
+	return rb_typeddata_is_kind_of(obj, &spectrogram_data_type);
+}
+
+long
+rb_spectrogram_frames(VALUE spec)
+{
+	return get_spectrogram(spec)->frames;
+}
+
+long
+rb_spectrogram_bins(VALUE spec)
+{
+	return get_spectrogram(spec)->bins;
+}
+
+long
+rb_spectrogram_size(VALUE spec)
+{
+	return get_spectrogram(spec)->size;
+}
+
+long
+rb_spectrogram_hop(VALUE spec)
+{
+	return get_spectrogram(spec)->hop;
+}
+
+long
+rb_spectrogram_fs(VALUE spec)
+{
+	return get_spectrogram(spec)->fs;
+}
+
+long
+rb_spectrogram_length(VALUE spec)
+{
+	return get_spectrogram(spec)->length;
+}
+
+long
+rb_spectrogram_offset(VALUE spec)
+{
+	return get_spectrogram(spec)->offset;
+}
+
+double *
+rb_spectrogram_data_ptr(VALUE obj)
+{
+	return get_spectrogram(obj)->s;
+}
+
+double *
+rb_spectrogram_window_ptr(VALUE obj)
+{
+	return get_spectrogram(obj)->window;
+}
@@ -7,6 +7,8 @@
 //#include <ruby/internal/memory.h> // ALLOC_N()
 //#include <ruby/internal/intern/array.h> // rb_ary_new(), rb_ary_store()
 #include "ruby/wave/globals.h"
+#include "ruby/wave/pcm.h"
+#include "internal/window_function.h"
 #include "internal/algorithm/wf.h"
 
 #ifndef HAVE_CYL_BESSEL_I0
@@ -810,6 +812,88 @@ wf_kbd(int argc, VALUE *argv, VALUE unused_obj)
 }
 
 
+/*******************************************************************************
+	Windows by name, for the +window:+ options of Wave::FFT
+*******************************************************************************/
+
+static const struct {
+	const char *name;
+	void (*cb)(double, long, double *);        // without a parameter
+	void (*cb_param)(double, long, double *);  // with one
+} wf_cb_table[] = {
+	{ "rectangular", wf_cb_rectangular, NULL },
+	{ "dirichlet", wf_cb_rectangular, NULL },
+	{ "hann", wf_cb_hann, wf_cb_generalized_hamming },
+	{ "hanning", wf_cb_hann, wf_cb_generalized_hamming },
+	{ "hamming", wf_cb_hamming, wf_cb_generalized_hamming },
+	{ "bartlett", wf_cb_bartlett, NULL },
+	{ "blackman", wf_cb_blackman, NULL },
+	{ "gaussian", wf_cb_gaussian, wf_cb_gaussian_with_param },
+	{ "kaiser", wf_cb_kaiser, wf_cb_kaiser_with_param },
+	{ "bartlett_hann", wf_cb_bartlett_hann, NULL },
+	{ "nuttall", wf_cb_nuttall, NULL },
+	{ "blackman_harris", wf_cb_blackman_harris, NULL },
+	{ "blackman_nuttall", wf_cb_blackman_nuttall, NULL },
+	{ "flat_top", wf_cb_flat_top, NULL },
+	{ "kbd", NULL, wf_cb_kbd_with_param },
+	{ "kaiser_bessel_derived", NULL, wf_cb_kbd_with_param },
+};
+
+void
+wave_window_arg(VALUE window, long len, double *w)
+{
+	VALUE name = window, param = Qnil;
+	
+	if (RB_TYPE_P(window, T_ARRAY) && RARRAY_LEN(window) == 2 && SYMBOL_P(RARRAY_AREF(window, 0)))
+	{
+		name = RARRAY_AREF(window, 0);
+		param = RARRAY_AREF(window, 1);
+	}
+	if (SYMBOL_P(name))
+	{
+		const char *s = rb_id2name(SYM2ID(name));
+		
+		for (size_t i = 0; i < sizeof(wf_cb_table) / sizeof(wf_cb_table[0]); i++)
+		{
+			if (strcmp(s, wf_cb_table[i].name) != 0)
+				continue;
+			if (NIL_P(param) && wf_cb_table[i].cb)
+				wf_cb_table[i].cb(0., len, w);
+			else if (!NIL_P(param) && wf_cb_table[i].cb_param)
+				wf_cb_table[i].cb_param(NUM2DBL(param), len, w);
+			else
+				rb_raise(rb_eArgError, "window %s %s a parameter", s, NIL_P(param) ? "needs" : "takes no");
+			return;
+		}
+		rb_raise(rb_eArgError, "unknown window: %"PRIsVALUE"", name);
+	}
+	
+	if (RB_TYPE_P(window, T_ARRAY))
+	{
+		if (RARRAY_LEN(window) != len)
+			rb_raise(rb_eArgError, "window length mismatch (%ld for %ld)", RARRAY_LEN(window), len);
+		for (long n = 0; n < len; n++)
+			w[n] = NUM2DBL(rb_ary_entry(window, n));
+		return;
+	}
+	if (rb_obj_is_kind_of(window, rb_cWavePCM))
+	{
+		if (rb_pcm_len(window) != len)
+			rb_raise(rb_eArgError, "window length mismatch (%ld for %ld)", rb_pcm_len(window), len);
+		if (rb_pcm_dtype(window) == RB_PCM_F32)
+		{
+			const float *s = rb_waveform_data_ptr_f32(window);
+			for (long n = 0; n < len; n++)
+				w[n] = s[n];
+		}
+		else if (len > 0)
+			memcpy(w, rb_waveform_data_ptr(window), len * sizeof(double));
+		return;
+	}
+	rb_raise(rb_eTypeError, "wrong window %"PRIsVALUE" (expected a Symbol, an Array or a Wave::PCM)", rb_obj_class(window));
+}
+
+
 /******************************************************************************/
 
 // Entry Point
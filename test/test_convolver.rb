@@ -0,0 +1,26 @@
+require 'test/unit'
+require 'wave'
+
+class TestConvolver < Test::Unit::TestCase
+	def setup
+		@ir = Wave::PCM.new(3, 8000){|i| [1.0, 0.5, 0.25][i]}
+	end
+	
+	def test_convolve
+		out = Wave::Convolver.convolve(Wave::PCM.new(2, 8000){ 1.0 }, @ir)
+		assert_equal(8000, out.fs)
+		assert_equal([1.0, 1.5, 0.75, 0.25], out.to_a.map{|x| x.round(12)})
+	end
+	
+	def test_impulse_responses_fs_mismatch
+		assert_raise(ArgumentError){ Wave::Convolver.new([@ir, Wave::PCM.new(3, 44100)]) }
+	end
+	
+	def test_input_fs_mismatch
+		conv = Wave::Convolver.new([@ir, @ir], block: 2)
+		assert_raise(ArgumentError){ conv.process(Wave::PCM.new(4, 44100)) }
+		assert_raise(ArgumentError){ conv.process([Wave::PCM.new(4, 8000), Wave::PCM.new(4, 44100)]) }
+		assert_raise(ArgumentError){ Wave::Convolver.convolve(Wave::PCM.new(4, 44100), @ir) }
+		assert_equal(2, conv.process(Wave::PCM.new(4, 8000)).size)
+	end
+end
@@ -0,0 +1,32 @@
+require 'test/unit'
+require 'wave'
+
+class TestFrames < Test::Unit::TestCase
+	def setup
+		@frames = Wave::Frames.from_pcm([Wave::PCM.new(4, 8000){|i| i * 0.25}, Wave::PCM.new(4, 8000){|i| -i * 0.25}])
+	end
+	
+	def test_channel_is_a_view
+		view = @frames.channel(1)
+		@frames[1, 2] = 0.5
+		assert_equal(0.5, view[2])
+		view.map!{|x| x * 2}
+		assert_equal(1.0, @frames[1, 2])
+	end
+	
+	def test_slice_of_channel_is_a_copy
+		view = @frames.channel(0)
+		slice = view[1, 2]
+		@frames[0, 1] = 0.5
+		view.map!{|x| x * 2}
+		assert_equal([0.25, 0.5], slice.to_a)
+		slice.map!{|x| -x}
+		assert_equal([0.0, 1.0, 1.0, 1.5], view.to_a)
+	end
+	
+	def test_io_buffer_of_channel_is_a_copy
+		buf = @frames.channel(0).to_io_buffer
+		@frames[0, 1] = 0.5
+		assert_equal(0.25, buf.get_value(:f64, 8))
+	end
+end